@@ -0,0 +1,700 @@
+// A headless benchmark and soak test for the SDK.  Each scenario runs for a while against
+// connected pads or a replayed capture, then reports call latencies, CPU time for each thread
+// in the process and the SDK's own statistics, so performance regressions show up before they
+// ship.
+//
+// SMXBench [-replay capture] [-fast] [-seconds n] [-threads n] [scenario ...]
+//
+// Scenarios are lights30, lights60 and lights120 (SMX_SetLights at that rate), poll
+// (SMX_GetInputState from several threads while lights are sent), config (a storm of
+// SMX_SetConfigEx calls) and teststream (streamed sensor test data).  By default, everything
+// runs except config, which writes to the pads' flash unless replaying.
+//
+// Allocations are counted with a CRT allocation hook, which only exists in debug builds.  The
+// SDK and this program share the CRT DLL, so this counts the SDK's allocations too.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include <tlhelp32.h>
+#include <crtdbg.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "SMX.h"
+using namespace std;
+
+namespace
+{
+    double g_fSecondsPerTick;
+    double GetTime()
+    {
+        LARGE_INTEGER iTime;
+        QueryPerformanceCounter(&iTime);
+        return iTime.QuadPart * g_fSecondsPerTick;
+    }
+
+    // A latency histogram with about 6% resolution.  Values under 32ns have their own
+    // bucket, and above that each power of two is split into 16 buckets.  This doesn't
+    // allocate, so it can be used from the threads being measured, and percentiles can be
+    // read from it at the end.
+    class LatencyHistogram
+    {
+    public:
+        void Add(double fSeconds)
+        {
+            uint64_t iNanoseconds = uint64_t(max(0.0, fSeconds) * 1e9);
+            m_iBuckets[GetBucket(iNanoseconds)]++;
+            m_iCount++;
+            m_fTotal += fSeconds;
+            m_fMax = max(m_fMax, fSeconds);
+        }
+
+        void Merge(const LatencyHistogram &other)
+        {
+            for(int i = 0; i < NUM_BUCKETS; ++i)
+                m_iBuckets[i] += other.m_iBuckets[i];
+            m_iCount += other.m_iCount;
+            m_fTotal += other.m_fTotal;
+            m_fMax = max(m_fMax, other.m_fMax);
+        }
+
+        // Return the time in seconds that fraction of samples were at or under.
+        double GetPercentile(double fFraction) const
+        {
+            uint64_t iTarget = max(uint64_t(1), uint64_t(fFraction * m_iCount + 0.5));
+            uint64_t iSeen = 0;
+            for(int i = 0; i < NUM_BUCKETS; ++i)
+            {
+                iSeen += m_iBuckets[i];
+                if(iSeen >= iTarget)
+                    return min(GetBucketEnd(i) / 1e9, m_fMax);
+            }
+            return m_fMax;
+        }
+
+        void Print(const char *szName) const
+        {
+            if(m_iCount == 0)
+            {
+                printf("    %-28s no samples\n", szName);
+                return;
+            }
+
+            printf("    %-28s %10llu  avg %9.2fus  p50 %9.2fus  p99 %9.2fus  p99.9 %9.2fus  max %9.2fus\n",
+                szName, (unsigned long long) m_iCount, m_fTotal / m_iCount * 1e6,
+                GetPercentile(0.5) * 1e6, GetPercentile(0.99) * 1e6, GetPercentile(0.999) * 1e6,
+                m_fMax * 1e6);
+        }
+
+    private:
+        static const int SUB_BUCKETS = 16;
+        static const int NUM_BUCKETS = 64*SUB_BUCKETS;
+
+        static int GetBucket(uint64_t iValue)
+        {
+            int iShift = 0;
+            while((iValue >> iShift) >= 2*SUB_BUCKETS)
+                iShift++;
+            return iShift*SUB_BUCKETS + int(iValue >> iShift);
+        }
+
+        // Return the first value past the end of a bucket, in nanoseconds.
+        static double GetBucketEnd(int iBucket)
+        {
+            int iShift = max(0, iBucket/SUB_BUCKETS - 1);
+            uint64_t iStart = uint64_t(iBucket - iShift*SUB_BUCKETS) << iShift;
+            return double(iStart + (uint64_t(1) << iShift));
+        }
+
+        uint64_t m_iBuckets[NUM_BUCKETS] = {};
+        uint64_t m_iCount = 0;
+        double m_fTotal = 0;
+        double m_fMax = 0;
+    };
+
+    // Give threads we create names for the report.  Threads we didn't name belong to the SDK.
+    // This is a fixed table so naming a thread doesn't allocate.
+    struct ThreadName
+    {
+        atomic<DWORD> m_iThreadId{0};
+        const char *m_szName = nullptr;
+    };
+    ThreadName g_ThreadNames[64];
+
+    void NameThread(const char *szName)
+    {
+        DWORD iThreadId = GetCurrentThreadId();
+        for(ThreadName &name: g_ThreadNames)
+        {
+            DWORD iExpected = 0;
+            if(name.m_iThreadId == iThreadId || name.m_iThreadId.compare_exchange_strong(iExpected, iThreadId))
+            {
+                name.m_szName = szName;
+                return;
+            }
+        }
+    }
+
+    const char *GetThreadName(DWORD iThreadId)
+    {
+        for(const ThreadName &name: g_ThreadNames)
+        {
+            if(name.m_iThreadId == iThreadId)
+                return name.m_szName;
+        }
+        return "SDK";
+    }
+
+    // Allocation counts for each thread, updated by the allocation hook without allocating.
+    struct ThreadAllocations
+    {
+        atomic<DWORD> m_iThreadId{0};
+        atomic<uint32_t> m_iAllocations{0};
+    };
+    ThreadAllocations g_ThreadAllocations[128];
+    bool g_bCountingAllocations = false;
+
+    void CountAllocation()
+    {
+        DWORD iThreadId = GetCurrentThreadId();
+        for(ThreadAllocations &thread: g_ThreadAllocations)
+        {
+            DWORD iExpected = 0;
+            if(thread.m_iThreadId == iThreadId || thread.m_iThreadId.compare_exchange_strong(iExpected, iThreadId))
+            {
+                thread.m_iAllocations++;
+                return;
+            }
+        }
+    }
+
+    uint32_t GetAllocations(DWORD iThreadId)
+    {
+        for(const ThreadAllocations &thread: g_ThreadAllocations)
+        {
+            if(thread.m_iThreadId == iThreadId)
+                return thread.m_iAllocations;
+        }
+        return 0;
+    }
+
+#ifdef _DEBUG
+    int AllocHook(int iAllocType, void *pUserData, size_t iSize, int iBlockType, long iRequest, const unsigned char *szFile, int iLine)
+    {
+        if(iAllocType == _HOOK_ALLOC || iAllocType == _HOOK_REALLOC)
+            CountAllocation();
+        return TRUE;
+    }
+#endif
+
+    void StartCountingAllocations()
+    {
+#ifdef _DEBUG
+        _CrtSetAllocHook(AllocHook);
+        g_bCountingAllocations = true;
+#endif
+    }
+
+    // The CPU time and allocation count of each thread in the process when a snapshot was taken.
+    struct ThreadCounters
+    {
+        double m_fCPUTime = 0;
+        uint32_t m_iAllocations = 0;
+    };
+    typedef map<DWORD, ThreadCounters> ThreadSnapshot;
+
+    void GetThreadSnapshot(ThreadSnapshot &snapshot)
+    {
+        snapshot.clear();
+        HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+        if(hSnapshot == INVALID_HANDLE_VALUE)
+            return;
+
+        THREADENTRY32 entry;
+        entry.dwSize = sizeof(entry);
+        for(BOOL bOK = Thread32First(hSnapshot, &entry); bOK; bOK = Thread32Next(hSnapshot, &entry))
+        {
+            if(entry.th32OwnerProcessID != GetCurrentProcessId())
+                continue;
+
+            HANDLE hThread = OpenThread(THREAD_QUERY_LIMITED_INFORMATION, FALSE, entry.th32ThreadID);
+            if(hThread == NULL)
+                continue;
+
+            FILETIME creation, exit, kernel, user;
+            if(GetThreadTimes(hThread, &creation, &exit, &kernel, &user))
+            {
+                ULARGE_INTEGER iKernel = { kernel.dwLowDateTime, kernel.dwHighDateTime };
+                ULARGE_INTEGER iUser = { user.dwLowDateTime, user.dwHighDateTime };
+                ThreadCounters &counters = snapshot[entry.th32ThreadID];
+                counters.m_fCPUTime = (iKernel.QuadPart + iUser.QuadPart) / 10000000.0;
+                counters.m_iAllocations = GetAllocations(entry.th32ThreadID);
+            }
+            CloseHandle(hThread);
+        }
+        CloseHandle(hSnapshot);
+    }
+
+    // Print the CPU time and allocations of each thread between two snapshots.  Threads that
+    // exited during the scenario aren't in the second snapshot, so they aren't shown.
+    void PrintThreadUsage(const ThreadSnapshot &before, const ThreadSnapshot &after, double fSeconds)
+    {
+        printf("  Threads:\n");
+        for(const auto &it: after)
+        {
+            ThreadCounters start;
+            auto beforeIt = before.find(it.first);
+            if(beforeIt != before.end())
+                start = beforeIt->second;
+
+            double fCPUTime = it.second.m_fCPUTime - start.m_fCPUTime;
+            uint32_t iAllocations = it.second.m_iAllocations - start.m_iAllocations;
+            if(fCPUTime == 0 && iAllocations == 0)
+                continue;
+
+            printf("    %-12s %6u  cpu %8.1fms (%5.1f%%)", GetThreadName(it.first), (unsigned) it.first,
+                fCPUTime * 1000, fCPUTime / fSeconds * 100);
+            if(g_bCountingAllocations)
+                printf("  allocations %u", iAllocations);
+            printf("\n");
+        }
+
+        if(!g_bCountingAllocations)
+            printf("    (allocations are only counted in debug builds)\n");
+    }
+
+    // Print an SMXHistogram from SMX_GetStats.  Its buckets are powers of two microseconds,
+    // so percentiles are approximate.
+    void PrintSDKHistogram(const char *szName, const SMXHistogram &histogram)
+    {
+        if(histogram.m_iCount == 0)
+            return;
+
+        auto getPercentile = [&histogram](double fFraction) {
+            uint32_t iTarget = max(1u, uint32_t(fFraction * histogram.m_iCount + 0.5));
+            uint32_t iSeen = 0;
+            for(int i = 0; i < SMX_HISTOGRAM_BUCKETS; ++i)
+            {
+                iSeen += histogram.m_iBuckets[i];
+                if(iSeen >= iTarget)
+                    return min(1u << i, histogram.m_iMaxMicroseconds);
+            }
+            return histogram.m_iMaxMicroseconds;
+        };
+
+        printf("    %-28s %10u  avg %7uus  p50 <%7uus  p99 <%7uus  p99.9 <%7uus  max %7uus\n",
+            szName, histogram.m_iCount, histogram.m_iAverageMicroseconds,
+            getPercentile(0.5), getPercentile(0.99), getPercentile(0.999), histogram.m_iMaxMicroseconds);
+    }
+
+    void PrintSDKStats()
+    {
+        SMXStats stats;
+        SMX_GetStats(&stats, true);
+        printf("  SDK:\n");
+        PrintSDKHistogram("input latency", stats.m_InputLatency);
+        PrintSDKHistogram("lock hold time", stats.m_LockHoldTime);
+        PrintSDKHistogram("command round trip", stats.m_CommandRoundTrip);
+        if(stats.m_iLightsUpdatesDropped || stats.m_iLightsCommandsCoalesced || stats.m_iTestFramesDropped)
+        {
+            printf("    lights updates dropped %u, lights commands coalesced %u, test frames dropped %u\n",
+                stats.m_iLightsUpdatesDropped, stats.m_iLightsCommandsCoalesced, stats.m_iTestFramesDropped);
+        }
+
+        const SMXLightsTimingStats &lightsStats = stats.m_LightsTiming;
+        if(lightsStats.m_iCommandsSent > 0)
+        {
+            printf("    %-28s %10u  avg %7uus  max %7uus  (%s timer)\n", "lights command lateness",
+                lightsStats.m_iCommandsSent, lightsStats.m_iAverageLatenessMicroseconds,
+                lightsStats.m_iMaxLatenessMicroseconds, lightsStats.m_bHighResolutionTimer? "high-resolution":"millisecond");
+        }
+    }
+
+    // Wait until the given time.  Sleep until shortly before it, then spin, so rates like
+    // 120Hz are accurate even with a coarse system timer.
+    void WaitUntil(double fTime)
+    {
+        while(true)
+        {
+            double fRemaining = fTime - GetTime();
+            if(fRemaining <= 0)
+                return;
+            if(fRemaining > 0.002)
+                Sleep(1);
+            else
+                YieldProcessor();
+        }
+    }
+
+    struct Options
+    {
+        double m_fSeconds = 10;
+        int m_iPollThreads = 4;
+        bool m_bReplaying = false;
+    };
+
+    // Scenarios record the latencies they measure here, and the report is printed after each.
+    // Scenarios with threads of their own take the final thread snapshot before stopping them,
+    // so their threads are included.
+    struct Results
+    {
+        deque<pair<string, LatencyHistogram>> m_Latencies;
+        ThreadSnapshot m_After;
+        double m_fEndTime = -1;
+
+        LatencyHistogram &Add(const string &sName)
+        {
+            m_Latencies.emplace_back(sName, LatencyHistogram());
+            return m_Latencies.back().second;
+        }
+    };
+
+    bool IsConnected(int iPad)
+    {
+        SMXInfo info;
+        SMX_GetInfo(iPad, &info);
+        return info.m_bConnected;
+    }
+
+    // Fill a lights update with one lit panel that moves each frame, so every update changes.
+    void MakeLights(int iFrame, char lights[864])
+    {
+        memset(lights, 0, 864);
+        int iPanel = iFrame % 18;
+        for(int iLED = 0; iLED < 16; ++iLED)
+        {
+            char *pColor = lights + (iPanel*16 + iLED)*3;
+            pColor[0] = (char) 0xFF;
+            pColor[1] = (char) (iFrame * 8);
+            pColor[2] = (char) (iLED * 16);
+        }
+    }
+
+    // Send lights at iRate updates per second, timing each SMX_SetLights call and how late it
+    // was made compared to when it was due.
+    void SendLights(const Options &options, int iRate, LatencyHistogram &callTime, LatencyHistogram &callLateness)
+    {
+        char lights[864];
+        double fStart = GetTime();
+        for(int iFrame = 0; ; ++iFrame)
+        {
+            double fDue = fStart + double(iFrame) / iRate;
+            if(fDue - fStart >= options.m_fSeconds)
+                break;
+
+            MakeLights(iFrame, lights);
+            WaitUntil(fDue);
+
+            double fCallStart = GetTime();
+            SMX_SetLights(lights);
+            double fCallEnd = GetTime();
+            callTime.Add(fCallEnd - fCallStart);
+            callLateness.Add(fCallStart - fDue);
+        }
+    }
+
+    void RunLights(const Options &options, int iRate, Results &results)
+    {
+        LatencyHistogram &callTime = results.Add("SMX_SetLights call");
+        LatencyHistogram &callLateness = results.Add("SMX_SetLights lateness");
+        SendLights(options, iRate, callTime, callLateness);
+    }
+
+    // Poll SMX_GetInputState from several threads as fast as possible, while the main thread
+    // sends lights at 60Hz so the SDK is doing work at the same time.
+    void RunPoll(const Options &options, Results &results)
+    {
+        static const char *szThreadNames[] = { "poll 1", "poll 2", "poll 3", "poll 4", "poll 5", "poll 6", "poll 7", "poll 8" };
+        int iThreads = min(options.m_iPollThreads, int(sizeof(szThreadNames) / sizeof(*szThreadNames)));
+
+        vector<LatencyHistogram> histograms(iThreads);
+        atomic<bool> bStop{false};
+        vector<thread> threads;
+        for(int i = 0; i < iThreads; ++i)
+        {
+            threads.emplace_back([&, i] {
+                NameThread(szThreadNames[i]);
+                LatencyHistogram &histogram = histograms[i];
+                uint32_t iTotal = 0;
+                for(int iCall = 0; !bStop; ++iCall)
+                {
+                    double fCallStart = GetTime();
+                    iTotal += SMX_GetInputState(iCall % 2);
+                    histogram.Add(GetTime() - fCallStart);
+                }
+
+                // Use the result, so the calls can't be optimized out.
+                if(iTotal == 0xFFFFFFFF)
+                    printf("\n");
+            });
+        }
+
+        LatencyHistogram &callTime = results.Add("SMX_SetLights call");
+        LatencyHistogram &callLateness = results.Add("SMX_SetLights lateness");
+        SendLights(options, 60, callTime, callLateness);
+
+        results.m_fEndTime = GetTime();
+        GetThreadSnapshot(results.m_After);
+        bStop = true;
+        for(thread &t: threads)
+            t.join();
+
+        LatencyHistogram &pollTime = results.Add("SMX_GetInputState call");
+        for(const LatencyHistogram &histogram: histograms)
+            pollTime.Merge(histogram);
+    }
+
+    // Write configurations as fast as possible, alternating between two slightly different
+    // ones so every write is a change.  This times each SMX_SetConfigEx call, and how long it
+    // takes for each write to be acknowledged.  Writes that are merged into a later one are
+    // acknowledged with it.  Replayed pads acknowledge writes as soon as the SDK sends them,
+    // so when replaying the acknowledgement time doesn't include a device.
+    void RunConfig(const Options &options, Results &results)
+    {
+        LatencyHistogram &callTime = results.Add("SMX_SetConfigEx call");
+        LatencyHistogram &ackTime = results.Add(options.m_bReplaying?
+            "config write acknowledged (synthetic, replayed)":"config write acknowledged");
+
+        SMXConfig originalConfig[2];
+        bool bHaveConfig[2];
+        for(int iPad = 0; iPad < 2; ++iPad)
+            bHaveConfig[iPad] = SMX_GetConfig(iPad, &originalConfig[iPad]);
+        if(!bHaveConfig[0] && !bHaveConfig[1])
+        {
+            printf("  No pads connected, skipping\n");
+            return;
+        }
+
+        // The time each write was made, by write number.
+        static const int MAX_WRITES = 1 << 16;
+        vector<double> afWriteTime[2];
+        uint32_t iFirstWrite[2] = { 0, 0 }, iLastWrite[2] = { 0, 0 }, iLastAcked[2] = { 0, 0 };
+        for(int iPad = 0; iPad < 2; ++iPad)
+            afWriteTime[iPad].resize(MAX_WRITES);
+
+        double fStart = GetTime();
+        for(int iWrite = 0; GetTime() - fStart < options.m_fSeconds; ++iWrite)
+        {
+            for(int iPad = 0; iPad < 2; ++iPad)
+            {
+                if(!bHaveConfig[iPad])
+                    continue;
+
+                SMXConfig config = originalConfig[iPad];
+                if(iWrite % 2)
+                    config.stepColor[0] ^= 1;
+
+                double fCallStart = GetTime();
+                uint32_t iWriteNumber = SMX_SetConfigEx(iPad, &config);
+                double fCallEnd = GetTime();
+                callTime.Add(fCallEnd - fCallStart);
+
+                if(iFirstWrite[iPad] == 0)
+                    iFirstWrite[iPad] = iLastAcked[iPad] = iWriteNumber - 1;
+                iLastWrite[iPad] = iWriteNumber;
+                afWriteTime[iPad][iWriteNumber % MAX_WRITES] = fCallEnd;
+            }
+
+            // Record acknowledgements that have arrived.
+            SMXState state;
+            SMX_GetState(&state);
+            double fNow = GetTime();
+            for(int iPad = 0; iPad < 2; ++iPad)
+            {
+                uint32_t iAcked = state.m_Pads[iPad].m_iConfigWriteAcked;
+                for(; int32_t(iAcked - iLastAcked[iPad]) > 0; iLastAcked[iPad]++)
+                    ackTime.Add(fNow - afWriteTime[iPad][(iLastAcked[iPad] + 1) % MAX_WRITES]);
+            }
+
+            Sleep(1);
+        }
+
+        // Put the original configuration back.
+        for(int iPad = 0; iPad < 2; ++iPad)
+        {
+            if(bHaveConfig[iPad])
+                SMX_SetConfigEx(iPad, &originalConfig[iPad]);
+        }
+    }
+
+    // Stream sensor test data, and time from each response arriving to it being read.
+    void RunTestStream(const Options &options, Results &results)
+    {
+        LatencyHistogram &readTime = results.Add("SMX_ReadTestFrames call");
+        LatencyHistogram &frameAge = results.Add("test frame age when read");
+
+        for(int iPad = 0; iPad < 2; ++iPad)
+        {
+            SMX_SetTestMode(iPad, SensorTestMode_CalibratedValues);
+            SMX_SetTestStreaming(iPad, true);
+        }
+
+        LARGE_INTEGER iFrequency;
+        QueryPerformanceFrequency(&iFrequency);
+
+        vector<SMXTestFrame> frames(64);
+        uint64_t iFrames = 0;
+        double fStart = GetTime();
+        while(GetTime() - fStart < options.m_fSeconds)
+        {
+            for(int iPad = 0; iPad < 2; ++iPad)
+            {
+                double fCallStart = GetTime();
+                int iRead = SMX_ReadTestFrames(iPad, frames.data(), (int) frames.size());
+                double fNow = GetTime();
+                readTime.Add(fNow - fCallStart);
+
+                for(int i = 0; i < iRead; ++i)
+                    frameAge.Add(fNow - frames[i].m_iTimestamp / double(iFrequency.QuadPart));
+                iFrames += iRead;
+            }
+            Sleep(1);
+        }
+
+        for(int iPad = 0; iPad < 2; ++iPad)
+        {
+            SMX_SetTestStreaming(iPad, false);
+            SMX_SetTestMode(iPad, SensorTestMode_Off);
+        }
+
+        printf("  %.1f test frames per second\n", iFrames / options.m_fSeconds);
+    }
+
+    void RunScenario(const string &sScenario, const Options &options)
+    {
+        printf("%s:\n", sScenario.c_str());
+
+        // Clear statistics from before this scenario.
+        SMXStats stats;
+        SMX_GetStats(&stats, true);
+
+        Results results;
+
+        ThreadSnapshot before;
+        GetThreadSnapshot(before);
+        double fStart = GetTime();
+
+        if(sScenario == "lights30")
+            RunLights(options, 30, results);
+        else if(sScenario == "lights60")
+            RunLights(options, 60, results);
+        else if(sScenario == "lights120")
+            RunLights(options, 120, results);
+        else if(sScenario == "poll")
+            RunPoll(options, results);
+        else if(sScenario == "config")
+            RunConfig(options, results);
+        else if(sScenario == "teststream")
+            RunTestStream(options, results);
+
+        if(results.m_fEndTime < 0)
+        {
+            results.m_fEndTime = GetTime();
+            GetThreadSnapshot(results.m_After);
+        }
+        double fElapsed = results.m_fEndTime - fStart;
+
+        printf("  Latency:\n");
+        for(const auto &it: results.m_Latencies)
+            it.second.Print(it.first.c_str());
+        PrintSDKStats();
+        PrintThreadUsage(before, results.m_After, fElapsed);
+        printf("\n");
+    }
+
+    void SMXStateChangedCallback(int pad, SMXUpdateCallbackReason reason, void *pUser)
+    {
+        NameThread("callback");
+    }
+
+    void Usage()
+    {
+        printf("SMXBench [-replay capture] [-fast] [-seconds n] [-threads n] [scenario ...]\n");
+        printf("\n");
+        printf("Scenarios: lights30 lights60 lights120 poll config teststream\n");
+        printf("\n");
+        printf("  -replay   Replay a capture file instead of using connected pads.\n");
+        printf("  -fast     Replay as fast as possible instead of with the captured timing.\n");
+        printf("  -seconds  How long to run each scenario (default 10).\n");
+        printf("  -threads  The number of threads polling input in the poll scenario (default 4).\n");
+        printf("\n");
+        printf("The config scenario writes configurations to connected pads, so it only runs by\n");
+        printf("default when replaying.\n");
+    }
+}
+
+int wmain(int argc, wchar_t *argv[])
+{
+    LARGE_INTEGER iFrequency;
+    QueryPerformanceFrequency(&iFrequency);
+    g_fSecondsPerTick = 1.0 / iFrequency.QuadPart;
+
+    Options options;
+    SMXStartOptions startOptions;
+    vector<string> scenarios;
+    for(int i = 1; i < argc; ++i)
+    {
+        wstring sArg = argv[i];
+        if(sArg == L"-replay" && i + 1 < argc)
+        {
+            startOptions.m_sReplayFile = argv[++i];
+            options.m_bReplaying = true;
+        }
+        else if(sArg == L"-fast")
+            startOptions.m_bReplayAsFastAsPossible = true;
+        else if(sArg == L"-seconds" && i + 1 < argc)
+            options.m_fSeconds = max(0.1, _wtof(argv[++i]));
+        else if(sArg == L"-threads" && i + 1 < argc)
+            options.m_iPollThreads = max(1, _wtoi(argv[++i]));
+        else if(sArg == L"lights30" || sArg == L"lights60" || sArg == L"lights120" ||
+            sArg == L"poll" || sArg == L"config" || sArg == L"teststream")
+            scenarios.push_back(string(sArg.begin(), sArg.end()));
+        else
+        {
+            Usage();
+            return 1;
+        }
+    }
+
+    if(scenarios.empty())
+    {
+        scenarios = { "lights30", "lights60", "lights120", "poll", "teststream" };
+        if(options.m_bReplaying)
+            scenarios.push_back("config");
+    }
+
+    // Use 1ms sleeps for pacing.
+    timeBeginPeriod(1);
+
+    NameThread("main");
+    StartCountingAllocations();
+    SMX_StartEx(SMXStateChangedCallback, nullptr, &startOptions);
+
+    // Give pads a few seconds to connect.
+    double fStart = GetTime();
+    while(GetTime() - fStart < 5 && !IsConnected(0) && !IsConnected(1))
+        Sleep(10);
+
+    for(int iPad = 0; iPad < 2; ++iPad)
+    {
+        SMXInfo info;
+        SMX_GetInfo(iPad, &info);
+        if(info.m_bConnected)
+            printf("Pad %i: %s, firmware %i\n", iPad, info.m_Serial, info.m_iFirmwareVersion);
+        else
+            printf("Pad %i: not connected\n", iPad);
+    }
+    printf("\n");
+
+    for(const string &sScenario: scenarios)
+        RunScenario(sScenario, options);
+
+    SMX_Stop();
+    timeEndPeriod(1);
+    return 0;
+}
@@ -0,0 +1,119 @@
+// A microbenchmark for the sensor test data decoder.  This compares the SSE2 decoder with
+// the original one bit at a time decoder, and checks that they give the same results.
+//
+// This builds the decoder source directly, since it isn't exported from the DLL.
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <chrono>
+#include <random>
+#include "Windows/SMXSensorTestDecode.h"
+using namespace std;
+using namespace SMX;
+
+namespace
+{
+    // The size of each panel's record in a sensor test response, and the number of bits the
+    // master controller sends for it.
+    const int RECORD_SIZE = 10;
+    const int RECORD_BITS = RECORD_SIZE*8;
+
+    typedef void DecodeFunc(const uint16_t *pWords, int iWords, uint8_t *pOut, int iOutSize);
+
+    // Transpose per-panel data into response words.  This is the inverse of the decoder.
+    void EncodeSensorTestData(const uint8_t *pIn, int iInSize, uint16_t *pWords)
+    {
+        for(int iBit = 0; iBit < iInSize*8; ++iBit)
+        {
+            uint16_t iWord = 0;
+            for(int iPanel = 0; iPanel < 9; ++iPanel)
+            {
+                uint8_t iByte = pIn[iPanel*iInSize + iBit/8];
+                if(iByte & (1 << (iBit%8)))
+                    iWord |= 1 << iPanel;
+            }
+            pWords[iBit] = iWord;
+        }
+    }
+
+    // Check the decoders against each other on random data, with every output size and
+    // with short inputs, so the padding is tested too.
+    bool Verify(mt19937 &random)
+    {
+        uniform_int_distribution<int> randomWord(0, 0xFFFF);
+        for(int iOutSize = 1; iOutSize <= MAX_SENSOR_TEST_DECODE_SIZE; ++iOutSize)
+        {
+            for(int iWords = 0; iWords <= iOutSize*8 + 16; ++iWords)
+            {
+                uint16_t words[MAX_SENSOR_TEST_DECODE_SIZE*8 + 16];
+                for(int i = 0; i < iWords; ++i)
+                    words[i] = (uint16_t) randomWord(random);
+
+                // Fill the outputs with different values, so bytes that aren't written don't match.
+                uint8_t expected[9*MAX_SENSOR_TEST_DECODE_SIZE], actual[9*MAX_SENSOR_TEST_DECODE_SIZE];
+                memset(expected, 0xAA, sizeof(expected));
+                memset(actual, 0x55, sizeof(actual));
+                DecodeSensorTestDataScalar(words, iWords, expected, iOutSize);
+                DecodeSensorTestData(words, iWords, actual, iOutSize);
+                if(memcmp(expected, actual, 9*iOutSize))
+                {
+                    printf("Mismatch decoding %i words into %i bytes per panel\n", iWords, iOutSize);
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    // Decode iIterations responses, and return the average time for each in nanoseconds.
+    double Time(DecodeFunc *pDecode, const uint16_t *pWords, int iIterations, uint8_t *pOut)
+    {
+        auto start = chrono::steady_clock::now();
+        for(int i = 0; i < iIterations; ++i)
+        {
+            pDecode(pWords, RECORD_BITS, pOut, RECORD_SIZE);
+
+            // Feed the result back into the input, so the calls can't be optimized out.
+            const_cast<uint16_t *>(pWords)[0] ^= pOut[0] & 1;
+        }
+        auto end = chrono::steady_clock::now();
+        return chrono::duration<double, nano>(end - start).count() / iIterations;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int iIterations = argc > 1? atoi(argv[1]):1000000;
+    if(iIterations <= 0)
+        iIterations = 1000000;
+
+    mt19937 random(0);
+    if(!Verify(random))
+        return 1;
+    printf("Decoders match.\n");
+
+    // Make a response that looks like a real one: each panel's record starts with the
+    // 0 1 0 signature, followed by random sensor data.
+    uniform_int_distribution<int> randomByte(0, 0xFF);
+    uint8_t records[9*RECORD_SIZE];
+    for(int i = 0; i < 9*RECORD_SIZE; ++i)
+        records[i] = (uint8_t) randomByte(random);
+    for(int iPanel = 0; iPanel < 9; ++iPanel)
+        records[iPanel*RECORD_SIZE] = (records[iPanel*RECORD_SIZE] & ~0x07) | 0x02;
+
+    uint16_t words[RECORD_BITS];
+    EncodeSensorTestData(records, RECORD_SIZE, words);
+
+    uint8_t out[9*RECORD_SIZE];
+    Time(DecodeSensorTestDataScalar, words, iIterations / 10, out);
+    double fScalar = Time(DecodeSensorTestDataScalar, words, iIterations, out);
+    Time(DecodeSensorTestData, words, iIterations / 10, out);
+    double fSSE2 = Time(DecodeSensorTestData, words, iIterations, out);
+
+    printf("Decoding %i bits for 9 panels, %i iterations:\n", RECORD_BITS, iIterations);
+    printf("    Scalar: %.1fns\n", fScalar);
+    printf("    SSE2:   %.1fns (%.1fx)\n", fSSE2, fScalar / fSSE2);
+    return 0;
+}
@@ -0,0 +1,229 @@
+#include "../Windows/SMXDeviceSearch.h"
+
+#include "../Windows/SMXStats.h"
+#include "../Windows/Helpers.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <string>
+#include <memory>
+#include <set>
+#include <vector>
+#include <libudev.h>
+using namespace std;
+using namespace SMX;
+
+// Our devices use the default Arduino Leonardo IDs.  Since other Arduino devices use them
+// too, the product name is checked as well.
+static const char *SMX_VENDOR_ID = "2341";
+static const char *SMX_PRODUCT_ID = "8037";
+static const char *SMX_PRODUCT_NAME = "StepManiaX";
+
+// Device paths are keyed as wide strings like device interface paths on Windows.  hidraw
+// nodes are always ASCII, like "/dev/hidraw0".
+static wstring PathToWide(const char *szPath)
+{
+    wstring sResult;
+    for(const char *p = szPath; *p; ++p)
+        sResult += (wchar_t) (unsigned char) *p;
+    return sResult;
+}
+
+static string PathToNarrow(const wstring &sPath)
+{
+    string sResult;
+    for(wchar_t c: sPath)
+        sResult += (char) c;
+    return sResult;
+}
+
+namespace {
+    // Whether a hidraw node is one of ours, according to udev.
+    enum DeviceMatch
+    {
+        DeviceMatch_Ours,
+        DeviceMatch_NotOurs,
+        DeviceMatch_Unknown,
+    };
+}
+
+static DeviceMatch MatchDevice(udev_device *pDevice)
+{
+    // The hidraw node's USB device has the IDs and product name.  These come from sysfs, so
+    // unlike on Windows, we can check them without opening the device.
+    udev_device *pUSBDevice = udev_device_get_parent_with_subsystem_devtype(pDevice, "usb", "usb_device");
+    if(pUSBDevice == nullptr)
+        return DeviceMatch_NotOurs;
+
+    const char *szVendorID = udev_device_get_sysattr_value(pUSBDevice, "idVendor");
+    const char *szProductID = udev_device_get_sysattr_value(pUSBDevice, "idProduct");
+    if(szVendorID == nullptr || szProductID == nullptr)
+        return DeviceMatch_Unknown;
+
+    if(strcmp(szVendorID, SMX_VENDOR_ID) || strcmp(szProductID, SMX_PRODUCT_ID))
+        return DeviceMatch_NotOurs;
+
+    const char *szProduct = udev_device_get_sysattr_value(pUSBDevice, "product");
+    if(szProduct == nullptr)
+        return DeviceMatch_Unknown;
+
+    return strcmp(szProduct, SMX_PRODUCT_NAME)? DeviceMatch_NotOurs:DeviceMatch_Ours;
+}
+
+// Return all hidraw device paths, and whether each is one of ours.  This doesn't open
+// the devices.
+static map<wstring, DeviceMatch> GetAllHidrawDevices(wstring &error)
+{
+    udev *pUdev = udev_new();
+    if(pUdev == nullptr)
+    {
+        error = L"udev_new failed";
+        return {};
+    }
+
+    udev_enumerate *pEnumerate = udev_enumerate_new(pUdev);
+    udev_enumerate_add_match_subsystem(pEnumerate, "hidraw");
+    udev_enumerate_scan_devices(pEnumerate);
+
+    map<wstring, DeviceMatch> devices;
+    udev_list_entry *pEntry;
+    udev_list_entry_foreach(pEntry, udev_enumerate_get_list_entry(pEnumerate))
+    {
+        udev_device *pDevice = udev_device_new_from_syspath(pUdev, udev_list_entry_get_name(pEntry));
+        if(pDevice == nullptr)
+            continue;
+
+        const char *szNode = udev_device_get_devnode(pDevice);
+        if(szNode != nullptr)
+            devices[PathToWide(szNode)] = MatchDevice(pDevice);
+        udev_device_unref(pDevice);
+    }
+
+    udev_enumerate_unref(pEnumerate);
+    udev_unref(pUdev);
+    return devices;
+}
+
+// Open one of our devices.  If NULL is returned we couldn't open it, usually because we
+// don't have permission.
+static shared_ptr<AutoCloseHandle> OpenUSBDevice(const wstring &sPath)
+{
+    double fStartTime = GetMonotonicTime();
+    int iFd = open(PathToNarrow(sPath).c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    g_Stats.m_DeviceProbeTime.AddSample(GetMonotonicTime() - fStartTime);
+
+    if(iFd == -1)
+    {
+        // If this is EACCES, the udev rule giving the user access to the device isn't installed.
+        Log(ssprintf("Error opening device %ls: %ls", sPath.c_str(), GetErrorString(errno).c_str()));
+        return nullptr;
+    }
+
+    return make_shared<AutoCloseHandle>(iFd);
+}
+
+vector<shared_ptr<AutoCloseHandle>> SMX::SMXDeviceSearch::GetDevices(wstring &error)
+{
+    map<wstring, DeviceMatch> aDevices = GetAllHidrawDevices(error);
+    set<wstring> aDevicePaths;
+    for(auto it: aDevices)
+        aDevicePaths.insert(it.first);
+    double fNow = GetMonotonicTime();
+
+    // Remove any entries that are no longer in the list.  The udev monitor wakes us up when
+    // a device is removed, so this happens as soon as it's unplugged, and a device plugged in
+    // later on the same path is checked again.
+    for(wstring sPath: m_setLastDevicePaths)
+    {
+        if(aDevicePaths.find(sPath) != aDevicePaths.end())
+            continue;
+
+        Log(ssprintf("Device removed: %ls", sPath.c_str()));
+        m_Devices.erase(sPath);
+        m_setRejectedDevicePaths.erase(sPath);
+        m_RetryDevicePaths.erase(sPath);
+    }
+
+    // Check for new entries.
+    for(auto it: aDevices)
+    {
+        const wstring &sPath = it.first;
+
+        // Skip devices we've already checked.
+        if(m_setRejectedDevicePaths.find(sPath) != m_setRejectedDevicePaths.end())
+            continue;
+
+        // Retry devices we couldn't check or open once they're due.  Otherwise, only look at
+        // devices that weren't in the list last time.
+        auto itRetry = m_RetryDevicePaths.find(sPath);
+        if(itRetry != m_RetryDevicePaths.end())
+        {
+            if(itRetry->second.m_fRetryAt > fNow)
+                continue;
+        }
+        else if(m_setLastDevicePaths.find(sPath) != m_setLastDevicePaths.end())
+            continue;
+
+        if(it.second == DeviceMatch_NotOurs)
+        {
+            m_setRejectedDevicePaths.insert(sPath);
+            m_RetryDevicePaths.erase(sPath);
+            continue;
+        }
+
+        // If udev didn't have the device's attributes yet or we couldn't open it, try again
+        // later, starting after half a second and doubling up to a minute.
+        shared_ptr<AutoCloseHandle> hDevice;
+        if(it.second == DeviceMatch_Ours)
+            hDevice = OpenUSBDevice(sPath);
+        if(hDevice == nullptr)
+        {
+            RetryState &retry = m_RetryDevicePaths[sPath];
+            double fDelay = min(60.0, 0.5 * (1 << min(retry.m_iFailures, 7)));
+            retry.m_iFailures++;
+            retry.m_fRetryAt = fNow + fDelay;
+            continue;
+        }
+
+        Log(ssprintf("Device added: %ls", sPath.c_str()));
+        m_Devices[sPath] = hDevice;
+        m_RetryDevicePaths.erase(sPath);
+    }
+
+    m_setLastDevicePaths = aDevicePaths;
+
+    vector<shared_ptr<AutoCloseHandle>> aResult;
+    for(auto it: m_Devices)
+        aResult.push_back(it.second);
+
+    return aResult;
+}
+
+double SMX::SMXDeviceSearch::GetTimeUntilRetry() const
+{
+    if(m_RetryDevicePaths.empty())
+        return -1;
+
+    double fRetryAt = m_RetryDevicePaths.begin()->second.m_fRetryAt;
+    for(auto it: m_RetryDevicePaths)
+        fRetryAt = min(fRetryAt, it.second.m_fRetryAt);
+    return max(0.0, fRetryAt - GetMonotonicTime());
+}
+
+void SMX::SMXDeviceSearch::DeviceWasClosed(shared_ptr<AutoCloseHandle> pDevice)
+{
+    map<wstring, shared_ptr<AutoCloseHandle>> aDevices;
+    for(auto it: m_Devices)
+    {
+        if(it.second == pDevice)
+        {
+            m_setLastDevicePaths.erase(it.first);
+        }
+        else
+        {
+            aDevices[it.first] = it.second;
+        }
+    }
+    m_Devices = aDevices;
+}
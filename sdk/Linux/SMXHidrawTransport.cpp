@@ -0,0 +1,159 @@
+#include "SMXHidrawTransport.h"
+#include "../Windows/SMXIOPort.h"
+#include "../Windows/SMXThreadOptions.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+using namespace std;
+using namespace SMX;
+
+shared_ptr<SMXHidrawTransport> SMX::SMXHidrawTransport::Create(shared_ptr<AutoCloseHandle> hDevice, shared_ptr<SMXIOPort> pIOPort, wstring &sError)
+{
+    return make_shared<SMXHidrawTransport>(hDevice, pIOPort);
+}
+
+SMX::SMXHidrawTransport::SMXHidrawTransport(shared_ptr<AutoCloseHandle> hDevice, shared_ptr<SMXIOPort> pIOPort):
+    m_hDevice(hDevice),
+    m_pIOPort(pIOPort)
+{
+    m_WriterThread = thread(&SMXHidrawTransport::WriterThreadMain, this);
+}
+
+SMX::SMXHidrawTransport::~SMXHidrawTransport()
+{
+    Close();
+}
+
+void SMX::SMXHidrawTransport::Close()
+{
+    if(!m_WriterThread.joinable())
+        return;
+
+    // If the writer thread is in the middle of a write, this waits for it to finish.  The fd
+    // is owned by m_hDevice, and stays open until the device search lets go of it.
+    m_bShutdown = true;
+    m_WriteEvent.Set();
+    m_WriterThread.join();
+
+    Packet packet;
+    while(m_Writes.Pop(packet))
+        ;
+    m_iWritesQueued = 0;
+    m_iWritesDone = 0;
+    m_iReportSize = -1;
+}
+
+bool SMX::SMXHidrawTransport::PeekReport(const uint8_t *&pData, int &iSize, wstring &sError)
+{
+    if(!m_WriterThread.joinable())
+        return false;
+
+    if(m_iReportSize == -1)
+    {
+        ssize_t iBytes = read(m_hDevice->value(), m_Report, sizeof(m_Report));
+        if(iBytes == -1)
+        {
+            // ENODEV means the device was unplugged.
+            if(errno != EAGAIN && errno != EINTR)
+                sError = wstring(L"Error reading device: ") + GetErrorString(errno);
+            return false;
+        }
+
+        m_iReportSize = (int) iBytes;
+    }
+
+    pData = m_Report;
+    iSize = m_iReportSize;
+    return true;
+}
+
+void SMX::SMXHidrawTransport::PopReport()
+{
+    m_iReportSize = -1;
+}
+
+void SMX::SMXHidrawTransport::BeginWrite(const uint8_t *pData, wstring &sError)
+{
+    if(!m_WriterThread.joinable())
+        return;
+
+    Packet packet;
+    memcpy(packet.m_Data, pData, REPORT_SIZE);
+    if(!m_Writes.Push(packet))
+    {
+        sError = L"Error writing to device: write queue full";
+        return;
+    }
+
+    m_iWritesQueued++;
+    m_WriteEvent.Set();
+}
+
+bool SMX::SMXHidrawTransport::WritesFinished(wstring &sError)
+{
+    int iError = m_iWriteError.load();
+    if(iError != 0)
+    {
+        sError = wstring(L"Error writing to device: ") + GetErrorString(iError);
+        return false;
+    }
+
+    return m_iWritesDone.load() == m_iWritesQueued;
+}
+
+bool SMX::SMXHidrawTransport::IsCompletionForTransport(const void *pCompletion) const
+{
+    // Reads are signalled by the fd, and finished writes are posted with it, so both come
+    // from SMXIOPort::Wait as the device handle.
+    return pCompletion == m_hDevice.get();
+}
+
+void SMX::SMXHidrawTransport::WriterThreadMain()
+{
+    SetThreadName("SMXHidrawWriter");
+
+    // Run at the same priority as the I/O thread, if we're allowed to, so lights commands
+    // don't wait behind other threads.
+    int iError;
+    SetCurrentThreadPriority(THREAD_PRIORITY_HIGHEST, iError);
+
+    while(true)
+    {
+        m_WriteEvent.Wait();
+        if(m_bShutdown)
+            break;
+
+        bool bWroteAny = false;
+        Packet packet;
+        while(m_Writes.Pop(packet))
+        {
+            while(m_iWriteError.load() == 0)
+            {
+                ssize_t iBytes = write(m_hDevice->value(), packet.m_Data, REPORT_SIZE);
+                if(iBytes != -1)
+                    break;
+
+                // In case the driver does honor O_NONBLOCK, wait until it'll take the report.
+                if(errno == EAGAIN)
+                {
+                    pollfd pfd = { m_hDevice->value(), POLLOUT, 0 };
+                    poll(&pfd, 1, 100);
+                    if(m_bShutdown)
+                        return;
+                    continue;
+                }
+
+                if(errno != EINTR)
+                    m_iWriteError = errno;
+            }
+
+            m_iWritesDone++;
+            bWroteAny = true;
+        }
+
+        if(bWroteAny)
+            m_pIOPort->PostCompletion(m_hDevice.get());
+    }
+}
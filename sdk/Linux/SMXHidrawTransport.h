@@ -0,0 +1,69 @@
+#ifndef SMXHidrawTransport_h
+#define SMXHidrawTransport_h
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+using namespace std;
+
+#include "../Windows/Helpers.h"
+#include "../Windows/SMXTransport.h"
+
+namespace SMX
+{
+class SMXIOPort;
+
+// A transport for a Linux hidraw device node opened by SMXDeviceSearch.  The fd is
+// nonblocking and added to the I/O thread's SMXIOPort by the owner, so the thread sleeps
+// until a report arrives, instead of polling.
+//
+// hidraw reads return one report each, starting with the report ID, like the reports we get
+// from Windows, except that they aren't padded to 64 bytes.
+//
+// hidraw writes block until the device accepts the report, even on a nonblocking fd, so
+// they're made by a writer thread.  It posts a completion to the SMXIOPort when it's written
+// a batch, which wakes the I/O thread like a finished write on Windows.
+class SMXHidrawTransport: public SMXTransport
+{
+public:
+    static shared_ptr<SMXHidrawTransport> Create(shared_ptr<AutoCloseHandle> hDevice, shared_ptr<SMXIOPort> pIOPort, wstring &sError);
+    SMXHidrawTransport(shared_ptr<AutoCloseHandle> hDevice, shared_ptr<SMXIOPort> pIOPort);
+    ~SMXHidrawTransport();
+
+    void Close() override;
+    bool PeekReport(const uint8_t *&pData, int &iSize, wstring &sError) override;
+    void PopReport() override;
+    void BeginWrite(const uint8_t *pData, wstring &sError) override;
+    bool WritesFinished(wstring &sError) override;
+    bool IsCompletionForTransport(const void *pCompletion) const override;
+
+private:
+    void WriterThreadMain();
+
+    shared_ptr<AutoCloseHandle> m_hDevice;
+    shared_ptr<SMXIOPort> m_pIOPort;
+
+    // The report returned by PeekReport, or -1 if we haven't read one.
+    uint8_t m_Report[REPORT_SIZE];
+    int m_iReportSize = -1;
+
+    // Packets waiting for the writer thread.  m_iWritesQueued is only used by the I/O thread,
+    // and m_iWritesDone is how many of them the writer thread has finished.  If a write fails,
+    // m_iWriteError is set to its errno, and the rest of the writes are discarded.
+    struct Packet
+    {
+        uint8_t m_Data[REPORT_SIZE];
+    };
+    SPSCQueue<Packet, 64> m_Writes;
+    Event m_WriteEvent;
+    thread m_WriterThread;
+    atomic<bool> m_bShutdown{false};
+    uint32_t m_iWritesQueued = 0;
+    atomic<uint32_t> m_iWritesDone{0};
+    atomic<int> m_iWriteError{0};
+};
+}
+
+#endif
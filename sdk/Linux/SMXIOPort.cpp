@@ -0,0 +1,145 @@
+#include "../Windows/SMXIOPort.h"
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+using namespace std;
+using namespace SMX;
+
+SMX::SMXIOPort::SMXIOPort()
+{
+    m_hEpoll = make_shared<AutoCloseHandle>(epoll_create1(EPOLL_CLOEXEC));
+    if(m_hEpoll->value() == -1)
+        LogFormat("epoll_create1 failed: %ls", GetErrorString(errno));
+
+    // The epoll data pointer tells Wait what each event is for.  Devices use their handle, and
+    // our own fds use their member.
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = &m_WakeEvent;
+    if(epoll_ctl(m_hEpoll->value(), EPOLL_CTL_ADD, m_WakeEvent.value(), &event) == -1)
+        LogFormat("epoll_ctl failed: %ls", GetErrorString(errno));
+
+    m_hTimer = make_shared<AutoCloseHandle>(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+    event.data.ptr = &m_hTimer;
+    if(m_hTimer->value() != -1 && epoll_ctl(m_hEpoll->value(), EPOLL_CTL_ADD, m_hTimer->value(), &event) == 0)
+        m_bHaveTimer = true;
+    else
+        LogFormat("High resolution timers not available: %ls", GetErrorString(errno));
+}
+
+SMX::SMXIOPort::~SMXIOPort()
+{
+}
+
+void SMX::SMXIOPort::Wake()
+{
+    m_bWoken = true;
+    m_WakeEvent.Set();
+}
+
+void SMX::SMXIOPort::PostCompletion(const void *pCompletion)
+{
+    // If the queue is full, update everything instead.
+    if(!m_PostedCompletions.Push(pCompletion))
+        m_bWoken = true;
+    m_WakeEvent.Set();
+}
+
+bool SMX::SMXIOPort::AddDevice(shared_ptr<AutoCloseHandle> pHandle)
+{
+    // We only wait for reads.  Writes are made by the transport's writer thread, which posts
+    // a completion when they finish.  Errors and hangups are always reported, and wake us up
+    // to read the error.
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = pHandle.get();
+    if(epoll_ctl(m_hEpoll->value(), EPOLL_CTL_ADD, pHandle->value(), &event) == -1 && errno != EEXIST)
+    {
+        LogFormat("epoll_ctl failed: %ls", GetErrorString(errno));
+        return false;
+    }
+
+    return true;
+}
+
+void SMX::SMXIOPort::RemoveDevice(shared_ptr<AutoCloseHandle> pHandle)
+{
+    // An unplugged device reports a hangup until it's closed, so this keeps it from waking us
+    // up constantly.
+    if(epoll_ctl(m_hEpoll->value(), EPOLL_CTL_DEL, pHandle->value(), nullptr) == -1 && errno != ENOENT)
+        LogFormat("epoll_ctl failed: %ls", GetErrorString(errno));
+}
+
+void SMX::SMXIOPort::SetTimer(double fTime)
+{
+    if(!m_bHaveTimer || fTime == m_fTimerDueAt)
+        return;
+
+    // The timer uses the same clock as GetMonotonicTime, so it can be set for an absolute time.
+    // A time of zero disarms it, so don't let it round down to that.
+    itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    double fSeconds = floor(fTime);
+    spec.it_value.tv_sec = (time_t) fSeconds;
+    spec.it_value.tv_nsec = max(1L, long((fTime - fSeconds) * 1000000000));
+    if(timerfd_settime(m_hTimer->value(), TFD_TIMER_ABSTIME, &spec, nullptr) == -1)
+    {
+        LogFormat("timerfd_settime failed: %ls", GetErrorString(errno));
+        m_bHaveTimer = false;
+        return;
+    }
+
+    m_fTimerDueAt = fTime;
+}
+
+bool SMX::SMXIOPort::Wait(int iTimeoutMS, const void *apCompletions[MAX_COMPLETIONS], int &iCompletions)
+{
+    iCompletions = 0;
+
+    epoll_event aEvents[MAX_COMPLETIONS];
+    int iEvents = epoll_wait(m_hEpoll->value(), aEvents, MAX_COMPLETIONS, iTimeoutMS);
+    if(iEvents <= 0)
+        return false;
+
+    bool bOnlyDeviceIO = true;
+    for(int iEvent = 0; iEvent < iEvents; ++iEvent)
+    {
+        void *pData = aEvents[iEvent].data.ptr;
+        if(pData == &m_WakeEvent)
+        {
+            // Reset the event before reading the queue, so anything posted after this sets
+            // it again.
+            m_WakeEvent.Reset();
+            if(m_bWoken.exchange(false))
+                bOnlyDeviceIO = false;
+
+            const void *pCompletion;
+            while(m_PostedCompletions.Pop(pCompletion))
+            {
+                if(iCompletions < MAX_COMPLETIONS)
+                    apCompletions[iCompletions++] = pCompletion;
+                else
+                    bOnlyDeviceIO = false;
+            }
+        }
+        else if(pData == &m_hTimer)
+        {
+            // Reading the timer resets it.  It isn't set anymore, so it'll be set again if what
+            // it was for isn't quite due yet.
+            uint64_t iExpirations;
+            ssize_t iResult = read(m_hTimer->value(), &iExpirations, sizeof(iExpirations));
+            (void) iResult;
+            m_fTimerDueAt = -1;
+            bOnlyDeviceIO = false;
+        }
+        else if(iCompletions < MAX_COMPLETIONS)
+            apCompletions[iCompletions++] = pData;
+    }
+    return bOnlyDeviceIO;
+}
@@ -3,17 +3,39 @@
 
 #include <stdint.h>
 
-#ifdef SMX_EXPORTS
+#if !defined(_WIN32)
+#define SMX_API __attribute__((visibility("default")))
+#elif defined(SMX_EXPORTS)
 #define SMX_API __declspec(dllexport)
 #else
 #define SMX_API __declspec(dllimport)
 #endif
 
+// The number of cabinets that can be connected at once.  Each cabinet has two pads, player 1
+// and player 2.  Functions that take a pad number accept 0 to SMX_MAX_CABINETS*2-1, where
+// the pad number is cabinet*2 + player: pads 0 and 1 are the first cabinet, 2 and 3 are the
+// second, and so on.  Applications with a single cabinet can just use pads 0 and 1.
+#define SMX_MAX_CABINETS 4
+
 struct SMXInfo;
 struct SMXConfig;
-enum SensorTestMode;
-enum SMXUpdateCallbackReason;
+
+// These enums are declared before they're defined, so they're given an explicit type, which
+// is required outside of MSVC.
+enum SensorTestMode: int;
+enum SMXUpdateCallbackReason: int;
 struct SMXSensorTestModeData;
+struct SMXTestFrame;
+struct SMXInputEvent;
+struct SMXLightsTimingStats;
+struct SMXLightsKeyframe;
+enum SMXLightsTrigger: int;
+struct SMXState;
+struct SMXSharedState;
+struct SMXStartOptions;
+enum SMXThread: int;
+struct SMXThreadOptions;
+struct SMXStats;
 
 // All functions are nonblocking.  Getters will return the most recent state.  Setters will
 // return immediately and do their work in the background.  No functions return errors, and
@@ -29,6 +51,10 @@ struct SMXSensorTestModeData;
 typedef void SMXUpdateCallback(int pad, SMXUpdateCallbackReason reason, void *pUser);
 extern "C" SMX_API void SMX_Start(SMXUpdateCallback UpdateCallback, void *pUser);
 
+// This is the same as SMX_Start, with options that control how UpdateCallback is called.  See
+// SMXStartOptions.  If options is NULL, this is the same as SMX_Start.
+extern "C" SMX_API void SMX_StartEx(SMXUpdateCallback UpdateCallback, void *pUser, const SMXStartOptions *options);
+
 // Shut down and disconnect from all devices.  This will wait for any user callbacks to complete,
 // and no user callbacks will be called after this returns.  This must not be called from within
 // the update callback.
@@ -36,15 +62,58 @@ extern "C" SMX_API void SMX_Stop();
 
 // Set a function to receive diagnostic logs.  By default, logs are written to stdout.
 // This can be called before SMX_Start, so it affects any logs sent during initialization.
+//
+// While the SDK is running, logs are delivered from a low-priority helper thread, so the
+// callback must be thread-safe.  Messages repeated more than a few times a second are
+// suppressed and summarized.
 typedef void SMXLogCallback(const char *log);
 extern "C" SMX_API void SMX_SetLogCallback(SMXLogCallback callback);
 
+// Set the scheduling options for one of the SDK's threads: which processors it can run on,
+// its priority, and whether it's registered with MMCSS.  See SMXThreadOptions.  This can be
+// called before SMX_Start, and the options are applied when the thread starts.  If the thread
+// is already running, it applies them the next time it wakes up, which is almost immediately.
+extern "C" SMX_API void SMX_SetThreadOptions(SMXThread thread, const SMXThreadOptions *options);
+
 // Get info about a pad.  Use this to detect which pads are currently connected.
 extern "C" SMX_API void SMX_GetInfo(int pad, SMXInfo *info);
 
+// Get info about a pad in a cabinet.  This is the same as SMX_GetInfo(cabinet*2 + pad, info).
+extern "C" SMX_API void SMX_GetCabinetInfo(int cabinet, int pad, SMXInfo *info);
+
+// Choose which cabinet the pad with the given serial number is placed in.  By default, pads are
+// placed in the first cabinet with a free slot for their player number, in the order they connect.
+// Use this to give cabinets a fixed order when more than one is connected.  If cabinet is -1,
+// any cabinet assigned to the serial is cleared.
+extern "C" SMX_API void SMX_AssignCabinet(const char *serial, int cabinet);
+
 // Get a mask of the currently pressed panels.
 extern "C" SMX_API uint16_t SMX_GetInputState(int pad);
 
+// Get the connection state, input state and configuration generation of every pad at once.
+// All pads are read from the same snapshot, so they're consistent with each other.  This
+// doesn't lock or wait for the I/O thread, so it's cheaper than calling SMX_GetInfo and
+// SMX_GetInputState for each pad.
+extern "C" SMX_API void SMX_GetState(SMXState *state);
+
+// Return a pointer to a block of memory holding the state of every pad, which the SDK keeps
+// up to date.  This is for hosts like C# and Unity that want to read state without a call and
+// marshalling for each value.  The pointer is the same for the life of the DLL, so it can be
+// cached, and it can be read before SMX_Start.  See SMXSharedState for how to read it.
+extern "C" SMX_API const SMXSharedState *SMX_GetSharedState();
+
+// Read input changes that have happened since the last call.  SMX_GetInputState only returns
+// the current state, so a panel that's pressed and released quickly may never be seen.  This
+// returns every change in the order it was received, with the time it arrived.
+//
+// Up to maxEvents events are written to events, and the number of events read is returned.
+// If the application stops reading events, the oldest events are kept and new events are
+// discarded once the buffer fills, so this should be called regularly if it's used at all.
+//
+// This doesn't lock, and can be called at any rate, but only one thread should read events
+// for each pad.
+extern "C" SMX_API int SMX_ReadInputEvents(int pad, SMXInputEvent *events, int maxEvents);
+
 // Update the lights.  Both pads are always updated together.  lightsData is a list of 8-bit RGB
 // colors, one for each LED.  Each panel has lights in the following order:
 //
@@ -68,6 +137,85 @@ extern "C" SMX_API uint16_t SMX_GetInputState(int pad);
 // controlling lights should send light updates continually, even if the lights aren't changing.
 extern "C" SMX_API void SMX_SetLights(const char lightsData[864]);
 
+// Update the lights for a cabinet.  SMX_SetLights is the same as SMX_SetCabinetLights(0, lightsData).
+extern "C" SMX_API void SMX_SetCabinetLights(int cabinet, const char lightsData[864]);
+
+// This is the same as SMX_SetLights, but takes the size of the lights data.  If the size is
+// wrong, the update is ignored and an error is logged.  In both cases, the lights data is read
+// during the call and isn't copied, so the buffer can be reused as soon as this returns.
+extern "C" SMX_API void SMX_SetLightsEx(const char *lightsData, int lightsDataSize);
+
+// Set a buffer for a cabinet's lights, in the same format as SMX_SetLights, to be sent with
+// SMX_CommitLights.  The buffer belongs to the caller, and must stay valid, and not move, until
+// it's replaced, cleared by passing NULL, or SMX_Stop is called.  Managed callers should pin it.
+extern "C" SMX_API void SMX_SetLightsBuffer(int cabinet, const char *lightsBuffer);
+
+// Send the lights in a cabinet's lights buffer.  This is the same as calling
+// SMX_SetCabinetLights with the buffer, without passing it each time.  The buffer is read
+// during the call, so it can be written again as soon as this returns.
+extern "C" SMX_API void SMX_CommitLights(int cabinet);
+
+// Update the lights for a cabinet from a palette of colors, with each light using 4 or 8 bits
+// to pick one.  This is much smaller than SMX_SetLights when only a few colors are used, and
+// the color scaling SMX_SetLights does is applied once to each palette color instead of to
+// every light.
+//
+// palette is paletteSize RGB colors, with up to 16 colors for 4-bit lights or 256 for 8-bit
+// lights.  indices has a color index for each light, in the same order as SMX_SetLights.  With
+// 4 bits per light, it's 144 bytes, and each byte holds two lights, with the first in the low
+// four bits.  With 8 bits, it's 288 bytes.  Lights using an index past the end of the palette
+// are black.
+extern "C" SMX_API void SMX_SetLightsIndexed(int cabinet, const uint8_t *palette, int paletteSize, const uint8_t *indices, int bitsPerLight);
+
+// Enable or disable delta lights mode.  This is disabled by default.  When enabled, lights
+// updates that don't change what a pad is showing aren't sent to that pad.  Unchanged lights
+// are still sent often enough to keep the pad from returning to auto-lighting, so applications
+// should still call SMX_SetLights continually.  This reduces USB traffic when lights aren't
+// changing on one or both pads.
+extern "C" SMX_API void SMX_SetLightsDeltaMode(bool enable);
+
+// Get statistics about how accurately lights commands are being paced.  This is the same as
+// SMXStats::m_LightsTiming from SMX_GetStats, which should be used instead.  If reset is true,
+// all SMX_GetStats statistics are reset after being read, not just these.
+extern "C" SMX_API void SMX_GetLightsTimingStats(SMXLightsTimingStats *stats, bool reset);
+
+// Enable or disable the lights engine.  This is disabled by default.  While it's enabled, the
+// SDK renders lights itself from animations set with SMX_SetPanelAnimation, and sends them at
+// the full lights rate, so panels can react to steps without the application sending lights
+// every frame.  Cabinets with no animations set aren't sent lights.  SMX_SetLights is ignored
+// while the engine is enabled, and SMX_ReenableAutoLights disables it.
+extern "C" SMX_API void SMX_SetLightsEngineEnabled(bool enable);
+
+// Upload a lights animation for the lights engine, and return its ID.  Keyframes must be in
+// order of time.  Colors are blended linearly between keyframes.  If loop is true, the animation
+// repeats, and its length is the time of the last keyframe.  Otherwise, it plays once.  The
+// keyframes are copied, so the buffer can be reused after this returns.  Return -1 if the
+// animation is invalid.
+extern "C" SMX_API int SMX_CreateLightsAnimation(const SMXLightsKeyframe *keyframes, int count, bool loop);
+
+// Delete an animation created by SMX_CreateLightsAnimation.  Panels using it go dark, and its
+// ID may be reused by a later animation.
+extern "C" SMX_API void SMX_DeleteLightsAnimation(int animation);
+
+// Set the animation a panel shows for a trigger, or clear it if animation is -1.  Panels are
+// numbered 0-8, in the same order as in SMX_SetLights.
+//
+// SMXLightsTrigger_Idle animations play whenever no other animation is playing.  Looping idle
+// animations are all timed together, so panels showing the same one stay in sync.
+//
+// SMXLightsTrigger_Press animations start when the panel is pressed.  Looping press animations
+// repeat until the panel is released, and others play once to the end.
+extern "C" SMX_API void SMX_SetPanelAnimation(int pad, int panel, SMXLightsTrigger trigger, int animation);
+
+// Play an animation once on a panel now, as if it had been pressed.  This can be used for
+// effects that aren't tied to steps.
+extern "C" SMX_API void SMX_PlayPanelAnimation(int pad, int panel, int animation);
+
+// Get timing and queueing statistics for the SDK, to help diagnose latency problems.  If reset
+// is true, the statistics are reset after being read.  Statistics are kept even before SMX_Start
+// is called and after SMX_Stop, so this may be called at any time.
+extern "C" SMX_API void SMX_GetStats(SMXStats *stats, bool reset);
+
 // By default, the panels light automatically when stepped on.  If a lights command is sent by
 // the application, this stops happening to allow the application to fully control lighting.
 // If no lights update is received for a few seconds, automatic lighting is reenabled by the
@@ -87,8 +235,17 @@ extern "C" SMX_API bool SMX_GetConfig(int pad, SMXConfig *config);
 // Update the current controller's configuration.  This doesn't block, and the new configuration will
 // be sent in the background.  SMX_GetConfig will return the new configuration as soon as this call
 // returns, without waiting for it to actually be sent to the controller.
+//
+// Calls made in quick succession, such as while a slider is being dragged, are combined, and
+// only the most recent configuration is sent.  Nothing is sent if the configuration hasn't changed.
 extern "C" SMX_API void SMX_SetConfig(int pad, const SMXConfig *config);
 
+// This is the same as SMX_SetConfig, and returns a write number for this call.  Write numbers
+// for a pad start at 1 and increase with each call.  Once m_iConfigWriteAcked in SMX_GetState
+// reaches this number, the device has acknowledged this configuration, or a later one.  If the
+// pad disconnects first, the write is discarded and won't be acknowledged.
+extern "C" SMX_API uint32_t SMX_SetConfigEx(int pad, const SMXConfig *config);
+
 // Reset a pad to its original configuration.
 extern "C" SMX_API void SMX_FactoryReset(int pad);
 
@@ -100,6 +257,18 @@ extern "C" SMX_API void SMX_ForceRecalibration(int pad);
 extern "C" SMX_API void SMX_SetTestMode(int pad, SensorTestMode mode);
 extern "C" SMX_API bool SMX_GetTestData(int pad, SMXSensorTestModeData *data);
 
+// Stream test data for the mode set with SMX_SetTestMode.  While this is enabled, test data is
+// requested continuously, with the next request already waiting when each one finishes, and
+// every response is queued to be read with SMX_ReadTestFrames.  The update callback isn't
+// called for each frame.  SMX_GetTestData still returns the most recent frame.
+extern "C" SMX_API void SMX_SetTestStreaming(int pad, bool enable);
+
+// Read test data frames queued while streaming, oldest first.  Up to maxFrames frames are
+// written to frames, and the number read is returned.  If frames aren't read quickly enough,
+// new ones are discarded once the queue fills.  This doesn't lock, and only one thread should
+// read frames for each pad.
+extern "C" SMX_API int SMX_ReadTestFrames(int pad, SMXTestFrame *frames, int maxFrames);
+
 // Return the build version of the DLL, which is based on the git tag at build time.  This
 // is only intended for diagnostic logging, and it's also the version we show in SMXConfig.
 extern "C" SMX_API const char *SMX_Version();
@@ -120,7 +289,261 @@ struct SMXInfo
     uint16_t m_iFirmwareVersion;
 };
 
-enum SMXUpdateCallbackReason {
+// A change in input state, returned by SMX_ReadInputEvents.
+struct SMXInputEvent
+{
+    // The mask of pressed panels after this change, in the same format as SMX_GetInputState.
+    uint16_t m_iInputState;
+
+    // The QueryPerformanceCounter value when the input report was received.  On Linux, this is
+    // CLOCK_MONOTONIC in nanoseconds.
+    int64_t m_iTimestamp;
+};
+
+// How SMX_StartEx delivers updates.
+enum SMXCallbackMode
+{
+    // UpdateCallback is called from a helper thread.  This is the default, and is what SMX_Start does.
+    SMXCallbackMode_Thread,
+
+    // UpdateCallback is called directly from the SDK's I/O thread, which avoids a thread switch
+    // for every update.  The callback must be thread-safe and must never block, since the I/O
+    // thread can't handle devices until it returns.  Callbacks that take longer than the budget
+    // in SMXStartOptions are logged.  SMX_Stop must not be called from the callback.
+    SMXCallbackMode_Inline,
+
+    // UpdateCallback isn't used and can be NULL.  Instead, the event in SMXStartOptions is set
+    // whenever something changes, and the application should check the state it's interested
+    // in, eg. with SMX_GetState.  This lets the application wait for updates along with its own
+    // handles.
+    SMXCallbackMode_Event,
+};
+
+struct SMXStartOptions
+{
+    SMXCallbackMode m_CallbackMode = SMXCallbackMode_Thread;
+
+    // With SMXCallbackMode_Inline, callbacks taking longer than this are logged.  If this is
+    // 0, a default of 250 microseconds is used.
+    int m_iInlineCallbackBudgetMicroseconds = 0;
+
+    // With SMXCallbackMode_Event, the Win32 event handle to set.  This should be an auto-reset
+    // event, and is owned by the application, which must not close it until after SMX_Stop.
+    // On Linux, this is an eventfd cast to a pointer, which is written to instead.  Note that
+    // fd 0 can't be used, since it's the same as not setting an event.
+    void *m_hEvent = nullptr;
+
+    // If set, all HID traffic to and from devices is written to this file, for replaying later.
+    const wchar_t *m_sCaptureFile = nullptr;
+
+    // If set, no devices are opened, and the devices in this capture file are replayed instead,
+    // connecting and sending input as they did when it was captured.  Anything sent to them is
+    // discarded.  Each device disconnects when it reaches the end of the capture.
+    const wchar_t *m_sReplayFile = nullptr;
+
+    // If true, the replay is played back as fast as the SDK can handle it, instead of with the
+    // timing it was captured with.  This is useful for benchmarking.
+    bool m_bReplayAsFastAsPossible = false;
+
+    // If true, the configuration of each pad is cached on disk, keyed by its serial number.
+    // When a pad that's been seen before connects, it's reported as connected with its cached
+    // configuration as soon as it identifies itself, instead of after its configuration is read.
+    // The configuration is still read in the background, and replaces the cached one if it's
+    // changed.  This isn't used when replaying.
+    bool m_bUseDeviceCache = false;
+
+    // The file to use for the device cache.  If this is null, the cache is kept in
+    // %LOCALAPPDATA%\StepManiaX\SMXDeviceCache.dat.
+    const wchar_t *m_sDeviceCacheFile = nullptr;
+};
+
+// The SDK's threads, for SMX_SetThreadOptions.
+enum SMXThread: int {
+    // The thread that talks to the pads.  By default, this runs at THREAD_PRIORITY_HIGHEST,
+    // since delays here delay input and lights.
+    SMXThread_IO,
+
+    // The thread that calls the update callback with SMXCallbackMode_Thread.  By default, this
+    // runs at THREAD_PRIORITY_HIGHEST.  With other callback modes there's no callback thread,
+    // and callbacks are made from the I/O thread.
+    SMXThread_Callback,
+
+    // The thread that searches for devices when they're plugged in or removed.  By default,
+    // this runs at THREAD_PRIORITY_NORMAL.  It isn't latency sensitive, so it can be lowered.
+    SMXThread_DeviceSearch,
+
+    NUM_SMX_THREADS
+};
+
+// Use the default priority in SMXThreadOptions::m_iPriority.
+#define SMX_THREAD_PRIORITY_DEFAULT 0x7FFFFFFF
+
+// Scheduling options for one of the SDK's threads, set with SMX_SetThreadOptions.
+struct SMXThreadOptions
+{
+    // If nonzero, the processors the thread may run on, as for SetThreadAffinityMask.  Only
+    // the low 32 bits are used in 32-bit builds.  If this is 0, the thread can run on any
+    // processor the process can.
+    uint64_t m_iAffinityMask = 0;
+
+    // The thread's priority, as a Win32 THREAD_PRIORITY value.  If this is
+    // SMX_THREAD_PRIORITY_DEFAULT, the priority listed in SMXThread is used.  On Linux, each
+    // priority level is 5 nice levels, so THREAD_PRIORITY_HIGHEST (2) is a nice value of -10.
+    // Raising priority requires CAP_SYS_NICE or an RLIMIT_NICE that allows it.
+    int m_iPriority = SMX_THREAD_PRIORITY_DEFAULT;
+
+    // If set, the thread is registered with the Multimedia Class Scheduler Service as this
+    // task, such as L"Pro Audio" or L"Games", with AvSetMmThreadCharacteristics.  MMCSS then
+    // manages the thread's priority, so m_iPriority only applies while MMCSS isn't boosting it.
+    // The string is copied.  This is ignored on Linux.
+    const wchar_t *m_sMMCSSTask = nullptr;
+};
+
+// The state of one pad, returned by SMX_GetState.
+struct SMXPadState
+{
+    // True if we're fully connected to this controller.  If this is false, the other
+    // fields won't be set.
+    bool m_bConnected;
+
+    // This device's serial number, as in SMXInfo.
+    char m_Serial[33];
+
+    // This device's firmware version.
+    uint16_t m_iFirmwareVersion;
+
+    // A mask of the currently pressed panels, as returned by SMX_GetInputState.
+    uint16_t m_iInputState;
+
+    // The QueryPerformanceCounter time the input state last changed, or CLOCK_MONOTONIC in
+    // nanoseconds on Linux.
+    int64_t m_iInputTimestamp;
+
+    // This is incremented whenever the configuration returned by SMX_GetConfig changes.
+    // Applications can compare it to the value they saw last to see if they need to read the
+    // configuration again.
+    uint32_t m_iConfigGeneration;
+
+    // The write number of the most recent SMX_SetConfigEx call that the device has acknowledged.
+    uint32_t m_iConfigWriteAcked;
+};
+
+// The state of all pads, returned by SMX_GetState.  Pads are numbered the same as in SMX_GetInfo.
+struct SMXState
+{
+    SMXPadState m_Pads[SMX_MAX_CABINETS*2];
+};
+
+// Lights timing statistics, in SMXStats::m_LightsTiming.  Each lights update is sent as two
+// commands, scheduled 1/60 of a second apart.  This reports how late each command was actually
+// sent compared to when it was scheduled.
+struct SMXLightsTimingStats
+{
+    // True if lights are scheduled with a high-resolution timer.  This requires Windows 10
+    // version 1803 or newer, and is always available on Linux.  Otherwise, lights are scheduled to the nearest millisecond, and
+    // timing depends on the system timer resolution.
+    bool m_bHighResolutionTimer;
+
+    // The number of lights commands sent.
+    uint32_t m_iCommandsSent;
+
+    // The average and maximum time between when a lights command was scheduled to be sent
+    // and when it actually was, in microseconds.
+    uint32_t m_iAverageLatenessMicroseconds;
+    uint32_t m_iMaxLatenessMicroseconds;
+
+    // A histogram of lateness.  Bucket 0 counts commands sent less than 250us late, and each
+    // following bucket doubles: under 500us, 1ms, 2ms, 4ms, 8ms and 16ms.  The last bucket
+    // counts everything 16ms or later.
+    uint32_t m_iLatenessHistogram[8];
+};
+
+// A keyframe of a lights animation for one panel, used by SMX_CreateLightsAnimation.
+struct SMXLightsKeyframe
+{
+    // The time of this keyframe since the start of the animation.
+    uint32_t m_iTimeMilliseconds;
+
+    // The color of each of the panel's 16 LEDs, in the same order as SMX_SetLights.
+    uint8_t m_Colors[16*3];
+};
+
+// When the lights engine plays a panel's animation.  See SMX_SetPanelAnimation.
+enum SMXLightsTrigger: int {
+    SMXLightsTrigger_Idle,
+    SMXLightsTrigger_Press,
+    NUM_SMX_LIGHTS_TRIGGERS
+};
+
+// The number of buckets in SMXHistogram.
+#define SMX_HISTOGRAM_BUCKETS 24
+
+// A histogram of durations, returned in SMXStats.  Bucket 0 counts durations under 1us, and
+// each following bucket doubles: under 2us, 4us, 8us, and so on.  The last bucket counts
+// everything longer.
+struct SMXHistogram
+{
+    uint32_t m_iCount;
+    uint32_t m_iAverageMicroseconds;
+    uint32_t m_iMaxMicroseconds;
+    uint32_t m_iBuckets[SMX_HISTOGRAM_BUCKETS];
+};
+
+// Statistics returned by SMX_GetStats.
+struct SMXStats
+{
+    // The time from an input report being received to the update callback for it starting.
+    // Input changes that are merged into an update callback that's already waiting aren't
+    // counted separately.  With SMXCallbackMode_Event, this isn't measured.
+    SMXHistogram m_InputLatency;
+
+    // How long the SDK's internal lock was held each time it was taken.  Long hold times delay
+    // input processing and calls into the SDK.
+    SMXHistogram m_LockHoldTime;
+
+    // The time from a command being sent to a pad to the pad reporting that it's finished.
+    SMXHistogram m_CommandRoundTrip;
+
+    // How long each scan for connected devices took.
+    SMXHistogram m_DeviceSearchTime;
+
+    // Connecting to a pad goes through these phases, which are each timed separately:
+    //
+    // m_DeviceProbeTime: opening a possible device during a scan and checking that it's a pad.
+    // m_DeviceOpenDelay: from a scan finding a pad to the SDK starting to talk to it.
+    // m_DeviceInfoTime: from starting to talk to the pad to receiving its device info.
+    // m_DeviceConfigTime: from receiving device info to reading its configuration, at which
+    // point the pad is connected.
+    SMXHistogram m_DeviceProbeTime;
+    SMXHistogram m_DeviceOpenDelay;
+    SMXHistogram m_DeviceInfoTime;
+    SMXHistogram m_DeviceConfigTime;
+
+    // The time from SMX_Start to each pad connecting for the first time.
+    SMXHistogram m_StartupConnectTime;
+
+    // The number of commands waiting to be sent to each pad, and the most that have been
+    // waiting at once.
+    uint32_t m_iCommandQueueDepth[SMX_MAX_CABINETS*2];
+    uint32_t m_iMaxCommandQueueDepth[SMX_MAX_CABINETS*2];
+
+    // The number of lights updates passed to SMX_SetLights that were replaced by a newer
+    // update before being sent.
+    uint32_t m_iLightsUpdatesDropped;
+
+    // The number of lights commands already queued for a pad that were discarded because
+    // a newer one was queued behind them.
+    uint32_t m_iLightsCommandsCoalesced;
+
+    // How many lights commands were sent, and how late they were sent.
+    SMXLightsTimingStats m_LightsTiming;
+
+    // The number of streamed test frames discarded because SMX_ReadTestFrames wasn't
+    // called quickly enough.
+    uint32_t m_iTestFramesDropped;
+};
+
+enum SMXUpdateCallbackReason: int {
     // This is called when a generic state change happens: connection or disconnection, inputs changed,
     // test data updated, etc.  It doesn't specify what's changed.  We simply check the whole state.
     SMXUpdateCallback_Updated,
@@ -219,7 +642,7 @@ struct SMXConfig
 static_assert(sizeof(SMXConfig) == 84, "Expected 84 bytes");
 
 // The values (except for Off) correspond with the protocol and must not be changed.
-enum SensorTestMode {
+enum SensorTestMode: int {
     SensorTestMode_Off = 0,
     // Return the raw, uncalibrated value of each sensor.
     SensorTestMode_UncalibratedValues = '0',
@@ -248,4 +671,62 @@ struct SMXSensorTestModeData
     int iDIPSwitchPerPanel[9];
 };
 
+// The version of SMXSharedState.  This is incremented when its layout changes.
+#define SMX_SHARED_STATE_VERSION 1
+
+// The state of one pad in SMXSharedState.
+struct SMXSharedPadState
+{
+    // The same state returned by SMX_GetState.
+    SMXPadState m_State;
+
+    // True if m_TestData holds the most recent test data, as returned by SMX_GetTestData.
+    bool m_bHaveTestData;
+    SMXSensorTestModeData m_TestData;
+};
+
+// The state block returned by SMX_GetSharedState.  This only holds plain data, so it can be
+// read directly from other languages with a matching struct.
+//
+// This is written by the I/O thread while readers may be reading it, so it's protected by
+// m_iSequence, which is odd while it's being written.  To read it:
+//
+// - Read m_iSequence.  If it's odd, wait briefly and try again.
+// - Copy the data you want.
+// - Read m_iSequence again.  If it's changed, the data may be torn, so start over.
+//
+// m_iSequence only changes when the state does, so it can also be compared to a value seen
+// earlier to check whether anything has changed.  m_iVersion and m_iSize never change, and can
+// be checked once to make sure the reader's struct matches.
+//
+// This is updated along with SMX_GetState, after the I/O thread finishes handling each batch
+// of I/O.  An update callback can run slightly before the change it reports shows up here, so
+// this is best read by polling, such as once per frame.
+struct SMXSharedState
+{
+    // SMX_SHARED_STATE_VERSION and sizeof(SMXSharedState).
+    uint32_t m_iVersion;
+    uint32_t m_iSize;
+
+    volatile uint32_t m_iSequence;
+
+    // The number of entries in m_Pads, which is SMX_MAX_CABINETS*2.
+    uint32_t m_iNumPads;
+
+    SMXSharedPadState m_Pads[SMX_MAX_CABINETS*2];
+};
+
+// A frame of streamed test data, returned by SMX_ReadTestFrames.
+struct SMXTestFrame
+{
+    // The QueryPerformanceCounter value when the response was received, or CLOCK_MONOTONIC in
+    // nanoseconds on Linux.
+    int64_t m_iTimestamp;
+
+    // The test mode this data is for.
+    SensorTestMode m_Mode;
+
+    SMXSensorTestModeData m_Data;
+};
+
 #endif
@@ -1,25 +1,22 @@
 #include "Helpers.h"
-#include <windows.h>
+#include "SMXStats.h"
 #include <algorithm>
+#include <stdexcept>
 using namespace std;
 using namespace SMX;
 
-namespace {
-    function<void(const string &log)> g_LogCallback = [](const string &log) {
-        printf("%6.3f: %s\n", GetMonotonicTime(), log.c_str());
-    };
-};
-
-void SMX::Log(string s)
-{
-    g_LogCallback(s);
-}
-
-void SMX::SetLogCallback(function<void(const string &log)> callback)
-{
-    g_LogCallback = callback;
-}
-
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#endif
+
+#ifdef _WIN32
 const DWORD MS_VC_EXCEPTION = 0x406D1388;  
 #pragma pack(push,8)  
 typedef struct tagTHREADNAME_INFO  
@@ -31,13 +28,13 @@ typedef struct tagTHREADNAME_INFO
 } THREADNAME_INFO;  
 
 #pragma pack(pop)  
-void SMX::SetThreadName(DWORD iThreadId, const string &name)
+void SMX::SetThreadName(const string &name)
 {
 
     THREADNAME_INFO info;  
     info.dwType = 0x1000;  
     info.szName = name.c_str();  
-    info.dwThreadID = iThreadId;
+    info.dwThreadID = (DWORD) -1;
     info.dwFlags = 0;  
 #pragma warning(push)  
 #pragma warning(disable: 6320 6322)  
@@ -48,6 +45,13 @@ void SMX::SetThreadName(DWORD iThreadId, const string &name)
     }  
 #pragma warning(pop)  
 }  
+#else
+void SMX::SetThreadName(const string &name)
+{
+    // Linux thread names are limited to 15 characters.
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+}
+#endif
 
 void SMX::StripCrnl(wstring &s)
 {
@@ -55,6 +59,7 @@ void SMX::StripCrnl(wstring &s)
         s.erase(s.size()-1);
 }
 
+#ifdef _WIN32
 wstring SMX::GetErrorString(int err)
 {
     wchar_t buf[1024] = L"";
@@ -65,10 +70,71 @@ wstring SMX::GetErrorString(int err)
     StripCrnl(sResult);
     return sResult;
 }
+#else
+wstring SMX::GetErrorString(int err)
+{
+    // strerror is ASCII, so this doesn't need a real conversion.
+    wstring sResult;
+    for(const char *p = strerror(err); *p; ++p)
+        sResult += (wchar_t) (unsigned char) *p;
+    return sResult;
+}
+
+// wchar_t is UTF-32 on Linux.
+string SMX::WideToUTF8(const wstring &s)
+{
+    string sResult;
+    for(wchar_t c: s)
+    {
+        uint32_t ch = (uint32_t) c;
+        if(ch < 0x80)
+            sResult += (char) ch;
+        else if(ch < 0x800)
+        {
+            sResult += (char) (0xC0 | (ch >> 6));
+            sResult += (char) (0x80 | (ch & 0x3F));
+        }
+        else if(ch < 0x10000)
+        {
+            sResult += (char) (0xE0 | (ch >> 12));
+            sResult += (char) (0x80 | ((ch >> 6) & 0x3F));
+            sResult += (char) (0x80 | (ch & 0x3F));
+        }
+        else
+        {
+            sResult += (char) (0xF0 | (ch >> 18));
+            sResult += (char) (0x80 | ((ch >> 12) & 0x3F));
+            sResult += (char) (0x80 | ((ch >> 6) & 0x3F));
+            sResult += (char) (0x80 | (ch & 0x3F));
+        }
+    }
+    return sResult;
+}
+
+wstring SMX::UTF8ToWide(const string &s)
+{
+    wstring sResult;
+    for(size_t i = 0; i < s.size(); )
+    {
+        uint8_t c = (uint8_t) s[i];
+        int iLength = c < 0x80? 1: c < 0xE0? 2: c < 0xF0? 3:4;
+        uint32_t ch = iLength == 1? c: c & (0x3F >> (iLength-1));
+        for(int j = 1; j < iLength && i+j < s.size(); ++j)
+            ch = (ch << 6) | (s[i+j] & 0x3F);
+        sResult += (wchar_t) ch;
+        i += iLength;
+    }
+    return sResult;
+}
+#endif
 
 string SMX::vssprintf(const char *szFormat, va_list argList)
 {
-    int iChars = vsnprintf(NULL, 0, szFormat, argList);
+    // The list is used twice, and it can't be reused after it's been read on every platform.
+    va_list argListCopy;
+    va_copy(argListCopy, argList);
+    int iChars = vsnprintf(NULL, 0, szFormat, argListCopy);
+    va_end(argListCopy);
 
     string sStr;
     sStr.resize(iChars+1);
@@ -102,6 +168,7 @@ string SMX::BinaryToHex(const string &sString)
     return BinaryToHex(sString.data(), sString.size());
 }
 
+#ifdef _WIN32
 bool SMX::GetRandomBytes(void *pData, int iBytes)
 {
     HCRYPTPROV hCryptProvider = 0;
@@ -113,7 +180,14 @@ bool SMX::GetRandomBytes(void *pData, int iBytes)
     CryptReleaseContext(hCryptProvider, 0);
     return bSuccess;
 }
+#else
+bool SMX::GetRandomBytes(void *pData, int iBytes)
+{
+    return getrandom(pData, iBytes, 0) == iBytes;
+}
+#endif
 
+#ifdef _WIN32
 // Monotonic timer code from https://stackoverflow.com/questions/24330496.
 // Why is this hard?
 //
@@ -202,6 +276,23 @@ double SMX::GetMonotonicTime()
     return iTime / 10000000.0;
 }
 
+int64_t SMX::GetTimestamp()
+{
+    LARGE_INTEGER iNow;
+    QueryPerformanceCounter(&iNow);
+    return iNow.QuadPart;
+}
+
+int64_t SMX::GetTimestampFrequency()
+{
+    static const int64_t iFrequency = [] {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        return frequency.QuadPart;
+    }();
+    return iFrequency;
+}
+
 SMX::AutoCloseHandle::AutoCloseHandle(HANDLE h)
 {
     handle = h;
@@ -213,38 +304,165 @@ SMX::AutoCloseHandle::~AutoCloseHandle()
         CloseHandle(handle);
 }
 
+SMX::Event::Event()
+{
+    m_hEvent = CreateEvent(NULL, false, false, NULL);
+}
+
+SMX::Event::~Event()
+{
+    CloseHandle(m_hEvent);
+}
+
+void SMX::Event::Set()
+{
+    SetEvent(m_hEvent);
+}
+
+bool SMX::Event::Wait(int iTimeoutMS)
+{
+    return WaitForSingleObject(m_hEvent, iTimeoutMS == -1? INFINITE:DWORD(iTimeoutMS)) == WAIT_OBJECT_0;
+}
+
+void SMX::Event::Reset()
+{
+    ResetEvent(m_hEvent);
+}
+
 SMX::Mutex::Mutex()
 {
-    m_hLock = CreateMutex(NULL, false, NULL);
+    InitializeSRWLock(&m_Lock);
 }
 
 SMX::Mutex::~Mutex()
 {
-    CloseHandle(m_hLock);
 }
 
 void SMX::Mutex::Lock()
 {
-    WaitForSingleObject(m_hLock, INFINITE);
-    m_iLockedByThread = GetCurrentThreadId();
+    AcquireSRWLockExclusive(&m_Lock);
+    m_LockedByThread = this_thread::get_id();
+
+    if(m_pHoldTimeHistogram)
+        m_iLockedAt = GetTimestamp();
 }
 
 void SMX::Mutex::Unlock()
 {
-    m_iLockedByThread = 0;
-    ReleaseMutex(m_hLock);
+    if(m_pHoldTimeHistogram)
+        m_pHoldTimeHistogram->AddSampleTicks(GetTimestamp() - m_iLockedAt);
+
+    m_LockedByThread = thread::id();
+    ReleaseSRWLockExclusive(&m_Lock);
+}
+#else
+// CLOCK_MONOTONIC doesn't advance during suspend, like the unbiased time above.
+double SMX::GetMonotonicTime()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+int64_t SMX::GetTimestamp()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+int64_t SMX::GetTimestampFrequency()
+{
+    return 1000000000;
+}
+
+SMX::AutoCloseHandle::AutoCloseHandle(int h)
+{
+    handle = h;
+}
+
+SMX::AutoCloseHandle::~AutoCloseHandle()
+{
+    if(handle != -1)
+        close(handle);
+}
+
+SMX::Event::Event()
+{
+    m_hEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+SMX::Event::~Event()
+{
+    close(m_hEvent);
+}
+
+// These don't log errors, since the log thread uses an Event.  Adding to the count only fails
+// if it would overflow, and reading it only fails if it isn't set, so neither is a problem.
+void SMX::Event::Set()
+{
+    uint64_t iValue = 1;
+    ssize_t iResult = write(m_hEvent, &iValue, sizeof(iValue));
+    (void) iResult;
+}
+
+bool SMX::Event::Wait(int iTimeoutMS)
+{
+    pollfd fd = { m_hEvent, POLLIN, 0 };
+    if(poll(&fd, 1, iTimeoutMS) <= 0)
+        return false;
+
+    Reset();
+    return true;
+}
+
+void SMX::Event::Reset()
+{
+    // Reading an eventfd resets its count.
+    uint64_t iValue;
+    ssize_t iResult = read(m_hEvent, &iValue, sizeof(iValue));
+    (void) iResult;
+}
+
+SMX::Mutex::Mutex()
+{
+    pthread_mutex_init(&m_Lock, NULL);
+}
+
+SMX::Mutex::~Mutex()
+{
+    pthread_mutex_destroy(&m_Lock);
+}
+
+void SMX::Mutex::Lock()
+{
+    pthread_mutex_lock(&m_Lock);
+    m_LockedByThread = this_thread::get_id();
+
+    if(m_pHoldTimeHistogram)
+        m_iLockedAt = GetTimestamp();
+}
+
+void SMX::Mutex::Unlock()
+{
+    if(m_pHoldTimeHistogram)
+        m_pHoldTimeHistogram->AddSampleTicks(GetTimestamp() - m_iLockedAt);
+
+    m_LockedByThread = thread::id();
+    pthread_mutex_unlock(&m_Lock);
 }
+#endif
 
 void SMX::Mutex::AssertNotLockedByCurrentThread()
 {
-    if(m_iLockedByThread == GetCurrentThreadId())
-        throw exception("Expected to not be locked");
+    if(m_LockedByThread.load() == this_thread::get_id())
+        throw runtime_error("Expected to not be locked");
 }
 
 void SMX::Mutex::AssertLockedByCurrentThread()
 {
-    if(m_iLockedByThread != GetCurrentThreadId())
-        throw exception("Expected to be locked");
+    if(m_LockedByThread.load() != this_thread::get_id())
+        throw runtime_error("Expected to be locked");
 }
 
 SMX::LockMutex::LockMutex(SMX::Mutex &mutex):
@@ -260,6 +478,7 @@ SMX::LockMutex::~LockMutex()
     m_Mutex.Unlock();
 }
 
+#ifdef _WIN32
 // This is a helper to let the config tool open a window, which has no freopen.
 // This isn't exposed in SMX.h.
 extern "C" __declspec(dllexport) void SMX_Internal_OpenConsole()
@@ -268,3 +487,4 @@ extern "C" __declspec(dllexport) void SMX_Internal_OpenConsole()
     freopen("CONOUT$","wb", stdout);
     freopen("CONOUT$","wb", stderr);
 }
+#endif
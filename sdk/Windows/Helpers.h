@@ -3,21 +3,32 @@
 
 #include <string>
 #include <stdarg.h>
-#include <windows.h>
+#include <string.h>
 #include <functional>
 #include <memory>
+#include <atomic>
+#include <thread>
 using namespace std;
 
-namespace SMX
-{
-void Log(string s);
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <immintrin.h>
 
-// Set a function to receive logs written by SMX::Log.  By default, logs are written
-// to stdout.
-void SetLogCallback(function<void(const string &log)> callback);
+// The spin-wait hint, as Windows names it.
+inline void YieldProcessor() { _mm_pause(); }
+#endif
+
+#include "SMXLog.h"
 
-void SetThreadName(DWORD iThreadId, const string &name);
+namespace SMX
+{
+// Name the calling thread, for debuggers.
+void SetThreadName(const string &name);
 void StripCrnl(wstring &s);
+
+// Return the message for a GetLastError code on Windows, or an errno value on Linux.
 wstring GetErrorString(int err);
 string vssprintf(const char *szFormat, va_list argList);
 string ssprintf(const char *fmt, ...);
@@ -26,6 +37,18 @@ string BinaryToHex(const string &sString);
 bool GetRandomBytes(void *pData, int iBytes);
 double GetMonotonicTime();
 
+#ifndef _WIN32
+// Paths are wide strings in the API, like Windows paths.  The filesystem uses UTF-8.
+string WideToUTF8(const wstring &s);
+wstring UTF8ToWide(const string &s);
+#endif
+
+// Return a high-resolution timestamp, and how many ticks it has per second.  This is
+// QueryPerformanceCounter on Windows, and CLOCK_MONOTONIC in nanoseconds on Linux.  Input
+// events, test frames and captures are timestamped with this.
+int64_t GetTimestamp();
+int64_t GetTimestampFrequency();
+
 // In order to be able to use smart pointers to fully manage an object, we need to get
 // a shared_ptr to pass around, but also store a weak_ptr in the object itself.  This
 // lets the object create shared_ptrs for itself as needed, without keeping itself from
@@ -55,24 +78,64 @@ weak_ptr<T> GetPointers(shared_ptr<T> &pSharedPtr, T *pObj)
 template<typename T, class... Args>
 shared_ptr<T> CreateObj(Args&&... args)
 {
-    shared_ptr<typename T> pResult;
+    shared_ptr<T> pResult;
     new T(pResult, std::forward<Args>(args)...);
     return dynamic_pointer_cast<T>(pResult);
 }
 
+// A handle on Windows, and a file descriptor on Linux.
+#ifdef _WIN32
+typedef HANDLE NativeHandle;
+#define INVALID_NATIVE_HANDLE INVALID_HANDLE_VALUE
+#else
+typedef int NativeHandle;
+#define INVALID_NATIVE_HANDLE -1
+#endif
+
 class AutoCloseHandle
 {
 public:
-    AutoCloseHandle(HANDLE h);
+    AutoCloseHandle(NativeHandle h);
     ~AutoCloseHandle();
-    HANDLE value() const { return handle; }
+    NativeHandle value() const { return handle; }
 
 private:
     AutoCloseHandle(const AutoCloseHandle &rhs);
     AutoCloseHandle &operator=(const AutoCloseHandle &rhs);
-    HANDLE handle;
+    NativeHandle handle;
+};
+
+// An auto-reset event.  Set wakes one thread waiting on it, or the next one to wait if
+// nobody is waiting yet.  On Linux this is an eventfd, so it can be polled along with
+// other fds.
+class Event
+{
+public:
+    Event();
+    ~Event();
+    void Set();
+
+    // Wait until the event is set, or for iTimeoutMS.  If iTimeoutMS is -1, wait forever.
+    // Return true if the event was set.
+    bool Wait(int iTimeoutMS=-1);
+
+    // Reset the event after waiting on value() with other handles.  This is only needed on
+    // Linux, since Windows resets it as the wait returns.
+    void Reset();
+
+    NativeHandle value() const { return m_hEvent; }
+
+private:
+    Event(const Event &rhs);
+    Event &operator=(const Event &rhs);
+    NativeHandle m_hEvent;
 };
 
+class StatsHistogram;
+
+// A non-recursive lock.  This is a slim reader/writer lock used exclusively on Windows, and
+// a pthread mutex on Linux, so locking and unlocking without contention doesn't make a
+// system call.
 class Mutex
 {
 public:
@@ -84,9 +147,183 @@ public:
     void AssertNotLockedByCurrentThread();
     void AssertLockedByCurrentThread();
 
+    // If set, record how long the lock is held each time it's unlocked.  This must be set
+    // while nothing is using the lock.
+    void SetHoldTimeHistogram(StatsHistogram *pHistogram) { m_pHoldTimeHistogram = pHistogram; }
+
+private:
+#ifdef _WIN32
+    SRWLOCK m_Lock;
+#else
+    pthread_mutex_t m_Lock;
+#endif
+    // This is only compared with the current thread, which can't race with itself, but it's
+    // read without the lock, so it's atomic.
+    atomic<thread::id> m_LockedByThread;
+    StatsHistogram *m_pHoldTimeHistogram = nullptr;
+    int64_t m_iLockedAt = 0;
+};
+
+// A fixed-size queue with a single producer thread and a single consumer thread.  Push
+// and Pop don't lock, so the producer and consumer never block each other.  Only one thread
+// may ever call Push, and only one thread may ever call Pop.
+template<typename T, int Size>
+class SPSCQueue
+{
+public:
+    // Add an item to the queue.  If the queue is full, return false and discard it.
+    bool Push(const T &item)
+    {
+        uint32_t iHead = m_iHead.load(memory_order_relaxed);
+        if(iHead - m_iTail.load(memory_order_acquire) >= Size)
+            return false;
+
+        m_Items[iHead % Size] = item;
+        m_iHead.store(iHead + 1, memory_order_release);
+        return true;
+    }
+
+    // Remove the oldest item from the queue.  Return false if the queue is empty.
+    bool Pop(T &item)
+    {
+        uint32_t iTail = m_iTail.load(memory_order_relaxed);
+        if(iTail == m_iHead.load(memory_order_acquire))
+            return false;
+
+        item = m_Items[iTail % Size];
+        m_iTail.store(iTail + 1, memory_order_release);
+        return true;
+    }
+
+private:
+    T m_Items[Size];
+
+    // These count up forever and wrap, so the queue is empty when they're equal.
+    static_assert((Size & (Size-1)) == 0, "Size must be a power of two");
+    atomic<uint32_t> m_iHead{0};
+    atomic<uint32_t> m_iTail{0};
+};
+
+// A fixed-size queue with any number of producer threads and a single consumer thread.
+// Like SPSCQueue, this never locks.  Each slot has a sequence number that tells producers
+// when it's free and the consumer when it's been filled, so producers only contend on
+// claiming a slot.
+template<typename T, int Size>
+class MPSCQueue
+{
+public:
+    MPSCQueue()
+    {
+        for(int i = 0; i < Size; ++i)
+            m_Cells[i].m_iSequence.store(i, memory_order_relaxed);
+    }
+
+    // Add an item to the queue.  If the queue is full, return false and discard it.
+    bool Push(const T &item)
+    {
+        uint32_t iPos = m_iHead.load(memory_order_relaxed);
+        Cell *pCell;
+        while(1)
+        {
+            pCell = &m_Cells[iPos % Size];
+            int32_t iDiff = int32_t(pCell->m_iSequence.load(memory_order_acquire) - iPos);
+            if(iDiff == 0)
+            {
+                // The slot is free.  Claim it, unless another producer got it first.
+                if(m_iHead.compare_exchange_weak(iPos, iPos + 1, memory_order_relaxed))
+                    break;
+            }
+            else if(iDiff < 0)
+            {
+                // The consumer hasn't emptied this slot yet, so the queue is full.
+                return false;
+            }
+            else
+                iPos = m_iHead.load(memory_order_relaxed);
+        }
+
+        pCell->m_Item = item;
+        pCell->m_iSequence.store(iPos + 1, memory_order_release);
+        return true;
+    }
+
+    // Return true if the queue is empty.  Like Pop, this can only be called by the consumer.
+    bool Empty() const
+    {
+        const Cell &cell = m_Cells[m_iTail % Size];
+        return int32_t(cell.m_iSequence.load(memory_order_acquire) - (m_iTail + 1)) < 0;
+    }
+
+    // Remove the oldest item from the queue.  Return false if the queue is empty.  Only
+    // one thread may call this.
+    bool Pop(T &item)
+    {
+        Cell &cell = m_Cells[m_iTail % Size];
+        if(int32_t(cell.m_iSequence.load(memory_order_acquire) - (m_iTail + 1)) < 0)
+            return false;
+
+        item = cell.m_Item;
+        cell.m_iSequence.store(m_iTail + Size, memory_order_release);
+        m_iTail++;
+        return true;
+    }
+
+private:
+    struct Cell
+    {
+        atomic<uint32_t> m_iSequence;
+        T m_Item;
+    };
+    Cell m_Cells[Size];
+
+    static_assert((Size & (Size-1)) == 0, "Size must be a power of two");
+    atomic<uint32_t> m_iHead{0};
+    uint32_t m_iTail = 0;
+};
+
+// A value that's written by one thread at a time and can be read by any thread without
+// locking.  Readers never block writers: a reader that overlaps a write just retries.
+// Writers must be serialized by the caller, usually by holding the lock that protects the
+// data being published.  T must be trivially copyable.
+template<typename T>
+class SeqLock
+{
+public:
+    void Store(const T &value)
+    {
+        // An odd sequence number tells readers that a write is in progress.
+        uint32_t iSequence = m_iSequence.load(memory_order_relaxed);
+        m_iSequence.store(iSequence + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        memcpy(&m_Value, &value, sizeof(T));
+
+        m_iSequence.store(iSequence + 2, memory_order_release);
+    }
+
+    void Load(T &value) const
+    {
+        while(1)
+        {
+            uint32_t iSequence = m_iSequence.load(memory_order_acquire);
+            if(iSequence & 1)
+            {
+                YieldProcessor();
+                continue;
+            }
+
+            memcpy(&value, (const void *) &m_Value, sizeof(T));
+            atomic_thread_fence(memory_order_acquire);
+
+            // If the sequence number changed, a write happened while we were copying.
+            if(m_iSequence.load(memory_order_relaxed) == iSequence)
+                return;
+        }
+    }
+
 private:
-    HANDLE m_hLock = INVALID_HANDLE_VALUE;
-    DWORD m_iLockedByThread = 0;
+    atomic<uint32_t> m_iSequence{0};
+    T m_Value;
 };
 
 // A local lock helper for Mutex.
@@ -1,15 +1,17 @@
 // This implements the public API.
 
-#include <windows.h>
 #include <memory>
 
 #include "../SMX.h"
 #include "SMXManager.h"
 #include "SMXDevice.h"
+#include "SMXStats.h"
+#include "SMXThreadOptions.h"
 #include "SMXBuildVersion.h"
 using namespace std;
 using namespace SMX;
 
+#ifdef _WIN32
 BOOL APIENTRY DllMain(HMODULE hModule, DWORD  ul_reason_for_call, LPVOID lpReserved)
 {
     switch(ul_reason_for_call)
@@ -22,11 +24,17 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD  ul_reason_for_call, LPVOID lpReser
     }
     return TRUE;
 }
+#endif
 
 static shared_ptr<SMXManager> g_pSMX;
 
 // DLL interface:
 SMX_API void SMX_Start(SMXUpdateCallback callback, void *pUser)
+{
+    SMX_StartEx(callback, pUser, nullptr);
+}
+
+SMX_API void SMX_StartEx(SMXUpdateCallback callback, void *pUser, const SMXStartOptions *options)
 {
     if(g_pSMX != NULL)
         return;
@@ -34,16 +42,25 @@ SMX_API void SMX_Start(SMXUpdateCallback callback, void *pUser)
     // The C++ interface takes a std::function, which doesn't need a user pointer.  We add
     // one for the C interface for convenience.
     auto UpdateCallback = [callback, pUser](int pad, SMXUpdateCallbackReason reason) {
-        callback(pad, reason, pUser);
+        if(callback)
+            callback(pad, reason, pUser);
     };
 
+    SMXStartOptions defaultOptions;
+    if(options == nullptr)
+        options = &defaultOptions;
+
     // Log(ssprintf("Struct sizes (native): %i %i %i\n", sizeof(SMXConfig), sizeof(SMXInfo), sizeof(SMXSensorTestModeData)));
-    g_pSMX = make_shared<SMXManager>(UpdateCallback);
+    StartLogThread();
+    StartTracing();
+    g_pSMX = make_shared<SMXManager>(UpdateCallback, *options);
 }
 
 SMX_API void SMX_Stop()
 {
     g_pSMX.reset();
+    StopTracing();
+    StopLogThread();
 }
 
 SMX_API void SMX_SetLogCallback(SMXLogCallback callback)
@@ -54,14 +71,73 @@ SMX_API void SMX_SetLogCallback(SMXLogCallback callback)
     });
 }
 
+SMX_API void SMX_SetThreadOptions(SMXThread thread, const SMXThreadOptions *options)
+{
+    if(options == nullptr)
+    {
+        Log("SetThreadOptions: options is NULL");
+        return;
+    }
+
+    SetThreadOptions(thread, *options);
+
+    // If we're running, wake up our threads so they apply the new options.
+    if(g_pSMX)
+        g_pSMX->ApplyThreadOptions();
+}
+
 SMX_API bool SMX_GetConfig(int pad, SMXConfig *config) { return g_pSMX->GetDevice(pad)->GetConfig(*config); }
 SMX_API void SMX_SetConfig(int pad, const SMXConfig *config) { g_pSMX->GetDevice(pad)->SetConfig(*config); }
+SMX_API uint32_t SMX_SetConfigEx(int pad, const SMXConfig *config) { return g_pSMX->GetDevice(pad)->SetConfig(*config); }
 SMX_API void SMX_GetInfo(int pad, SMXInfo *info) { g_pSMX->GetDevice(pad)->GetInfo(*info); }
+SMX_API void SMX_GetCabinetInfo(int cabinet, int pad, SMXInfo *info)
+{
+    if(cabinet < 0 || cabinet >= SMX_MAX_CABINETS || pad < 0 || pad >= 2)
+    {
+        LogFormat("GetCabinetInfo: Invalid cabinet %i or pad %i", cabinet, pad);
+        *info = SMXInfo();
+        return;
+    }
+
+    g_pSMX->GetDevice(cabinet*2 + pad)->GetInfo(*info);
+}
+SMX_API void SMX_AssignCabinet(const char *serial, int cabinet) { g_pSMX->AssignCabinet(serial, cabinet); }
 SMX_API uint16_t SMX_GetInputState(int pad) { return g_pSMX->GetDevice(pad)->GetInputState(); }
+SMX_API void SMX_GetState(SMXState *state) { g_pSMX->GetState(*state); }
+SMX_API const SMXSharedState *SMX_GetSharedState() { return SMXManager::GetSharedState(); }
+SMX_API int SMX_ReadInputEvents(int pad, SMXInputEvent *events, int maxEvents) { return g_pSMX->ReadInputEvents(pad, events, maxEvents); }
 SMX_API void SMX_FactoryReset(int pad) { g_pSMX->GetDevice(pad)->FactoryReset(); }
 SMX_API void SMX_ForceRecalibration(int pad) { g_pSMX->GetDevice(pad)->ForceRecalibration(); }
 SMX_API void SMX_SetTestMode(int pad, SensorTestMode mode) { g_pSMX->GetDevice(pad)->SetSensorTestMode((SensorTestMode) mode); }
 SMX_API bool SMX_GetTestData(int pad, SMXSensorTestModeData *data) { return g_pSMX->GetDevice(pad)->GetTestData(*data); }
-SMX_API void SMX_SetLights(const char lightsData[864]) { g_pSMX->SetLights(string(lightsData, 864)); }
+SMX_API void SMX_SetTestStreaming(int pad, bool enable) { g_pSMX->GetDevice(pad)->SetSensorTestStreaming(enable); }
+SMX_API int SMX_ReadTestFrames(int pad, SMXTestFrame *frames, int maxFrames) { return g_pSMX->ReadTestFrames(pad, frames, maxFrames); }
+SMX_API void SMX_SetLights(const char lightsData[864]) { g_pSMX->SetLights(0, lightsData, 864); }
+SMX_API void SMX_SetCabinetLights(int cabinet, const char lightsData[864]) { g_pSMX->SetLights(cabinet, lightsData, 864); }
+SMX_API void SMX_SetLightsEx(const char *lightsData, int lightsDataSize) { g_pSMX->SetLights(0, lightsData, lightsDataSize); }
+SMX_API void SMX_SetLightsBuffer(int cabinet, const char *lightsBuffer) { g_pSMX->SetLightsBuffer(cabinet, lightsBuffer); }
+SMX_API void SMX_CommitLights(int cabinet) { g_pSMX->CommitLights(cabinet); }
+SMX_API void SMX_SetLightsIndexed(int cabinet, const uint8_t *palette, int paletteSize, const uint8_t *indices, int bitsPerLight) { g_pSMX->SetLightsIndexed(cabinet, palette, paletteSize, indices, bitsPerLight); }
 SMX_API void SMX_ReenableAutoLights() { g_pSMX->ReenableAutoLights(); }
+SMX_API void SMX_SetLightsDeltaMode(bool enable) { g_pSMX->SetLightsDeltaMode(enable); }
+SMX_API void SMX_SetLightsEngineEnabled(bool enable) { g_pSMX->SetLightsEngineEnabled(enable); }
+SMX_API int SMX_CreateLightsAnimation(const SMXLightsKeyframe *keyframes, int count, bool loop) { return g_pSMX->CreateLightsAnimation(keyframes, count, loop); }
+SMX_API void SMX_DeleteLightsAnimation(int animation) { g_pSMX->DeleteLightsAnimation(animation); }
+SMX_API void SMX_SetPanelAnimation(int pad, int panel, SMXLightsTrigger trigger, int animation) { g_pSMX->SetPanelAnimation(pad, panel, trigger, animation); }
+SMX_API void SMX_PlayPanelAnimation(int pad, int panel, int animation) { g_pSMX->PlayPanelAnimation(pad, panel, animation); }
+
+SMX_API void SMX_GetStats(SMXStats *stats, bool reset)
+{
+    memset(stats, 0, sizeof(*stats));
+    GetStats(*stats, reset);
+    if(g_pSMX)
+        g_pSMX->GetStats(*stats, reset);
+}
+
+SMX_API void SMX_GetLightsTimingStats(SMXLightsTimingStats *stats, bool reset)
+{
+    SMXStats allStats;
+    SMX_GetStats(&allStats, reset);
+    *stats = allStats.m_LightsTiming;
+}
 SMX_API const char *SMX_Version() { return SMX_BUILD_VERSION; }
@@ -0,0 +1,329 @@
+#include "SMXCapture.h"
+#include "Helpers.h"
+
+#include <algorithm>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+using namespace std;
+using namespace SMX;
+
+namespace {
+    const uint32_t CAPTURE_FILE_VERSION = 1;
+
+    // Flush the capture buffer when it's this large.
+    const int CAPTURE_BUFFER_SIZE = 64*1024;
+
+    // CaptureRecord::m_iDevice is one byte.
+    const int MAX_CAPTURE_DEVICES = 256;
+}
+
+shared_ptr<SMXCaptureWriter> SMX::SMXCaptureWriter::Create(const wstring &sPath, wstring &sError)
+{
+#ifdef _WIN32
+    HANDLE hFile = CreateFileW(sPath.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(hFile == INVALID_HANDLE_VALUE)
+    {
+        sError = wstring(L"Error creating capture file: ") + GetErrorString(GetLastError());
+        return nullptr;
+    }
+#else
+    int hFile = open(WideToUTF8(sPath).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(hFile == -1)
+    {
+        sError = wstring(L"Error creating capture file: ") + GetErrorString(errno);
+        return nullptr;
+    }
+#endif
+
+    return make_shared<SMXCaptureWriter>(hFile);
+}
+
+SMX::SMXCaptureWriter::SMXCaptureWriter(NativeHandle hFile)
+{
+    m_hFile = hFile;
+    m_Buffer.reserve(CAPTURE_BUFFER_SIZE + sizeof(CaptureRecord) + 64);
+
+    CaptureFileHeader header;
+    memcpy(header.m_Magic, "SMXC", 4);
+    header.m_iVersion = CAPTURE_FILE_VERSION;
+    header.m_iQPCFrequency = GetTimestampFrequency();
+    m_Buffer.insert(m_Buffer.end(), (const uint8_t *) &header, (const uint8_t *) (&header + 1));
+}
+
+SMX::SMXCaptureWriter::~SMXCaptureWriter()
+{
+    Flush();
+#ifdef _WIN32
+    CloseHandle(m_hFile);
+#else
+    close(m_hFile);
+#endif
+}
+
+int SMX::SMXCaptureWriter::AllocateDeviceId()
+{
+    if(m_iNextDevice == MAX_CAPTURE_DEVICES)
+    {
+        Log("Capture: too many device connections (not captured)");
+        return -1;
+    }
+    return m_iNextDevice++;
+}
+
+void SMX::SMXCaptureWriter::Write(int iDevice, CaptureDirection direction, int64_t iTimestamp, const uint8_t *pData, int iSize)
+{
+    if(iDevice == -1)
+        return;
+
+    iSize = min(iSize, 64);
+    int iStoredSize = iSize;
+    while(iStoredSize > 0 && pData[iStoredSize-1] == 0)
+        --iStoredSize;
+
+    CaptureRecord record;
+    record.m_iTimestamp = iTimestamp;
+    record.m_iDevice = (uint8_t) iDevice;
+    record.m_iDirection = (uint8_t) direction;
+    record.m_iSize = (uint8_t) iSize;
+    record.m_iStoredSize = (uint8_t) iStoredSize;
+    m_Buffer.insert(m_Buffer.end(), (const uint8_t *) &record, (const uint8_t *) (&record + 1));
+    m_Buffer.insert(m_Buffer.end(), pData, pData + iStoredSize);
+
+    if(m_Buffer.size() >= CAPTURE_BUFFER_SIZE)
+        Flush();
+}
+
+void SMX::SMXCaptureWriter::Flush()
+{
+    if(m_Buffer.empty())
+        return;
+
+#ifdef _WIN32
+    DWORD iWritten;
+    if(!WriteFile(m_hFile, m_Buffer.data(), (DWORD) m_Buffer.size(), &iWritten, NULL))
+        LogFormat("Error writing capture file: %ls", GetErrorString(GetLastError()));
+#else
+    // Regular files don't have short writes unless the disk is full, which is an error too.
+    ssize_t iWritten = write(m_hFile, m_Buffer.data(), m_Buffer.size());
+    if(iWritten == -1)
+        LogFormat("Error writing capture file: %ls", GetErrorString(errno));
+    else if(iWritten != (ssize_t) m_Buffer.size())
+        Log("Error writing capture file: short write");
+#endif
+    m_Buffer.clear();
+}
+
+shared_ptr<SMXReplay> SMX::SMXReplay::Create(const wstring &sPath, bool bRealTime, wstring &sError)
+{
+#ifdef _WIN32
+    HANDLE hFile = CreateFileW(sPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(hFile == INVALID_HANDLE_VALUE)
+    {
+        sError = wstring(L"Error opening replay file: ") + GetErrorString(GetLastError());
+        return nullptr;
+    }
+    AutoCloseHandle file(hFile);
+
+    LARGE_INTEGER iFileSize;
+    if(!GetFileSizeEx(hFile, &iFileSize) || iFileSize.QuadPart > 0x7FFFFFFF)
+    {
+        sError = L"Error reading replay file: file too large";
+        return nullptr;
+    }
+
+    vector<uint8_t> file_data((size_t) iFileSize.QuadPart);
+    DWORD iRead = 0;
+    if(!file_data.empty() && (!ReadFile(hFile, file_data.data(), (DWORD) file_data.size(), &iRead, NULL) || iRead != file_data.size()))
+    {
+        sError = wstring(L"Error reading replay file: ") + GetErrorString(GetLastError());
+        return nullptr;
+    }
+#else
+    int hFile = open(WideToUTF8(sPath).c_str(), O_RDONLY | O_CLOEXEC);
+    if(hFile == -1)
+    {
+        sError = wstring(L"Error opening replay file: ") + GetErrorString(errno);
+        return nullptr;
+    }
+    AutoCloseHandle file(hFile);
+
+    struct stat st;
+    if(fstat(hFile, &st) == -1 || st.st_size > 0x7FFFFFFF)
+    {
+        sError = L"Error reading replay file: file too large";
+        return nullptr;
+    }
+
+    vector<uint8_t> file_data((size_t) st.st_size);
+    if(!file_data.empty() && read(hFile, file_data.data(), file_data.size()) != (ssize_t) file_data.size())
+    {
+        sError = wstring(L"Error reading replay file: ") + GetErrorString(errno);
+        return nullptr;
+    }
+#endif
+
+    CaptureFileHeader header;
+    if(file_data.size() < sizeof(header))
+    {
+        sError = L"Error reading replay file: not a capture file";
+        return nullptr;
+    }
+    memcpy(&header, file_data.data(), sizeof(header));
+    if(memcmp(header.m_Magic, "SMXC", 4) || header.m_iVersion != CAPTURE_FILE_VERSION || header.m_iQPCFrequency <= 0)
+    {
+        sError = L"Error reading replay file: not a supported capture file";
+        return nullptr;
+    }
+
+    shared_ptr<SMXReplay> pReplay = make_shared<SMXReplay>();
+    pReplay->m_bRealTime = bRealTime;
+    pReplay->m_iQPCFrequency = header.m_iQPCFrequency;
+
+    // Index the reports devices sent.  The data is copied into m_Data, so we only keep the
+    // part of the file we'll replay.
+    bool bFirst = true;
+    size_t iPos = sizeof(header);
+    while(iPos + sizeof(CaptureRecord) <= file_data.size())
+    {
+        CaptureRecord record;
+        memcpy(&record, file_data.data() + iPos, sizeof(record));
+        iPos += sizeof(record);
+        if(iPos + record.m_iStoredSize > file_data.size() || record.m_iStoredSize > record.m_iSize || record.m_iSize > 64)
+        {
+            Log("Replay file is truncated or corrupt (ignoring the rest)");
+            break;
+        }
+
+        if(bFirst)
+            pReplay->m_iFirstTimestamp = record.m_iTimestamp;
+        bFirst = false;
+
+        if(record.m_iDevice >= pReplay->m_Devices.size())
+            pReplay->m_Devices.resize(record.m_iDevice + 1);
+        Device &device = pReplay->m_Devices[record.m_iDevice];
+
+        // The device connected when its first record was written, which is normally the device
+        // info request.
+        if(device.m_iFirstTimestamp == 0)
+            device.m_iFirstTimestamp = record.m_iTimestamp;
+
+        if(record.m_iDirection == CaptureDirection_Read)
+        {
+            Report report;
+            report.m_iTimestamp = record.m_iTimestamp;
+            report.m_iOffset = (uint32_t) pReplay->m_Data.size();
+            report.m_iSize = record.m_iSize;
+            report.m_iStoredSize = record.m_iStoredSize;
+            device.m_Reports.push_back(report);
+            pReplay->m_Data.insert(pReplay->m_Data.end(), file_data.begin() + iPos, file_data.begin() + iPos + record.m_iStoredSize);
+        }
+
+        iPos += record.m_iStoredSize;
+    }
+
+    pReplay->m_fStartTime = GetMonotonicTime();
+    LogFormat("Replaying %i devices", pReplay->GetNumDevices());
+    return pReplay;
+}
+
+double SMX::SMXReplay::GetRecordTime(int64_t iTimestamp) const
+{
+    // When replaying as fast as possible, everything is due as soon as playback starts.
+    if(!m_bRealTime)
+        return m_fStartTime;
+
+    return m_fStartTime + double(iTimestamp - m_iFirstTimestamp) / m_iQPCFrequency;
+}
+
+bool SMX::SMXReplay::IsDeviceWaitingToConnect(int iDevice) const
+{
+    const Device &device = m_Devices[iDevice];
+    if(device.m_bConnected || device.m_Reports.empty())
+        return false;
+    return GetRecordTime(device.m_iFirstTimestamp) <= GetMonotonicTime();
+}
+
+void SMX::SMXReplay::SetDeviceConnected(int iDevice)
+{
+    m_Devices[iDevice].m_bConnected = true;
+}
+
+bool SMX::SMXReplay::PeekReport(int iDevice, uint8_t *pData, int &iSize) const
+{
+    const Device &device = m_Devices[iDevice];
+    if(device.m_iNextReport == device.m_Reports.size())
+        return false;
+
+    const Report &report = device.m_Reports[device.m_iNextReport];
+    if(GetRecordTime(report.m_iTimestamp) > GetMonotonicTime())
+        return false;
+
+    memset(pData, 0, 64);
+    memcpy(pData, m_Data.data() + report.m_iOffset, report.m_iStoredSize);
+    iSize = report.m_iSize;
+    return true;
+}
+
+void SMX::SMXReplay::PopReport(int iDevice)
+{
+    Device &device = m_Devices[iDevice];
+    if(device.m_iNextReport < device.m_Reports.size())
+        device.m_iNextReport++;
+}
+
+bool SMX::SMXReplay::IsDeviceFinished(int iDevice) const
+{
+    const Device &device = m_Devices[iDevice];
+    return device.m_iNextReport == device.m_Reports.size();
+}
+
+double SMX::SMXReplay::GetNextReportTime() const
+{
+    double fNext = -1;
+    for(const Device &device: m_Devices)
+    {
+        if(device.m_iNextReport == device.m_Reports.size())
+            continue;
+
+        // A device that hasn't connected yet is due when it connects.
+        int64_t iTimestamp = device.m_bConnected? device.m_Reports[device.m_iNextReport].m_iTimestamp:device.m_iFirstTimestamp;
+        double fTime = GetRecordTime(iTimestamp);
+        if(fNext == -1 || fTime < fNext)
+            fNext = fTime;
+    }
+    return fNext;
+}
+
+SMX::SMXReplayTransport::SMXReplayTransport(shared_ptr<SMXReplay> pReplay, int iDevice):
+    m_pReplay(pReplay),
+    m_iDevice(iDevice)
+{
+    m_pReplay->SetDeviceConnected(iDevice);
+}
+
+bool SMX::SMXReplayTransport::PeekReport(const uint8_t *&pData, int &iSize, wstring &sError)
+{
+    if(m_pReplay == nullptr)
+        return false;
+
+    if(m_pReplay->PeekReport(m_iDevice, m_Report, iSize))
+    {
+        pData = m_Report;
+        return true;
+    }
+
+    // Once we run out of reports, report the device as disconnected.
+    if(m_pReplay->IsDeviceFinished(m_iDevice))
+        sError = L"Replay finished";
+    return false;
+}
+
+void SMX::SMXReplayTransport::PopReport()
+{
+    if(m_pReplay)
+        m_pReplay->PopReport(m_iDevice);
+}
@@ -0,0 +1,149 @@
+#ifndef SMXCapture_h
+#define SMXCapture_h
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "Helpers.h"
+#include "SMXTransport.h"
+
+namespace SMX
+{
+// Raw HID traffic can be captured to a file, and replayed later in place of real devices.
+// This lets the whole SDK be exercised and benchmarked without hardware.
+//
+// A capture file is a CaptureFileHeader followed by records.  Each record is a CaptureRecord
+// followed by m_iStoredSize bytes of data.  Reports are padded to 64 bytes by Windows, so
+// trailing zeros are trimmed from the stored data, and replaying pads it back out to m_iSize.
+#pragma pack(push,1)
+struct CaptureFileHeader
+{
+    char m_Magic[4]; // "SMXC"
+    uint32_t m_iVersion;
+    int64_t m_iQPCFrequency;
+};
+
+struct CaptureRecord
+{
+    // The GetTimestamp time of the report.  m_iQPCFrequency is its frequency.
+    int64_t m_iTimestamp;
+
+    // Each device connection in the capture has its own ID.
+    uint8_t m_iDevice;
+    uint8_t m_iDirection; // CaptureDirection
+    uint8_t m_iSize;
+    uint8_t m_iStoredSize;
+};
+#pragma pack(pop)
+
+enum CaptureDirection
+{
+    CaptureDirection_Read,
+    CaptureDirection_Write,
+};
+
+// This writes a capture file.  It's only used by the I/O thread.  Records are buffered, so
+// capturing doesn't make a system call for each report.
+class SMXCaptureWriter
+{
+public:
+    static shared_ptr<SMXCaptureWriter> Create(const wstring &sPath, wstring &sError);
+    SMXCaptureWriter(NativeHandle hFile);
+    ~SMXCaptureWriter();
+
+    // Return a new device ID for a connection.  Returns -1 if there are too many.
+    int AllocateDeviceId();
+
+    void Write(int iDevice, CaptureDirection direction, int64_t iTimestamp, const uint8_t *pData, int iSize);
+    void Flush();
+
+private:
+    NativeHandle m_hFile;
+    vector<uint8_t> m_Buffer;
+    int m_iNextDevice = 0;
+};
+
+// This plays back a capture file.  The whole file is loaded up front, so playback doesn't
+// read the disk.  It's only used by the I/O thread.
+//
+// Only the reports devices sent are replayed.  Packets written by the SDK are ignored, and
+// SMXDeviceConnection acknowledges commands itself, so the SDK doesn't need to send the
+// same commands it did when the capture was made.
+class SMXReplay
+{
+public:
+    // If bRealTime is true, reports are played back with the timing they were captured with.
+    // Otherwise, they're played back as fast as the SDK reads them.
+    static shared_ptr<SMXReplay> Create(const wstring &sPath, bool bRealTime, wstring &sError);
+
+    // Return the number of devices in the capture.  Their device IDs are 0 to GetNumDevices()-1.
+    int GetNumDevices() const { return (int) m_Devices.size(); }
+
+    // Return true if iDevice was connected at this point in the capture, and hasn't
+    // been replayed yet.
+    bool IsDeviceWaitingToConnect(int iDevice) const;
+    void SetDeviceConnected(int iDevice);
+
+    // Copy the next report from iDevice into pData, if one is due, without removing it.
+    // pData must hold 64 bytes.  PopReport removes it.
+    bool PeekReport(int iDevice, uint8_t *pData, int &iSize) const;
+    void PopReport(int iDevice);
+
+    // Return true if every report from iDevice has been read.
+    bool IsDeviceFinished(int iDevice) const;
+
+    // Return the GetMonotonicTime time the next report is due, or -1 if there are none left.
+    double GetNextReportTime() const;
+
+private:
+    double GetRecordTime(int64_t iTimestamp) const;
+
+    bool m_bRealTime = true;
+    double m_fStartTime = 0;
+    int64_t m_iFirstTimestamp = 0;
+    int64_t m_iQPCFrequency = 1;
+
+    // The loaded reports.  Each device indexes records in m_Data.
+    struct Report
+    {
+        int64_t m_iTimestamp;
+        uint32_t m_iOffset;
+        uint8_t m_iSize;
+        uint8_t m_iStoredSize;
+    };
+    struct Device
+    {
+        int64_t m_iFirstTimestamp = 0;
+        bool m_bConnected = false;
+        vector<Report> m_Reports;
+        int m_iNextReport = 0;
+    };
+    vector<Device> m_Devices;
+    vector<uint8_t> m_Data;
+};
+
+// A transport that reads reports from one device in a replay.  Nothing is written.
+class SMXReplayTransport: public SMXTransport
+{
+public:
+    SMXReplayTransport(shared_ptr<SMXReplay> pReplay, int iDevice);
+
+    void Close() override { m_pReplay.reset(); }
+    bool PeekReport(const uint8_t *&pData, int &iSize, wstring &sError) override;
+    void PopReport() override;
+    void BeginWrite(const uint8_t *pData, wstring &sError) override { }
+    bool WritesFinished(wstring &sError) override { return true; }
+    bool IsCompletionForTransport(const void *pCompletion) const override { return false; }
+    bool IsSimulated() const override { return true; }
+
+private:
+    shared_ptr<SMXReplay> m_pReplay;
+    int m_iDevice;
+    uint8_t m_Report[REPORT_SIZE];
+};
+}
+
+#endif
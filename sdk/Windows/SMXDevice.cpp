@@ -2,66 +2,65 @@
 
 #include "../SMX.h"
 #include "Helpers.h"
+#include "SMXStats.h"
+#include "SMXDeviceCache.h"
 #include "SMXDeviceConnection.h"
 #include "SMXDeviceSearch.h"
-#include <windows.h>
+#include "SMXSensorTestDecode.h"
+#include "SMXIOPort.h"
 #include <memory>
 #include <vector>
 #include <map>
 using namespace std;
 using namespace SMX;
 
-// Extract test data for panel iPanel.
-static void ReadDataForPanel(const vector<uint16_t> &data, int iPanel, void *pOut, int iOutSize)
-{
-    int m_iBit = 0;
-
-    uint8_t *p = (uint8_t *) pOut;
-
-    // Read each byte.
-    for(int i = 0; i < iOutSize; ++i)
-    {
-        // Read each bit in this byte.
-        uint8_t result = 0;
-        for(int j = 0; j < 8; ++j)
-        {
-            bool bit = false;
+const double SMXDevice::CONFIG_WRITE_INTERVAL = 0.05;
 
-            if(m_iBit < data.size())
-            {
-                bit = data[m_iBit] & (1 << iPanel);
-                m_iBit++;
-            }
-
-            result |= bit << j;
-        }
+shared_ptr<SMXDevice> SMX::SMXDevice::Create(shared_ptr<SMXIOPort> pIOPort, Mutex &lock)
+{
+    return CreateObj<SMXDevice>(pIOPort, lock);
+}
 
-        *p++ = result;
-    }
+SMX::SMXDevice::SMXDevice(shared_ptr<SMXDevice> &pSelf, shared_ptr<SMXIOPort> pIOPort, Mutex &lock):
+    m_pIOPort(pIOPort),
+    m_Lock(lock),
+    m_pSelf(GetPointers(pSelf, this))
+{
+    m_pConnection = SMXDeviceConnection::Create();
+    m_State.Store(State());
+    m_fCreatedAt = GetMonotonicTime();
 }
 
+SMX::SMXDevice::~SMXDevice()
+{
+}
 
-shared_ptr<SMXDevice> SMX::SMXDevice::Create(shared_ptr<AutoCloseHandle> hEvent, Mutex &lock)
+bool SMX::SMXDevice::OpenDeviceHandle(shared_ptr<AutoCloseHandle> pHandle, wstring &sError)
 {
-    return CreateObj<SMXDevice>(hEvent, lock);
+    m_Lock.AssertLockedByCurrentThread();
+    m_fOpenedAt = GetMonotonicTime();
+    m_bRecordedConnectTime = false;
+    return m_pConnection->Open(pHandle, m_pIOPort, sError);
 }
 
-SMX::SMXDevice::SMXDevice(shared_ptr<SMXDevice> &pSelf, shared_ptr<AutoCloseHandle> hEvent, Mutex &lock):
-    m_pSelf(GetPointers(pSelf, this)),
-    m_hEvent(hEvent),
-    m_Lock(lock)
+bool SMX::SMXDevice::OpenReplay(shared_ptr<SMXReplay> pReplay, int iDevice, wstring &sError)
 {
-    m_pConnection = SMXDeviceConnection::Create();
+    m_Lock.AssertLockedByCurrentThread();
+    m_fOpenedAt = GetMonotonicTime();
+    m_bRecordedConnectTime = false;
+    return m_pConnection->OpenReplay(pReplay, iDevice, sError);
 }
 
-SMX::SMXDevice::~SMXDevice()
+void SMX::SMXDevice::SetCaptureWriter(shared_ptr<SMXCaptureWriter> pCaptureWriter)
 {
+    m_Lock.AssertLockedByCurrentThread();
+    m_pConnection->SetCaptureWriter(pCaptureWriter);
 }
 
-bool SMX::SMXDevice::OpenDeviceHandle(shared_ptr<AutoCloseHandle> pHandle, wstring &sError)
+void SMX::SMXDevice::SetDeviceCacheLocked(shared_ptr<SMXDeviceCache> pDeviceCache)
 {
     m_Lock.AssertLockedByCurrentThread();
-    return m_pConnection->Open(pHandle, sError);
+    m_pDeviceCache = pDeviceCache;
 }
 
 void SMX::SMXDevice::CloseDevice()
@@ -70,8 +69,15 @@ void SMX::SMXDevice::CloseDevice()
 
     m_pConnection->Close();
     m_bHaveConfig = false;
+    m_bConfigFromCache = false;
     m_bSendConfig = false;
 
+    // A configuration write in flight won't be acknowledged.
+    m_bSendingConfig = false;
+
+    // Any test data requests in flight won't be answered.
+    m_iSensorTestRequests = 0;
+
     CallUpdateCallback(SMXUpdateCallback_Updated);
 }
 
@@ -80,19 +86,38 @@ shared_ptr<AutoCloseHandle> SMX::SMXDevice::GetDeviceHandle() const
     return m_pConnection->GetDeviceHandle();
 }
 
-void SMX::SMXDevice::SetUpdateCallback(function<void(int PadNumber, SMXUpdateCallbackReason reason)> pCallback)
+bool SMX::SMXDevice::IsCompletionForDevice(const void *pCompletion) const
+{
+    m_Lock.AssertLockedByCurrentThread();
+    return m_pConnection->IsCompletionForConnection(pCompletion);
+}
+
+// Wake up the communications thread, so it runs our Update.
+void SMX::SMXDevice::WakeIOThread()
+{
+    if(m_pIOPort)
+        m_pIOPort->Wake();
+}
+
+void SMX::SMXDevice::SetUpdateCallback(function<void(int PadNumber, SMXUpdateCallbackReason reason, int64_t iInputTimestamp)> pCallback)
 {
     LockMutex Lock(m_Lock);
     m_pUpdateCallback = pCallback;
 }
 
-bool SMX::SMXDevice::IsConnected() const
+void SMX::SMXDevice::SetPadNumberLocked(int iPad, InputEventQueue *pInputEvents, TestFrameQueue *pTestFrames)
 {
-    m_Lock.AssertNotLockedByCurrentThread();
+    m_Lock.AssertLockedByCurrentThread();
+    m_iPadNumber = iPad;
+    m_pTestFrames = pTestFrames;
+    m_pConnection->SetInputEventQueue(pInputEvents);
+}
 
-    // Don't expose the device as connected until we've read the current configuration.
-    LockMutex Lock(m_Lock);
-    return IsConnectedLocked();
+bool SMX::SMXDevice::IsConnected() const
+{
+    State state;
+    m_State.Load(state);
+    return state.m_Info.m_bConnected;
 }
 
 bool SMX::SMXDevice::IsConnectedLocked() const
@@ -101,31 +126,31 @@ bool SMX::SMXDevice::IsConnectedLocked() const
     return m_pConnection->IsConnectedWithDeviceInfo() && m_bHaveConfig;
 }
 
-void SMX::SMXDevice::SendCommand(string cmd, function<void()> pComplete)
+void SMX::SMXDevice::SendCommand(const string &cmd, function<void()> pComplete, CommandClass iClass)
 {
     LockMutex Lock(m_Lock);
-    SendCommandLocked(cmd, pComplete);
+    SendCommandLocked(cmd, pComplete, iClass);
 }
 
-void SMX::SMXDevice::SendCommandLocked(string cmd, function<void()> pComplete)
+void SMX::SMXDevice::SendCommandLocked(const string &cmd, function<void()> pComplete, CommandClass iClass)
 {
     m_Lock.AssertLockedByCurrentThread();
 
     // This call is nonblocking, so it's safe to do this in the UI thread.
     if(m_pConnection->IsConnected())
     {
-        m_pConnection->SendCommand(cmd, pComplete);
+        m_pConnection->SendCommand(cmd, pComplete, iClass);
 
         // Wake up the communications thread to send the message.
-        if(m_hEvent)
-            SetEvent(m_hEvent->value());
+        WakeIOThread();
     }
 }
 
 void SMX::SMXDevice::GetInfo(SMXInfo &info)
 {
-    LockMutex Lock(m_Lock);
-    GetInfoLocked(info);
+    State state;
+    m_State.Load(state);
+    info = state.m_Info;
 }
 
 void SMX::SMXDevice::GetInfoLocked(SMXInfo &info)
@@ -156,29 +181,30 @@ bool SMX::SMXDevice::IsPlayer2Locked() const
 
 bool SMX::SMXDevice::GetConfig(SMXConfig &configOut)
 {
-    LockMutex Lock(m_Lock);
-
-    // If SetConfig was called to write a new configuration but we haven't sent it
-    // yet, return it instead of the configuration we read alst, so GetConfig
-    // immediately after SetConfig returns the value the caller expects set.
-    if(m_bSendConfig)
-        configOut = wanted_config;
-    else
-        configOut = config;
-
-    return m_bHaveConfig;
+    State state;
+    m_State.Load(state);
+    configOut = state.m_Config;
+    return state.m_bHaveConfig;
 }
 
-void SMX::SMXDevice::SetConfig(const SMXConfig &newConfig)
+uint32_t SMX::SMXDevice::SetConfig(const SMXConfig &newConfig)
 {
     LockMutex Lock(m_Lock);
     wanted_config = newConfig;
     m_bSendConfig = true;
+    m_iPendingConfigWrite = ++m_iConfigWrite;
+
+    // Publish the new configuration before returning, so GetConfig returns it immediately.
+    PublishStateLocked();
+
+    // Wake the communications thread so it sends the new configuration.
+    WakeIOThread();
+    return m_iPendingConfigWrite;
 }
 
 uint16_t SMX::SMXDevice::GetInputState() const
 {
-    LockMutex Lock(m_Lock);
+    // The input state is atomic, so we don't need to lock or read the snapshot.
     return m_pConnection->GetInputState();
 }
 
@@ -204,29 +230,107 @@ void SMX::SMXDevice::SetSensorTestMode(SensorTestMode mode)
 {
     LockMutex Lock(m_Lock);
     m_SensorTestMode = mode;
+    WakeIOThread();
 }
 
-bool SMX::SMXDevice::GetTestData(SMXSensorTestModeData &data)
+void SMX::SMXDevice::SetSensorTestStreaming(bool bStreaming)
 {
     LockMutex Lock(m_Lock);
+    m_bStreamSensorTestData = bStreaming;
+    WakeIOThread();
+}
+
+bool SMX::SMXDevice::GetTestData(SMXSensorTestModeData &data)
+{
+    State state;
+    m_State.Load(state);
 
     // Stop if we haven't read test mode data yet.
+    if(!state.m_bHaveTestData)
+        return false;
+
+    data = state.m_TestData;
+    return true;
+}
+
+bool SMX::SMXDevice::GetTestDataLocked(SMXSensorTestModeData &data)
+{
+    m_Lock.AssertLockedByCurrentThread();
     if(!m_HaveSensorTestModeData)
         return false;
 
-    data = m_SensorTestData;
+    memcpy(&data, &m_SensorTestData, sizeof(data));
     return true;
 }
 
-void SMX::SMXDevice::CallUpdateCallback(SMXUpdateCallbackReason reason)
+void SMX::SMXDevice::PublishStateLocked()
 {
     m_Lock.AssertLockedByCurrentThread();
 
+    State state;
+    GetInfoLocked(state.m_Info);
+
+    // If SetConfig was called to write a new configuration but we haven't sent it
+    // yet, return it instead of the configuration we read last, so GetConfig
+    // immediately after SetConfig returns the value the caller expects set.
+    state.m_Config = m_bSendConfig? wanted_config:config;
+    state.m_bHaveConfig = m_bHaveConfig;
+
+    if(state.m_bHaveConfig != m_bPublishedHaveConfig ||
+        memcmp(&state.m_Config, &m_PublishedConfig, sizeof(SMXConfig)))
+    {
+        m_iConfigGeneration++;
+        m_PublishedConfig = state.m_Config;
+        m_bPublishedHaveConfig = state.m_bHaveConfig;
+    }
+
+    state.m_bHaveTestData = m_HaveSensorTestModeData;
+    if(m_HaveSensorTestModeData)
+        state.m_TestData = m_SensorTestData;
+
+    m_State.Store(state);
+}
+
+void SMX::SMXDevice::GetPadStateLocked(SMXPadState &state)
+{
+    m_Lock.AssertLockedByCurrentThread();
+
+    SMXInfo info;
+    GetInfoLocked(info);
+
+    memset(&state, 0, sizeof(state));
+    state.m_bConnected = info.m_bConnected;
+    if(!state.m_bConnected)
+        return;
+
+    memcpy(state.m_Serial, info.m_Serial, sizeof(state.m_Serial));
+    state.m_iFirmwareVersion = info.m_iFirmwareVersion;
+    state.m_iInputState = m_pConnection->GetInputState();
+    state.m_iInputTimestamp = m_pConnection->GetInputTimestamp();
+    state.m_iConfigGeneration = m_iConfigGeneration;
+    state.m_iConfigWriteAcked = m_iConfigWriteAcked;
+}
+
+void SMX::SMXDevice::GetCommandQueueDepthLocked(uint32_t &iDepth, uint32_t &iMaxDepth, bool bReset)
+{
+    m_Lock.AssertLockedByCurrentThread();
+
+    iDepth = m_pConnection->GetCommandQueueDepth();
+    iMaxDepth = m_pConnection->GetMaxCommandQueueDepth(bReset);
+}
+
+void SMX::SMXDevice::CallUpdateCallback(SMXUpdateCallbackReason reason, int64_t iInputTimestamp)
+{
+    m_Lock.AssertLockedByCurrentThread();
+
+    // The callback is run asynchronously, so make sure the state it reads is already
+    // published.
+    PublishStateLocked();
+
     if(!m_pUpdateCallback)
         return;
 
-    SMXDeviceInfo deviceInfo = m_pConnection->GetDeviceInfo();
-    m_pUpdateCallback(deviceInfo.m_bP2? 1:0, reason);
+    m_pUpdateCallback(m_iPadNumber, reason, iInputTimestamp);
 }
 
 void SMX::SMXDevice::HandlePackets()
@@ -235,7 +339,7 @@ void SMX::SMXDevice::HandlePackets()
 
     while(1)
     {
-        string buf;
+        string &buf = m_sReadPacket;
         if(!m_pConnection->ReadPacket(buf))
             break;
         if(buf.empty())
@@ -265,10 +369,18 @@ void SMX::SMXDevice::HandlePackets()
 
             // Copy in the configuration.
             // Log(ssprintf("Read back configuration: %i bytes, first byte %i", iSize, buf[2]));
-            memcpy(&config, buf.data()+2, min(iSize, sizeof(config)));
+            SMXConfig oldConfig = config;
+            memcpy(&config, buf.data()+2, min((size_t) iSize, sizeof(config)));
             m_bHaveConfig = true;
             buf.erase(buf.begin(), buf.begin()+iSize+2);
 
+            // If we were using a cached configuration, this replaces it.
+            if(m_bConfigFromCache && memcmp(&oldConfig, &config, sizeof(config)))
+                LogFormat("Cached configuration for %s was out of date", m_pConnection->GetDeviceInfo().m_Serial);
+            m_bConfigFromCache = false;
+            if(m_pDeviceCache)
+                m_pDeviceCache->SetConfig(m_pConnection->GetDeviceInfo(), config);
+
             CallUpdateCallback(SMXUpdateCallback_Updated);
             break;
         }
@@ -284,12 +396,32 @@ void SMX::SMXDevice::SendConfig()
 {
     m_Lock.AssertLockedByCurrentThread();
 
-    if(!m_pConnection->IsConnected() || !m_bSendConfig || m_bSendingConfig)
+    if(!m_pConnection->IsConnected() || !m_bSendConfig)
         return;
 
     // We can't update the configuration until we've received the device's previous
-    // configuration.
-    if(!m_bHaveConfig)
+    // configuration.  A cached configuration isn't enough, since it may be out of date.
+    if(!m_bHaveConfig || m_bConfigFromCache)
+        return;
+
+    // If this is what the device already has, or what we're already writing, there's nothing
+    // to send.  This happens when a slider is dragged back to where it started.  The write is
+    // acknowledged now, or along with the write in flight.
+    if(!memcmp(&wanted_config, &config, sizeof(config)))
+    {
+        m_bSendConfig = false;
+        if(m_bSendingConfig)
+            m_iSendingConfigWrite = m_iPendingConfigWrite;
+        else
+            m_iConfigWriteAcked = m_iPendingConfigWrite;
+        return;
+    }
+
+    // Don't send another config packet until the last one finishes, and don't send them more
+    // often than CONFIG_WRITE_INTERVAL, so if we get a bunch of SetConfig calls quickly we
+    // won't spam the device, which can get slow.  The I/O thread will wake up when it's time
+    // to send it.
+    if(m_bSendingConfig || GetMonotonicTime() < m_fNextConfigSendTime)
         return;
 
     // Write configuration command:
@@ -298,22 +430,33 @@ void SMX::SMXDevice::SendConfig()
     sData.append((char *) &iSize, sizeof(iSize));
     sData.append((char *) &wanted_config, sizeof(wanted_config));
 
-    // Don't send another config packet until this one finishes, so if we get a bunch of
-    // SetConfig calls quickly we won't spam the device, which can get slow.
+    // The device finishing the command acknowledges the write, so we don't need to read
+    // the configuration back to verify it.  If the device disconnects first, we'll read
+    // the configuration again when it reconnects.
     m_bSendingConfig = true;
+    m_iSendingConfigWrite = m_iPendingConfigWrite;
+    m_fNextConfigSendTime = GetMonotonicTime() + CONFIG_WRITE_INTERVAL;
     SendCommandLocked(sData, [&] {
         m_bSendingConfig = false;
+        m_iConfigWriteAcked = m_iSendingConfigWrite;
+        if(m_pDeviceCache)
+            m_pDeviceCache->SetConfig(m_pConnection->GetDeviceInfo(), config);
     });
     m_bSendConfig = false;
 
     // Assume the configuration is what we just sent, so calls to GetConfig will
-    // continue to return it.  Otherwise, they'd return the old values until the
-    // command below completes.
+    // continue to return it, and later writes are compared against it.
     config = wanted_config;
+}
 
-    // After we write the configuration, read back the updated configuration to
-    // verify it.
-    SendCommandLocked("g\n");
+double SMX::SMXDevice::GetNextConfigSendTimeLocked() const
+{
+    m_Lock.AssertLockedByCurrentThread();
+
+    // If a write is in flight, its completion will wake us up instead.
+    if(!m_pConnection->IsConnected() || !m_bSendConfig || !m_bHaveConfig || m_bConfigFromCache || m_bSendingConfig)
+        return -1;
+    return m_fNextConfigSendTime;
 }
 
 void SMX::SMXDevice::Update(wstring &sError)
@@ -337,10 +480,31 @@ void SMX::SMXDevice::Update(wstring &sError)
 
         // If the inputs changed from packets we just processed, call the update callback.
         if(iOldState != m_pConnection->GetInputState())
-            CallUpdateCallback(SMXUpdateCallback_Updated);
+            CallUpdateCallback(SMXUpdateCallback_Updated, m_pConnection->GetInputTimestamp());
     }
 
     HandlePackets();
+    RecordConnectTimings();
+
+    // Publish anything that changed before we release the lock.
+    PublishStateLocked();
+}
+
+void SMX::SMXDevice::RecordConnectTimings()
+{
+    m_Lock.AssertLockedByCurrentThread();
+
+    if(m_bRecordedConnectTime || !IsConnectedLocked())
+        return;
+    m_bRecordedConnectTime = true;
+
+    double fNow = GetMonotonicTime();
+    g_Stats.m_DeviceConfigTime.AddSample(fNow - m_fDeviceInfoAt);
+    if(!m_bConnectedSinceStart)
+    {
+        g_Stats.m_StartupConnectTime.AddSample(fNow - m_fCreatedAt);
+        m_bConnectedSinceStart = true;
+    }
 }
 
 void SMX::SMXDevice::CheckActive()
@@ -352,6 +516,8 @@ void SMX::SMXDevice::CheckActive()
         return;
 
     m_pConnection->SetActive(true);
+    m_fDeviceInfoAt = GetMonotonicTime();
+    g_Stats.m_DeviceInfoTime.AddSample(m_fDeviceInfoAt - m_fOpenedAt);
 
     // Reset panels.
     SendCommandLocked("R\n");
@@ -359,6 +525,15 @@ void SMX::SMXDevice::CheckActive()
     // Read the current configuration.  The device will return a "g" response containing
     // its current SMXConfig.
     SendCommandLocked("g\n");
+
+    // If we've seen this device before, use the configuration it had last time until the
+    // "g" response arrives, so we report that it's connected right away.
+    if(m_pDeviceCache && m_pDeviceCache->GetConfig(m_pConnection->GetDeviceInfo(), config))
+    {
+        m_bHaveConfig = true;
+        m_bConfigFromCache = true;
+        CallUpdateCallback(SMXUpdateCallback_Updated);
+    }
 }
 
 // Check if we need to request test mode data.
@@ -369,23 +544,22 @@ void SMX::SMXDevice::UpdateTestMode()
     if(m_SensorTestMode == SensorTestMode_Off)
         return;
 
-    // Request sensor data from the master.  Don't send this if we have a request outstanding
-    // already.
-    uint32_t now = GetTickCount();
-    if(m_WaitingForSensorTestModeResponse != SensorTestMode_Off)
-    {
-        // This request should be quick.  If we haven't received a response in a long
-        // time, assume the request wasn't received.
-        if(now - m_SentSensorTestModeRequestAtTicks < 2000)
-            return;
-    }
-
+    // Request sensor data from the master.  This request should be quick.  If we haven't
+    // received a response in a long time, assume the requests weren't received.
+    uint32_t now = uint32_t(GetMonotonicTime() * 1000);
+    if(m_iSensorTestRequests > 0 && now - m_SentSensorTestModeRequestAtTicks >= 2000)
+        m_iSensorTestRequests = 0;
 
-    // Send the request.
-    m_WaitingForSensorTestModeResponse = m_SensorTestMode;
-    m_SentSensorTestModeRequestAtTicks = now;
+    // Normally, don't send a request if we have one outstanding already.  When streaming,
+    // keep the next request queued behind the one in flight.
+    int iMaxRequests = m_bStreamSensorTestData? MAX_SENSOR_TEST_REQUESTS:1;
+    while(m_iSensorTestRequests < iMaxRequests)
+    {
+        m_SensorTestRequests[m_iSensorTestRequests++] = m_SensorTestMode;
+        m_SentSensorTestModeRequestAtTicks = now;
 
-    SendCommandLocked(ssprintf("y%c\n", m_SensorTestMode));
+        SendCommandLocked(ssprintf("y%c\n", m_SensorTestMode), nullptr, CommandClass_Diagnostics);
+    }
 }
 
 // Handle a response to UpdateTestMode.
@@ -402,39 +576,41 @@ void SMX::SMXDevice::HandleSensorTestDataResponse(const string &sReadBuffer)
         return;
 
     // If we don't have the whole packet yet, wait.
-    uint8_t iSize = sReadBuffer[2] * 2;
-    if(sReadBuffer.size() < iSize + 3)
+    int iBits = uint8_t(sReadBuffer[2]);
+    if(sReadBuffer.size() < iBits*2 + 3)
         return;
 
     SensorTestMode iMode = (SensorTestMode) sReadBuffer[1];
 
-    // Copy off the data and remove it from the serial buffer.
-    vector<uint16_t> data;
-    for(int i = 3; i < iSize + 3; i += 2)
+    // Copy off the data.  This is called for every frame when streaming, so decode into a
+    // fixed buffer instead of allocating.  The bit count is 8 bits, so this always fits.
+    uint16_t data[256];
+    for(int i = 0; i < iBits; ++i)
     {
-        uint16_t iValue =
-            (uint8_t(sReadBuffer[i+1]) << 8) |
-            (uint8_t(sReadBuffer[i+0]) << 0);
-        data.push_back(iValue);
+        data[i] =
+            (uint8_t(sReadBuffer[3 + i*2 + 1]) << 8) |
+            (uint8_t(sReadBuffer[3 + i*2 + 0]) << 0);
     }
 
-    if(m_WaitingForSensorTestModeResponse == SensorTestMode_Off)
+    if(m_iSensorTestRequests == 0)
     {
         Log("Ignoring unexpected sensor data request.  It may have been sent by another application.");
         return;
     }
 
-    if(iMode != m_WaitingForSensorTestModeResponse)
+    // Responses arrive in the order we sent the requests.
+    if(iMode != m_SensorTestRequests[0])
     {
-        Log(ssprintf("Ignoring unexpected sensor data request (got %i, expected %i)", iMode, m_WaitingForSensorTestModeResponse));
+        LogFormat("Ignoring unexpected sensor data request (got %i, expected %i)", iMode, m_SensorTestRequests[0]);
         return;
     }
 
-    m_WaitingForSensorTestModeResponse = SensorTestMode_Off;
+    m_iSensorTestRequests--;
+    for(int i = 0; i < m_iSensorTestRequests; ++i)
+        m_SensorTestRequests[i] = m_SensorTestRequests[i+1];
 
-    // We match m_WaitingForSensorTestModeResponse, which is the sensor request we most
-    // recently sent.  If we don't match g_SensorTestMode, then the sensor mode was changed
-    // while a request was in the air.  Just ignore the response.
+    // We match the oldest request we sent.  If we don't match m_SensorTestMode, then the
+    // sensor mode was changed while a request was in the air.  Just ignore the response.
     if(iMode != m_SensorTestMode)
         return;
 
@@ -463,11 +639,13 @@ void SMX::SMXDevice::HandleSensorTestDataResponse(const string &sReadBuffer)
     memset(output.bBadSensorInput, 0, sizeof(output.bBadSensorInput));
     memset(output.iDIPSwitchPerPanel, 0, sizeof(output.iDIPSwitchPerPanel));
 
+    // Decode the response from all panels at once.
+    detail_data all_pad_data[9];
+    DecodeSensorTestData(data, iBits, (uint8_t *) all_pad_data, sizeof(detail_data));
+
     for(int iPanel = 0; iPanel < 9; ++iPanel)
     {
-        // Decode the response from this panel.
-        detail_data pad_data;
-        ReadDataForPanel(data, iPanel, &pad_data, sizeof(pad_data));
+        const detail_data &pad_data = all_pad_data[iPanel];
 
         // Check the header.  This is always 0 1 0, to identify it as a response, and not as random
         // steps from the player.
@@ -490,5 +668,36 @@ void SMX::SMXDevice::HandleSensorTestDataResponse(const string &sReadBuffer)
             output.sensorLevel[iPanel][iSensor] = pad_data.sensors[iSensor];
     }
 
+    // When streaming, queue the frame instead of calling the update callback.  The snapshot
+    // for GetTestData is published at the end of Update.
+    if(m_bStreamSensorTestData)
+    {
+        QueueTestFrame(iMode);
+        return;
+    }
+
     CallUpdateCallback(SMXUpdateCallback_Updated);
 }
+
+void SMX::SMXDevice::QueueTestFrame(SensorTestMode iMode)
+{
+    m_Lock.AssertLockedByCurrentThread();
+    if(m_pTestFrames == nullptr)
+        return;
+
+    SMXTestFrame frame;
+    frame.m_iTimestamp = GetTimestamp();
+    frame.m_Mode = iMode;
+    frame.m_Data = m_SensorTestData;
+    if(m_pTestFrames->Push(frame))
+    {
+        m_bTestFramesOverflowed = false;
+        return;
+    }
+
+    // Only log once each time the queue fills, like input events.
+    g_Stats.m_iTestFramesDropped++;
+    if(!m_bTestFramesOverflowed)
+        Log("Test frame queue full (frames discarded)");
+    m_bTestFramesOverflowed = true;
+}
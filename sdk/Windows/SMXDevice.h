@@ -1,17 +1,21 @@
 #ifndef SMXDevice_h
 #define SMXDevice_h
 
-#include <windows.h>
 #include <memory>
 #include <functional>
 using namespace std;
 
 #include "Helpers.h"
+#include "SMXDeviceConnection.h"
 #include "../SMX.h"
 
 namespace SMX
 {
-class SMXDeviceConnection;
+class SMXDeviceCache;
+class SMXIOPort;
+
+// Streamed test frames for one pad slot.  Like InputEventQueue, these are owned by SMXManager.
+typedef SPSCQueue<SMXTestFrame, 128> TestFrameQueue;
 
 // The high-level interface to a single controller.  This is managed by SMXManager, and uses SMXDeviceConnection
 // for low-level USB communication.
@@ -22,43 +26,70 @@ public:
     //
     // lock is our serialization mutex.  This is shared across SMXManager and all SMXDevices.
     //
-    // hEvent is signalled when we have new packets to be sent, to wake the communications thread.  The
-    // device handle opened with OpenPort must also be monitored, to check when packets have been received
-    // (or successfully sent).
-    static shared_ptr<SMXDevice> Create(shared_ptr<SMX::AutoCloseHandle> hEvent, SMX::Mutex &lock);
-    SMXDevice(shared_ptr<SMXDevice> &pSelf, shared_ptr<SMX::AutoCloseHandle> hEvent, SMX::Mutex &lock);
+    // pIOPort is what the communications thread waits on.  We wake it when we have new packets
+    // to be sent.  The device handle opened with OpenDeviceHandle must also be added to it by
+    // the owner, so the thread wakes when packets have been received (or successfully sent).
+    static shared_ptr<SMXDevice> Create(shared_ptr<SMXIOPort> pIOPort, SMX::Mutex &lock);
+    SMXDevice(shared_ptr<SMXDevice> &pSelf, shared_ptr<SMXIOPort> pIOPort, SMX::Mutex &lock);
     ~SMXDevice();
 
     bool OpenDeviceHandle(shared_ptr<SMX::AutoCloseHandle> pHandle, wstring &sError);
+
+    // Connect to device iDevice in a replay instead of a real device.  See SMXDeviceConnection::OpenReplay.
+    bool OpenReplay(shared_ptr<SMXReplay> pReplay, int iDevice, wstring &sError);
+
+    // Capture traffic for this connection to pCaptureWriter.  This is called after opening.
+    void SetCaptureWriter(shared_ptr<SMXCaptureWriter> pCaptureWriter);
+
+    // Use pDeviceCache to report the configuration the device had last time as soon as we
+    // have its device info, and keep it updated.
+    void SetDeviceCacheLocked(shared_ptr<SMXDeviceCache> pDeviceCache);
     void CloseDevice();
     shared_ptr<SMX::AutoCloseHandle> GetDeviceHandle() const;
 
+    // Return true if pCompletion belongs to an I/O request made by this device.  This is used
+    // to route completions from SMXIOPort::Wait.
+    bool IsCompletionForDevice(const void *pCompletion) const;
+
     // Set a function to be called when something changes on the device.  This allows efficiently
     // detecting when a panel is pressed or other changes happen on the device.
-    void SetUpdateCallback(function<void(int PadNumber, SMXUpdateCallbackReason reason)> pCallback);
+    // iInputTimestamp is the GetTimestamp time of the input report that caused the
+    // callback, or 0 if it wasn't caused by an input change.
+    void SetUpdateCallback(function<void(int PadNumber, SMXUpdateCallbackReason reason, int64_t iInputTimestamp)> pCallback);
+
+    // Set the pad number passed to the update callback, and the slot's queues that input events
+    // and streamed test frames are added to.  This is set by SMXManager from the I/O thread
+    // when it places the device in a slot.
+    void SetPadNumberLocked(int iPad, InputEventQueue *pInputEvents, TestFrameQueue *pTestFrames);
 
     // Return true if we're connected.
     bool IsConnected() const;
 
     // Send a raw command.
-    void SendCommand(string sCmd, function<void()> pComplete=nullptr);
-    void SendCommandLocked(string sCmd, function<void()> pComplete=nullptr);
+    void SendCommand(const string &sCmd, function<void()> pComplete=nullptr, CommandClass iClass=CommandClass_Control);
+    void SendCommandLocked(const string &sCmd, function<void()> pComplete=nullptr, CommandClass iClass=CommandClass_Control);
 
-    // Get basic info about the device.
+    // Get basic info about the device.  GetInfo and the other getters below read a snapshot,
+    // so they never wait for the I/O thread.
     void GetInfo(SMXInfo &info);
     void GetInfoLocked(SMXInfo &info); // used by SMXManager
 
     // Return true if this device is configured as player 2.
     bool IsPlayer2Locked() const; // used by SMXManager
 
+    // Get the state returned by SMX_GetState for this device.
+    void GetPadStateLocked(SMXPadState &state); // used by SMXManager
+    void GetCommandQueueDepthLocked(uint32_t &iDepth, uint32_t &iMaxDepth, bool bReset); // used by SMXManager
+
     // Get the configuration of the connected device (or the most recently read configuration if
     // we're not connected).
     bool GetConfig(SMXConfig &configOut);
 
-    // Set the configuration of the connected device.
+    // Set the configuration of the connected device, and return its write number.  See
+    // SMX_SetConfigEx.
     //
     // This is asynchronous and returns immediately.
-    void SetConfig(const SMXConfig &newConfig);
+    uint32_t SetConfig(const SMXConfig &newConfig);
 
     // Return a mask of the panels currently pressed.
     uint16_t GetInputState() const;
@@ -81,6 +112,10 @@ public:
     // Return the most recent test data we've received from the pad.  Return false if we haven't
     // received test data since changing the test mode (or if we're not in a test mode).
     bool GetTestData(SMXSensorTestModeData &data);
+    bool GetTestDataLocked(SMXSensorTestModeData &data); // used by SMXManager
+
+    // Enable or disable streaming test data.  See SMX_SetTestStreaming.
+    void SetSensorTestStreaming(bool bStreaming);
 
     // Internal:
 
@@ -90,20 +125,32 @@ public:
     // sError will be set on a communications error.  The owner must close the device.
     void Update(wstring &sError);
 
+    // Return the GetMonotonicTime time a configuration write is waiting for, or -1 if there
+    // isn't one.  The I/O thread wakes up at this time to send it.
+    double GetNextConfigSendTimeLocked() const;
+
 private:
-    shared_ptr<SMX::AutoCloseHandle> m_hEvent;
+    shared_ptr<SMXIOPort> m_pIOPort;
     SMX::Mutex &m_Lock;
 
-    function<void(int PadNumber, SMXUpdateCallbackReason reason)> m_pUpdateCallback;
+    void WakeIOThread();
+
+    function<void(int PadNumber, SMXUpdateCallbackReason reason, int64_t iInputTimestamp)> m_pUpdateCallback;
+    int m_iPadNumber = 0;
     weak_ptr<SMXDevice> m_pSelf;
 
     shared_ptr<SMXDeviceConnection> m_pConnection;
 
     // The configuration we've read from the device.  m_bHaveConfig is true if we've received
-    // a configuration from the device since we've connected to it.
+    // a configuration from the device since we've connected to it, or have a cached one.
     SMXConfig config;
     bool m_bHaveConfig = false;
 
+    // If true, config came from m_pDeviceCache, and we're still waiting for the device to
+    // send its configuration.
+    bool m_bConfigFromCache = false;
+    shared_ptr<SMXDeviceCache> m_pDeviceCache;
+
     // This is the configuration the user has set, if he's changed anything.  We send this to
     // the device if m_bSendConfig is true.  Once we send it once, m_bSendConfig is cleared, and
     // if we see a different configuration from the device again we won't re-send this.
@@ -111,21 +158,78 @@ private:
     bool m_bSendConfig = false;
     bool m_bSendingConfig = false;
 
-    void CallUpdateCallback(SMXUpdateCallbackReason reason);
+    // Configuration writes are sent at most once per CONFIG_WRITE_INTERVAL.  SetConfig calls
+    // made while we're waiting replace wanted_config, so a burst of calls is sent as a single
+    // write of the last one.
+    static const double CONFIG_WRITE_INTERVAL;
+    double m_fNextConfigSendTime = 0;
+
+    // Each SetConfig call gets the next write number.  m_iPendingConfigWrite is the number of
+    // wanted_config, m_iSendingConfigWrite is the number of the write in flight, and
+    // m_iConfigWriteAcked is the most recent write the device has acknowledged.
+    uint32_t m_iConfigWrite = 0;
+    uint32_t m_iPendingConfigWrite = 0;
+    uint32_t m_iSendingConfigWrite = 0;
+    uint32_t m_iConfigWriteAcked = 0;
+
+    // A copy of the state returned by the getters.  This is published by the I/O thread (or
+    // by setters) while holding m_Lock, and read by the getters without locking.
+    struct State
+    {
+        SMXInfo m_Info;
+        SMXConfig m_Config;
+        bool m_bHaveConfig = false;
+        SMXSensorTestModeData m_TestData;
+        bool m_bHaveTestData = false;
+    };
+    SeqLock<State> m_State;
+    void PublishStateLocked();
+
+    // This is incremented by PublishStateLocked when the configuration it publishes changes.
+    uint32_t m_iConfigGeneration = 0;
+    SMXConfig m_PublishedConfig;
+    bool m_bPublishedHaveConfig = false;
+
+    void CallUpdateCallback(SMXUpdateCallbackReason reason, int64_t iInputTimestamp=0);
     void HandlePackets();
 
+    // The buffer HandlePackets reads into.  This is kept so its memory is reused.
+    string m_sReadPacket;
+
     void SendConfig();
     void CheckActive();
     bool IsConnectedLocked() const;
 
+    // Connection phase timings for SMX_GetStats.  Devices are created by SMX_Start, so
+    // m_fCreatedAt is when we started.
+    void RecordConnectTimings();
+    double m_fCreatedAt = 0;
+    double m_fOpenedAt = 0;
+    double m_fDeviceInfoAt = 0;
+    bool m_bRecordedConnectTime = false;
+    bool m_bConnectedSinceStart = false;
+
     // Test/diagnostics mode handling.
     void UpdateTestMode();
     void HandleSensorTestDataResponse(const string &sReadBuffer);
-    SensorTestMode m_WaitingForSensorTestModeResponse = SensorTestMode_Off;
+    void QueueTestFrame(SensorTestMode iMode);
     SensorTestMode m_SensorTestMode = SensorTestMode_Off;
     bool m_HaveSensorTestModeData = false;
     SMXSensorTestModeData m_SensorTestData;
     uint32_t m_SentSensorTestModeRequestAtTicks = 0;
+
+    // The modes of the test data requests we've sent and haven't had a response to, oldest
+    // first.  Normally only one request is sent at a time.  When streaming, we keep a second
+    // request queued, so it's sent as soon as the device finishes the first.
+    static const int MAX_SENSOR_TEST_REQUESTS = 2;
+    SensorTestMode m_SensorTestRequests[MAX_SENSOR_TEST_REQUESTS];
+    int m_iSensorTestRequests = 0;
+
+    // If true, test data is being streamed into the queue for our slot, which is drained by
+    // SMX_ReadTestFrames from the application's thread.
+    bool m_bStreamSensorTestData = false;
+    TestFrameQueue *m_pTestFrames = nullptr;
+    bool m_bTestFramesOverflowed = false;
 };
 }
 
@@ -0,0 +1,289 @@
+#include "SMXDeviceCache.h"
+#include "Helpers.h"
+
+#include <algorithm>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+using namespace std;
+using namespace SMX;
+
+namespace {
+    const uint32_t CACHE_FILE_VERSION = 1;
+
+    // Wait this long after the last change before saving.
+    const double SAVE_DELAY = 2.0;
+
+    // Only keep this many devices.  The least recently updated ones are dropped.
+    const int MAX_CACHE_ENTRIES = 64;
+
+    // A cache file is a CacheFileHeader followed by m_iEntries CacheFileEntries.  If the size
+    // of SMXConfig changes, old caches are discarded.
+#pragma pack(push,1)
+    struct CacheFileHeader
+    {
+        char m_Magic[4]; // "SMXD"
+        uint32_t m_iVersion;
+        uint32_t m_iConfigSize;
+        uint32_t m_iEntries;
+    };
+
+    struct CacheFileEntry
+    {
+        char m_Serial[33];
+        uint16_t m_iFirmwareVersion;
+        SMXConfig m_Config;
+    };
+#pragma pack(pop)
+}
+
+shared_ptr<SMXDeviceCache> SMX::SMXDeviceCache::Create(const wstring &sPath)
+{
+    shared_ptr<SMXDeviceCache> pCache = make_shared<SMXDeviceCache>();
+    pCache->m_sPath = sPath;
+
+    wstring sError;
+    if(!pCache->Load(sError))
+    {
+        LogFormat("%ls", sError);
+        pCache->m_Entries.clear();
+    }
+
+    return pCache;
+}
+
+wstring SMX::SMXDeviceCache::GetDefaultPath()
+{
+#ifdef _WIN32
+    wchar_t szLocalAppData[MAX_PATH];
+    DWORD iLength = GetEnvironmentVariableW(L"LOCALAPPDATA", szLocalAppData, MAX_PATH);
+    if(iLength == 0 || iLength >= MAX_PATH)
+        return wstring();
+
+    return wstring(szLocalAppData) + L"\\StepManiaX\\SMXDeviceCache.dat";
+#else
+    // Use the XDG cache directory, which defaults to ~/.cache.
+    const char *szCache = getenv("XDG_CACHE_HOME");
+    if(szCache != nullptr && szCache[0] == '/')
+        return UTF8ToWide(szCache) + L"/StepManiaX/SMXDeviceCache.dat";
+
+    const char *szHome = getenv("HOME");
+    if(szHome == nullptr || szHome[0] == 0)
+        return wstring();
+
+    return UTF8ToWide(szHome) + L"/.cache/StepManiaX/SMXDeviceCache.dat";
+#endif
+}
+
+const SMXDeviceCache::Entry *SMX::SMXDeviceCache::FindEntry(const char *szSerial) const
+{
+    for(const Entry &entry: m_Entries)
+    {
+        if(!strcmp(entry.m_Info.m_Serial, szSerial))
+            return &entry;
+    }
+    return nullptr;
+}
+
+bool SMX::SMXDeviceCache::GetConfig(const SMXDeviceInfo &info, SMXConfig &config) const
+{
+    const Entry *pEntry = FindEntry(info.m_Serial);
+    if(pEntry == nullptr || pEntry->m_Info.m_iFirmwareVersion != info.m_iFirmwareVersion)
+        return false;
+
+    config = pEntry->m_Config;
+    return true;
+}
+
+void SMX::SMXDeviceCache::SetConfig(const SMXDeviceInfo &info, const SMXConfig &config)
+{
+    const Entry *pEntry = FindEntry(info.m_Serial);
+    if(pEntry != nullptr && pEntry->m_Info.m_iFirmwareVersion == info.m_iFirmwareVersion &&
+        !memcmp(&pEntry->m_Config, &config, sizeof(config)))
+        return;
+
+    // Move the device to the end, so the least recently updated devices are at the front.
+    if(pEntry != nullptr)
+        m_Entries.erase(m_Entries.begin() + (pEntry - m_Entries.data()));
+    if(m_Entries.size() >= MAX_CACHE_ENTRIES)
+        m_Entries.erase(m_Entries.begin());
+
+    Entry entry;
+    entry.m_Info = info;
+    entry.m_Config = config;
+    m_Entries.push_back(entry);
+
+    m_fSaveAt = GetMonotonicTime() + SAVE_DELAY;
+}
+
+double SMX::SMXDeviceCache::GetNextSaveTime() const
+{
+    return m_fSaveAt;
+}
+
+void SMX::SMXDeviceCache::SaveIfNeeded(bool bForce)
+{
+    if(m_fSaveAt < 0)
+        return;
+    if(!bForce && GetMonotonicTime() < m_fSaveAt)
+        return;
+
+    m_fSaveAt = -1;
+    Save();
+}
+
+// Read exactly iSize bytes from a file.
+static bool ReadFromFile(NativeHandle hFile, void *pData, size_t iSize)
+{
+#ifdef _WIN32
+    DWORD iRead = 0;
+    return ReadFile(hFile, pData, (DWORD) iSize, &iRead, NULL) && iRead == iSize;
+#else
+    return read(hFile, pData, iSize) == (ssize_t) iSize;
+#endif
+}
+
+bool SMX::SMXDeviceCache::Load(wstring &sError)
+{
+#ifdef _WIN32
+    HANDLE hFile = CreateFileW(m_sPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(hFile == INVALID_HANDLE_VALUE)
+    {
+        // It's normal for the cache to not exist yet.
+        int iError = GetLastError();
+        if(iError == ERROR_FILE_NOT_FOUND || iError == ERROR_PATH_NOT_FOUND)
+            return true;
+
+        sError = wstring(L"Error opening device cache: ") + GetErrorString(iError);
+        return false;
+    }
+#else
+    int hFile = open(WideToUTF8(m_sPath).c_str(), O_RDONLY | O_CLOEXEC);
+    if(hFile == -1)
+    {
+        // It's normal for the cache to not exist yet.
+        int iError = errno;
+        if(iError == ENOENT || iError == ENOTDIR)
+            return true;
+
+        sError = wstring(L"Error opening device cache: ") + GetErrorString(iError);
+        return false;
+    }
+#endif
+    AutoCloseHandle file(hFile);
+
+    CacheFileHeader header;
+    if(!ReadFromFile(hFile, &header, sizeof(header)) ||
+        memcmp(header.m_Magic, "SMXD", 4) || header.m_iVersion != CACHE_FILE_VERSION ||
+        header.m_iConfigSize != sizeof(SMXConfig) || header.m_iEntries > MAX_CACHE_ENTRIES)
+    {
+        sError = L"Ignoring unsupported device cache";
+        return false;
+    }
+
+    vector<CacheFileEntry> aEntries(header.m_iEntries);
+    size_t iSize = aEntries.size() * sizeof(CacheFileEntry);
+    if(iSize > 0 && !ReadFromFile(hFile, aEntries.data(), iSize))
+    {
+        sError = L"Ignoring truncated device cache";
+        return false;
+    }
+
+    for(const CacheFileEntry &fileEntry: aEntries)
+    {
+        Entry entry;
+        memcpy(entry.m_Info.m_Serial, fileEntry.m_Serial, sizeof(entry.m_Info.m_Serial));
+        entry.m_Info.m_Serial[sizeof(entry.m_Info.m_Serial)-1] = 0;
+        entry.m_Info.m_iFirmwareVersion = fileEntry.m_iFirmwareVersion;
+        entry.m_Config = fileEntry.m_Config;
+        m_Entries.push_back(entry);
+    }
+
+    return true;
+}
+
+void SMX::SMXDeviceCache::Save()
+{
+    // Create the directory the cache is in, in case this is the first time we've saved it.
+    // On Linux, ~/.cache may not exist yet either, so create each directory in the path.
+    size_t iSlash = m_sPath.find_last_of(L"\\/");
+#ifdef _WIN32
+    if(iSlash != wstring::npos)
+        CreateDirectoryW(m_sPath.substr(0, iSlash).c_str(), NULL);
+#else
+    for(size_t iPos = m_sPath.find(L'/', 1); iSlash != wstring::npos && iPos <= iSlash; iPos = m_sPath.find(L'/', iPos + 1))
+        mkdir(WideToUTF8(m_sPath.substr(0, iPos)).c_str(), 0755);
+#endif
+
+    vector<uint8_t> data(sizeof(CacheFileHeader) + m_Entries.size() * sizeof(CacheFileEntry));
+    CacheFileHeader *pHeader = (CacheFileHeader *) data.data();
+    memcpy(pHeader->m_Magic, "SMXD", 4);
+    pHeader->m_iVersion = CACHE_FILE_VERSION;
+    pHeader->m_iConfigSize = sizeof(SMXConfig);
+    pHeader->m_iEntries = (uint32_t) m_Entries.size();
+
+    CacheFileEntry *pFileEntries = (CacheFileEntry *) (data.data() + sizeof(CacheFileHeader));
+    for(size_t i = 0; i < m_Entries.size(); ++i)
+    {
+        memcpy(pFileEntries[i].m_Serial, m_Entries[i].m_Info.m_Serial, sizeof(pFileEntries[i].m_Serial));
+        pFileEntries[i].m_iFirmwareVersion = m_Entries[i].m_Info.m_iFirmwareVersion;
+        pFileEntries[i].m_Config = m_Entries[i].m_Config;
+    }
+
+    // Write to a temporary file and move it over the old one, so a crash while saving
+    // can't leave a partial cache behind.
+    wstring sTempPath = m_sPath + L".tmp";
+#ifdef _WIN32
+    HANDLE hFile = CreateFileW(sTempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(hFile == INVALID_HANDLE_VALUE)
+    {
+        LogFormat("Error writing device cache: %ls", GetErrorString(GetLastError()));
+        return;
+    }
+
+    DWORD iWritten = 0;
+    bool bWritten = !!WriteFile(hFile, data.data(), (DWORD) data.size(), &iWritten, NULL) && iWritten == data.size();
+    int iError = GetLastError();
+    CloseHandle(hFile);
+    if(!bWritten)
+    {
+        LogFormat("Error writing device cache: %ls", GetErrorString(iError));
+        DeleteFileW(sTempPath.c_str());
+        return;
+    }
+
+    if(!MoveFileExW(sTempPath.c_str(), m_sPath.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        LogFormat("Error writing device cache: %ls", GetErrorString(GetLastError()));
+        DeleteFileW(sTempPath.c_str());
+    }
+#else
+    string sTempPathUTF8 = WideToUTF8(sTempPath);
+    int hFile = open(sTempPathUTF8.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(hFile == -1)
+    {
+        LogFormat("Error writing device cache: %ls", GetErrorString(errno));
+        return;
+    }
+
+    bool bWritten = write(hFile, data.data(), data.size()) == (ssize_t) data.size();
+    int iError = errno;
+    close(hFile);
+    if(!bWritten)
+    {
+        LogFormat("Error writing device cache: %ls", GetErrorString(iError));
+        unlink(sTempPathUTF8.c_str());
+        return;
+    }
+
+    if(rename(sTempPathUTF8.c_str(), WideToUTF8(m_sPath).c_str()) == -1)
+    {
+        LogFormat("Error writing device cache: %ls", GetErrorString(errno));
+        unlink(sTempPathUTF8.c_str());
+    }
+#endif
+}
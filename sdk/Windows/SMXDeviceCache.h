@@ -0,0 +1,66 @@
+#ifndef SMXDeviceCache_h
+#define SMXDeviceCache_h
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "SMXDeviceConnection.h"
+#include "../SMX.h"
+
+namespace SMX
+{
+// This remembers the configuration of each device we've seen, keyed by its serial number, so
+// a device can report that it's connected as soon as we have its device info, without waiting
+// for its configuration to be read.  The configuration is still read, and replaces the cached
+// one when it arrives.
+//
+// The cache is only used by the I/O thread.  Changes are saved to disk after they settle, by
+// SaveIfNeeded, which the I/O thread calls while it's not holding the lock.
+class SMXDeviceCache
+{
+public:
+    // Load the cache from sPath.  If the file doesn't exist or can't be read, the cache starts
+    // out empty.
+    static shared_ptr<SMXDeviceCache> Create(const wstring &sPath);
+
+    // Return the path used if SMXStartOptions::m_sDeviceCacheFile isn't set.
+    static wstring GetDefaultPath();
+
+    // If we have a configuration cached for this device, return it.  Entries are only used if
+    // they were cached with the same firmware version.
+    bool GetConfig(const SMXDeviceInfo &info, SMXConfig &config) const;
+
+    // Remember the configuration for a device.
+    void SetConfig(const SMXDeviceInfo &info, const SMXConfig &config);
+
+    // Return the GetMonotonicTime time changes should be saved, or -1 if there's nothing to save.
+    double GetNextSaveTime() const;
+
+    // Save the cache if it has changes that are due to be saved.  If bForce is true, save any
+    // changes immediately.
+    void SaveIfNeeded(bool bForce=false);
+
+private:
+    struct Entry
+    {
+        SMXDeviceInfo m_Info;
+        SMXConfig m_Config;
+    };
+
+    const Entry *FindEntry(const char *szSerial) const;
+    bool Load(wstring &sError);
+    void Save();
+
+    wstring m_sPath;
+    vector<Entry> m_Entries;
+
+    // If there are unsaved changes, this is the time they should be saved.  This is delayed
+    // after each change, so a burst of configuration writes is only saved once.
+    double m_fSaveAt = -1;
+};
+}
+
+#endif
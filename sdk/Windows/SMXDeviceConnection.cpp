@@ -1,17 +1,33 @@
 #include "SMXDeviceConnection.h"
+#include "SMXStats.h"
 #include "Helpers.h"
 
+#ifdef _WIN32
+#include "SMXHIDTransport.h"
+#else
+#include "../Linux/SMXHidrawTransport.h"
+#include <errno.h>
+#include <sys/eventfd.h>
+#endif
+
 #include <string>
 #include <memory>
+#include <math.h>
 using namespace std;
 using namespace SMX;
 
-#include <hidsdi.h>
-#include <SetupAPI.h>
+#define PACKET_FLAG_START_OF_COMMAND      0x04
+#define PACKET_FLAG_END_OF_COMMAND        0x01
+#define PACKET_FLAG_HOST_CMD_FINISHED     0x02
+#define PACKET_FLAG_DEVICE_INFO           0x80
+
+// When diagnostics and lights are both waiting, the most of the device's time lights can use.
+const double SMXDeviceConnection::MAX_LIGHTS_SHARE = 0.5;
+const double SMXDeviceConnection::CLASS_BUSY_TIME_HALF_LIFE = 0.25;
 
 SMX::SMXDeviceConnection::PendingCommandPacket::PendingCommandPacket()
 {
-    memset(&m_OverlappedWrite, 0, sizeof(m_OverlappedWrite));
+    memset(m_Data, 0, sizeof(m_Data));
 }
 
 shared_ptr<SMX::SMXDeviceConnection> SMXDeviceConnection::Create()
@@ -22,7 +38,14 @@ shared_ptr<SMX::SMXDeviceConnection> SMXDeviceConnection::Create()
 SMX::SMXDeviceConnection::SMXDeviceConnection(shared_ptr<SMXDeviceConnection> &pSelf):
     m_pSelf(GetPointers(pSelf, this))
 {
-    memset(&overlapped_read, 0, sizeof(overlapped_read));
+    // Preallocate the read buffers, so we don't allocate while receiving commands.  This is
+    // enough for the largest response the device sends.
+    m_sCurrentReadBuffer.reserve(256);
+    for(string &sBuffer: m_sReadBuffers)
+        sBuffer.reserve(256);
+    m_apPendingCommands.reserve(32);
+    m_apFreeCommands.reserve(32);
+    memset(m_fClassBusyTime, 0, sizeof(m_fClassBusyTime));
 }
 
 SMX::SMXDeviceConnection::~SMXDeviceConnection()
@@ -30,40 +53,99 @@ SMX::SMXDeviceConnection::~SMXDeviceConnection()
     Close();
 }
 
-bool SMX::SMXDeviceConnection::Open(shared_ptr<AutoCloseHandle> DeviceHandle, wstring &sError)
+bool SMX::SMXDeviceConnection::Open(shared_ptr<AutoCloseHandle> DeviceHandle, shared_ptr<SMXIOPort> pIOPort, wstring &sError)
 {
-    m_hDevice = DeviceHandle;
+#ifdef _WIN32
+    shared_ptr<SMXTransport> pTransport = SMXHIDTransport::Create(DeviceHandle, sError);
+#else
+    shared_ptr<SMXTransport> pTransport = SMXHidrawTransport::Create(DeviceHandle, pIOPort, sError);
+#endif
+    OpenTransport(DeviceHandle, pTransport);
+    return true;
+}
+
+bool SMX::SMXDeviceConnection::OpenReplay(shared_ptr<SMXReplay> pReplay, int iDevice, wstring &sError)
+{
+    // Nothing is read or written through this handle.  It just gives the replay device
+    // a unique handle, like a real device.
+#ifdef _WIN32
+    HANDLE hPlaceholder = CreateEvent(NULL, false, false, NULL);
+    if(hPlaceholder == NULL)
+    {
+        sError = wstring(L"CreateEvent failed: ") + GetErrorString(GetLastError());
+        return false;
+    }
+#else
+    int hPlaceholder = eventfd(0, EFD_CLOEXEC);
+    if(hPlaceholder == -1)
+    {
+        sError = wstring(L"eventfd failed: ") + GetErrorString(errno);
+        return false;
+    }
+#endif
 
-    if(!HidD_SetNumInputBuffers(DeviceHandle->value(), 512))
-        Log(ssprintf("Error: HidD_SetNumInputBuffers: %ls", GetErrorString(GetLastError()).c_str()));
+    OpenTransport(make_shared<AutoCloseHandle>(hPlaceholder), make_shared<SMXReplayTransport>(pReplay, iDevice));
+    return true;
+}
 
-    // Begin the first async read.
-    BeginAsyncRead(sError);
+void SMX::SMXDeviceConnection::OpenTransport(shared_ptr<AutoCloseHandle> DeviceHandle, shared_ptr<SMXTransport> pTransport)
+{
+    m_hDevice = DeviceHandle;
+    m_pTransport = pTransport;
+    BeginSession();
+}
 
+// Start talking to a device we've just opened.
+void SMX::SMXDeviceConnection::BeginSession()
+{
     // Request device info.
     RequestDeviceInfo([&] {
-        Log(ssprintf("Received device info.  Master version: %i, P%i", m_DeviceInfo.m_iFirmwareVersion, m_DeviceInfo.m_bP2+1));
+        LogFormat("Received device info.  Master version: %i, P%i", m_DeviceInfo.m_iFirmwareVersion, m_DeviceInfo.m_bP2+1);
         m_bGotInfo = true;
     });
+}
 
-    return true;
+void SMX::SMXDeviceConnection::SetCaptureWriter(shared_ptr<SMXCaptureWriter> pWriter)
+{
+    m_pCaptureWriter = pWriter;
+    m_iCaptureDevice = pWriter? pWriter->AllocateDeviceId():-1;
 }
 
 void SMX::SMXDeviceConnection::Close()
 {
     Log("Closing device");
 
-    if(m_hDevice)
-        CancelIo(m_hDevice->value());
+    // Stop I/O before releasing commands, so nothing is still using their buffers.
+    if(m_pTransport)
+        m_pTransport->Close();
+
+    if(m_pCaptureWriter)
+        m_pCaptureWriter->Flush();
 
     m_hDevice.reset();
-    m_sReadBuffers.clear();
-    m_aPendingCommands.clear();
-    memset(&overlapped_read, 0, sizeof(overlapped_read));
+    m_pTransport.reset();
+    m_pCaptureWriter.reset();
+    m_iCaptureDevice = -1;
+    m_iFirstReadBuffer = 0;
+    m_iReadBufferCount = 0;
+    m_sCurrentReadBuffer.clear();
+    for(shared_ptr<PendingCommand> &pCommand: m_apPendingCommands)
+        ReleaseCommand(pCommand);
+    m_apPendingCommands.clear();
+    if(m_pCurrentCommand)
+        ReleaseCommand(m_pCurrentCommand);
     m_bActive = false;
     m_bGotInfo = false;
-    m_pCurrentCommand = nullptr;
-    m_iInputState = 0;
+    memset(m_fClassBusyTime, 0, sizeof(m_fClassBusyTime));
+
+    // Treat disconnecting as releasing any panels that were pressed, so readers of the
+    // input event queue don't see a stuck panel.
+    SetInputState(0, GetTimestamp());
+}
+
+bool SMX::SMXDeviceConnection::IsCompletionForConnection(const void *pCompletion) const
+{
+    return m_pTransport != nullptr && m_pTransport->IsCompletionForTransport(pCompletion);
 }
 
 void SMX::SMXDeviceConnection::SetActive(bool bActive)
@@ -85,76 +167,170 @@ void SMX::SMXDeviceConnection::Update(wstring &sError)
         return;
     }
 
-    // A read packet can allow us to initiate a write, so check reads before writes.
+    // A read packet can allow us to initiate a write, so check reads before writes.  When
+    // the device is simulated, send first too, since it may be waiting for a request.
+    if(m_pTransport->IsSimulated())
+        CheckWrites(sError);
     CheckReads(sError);
     CheckWrites(sError);
 }
 
 bool SMX::SMXDeviceConnection::ReadPacket(string &out)
 {
-    if(m_sReadBuffers.empty())
+    if(m_iReadBufferCount == 0)
         return false;
-    out = m_sReadBuffers.front();
-    m_sReadBuffers.pop_front();
+
+    // Swap the buffer out instead of copying it.  The caller's old buffer takes its place,
+    // so if the caller reuses the same string, neither side allocates.
+    out.clear();
+    swap(out, m_sReadBuffers[m_iFirstReadBuffer]);
+    m_iFirstReadBuffer = (m_iFirstReadBuffer + 1) % MAX_READ_BUFFERS;
+    m_iReadBufferCount--;
     return true;
 }
 
+// Handle each report that's arrived, oldest first.
 void SMX::SMXDeviceConnection::CheckReads(wstring &error)
 {
-    DWORD bytes;
-    int result = GetOverlappedResult(m_hDevice->value(), &overlapped_read, &bytes, FALSE);
-    if(result == 0)
+    // A simulated device has every report ready at once when it's replaying as fast as
+    // possible, so only handle a few at a time, like we'd see from a real device.  This gives
+    // the rest of the SDK a chance to handle each one.
+    bool bSimulated = m_pTransport->IsSimulated();
+    for(int i = 0; !bSimulated || i < MAX_SIMULATED_REPORTS_PER_UPDATE; ++i)
     {
-        int windows_error = GetLastError();
-        if(windows_error != ERROR_IO_PENDING && windows_error != ERROR_IO_INCOMPLETE)
-            error = wstring(L"Error reading device: ") + GetErrorString(windows_error).c_str();
-        return;
+        const uint8_t *pData;
+        int iSize;
+        if(!m_pTransport->PeekReport(pData, iSize, error))
+            return;
+
+        uint8_t simulated[SMXTransport::REPORT_SIZE];
+        if(bSimulated)
+        {
+            memcpy(simulated, pData, iSize);
+            if(!ShouldHandleSimulatedReport(simulated, iSize))
+                return;
+            pData = simulated;
+        }
+
+        // Handle the report before popping it, since popping may reuse its buffer.
+        HandleUsbPacket(pData, iSize);
+        m_pTransport->PopReport();
+    }
+}
+
+// A simulated device's responses aren't to the commands we actually sent, since it doesn't
+// see them and CheckWrites acknowledges them itself, so they need to be kept in step with us:
+// - The device info response waits until we've requested device info.
+// - Other responses wait until we're active, since they'd be ignored before then.
+// - PACKET_FLAG_HOST_CMD_FINISHED is removed, since it's for commands we didn't send.
+// Return false if the report should wait.  pData is modified.
+bool SMX::SMXDeviceConnection::ShouldHandleSimulatedReport(uint8_t *pData, int iSize)
+{
+    if(pData[0] != 6 || iSize < 3)
+        return true;
+
+    if(pData[1] & PACKET_FLAG_DEVICE_INFO)
+    {
+        bool bRequested = m_pCurrentCommand != nullptr && m_pCurrentCommand->m_bIsDeviceInfoCommand;
+        if(!bRequested && !m_bGotInfo)
+            return false;
     }
+    else if(!m_bActive)
+        return false;
+
+    pData[1] &= ~PACKET_FLAG_HOST_CMD_FINISHED;
+    return true;
+}
+
+void SMX::SMXDeviceConnection::SetInputState(uint16_t iInputState, int64_t iTimestamp)
+{
+    if(iInputState == m_iInputState.load(memory_order_relaxed))
+        return;
+    m_iInputState.store(iInputState, memory_order_relaxed);
+    m_iInputTimestamp = iTimestamp;
+    if(m_pInputEvents == nullptr)
+        return;
 
-    HandleUsbPacket(string(overlapped_read_buffer, bytes));
+    SMXInputEvent event;
+    event.m_iInputState = iInputState;
+    event.m_iTimestamp = iTimestamp;
+    if(m_pInputEvents->Push(event))
+    {
+        m_bInputEventsOverflowed = false;
+        return;
+    }
 
-    // Start the next read.
-    BeginAsyncRead(error);
+    // Only log once each time the queue fills, so an application that never reads events
+    // doesn't spam the log.
+    if(!m_bInputEventsOverflowed)
+        Log("Input event queue full (events discarded)");
+    m_bInputEventsOverflowed = true;
 }
 
-void SMX::SMXDeviceConnection::HandleUsbPacket(const string &buf)
+// The HID reports we receive.  These are read directly out of the read buffer.
+#pragma pack(push,1)
+struct InputStateReport
+{
+    uint8_t iReportId; // 3
+    uint16_t iInputState;
+};
+
+struct SerialReport
 {
-    if(buf.empty())
+    uint8_t iReportId; // 6
+    uint8_t iFlags; // PACKET_FLAG_*
+    uint8_t iSize; // the number of bytes used in data
+    uint8_t data[61];
+};
+#pragma pack(pop)
+
+// Handle a HID report.  This is called for every report we receive, including input
+// reports at up to 1kHz, so this shouldn't allocate memory.
+void SMX::SMXDeviceConnection::HandleUsbPacket(const uint8_t *pData, int iSize)
+{
+    if(iSize == 0)
         return;
-    // Log(ssprintf("Read: %s", BinaryToHex(buf).c_str()));
+    // Log(ssprintf("Read: %s", BinaryToHex(pData, iSize).c_str()));
 
-    int iReportId = buf[0];
+    if(m_pCaptureWriter)
+    {
+        m_pCaptureWriter->Write(m_iCaptureDevice, CaptureDirection_Read, GetTimestamp(), pData, iSize);
+    }
+
+    int iReportId = pData[0];
     switch(iReportId)
     {
     case 3:
-        // Input state.  We could also read this as a normal HID button change.
-        m_iInputState = ((buf[2] & 0xFF) << 8) |
-                ((buf[1] & 0xFF) << 0);
+    {
+        // Input state.  We could also read this as a normal HID button change.  Timestamp
+        // it as early as we can.
+        int64_t iNow = GetTimestamp();
 
-        // Log(ssprintf("Input state: %x (%x %x)\n", m_iInputState, buf[2], buf[1]));
+        if(iSize < sizeof(InputStateReport))
+            return;
+
+        const InputStateReport *pReport = (const InputStateReport *) pData;
+        SetInputState(pReport->iInputState, iNow);
+
+        // Log(ssprintf("Input state: %x\n", pReport->iInputState));
         break;
+    }
 
     case 6:
+    {
         // A HID serial packet.
-        if(buf.size() < 3)
+        if(iSize < 3)
             return;
 
-        int cmd = buf[1];
-
-#define PACKET_FLAG_START_OF_COMMAND      0x04
-#define PACKET_FLAG_END_OF_COMMAND        0x01
-#define PACKET_FLAG_HOST_CMD_FINISHED     0x02
-#define PACKET_FLAG_DEVICE_INFO           0x80
-
-        int bytes = buf[2];
-        if(3 + bytes > buf.size())
+        const SerialReport *pReport = (const SerialReport *) pData;
+        int cmd = pReport->iFlags;
+        int bytes = pReport->iSize;
+        if(3 + bytes > iSize || bytes > sizeof(pReport->data))
         {
             Log("Communication error: oversized packet (ignored)");
             return;
         }
 
-        string sPacket( buf.begin()+3, buf.begin()+3+bytes );
-
         if(cmd & PACKET_FLAG_DEVICE_INFO)
         {
             // This is a response to RequestDeviceInfo.  Since any application can send this,
@@ -178,23 +354,21 @@ void SMX::SMXDeviceConnection::HandleUsbPacket(const string &buf)
 
             // The packet contains data_info_packet.  The packet is actually one byte smaller
             // due to a padding byte added (it contains 23 bytes of data but the struct is
-            // 24 bytes).  Resize to be sure.
-            sPacket.resize(sizeof(data_info_packet));
+            // 24 bytes).  Copy it into a zeroed struct to be sure.
+            data_info_packet packet;
+            memset(&packet, 0, sizeof(packet));
+            memcpy(&packet, pReport->data, min(bytes, (int) sizeof(packet)));
 
             // Convert the info packet from the wire protocol to our friendlier API.
-            const data_info_packet *packet = (data_info_packet *) sPacket.data();
-            m_DeviceInfo.m_bP2 = packet->player == '1';
-            m_DeviceInfo.m_iFirmwareVersion = packet->firmware_version;
+            m_DeviceInfo.m_bP2 = packet.player == '1';
+            m_DeviceInfo.m_iFirmwareVersion = packet.firmware_version;
 
             // The serial is binary in this packet.  Hex format it, which is the same thing
             // we'll get if we read the USB serial number (eg. HidD_GetSerialNumberString).
-            string sHexSerial = BinaryToHex(packet->serial, 16);
+            string sHexSerial = BinaryToHex(packet.serial, 16);
             memcpy(m_DeviceInfo.m_Serial, sHexSerial.c_str(), 33);
 
-            if(m_pCurrentCommand->m_pComplete)
-                m_pCurrentCommand->m_pComplete();
-            m_pCurrentCommand = nullptr;
-
+            CompleteCurrentCommand();
             break;
         }
 
@@ -203,12 +377,14 @@ void SMX::SMXDeviceConnection::HandleUsbPacket(const string &buf)
         if(!m_bActive)
             break;
 
-        m_sCurrentReadBuffer.append(sPacket);
+        // This keeps its capacity when cleared, so this only allocates until the buffer has
+        // grown to fit the largest command.
+        m_sCurrentReadBuffer.append((const char *) pReport->data, bytes);
 
         if(cmd & PACKET_FLAG_END_OF_COMMAND)
         {
             if(!m_sCurrentReadBuffer.empty())
-                m_sReadBuffers.push_back(m_sCurrentReadBuffer);
+                PushReadBuffer();
             m_sCurrentReadBuffer.clear();
         }
 
@@ -216,101 +392,270 @@ void SMX::SMXDeviceConnection::HandleUsbPacket(const string &buf)
         {
             // This tells us that a command we wrote to the device has finished executing, and
             // it's safe to start writing another.
-            if(m_pCurrentCommand && m_pCurrentCommand->m_pComplete)
-                m_pCurrentCommand->m_pComplete();
-            m_pCurrentCommand = nullptr;
+            if(m_pCurrentCommand)
+                CompleteCurrentCommand();
         }
 
         break;
     }
+    }
+}
+
+// Move m_sCurrentReadBuffer into the queue of completed commands.  The buffers are swapped
+// rather than copied, so each buffer's memory is reused as it goes around the queue.
+void SMX::SMXDeviceConnection::PushReadBuffer()
+{
+    if(m_iReadBufferCount == MAX_READ_BUFFERS)
+    {
+        Log("Communication error: too many unread commands (ignored)");
+        return;
+    }
 
+    int iIndex = (m_iFirstReadBuffer + m_iReadBufferCount) % MAX_READ_BUFFERS;
+    swap(m_sReadBuffers[iIndex], m_sCurrentReadBuffer);
+    m_iReadBufferCount++;
 }
 
-void SMX::SMXDeviceConnection::BeginAsyncRead(wstring &error)
+void SMX::SMXDeviceConnection::CheckWrites(wstring &error)
 {
-    while(1)
+    if(m_pCurrentCommand)
+    {
+        // A command is in progress.  See if its writes have completed.
+        PendingCommand &command = *m_pCurrentCommand;
+        if(command.m_iPacketsWritten < command.m_Packets.size() && m_pTransport->WritesFinished(error))
+            command.m_iPacketsWritten = (int) command.m_Packets.size();
+
+        // Don't clear m_pCurrentCommand here.  It'll stay set until we get a PACKET_FLAG_HOST_CMD_FINISHED
+        // packet from the device, which tells us it's ready to receive another command.
+        return;
+    }
+
+    // Stop if we have nothing to do.
+    if(m_apPendingCommands.empty())
+        return;
+
+    int iNextCommand = GetNextCommandToSend();
+    shared_ptr<PendingCommand> pPendingCommand = m_apPendingCommands[iNextCommand];
+    pPendingCommand->m_fSentAt = GetMonotonicTime();
+    for(PendingCommandPacket &packet: pPendingCommand->m_Packets)
     {
-        // Our read buffer is 64 bytes.  The HID input packet is much smaller than that,
-        // but Windows pads packets to the maximum size of any HID report, and the HID
-        // serial packet is 64 bytes, so we'll get 64 bytes even for 3-byte input packets.
-        // If this didn't happen, we'd have to be smarter about pulling data out of the
-        // read buffer.
-        DWORD bytes;
-        memset(overlapped_read_buffer, sizeof(overlapped_read_buffer), 0);
-        if(!ReadFile(m_hDevice->value(), overlapped_read_buffer, sizeof(overlapped_read_buffer), &bytes, &overlapped_read))
+        // Log(ssprintf("Write: %s", BinaryToHex(packet.m_Data, sizeof(packet.m_Data)).c_str()));
+        if(m_pCaptureWriter)
         {
-            int windows_error = GetLastError();
-            if(windows_error != ERROR_IO_PENDING && windows_error != ERROR_IO_INCOMPLETE)
-                error = wstring(L"Error reading device: ") + GetErrorString(windows_error).c_str();
-            return;
+            m_pCaptureWriter->Write(m_iCaptureDevice, CaptureDirection_Write, GetTimestamp(), packet.m_Data, sizeof(packet.m_Data));
         }
 
-        // The async read finished synchronously.  This just means that there was already data waiting.
-        // Handle the result, and loop to try to start the next async read again.
-        HandleUsbPacket(string(overlapped_read_buffer, bytes));
+        m_pTransport->BeginWrite(packet.m_Data, error);
+        if(!error.empty())
+            return;
     }
+
+    // Remove this command and store it in m_pCurrentCommand, and we'll stop sending data until the command finishes.
+    m_pCurrentCommand = pPendingCommand;
+    m_apPendingCommands.erase(m_apPendingCommands.begin() + iNextCommand);
+
+    // A simulated device won't finish the command, so finish it now.  Device info requests
+    // are finished by the simulated response.
+    if(m_pTransport->IsSimulated() && !m_pCurrentCommand->m_bIsDeviceInfoCommand)
+        CompleteCurrentCommand();
 }
 
-void SMX::SMXDeviceConnection::CheckWrites(wstring &error)
+// Return the index in m_apPendingCommands of the command to send next.  There must be at
+// least one waiting.
+int SMX::SMXDeviceConnection::GetNextCommandToSend()
 {
-    if(m_pCurrentCommand && !m_pCurrentCommand->m_Packets.empty())
+    // Find the oldest command in each class.
+    int iOldestInClass[NUM_COMMAND_CLASSES];
+    bool bClassWaiting[NUM_COMMAND_CLASSES];
+    for(int iClass = 0; iClass < NUM_COMMAND_CLASSES; ++iClass)
     {
-        // A command is in progress.  See if any writes have completed.
-        while(!m_pCurrentCommand->m_Packets.empty())
-        {
-            shared_ptr<PendingCommandPacket> pFirstPacket = m_pCurrentCommand->m_Packets.front();
+        iOldestInClass[iClass] = -1;
+        bClassWaiting[iClass] = false;
+    }
+
+    for(int i = (int) m_apPendingCommands.size() - 1; i >= 0; --i)
+    {
+        CommandClass iClass = m_apPendingCommands[i]->m_iClass;
+        iOldestInClass[iClass] = i;
+        bClassWaiting[iClass] = true;
+    }
+
+    return iOldestInClass[ChooseClassToSend(bClassWaiting)];
+}
+
+// Decide which traffic class to send a command from.  bClassWaiting is true for each class
+// that has a command waiting, and at least one is true.
+SMX::CommandClass SMX::SMXDeviceConnection::ChooseClassToSend(const bool bClassWaiting[NUM_COMMAND_CLASSES])
+{
+    if(bClassWaiting[CommandClass_Control])
+        return CommandClass_Control;
+
+    if(!bClassWaiting[CommandClass_Lights])
+        return CommandClass_Diagnostics;
+    if(!bClassWaiting[CommandClass_Diagnostics])
+        return CommandClass_Lights;
+
+    // Both diagnostics and lights are waiting.  Send lights unless they've been using more
+    // than their share of the device recently.
+    DecayClassBusyTime();
+    double fLights = m_fClassBusyTime[CommandClass_Lights];
+    double fTotal = fLights + m_fClassBusyTime[CommandClass_Diagnostics];
+    if(fTotal > 0 && fLights / fTotal > MAX_LIGHTS_SHARE)
+        return CommandClass_Diagnostics;
+    return CommandClass_Lights;
+}
+
+// Bring m_fClassBusyTime up to date.
+void SMX::SMXDeviceConnection::DecayClassBusyTime()
+{
+    double fNow = GetMonotonicTime();
+    double fScale = pow(0.5, (fNow - m_fClassBusyTimeDecayedAt) / CLASS_BUSY_TIME_HALF_LIFE);
+    for(double &fBusyTime: m_fClassBusyTime)
+        fBusyTime *= fScale;
+    m_fClassBusyTimeDecayedAt = fNow;
+}
+
+// Get an unused command to fill in.  This reuses a released command if possible.
+shared_ptr<SMX::SMXDeviceConnection::PendingCommand> SMX::SMXDeviceConnection::AllocateCommand()
+{
+    // The transport copies packets as they're written, so released commands can be reused
+    // right away.
+    if(m_apFreeCommands.empty())
+        return make_shared<PendingCommand>();
+
+    shared_ptr<PendingCommand> pCommand = m_apFreeCommands.back();
+    m_apFreeCommands.pop_back();
+    return pCommand;
+}
+
+// Return a command to the free list, and clear pCommand.
+void SMX::SMXDeviceConnection::ReleaseCommand(shared_ptr<PendingCommand> &pCommand)
+{
+    pCommand->m_sCommand.clear();
+    pCommand->m_iPacketsWritten = 0;
+    pCommand->m_pComplete = nullptr;
+    pCommand->m_iClass = CommandClass_Control;
+    pCommand->m_fSentAt = 0;
+    pCommand->m_bIsDeviceInfoCommand = false;
+    m_apFreeCommands.push_back(pCommand);
+    pCommand.reset();
+}
+
+// The device has finished m_pCurrentCommand.  Call its completion callback and release it.
+void SMX::SMXDeviceConnection::CompleteCurrentCommand()
+{
+    // Clear m_pCurrentCommand before calling the callback, so if it sends another command
+    // it's not confused with this one.
+    shared_ptr<PendingCommand> pCommand = m_pCurrentCommand;
+    m_pCurrentCommand = nullptr;
+
+    // Charge the time the device spent on this command to its class.
+    DecayClassBusyTime();
+    double fRoundTrip = GetMonotonicTime() - pCommand->m_fSentAt;
+    m_fClassBusyTime[pCommand->m_iClass] += fRoundTrip;
+    g_Stats.m_CommandRoundTrip.AddSample(fRoundTrip);
+
+    if(pCommand->m_pComplete)
+        pCommand->m_pComplete();
+    ReleaseCommand(pCommand);
+}
 
-            DWORD bytes;
-            int iResult = GetOverlappedResult(m_hDevice->value(), &pFirstPacket->m_OverlappedWrite, &bytes, FALSE);
-            if(iResult == 0)
+// If cmd is redundant with a command that's already waiting to be sent, merge it and
+// return true.
+bool SMX::SMXDeviceConnection::CoalesceCommand(const string &cmd, function<void()> pComplete, CommandClass iClass)
+{
+    // A lights update is a command for the top half of the panels followed by one for the
+    // bottom half.  If a new update is starting, any lights updates that are still waiting
+    // are out of date, so discard them.  We always finish an update once we start it, so
+    // only discard a whole update: a bottom half whose top half has already been sent is
+    // kept.  Don't drop commands with callbacks, since someone is waiting for them.
+    if(iClass == CommandClass_Lights && !cmd.empty() && cmd[0] == '2')
+    {
+        for(int i = 0; i < m_apPendingCommands.size(); )
+        {
+            shared_ptr<PendingCommand> &pCommand = m_apPendingCommands[i];
+            if(pCommand->m_iClass != CommandClass_Lights || pCommand->m_sCommand[0] != '2' || pCommand->m_pComplete)
             {
-                int windows_error = GetLastError();
-                if(windows_error != ERROR_IO_PENDING && windows_error != ERROR_IO_INCOMPLETE)
-                    error = wstring(L"Error writing to device: ") + GetErrorString(windows_error).c_str();
-                return;
+                ++i;
+                continue;
             }
 
-            m_pCurrentCommand->m_Packets.pop_front();
-        }
-
+            // Find this update's bottom half, which is the next lights command.
+            int iBottomHalf = -1;
+            for(int j = i+1; j < m_apPendingCommands.size(); ++j)
+            {
+                if(m_apPendingCommands[j]->m_iClass != CommandClass_Lights)
+                    continue;
+                if(m_apPendingCommands[j]->m_sCommand[0] == '3')
+                    iBottomHalf = j;
+                break;
+            }
 
-        // Don't clear m_pCurrentCommand here.  It'll stay set until we get a PACKET_FLAG_HOST_CMD_FINISHED
-        // packet from the device, which tells us it's ready to receive another command.
-    }
+            if(iBottomHalf != -1 && m_apPendingCommands[iBottomHalf]->m_pComplete)
+            {
+                ++i;
+                continue;
+            }
 
-    // Don't send packets if there's a command in progress.
-    if(m_pCurrentCommand)
-        return;
+            // Erase the bottom half first, so i is still valid.
+            if(iBottomHalf != -1)
+            {
+                ReleaseCommand(m_apPendingCommands[iBottomHalf]);
+                m_apPendingCommands.erase(m_apPendingCommands.begin() + iBottomHalf);
+                g_Stats.m_iLightsCommandsCoalesced++;
+            }
 
-    // Stop if we have nothing to do.
-    if(m_aPendingCommands.empty())
-        return;
+            ReleaseCommand(m_apPendingCommands[i]);
+            m_apPendingCommands.erase(m_apPendingCommands.begin() + i);
+            g_Stats.m_iLightsCommandsCoalesced++;
+        }
 
-    // Send the next command.
-    shared_ptr<PendingCommand> pPendingCommand = m_aPendingCommands.front();
+        // The new command still needs to be queued.
+        return false;
+    }
 
-    for(shared_ptr<PendingCommandPacket> &pPacket: pPendingCommand->m_Packets)
+    // Reading the configuration twice in a row will return the same thing, so if the last
+    // command waiting in this class is also a "g", merge them.  CheckActive and FactoryReset
+    // both end with a "g", so this happens when they're called back to back.
+    if(cmd == "g\n")
     {
-        // In theory the API allows this to return success if the write completed successfully without needing to
-        // be async, like reads can.  However, this can't really happen (the write always needs to go to the device
-        // first, unlike reads which might already be buffered), and there's no way to test it if we implement that,
-        // so this assumes all writes are async.
-        DWORD unused;
-        // Log(ssprintf("Write: %s", BinaryToHex(pPacket->sData).c_str()));
-        if(!WriteFile(m_hDevice->value(), pPacket->sData.data(), pPacket->sData.size(), &unused, &pPacket->m_OverlappedWrite))
+        for(int i = (int) m_apPendingCommands.size() - 1; i >= 0; --i)
         {
-            int windows_error = GetLastError();
-            if(windows_error != ERROR_IO_PENDING && windows_error != ERROR_IO_INCOMPLETE)
+            shared_ptr<PendingCommand> &pCommand = m_apPendingCommands[i];
+            if(pCommand->m_iClass != iClass)
+                continue;
+
+            if(pCommand->m_sCommand != cmd)
+                return false;
+
+            // Call both callbacks when the merged command completes.
+            if(pComplete)
             {
-                error = wstring(L"Error writing to device: ") + GetErrorString(windows_error).c_str();
-                return;
+                function<void()> pPreviousComplete = pCommand->m_pComplete;
+                if(pPreviousComplete)
+                {
+                    pCommand->m_pComplete = [pPreviousComplete, pComplete] {
+                        pPreviousComplete();
+                        pComplete();
+                    };
+                }
+                else
+                    pCommand->m_pComplete = pComplete;
             }
+
+            return true;
         }
     }
 
-    // Remove this command and store it in m_pCurrentCommand, and we'll stop sending data until the command finishes.
-    m_pCurrentCommand = pPendingCommand;
-    m_aPendingCommands.pop_front();
+    return false;
+}
+
+int SMX::SMXDeviceConnection::GetMaxCommandQueueDepth(bool bReset)
+{
+    int iMaxDepth = m_iMaxCommandQueueDepth;
+    if(bReset)
+        m_iMaxCommandQueueDepth = (int) m_apPendingCommands.size();
+    return iMaxDepth;
 }
 
 // Request device info.  This is the same as sending an 'i' command, but we can send it safely
@@ -318,38 +663,41 @@ void SMX::SMXDeviceConnection::CheckWrites(wstring &error)
 // enumeration.
 void SMX::SMXDeviceConnection::RequestDeviceInfo(function<void()> pComplete)
 {
-    shared_ptr<PendingCommand> pPendingCommand = make_shared<PendingCommand>();
+    shared_ptr<PendingCommand> pPendingCommand = AllocateCommand();
     pPendingCommand->m_pComplete = pComplete;
     pPendingCommand->m_bIsDeviceInfoCommand = true;
 
-    shared_ptr<PendingCommandPacket> pCommandPacket = make_shared<PendingCommandPacket>();
+    pPendingCommand->m_Packets.resize(1);
+    PendingCommandPacket &packet = pPendingCommand->m_Packets[0];
+    memset(packet.m_Data, 0, sizeof(packet.m_Data));
+    packet.m_Data[0] = 5; // report ID
+    packet.m_Data[1] = PACKET_FLAG_DEVICE_INFO; // flags
+    packet.m_Data[2] = 0; // bytes in packet
 
-    string sPacket({
-        5, // report ID
-        (char) (uint8_t) PACKET_FLAG_DEVICE_INFO, // flags
-        (char) 0, // bytes in packet
-    });
-    sPacket.resize(64, 0);
-    pCommandPacket->sData = sPacket;
-
-    pPendingCommand->m_Packets.push_back(pCommandPacket);
-
-    m_aPendingCommands.push_back(pPendingCommand);
+    m_apPendingCommands.push_back(pPendingCommand);
+    m_iMaxCommandQueueDepth = max(m_iMaxCommandQueueDepth, (int) m_apPendingCommands.size());
 }
 
-void SMX::SMXDeviceConnection::SendCommand(const string &cmd, function<void()> pComplete)
+void SMX::SMXDeviceConnection::SendCommand(const string &cmd, function<void()> pComplete, CommandClass iClass)
 {
-    shared_ptr<PendingCommand> pPendingCommand = make_shared<PendingCommand>();
+    if(CoalesceCommand(cmd, pComplete, iClass))
+        return;
+
+    shared_ptr<PendingCommand> pPendingCommand = AllocateCommand();
+    pPendingCommand->m_sCommand = cmd;
     pPendingCommand->m_pComplete = pComplete;
+    pPendingCommand->m_iClass = iClass;
 
     // Send the command in packets.  We allow sending zero-length packets here
     // for testing purposes.
-    int i = 0;
-    do {
-        shared_ptr<PendingCommandPacket> pCommandPacket = make_shared<PendingCommandPacket>();
+    int iPackets = max(1, int(cmd.size() + 60) / 61);
+    pPendingCommand->m_Packets.resize(iPackets);
 
+    int i = 0;
+    for(PendingCommandPacket &packet: pPendingCommand->m_Packets)
+    {
         int iFlags = 0;
-        int iPacketSize = min(cmd.size() - i, 61);
+        int iPacketSize = min((int) cmd.size() - i, 61);
 
         bool bFirstPacket = (i == 0);
         if(bFirstPacket)
@@ -359,21 +707,15 @@ void SMX::SMXDeviceConnection::SendCommand(const string &cmd, function<void()> p
         if(bLastPacket)
             iFlags |= PACKET_FLAG_END_OF_COMMAND;
 
-        string sPacket({
-            5, // report ID
-            (char) iFlags,
-            (char) iPacketSize, // bytes in packet
-        });
-
-        sPacket.append(cmd.begin() + i, cmd.begin() + i + iPacketSize);
-        sPacket.resize(64, 0);
-        pCommandPacket->sData = sPacket;
-
-        pPendingCommand->m_Packets.push_back(pCommandPacket);
+        memset(packet.m_Data, 0, sizeof(packet.m_Data));
+        packet.m_Data[0] = 5; // report ID
+        packet.m_Data[1] = (uint8_t) iFlags;
+        packet.m_Data[2] = (uint8_t) iPacketSize; // bytes in packet
+        memcpy(packet.m_Data + 3, cmd.data() + i, iPacketSize);
 
         i += iPacketSize;
     }
-    while(i < cmd.size());
 
-    m_aPendingCommands.push_back(pPendingCommand);
+    m_apPendingCommands.push_back(pPendingCommand);
+    m_iMaxCommandQueueDepth = max(m_iMaxCommandQueueDepth, (int) m_apPendingCommands.size());
 }
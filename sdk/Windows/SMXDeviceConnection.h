@@ -1,7 +1,6 @@
 #ifndef SMXDevice_H
 #define SMXDevice_H
 
-#include <windows.h>
 #include <vector>
 #include <memory>
 #include <string>
@@ -10,9 +9,17 @@
 using namespace std;
 
 #include "Helpers.h"
+#include "../SMX.h"
+#include "SMXCapture.h"
+#include "SMXTransport.h"
 
 namespace SMX
 {
+class SMXIOPort;
+
+// Input changes for one pad slot.  These are owned by SMXManager and keyed by slot, so each
+// slot has a single reader even while devices are moving between slots.
+typedef SPSCQueue<SMXInputEvent, 256> InputEventQueue;
 
 struct SMXDeviceInfo
 {
@@ -26,7 +33,30 @@ struct SMXDeviceInfo
     uint16_t m_iFirmwareVersion;
 };
 
-// Low-level SMX device handling.
+// Commands are sent to the device one at a time, and each is put in a traffic class that
+// decides which is sent next when more than one is waiting.  Within a class, commands are
+// sent in the order they were queued.
+enum CommandClass
+{
+    // Device info, configuration and other commands that change the device's state.  These
+    // are rare, and are always sent first.
+    CommandClass_Control,
+
+    // Sensor test mode requests.  These share the device with lights.
+    CommandClass_Diagnostics,
+
+    // Lights updates.  When diagnostics are also waiting, lights are limited to
+    // MAX_LIGHTS_SHARE of the time the device spends on commands, so a backlog of lights
+    // can't hold up sensor test data, and constant sensor test requests can't stop lights
+    // from updating.
+    CommandClass_Lights,
+
+    NUM_COMMAND_CLASSES
+};
+
+// Low-level SMX device handling.  This implements the device's protocol: commands are split
+// into packets, PACKET_FLAG_* tracks their progress, and device info is requested when we
+// connect.  Moving reports to and from the device is left to an SMXTransport.
 class SMXDeviceConnection
 {
 public:
@@ -34,13 +64,33 @@ public:
     SMXDeviceConnection(shared_ptr<SMXDeviceConnection> &pSelf);
     ~SMXDeviceConnection();
 
-    bool Open(shared_ptr<AutoCloseHandle> DeviceHandle, wstring &error);
+    // Open a HID device.  Transports that do I/O on their own threads wake the I/O thread
+    // through pIOPort.
+    bool Open(shared_ptr<AutoCloseHandle> DeviceHandle, shared_ptr<SMXIOPort> pIOPort, wstring &error);
+
+    // Start talking to a device through pTransport.  DeviceHandle identifies the device, and
+    // is returned by GetDeviceHandle.
+    void OpenTransport(shared_ptr<AutoCloseHandle> DeviceHandle, shared_ptr<SMXTransport> pTransport);
+
+    // Open a device from a capture file instead of a real device.  Reports from iDevice in
+    // the capture are read in place of reports from a device, and nothing is written.
+    // GetDeviceHandle returns a placeholder handle, so callers can tell replay devices
+    // apart like real ones.  Once every report has been replayed, Update returns an error
+    // as if the device was disconnected.
+    bool OpenReplay(shared_ptr<SMXReplay> pReplay, int iDevice, wstring &error);
+
+    // Capture every report we read and every packet we write to pWriter.  This must be
+    // called after opening the device.
+    void SetCaptureWriter(shared_ptr<SMXCaptureWriter> pWriter);
 
     void Close();
     
     // Get the device handle opened by Open(), or NULL if we're not open.
     shared_ptr<AutoCloseHandle> GetDeviceHandle() const { return m_hDevice; }
 
+    // Return true if pCompletion is from SMXIOPort::Wait for one of our reads or writes.
+    bool IsCompletionForConnection(const void *pCompletion) const;
+
     void Update(wstring &sError);
 
     // Devices are inactive by default, and will just read device info and then idle.  We'll
@@ -55,64 +105,137 @@ public:
     SMXDeviceInfo GetDeviceInfo() const { return m_DeviceInfo; }
 
     // Read from the read buffer.  This only returns data that we've already read, so there aren't
-    // any errors to report here.
+    // any errors to report here.  out's previous buffer is recycled, so callers should reuse the
+    // same string to avoid allocating.
     bool ReadPacket(string &out);
 
     // Send a command.  This must be a single complete command: partial writes and multiple
     // commands in a call aren't allowed.
-    void SendCommand(const string &cmd, function<void()> pComplete=nullptr);
+    //
+    // Redundant commands that haven't been sent yet are coalesced.  A lights command for the
+    // top half of the panels replaces any lights commands that are still waiting, and a "g"
+    // command queued directly after another "g" in the same class is merged into it.  If
+    // commands are merged, each of their completion callbacks are still called.
+    void SendCommand(const string &cmd, function<void()> pComplete=nullptr, CommandClass iClass=CommandClass_Control);
 
-    uint16_t GetInputState() const { return m_iInputState; }
+    // This can be called from any thread without locking.
+    uint16_t GetInputState() const { return m_iInputState.load(memory_order_relaxed); }
+
+    // Return the GetTimestamp time the input state last changed.  This is only
+    // used by the I/O thread.
+    int64_t GetInputTimestamp() const { return m_iInputTimestamp; }
+
+    // Return the number of commands waiting to be sent, and the most that have been waiting
+    // at once since the last reset.
+    int GetCommandQueueDepth() const { return (int) m_apPendingCommands.size(); }
+    int GetMaxCommandQueueDepth(bool bReset);
+
+    // Set the queue input changes are added to.  This is only called from the I/O thread.
+    void SetInputEventQueue(InputEventQueue *pInputEvents) { m_pInputEvents = pInputEvents; }
 
 private:
-    void RequestDeviceInfo(function<void()> pComplete = nullptr);
+    struct PendingCommand;
 
+    void RequestDeviceInfo(function<void()> pComplete = nullptr);
+    shared_ptr<PendingCommand> AllocateCommand();
+    void ReleaseCommand(shared_ptr<PendingCommand> &pCommand);
+    void CompleteCurrentCommand();
+    bool CoalesceCommand(const string &cmd, function<void()> pComplete, CommandClass iClass);
+    int GetNextCommandToSend();
+    CommandClass ChooseClassToSend(const bool bClassWaiting[NUM_COMMAND_CLASSES]);
+    void DecayClassBusyTime();
+
+    void BeginSession();
     void CheckReads(wstring &error);
-    void BeginAsyncRead(wstring &error);
+    bool ShouldHandleSimulatedReport(uint8_t *pData, int iSize);
     void CheckWrites(wstring &error);
-    void HandleUsbPacket(const string &buf);
+    void HandleUsbPacket(const uint8_t *pData, int iSize);
+    void PushReadBuffer();
+    void SetInputState(uint16_t iInputState, int64_t iTimestamp);
 
     weak_ptr<SMXDeviceConnection> m_pSelf;
     shared_ptr<AutoCloseHandle> m_hDevice;
+    shared_ptr<SMXTransport> m_pTransport;
+
+    // If we're capturing, the capture file and our device ID in it.
+    shared_ptr<SMXCaptureWriter> m_pCaptureWriter;
+    int m_iCaptureDevice = -1;
 
     bool m_bActive = false;
 
     // After we open a device, we request basic info.  Once we get it, this is set to true.
     bool m_bGotInfo = false;
     
-    list<string> m_sReadBuffers;
+    // Completed commands received from the device, waiting to be read by ReadPacket.  This
+    // is a fixed ring, and the strings keep their capacity as they're reused.  We only have
+    // one command in flight at a time, so this is only ever lightly used.
+    static const int MAX_READ_BUFFERS = 16;
+    string m_sReadBuffers[MAX_READ_BUFFERS];
+    int m_iFirstReadBuffer = 0;
+    int m_iReadBufferCount = 0;
+
+    // The command currently being received.
     string m_sCurrentReadBuffer;
 
     struct PendingCommandPacket {
         PendingCommandPacket();
 
-        string sData;
-        OVERLAPPED m_OverlappedWrite;
+        uint8_t m_Data[SMXTransport::REPORT_SIZE];
     };
 
     // Commands that are waiting to be sent:
     struct PendingCommand {
-        list<shared_ptr<PendingCommandPacket>> m_Packets;
+        // The command, and the HID packets it's sent in.
+        string m_sCommand;
+        vector<PendingCommandPacket> m_Packets;
 
-        // This is only called if m_bWaitForResponse if true.  Otherwise, we send the command
-        // and forget about it.
+        // The number of packets in m_Packets whose writes have completed.  This is only updated
+        // once they've all completed.
+        int m_iPacketsWritten = 0;
+
+        // This is called when the device tells us the command has finished.
         function<void()> m_pComplete;
 
+        CommandClass m_iClass = CommandClass_Control;
+
+        // When we started writing this command.
+        double m_fSentAt = 0;
+
         // If true, once we send this command we won't send any other commands until we get
         // a response.
         bool m_bIsDeviceInfoCommand = false;
     };
-    list<shared_ptr<PendingCommand>> m_aPendingCommands;
+    vector<shared_ptr<PendingCommand>> m_apPendingCommands;
+    int m_iMaxCommandQueueDepth = 0;
 
-    // If set, we've sent a command out of m_aPendingCommands and we're waiting for a response.  We
+    // Commands that aren't in use, which are reused by AllocateCommand.  Their buffers keep
+    // their capacity, so once we've sent one of each kind of command, queueing commands
+    // doesn't allocate.
+    vector<shared_ptr<PendingCommand>> m_apFreeCommands;
+
+    // If set, we've sent a command out of m_apPendingCommands and we're waiting for a response.  We
     // can't send another command until the previous one has completed.
     shared_ptr<PendingCommand> m_pCurrentCommand = nullptr;
 
-    // We always have a read in progress.
-    OVERLAPPED overlapped_read;
-    char overlapped_read_buffer[64];
-
-    uint16_t m_iInputState = 0;
+    // How long the device has recently spent on commands in each class, from when we start
+    // writing a command until it finishes.  This decays with a half-life of
+    // CLASS_BUSY_TIME_HALF_LIFE, so it reflects the last fraction of a second.
+    static const double MAX_LIGHTS_SHARE;
+    static const double CLASS_BUSY_TIME_HALF_LIFE;
+    double m_fClassBusyTime[NUM_COMMAND_CLASSES];
+    double m_fClassBusyTimeDecayedAt = 0;
+
+    // The most reports handled from a simulated device in each Update.
+    static const int MAX_SIMULATED_REPORTS_PER_UPDATE = 4;
+
+    // This is written by the I/O thread and read by the application without locking.
+    atomic<uint16_t> m_iInputState{0};
+    int64_t m_iInputTimestamp = 0;
+
+    // Every input state change we've received, with the time it arrived, is added to the
+    // queue for our slot.  This is filled by the I/O thread and drained by SMX_ReadInputEvents.
+    InputEventQueue *m_pInputEvents = nullptr;
+    bool m_bInputEventsOverflowed = false;
 
     // The current device info.  We retrieve this when we connect.
     SMXDeviceInfo m_DeviceInfo;
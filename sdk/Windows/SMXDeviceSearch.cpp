@@ -1,11 +1,14 @@
 #include "SMXDeviceSearch.h"
 
 #include "SMXDeviceConnection.h"
+#include "SMXStats.h"
 #include "Helpers.h"
 
 #include <string>
 #include <memory>
 #include <set>
+#include <vector>
+#include <wctype.h>
 using namespace std;
 using namespace SMX;
 
@@ -62,8 +65,43 @@ static set<wstring> GetAllHIDDevicePaths(wstring &error)
     return paths;
 }
 
-static shared_ptr<AutoCloseHandle> OpenUSBDevice(LPCTSTR DevicePath, wstring &error)
+// Our devices use the default Arduino Leonardo IDs.
+static const int SMX_VENDOR_ID = 0x2341;
+static const int SMX_PRODUCT_ID = 0x8037;
+
+// Read the USB vendor and product IDs from a device interface path, which look like
+// "\\?\hid#vid_2341&pid_8037&mi_02#...".  This lets us skip devices that obviously aren't
+// ours without opening them, which sends requests to the device.  Return false if the path
+// isn't in this format, in which case the device needs to be opened to check.
+static bool GetIDsFromDevicePath(wstring sPath, int &iVendorID, int &iProductID)
+{
+    for(wchar_t &c: sPath)
+        c = towlower(c);
+
+    size_t iVID = sPath.find(L"vid_");
+    size_t iPID = sPath.find(L"pid_");
+    if(iVID == wstring::npos || iPID == wstring::npos)
+        return false;
+
+    wchar_t *pEnd;
+    iVendorID = wcstol(sPath.c_str() + iVID + 4, &pEnd, 16);
+    if(pEnd != sPath.c_str() + iVID + 8)
+        return false;
+
+    iProductID = wcstol(sPath.c_str() + iPID + 4, &pEnd, 16);
+    if(pEnd != sPath.c_str() + iPID + 8)
+        return false;
+
+    return true;
+}
+
+// Open a device if it's one of ours.  If bNotOurDevice is set, the device was opened and
+// isn't ours, so there's no need to check it again.  Otherwise, if NULL is returned we
+// couldn't open the device.
+static shared_ptr<AutoCloseHandle> OpenUSBDevice(LPCTSTR DevicePath, bool &bNotOurDevice, wstring &error)
 {
+    bNotOurDevice = false;
+
     // Log(ssprintf("Opening device: %ls", DevicePath));
     HANDLE OpenDevice = CreateFile(
         DevicePath,
@@ -91,9 +129,10 @@ static shared_ptr<AutoCloseHandle> OpenUSBDevice(LPCTSTR DevicePath, wstring &er
         return nullptr;
     }
 
-    if(HidAttributes.VendorID != 0x2341 || HidAttributes.ProductID != 0x8037)
+    if(HidAttributes.VendorID != SMX_VENDOR_ID || HidAttributes.ProductID != SMX_PRODUCT_ID)
     {
         Log(ssprintf("Device %ls: not our device (ID %04x:%04x)", DevicePath, HidAttributes.VendorID, HidAttributes.ProductID));
+        bNotOurDevice = true;
         return nullptr;
     }
 
@@ -110,17 +149,75 @@ static shared_ptr<AutoCloseHandle> OpenUSBDevice(LPCTSTR DevicePath, wstring &er
     if(wstring(ProductName) != L"StepManiaX")
     {
         Log(ssprintf("Device %ls: not our device (%ls)", DevicePath, ProductName));
+        bNotOurDevice = true;
         return nullptr;
     }
 
     return result;
 }
 
+namespace {
+    // A device we need to open to see if it's ours, and the result.
+    struct DeviceProbe
+    {
+        wstring m_sPath;
+        shared_ptr<AutoCloseHandle> m_hDevice;
+        bool m_bNotOurDevice = false;
+        wstring m_sError;
+    };
+
+    void ProbeDevice(DeviceProbe &probe)
+    {
+        double fStartTime = GetMonotonicTime();
+        probe.m_hDevice = OpenUSBDevice(probe.m_sPath.c_str(), probe.m_bNotOurDevice, probe.m_sError);
+        g_Stats.m_DeviceProbeTime.AddSample(GetMonotonicTime() - fStartTime);
+    }
+
+    void CALLBACK ProbeDeviceCallback(PTP_CALLBACK_INSTANCE pInstance, void *pContext, PTP_WORK pWork)
+    {
+        ProbeDevice(*(DeviceProbe *) pContext);
+    }
+
+    // Probe devices.  Opening a device and reading its product string waits on requests to
+    // the device, so when there's more than one, probe them in parallel on the thread pool.
+    void ProbeDevices(vector<DeviceProbe> &aProbes)
+    {
+        if(aProbes.size() == 1)
+        {
+            ProbeDevice(aProbes[0]);
+            return;
+        }
+
+        vector<PTP_WORK> apWork;
+        for(DeviceProbe &probe: aProbes)
+        {
+            PTP_WORK pWork = CreateThreadpoolWork(ProbeDeviceCallback, &probe, NULL);
+            if(pWork == NULL)
+            {
+                ProbeDevice(probe);
+                continue;
+            }
+
+            SubmitThreadpoolWork(pWork);
+            apWork.push_back(pWork);
+        }
+
+        for(PTP_WORK pWork: apWork)
+        {
+            WaitForThreadpoolWorkCallbacks(pWork, false);
+            CloseThreadpoolWork(pWork);
+        }
+    }
+}
+
 vector<shared_ptr<AutoCloseHandle>> SMX::SMXDeviceSearch::GetDevices(wstring &error)
 {
     set<wstring> aDevicePaths = GetAllHIDDevicePaths(error);
+    double fNow = GetMonotonicTime();
 
-    // Remove any entries in m_Devices that are no longer in the list.
+    // Remove any entries that are no longer in the list.  Removing a device sends a notification
+    // that makes us rescan, so this happens as soon as it's unplugged, and a device plugged in
+    // later on the same path is checked again.
     for(wstring sPath: m_setLastDevicePaths)
     {
         if(aDevicePaths.find(sPath) != aDevicePaths.end())
@@ -128,23 +225,73 @@ vector<shared_ptr<AutoCloseHandle>> SMX::SMXDeviceSearch::GetDevices(wstring &er
 
         Log(ssprintf("Device removed: %ls", sPath.c_str()));
         m_Devices.erase(sPath);
+        m_setRejectedDevicePaths.erase(sPath);
+        m_RetryDevicePaths.erase(sPath);
     }
 
     // Check for new entries.
+    vector<DeviceProbe> aProbes;
     for(wstring sPath: aDevicePaths)
     {
-        // Only look at devices that weren't in the list last time.  OpenUSBDevice has
-        // to open the device and causes requests to be sent to it.
-        if(m_setLastDevicePaths.find(sPath) != m_setLastDevicePaths.end())
+        // Skip devices we've already checked.
+        if(m_setRejectedDevicePaths.find(sPath) != m_setRejectedDevicePaths.end())
+            continue;
+
+        // Retry devices we couldn't check once they're due.  Otherwise, only look at devices
+        // that weren't in the list last time.  OpenUSBDevice has to open the device and causes
+        // requests to be sent to it.
+        auto itRetry = m_RetryDevicePaths.find(sPath);
+        if(itRetry != m_RetryDevicePaths.end())
+        {
+            if(itRetry->second.m_fRetryAt > fNow)
+                continue;
+        }
+        else if(m_setLastDevicePaths.find(sPath) != m_setLastDevicePaths.end())
+            continue;
+
+        // If the path tells us the device's IDs, we can reject foreign devices before
+        // opening them.
+        int iVendorID, iProductID;
+        if(GetIDsFromDevicePath(sPath, iVendorID, iProductID) &&
+            (iVendorID != SMX_VENDOR_ID || iProductID != SMX_PRODUCT_ID))
+        {
+            m_setRejectedDevicePaths.insert(sPath);
+            continue;
+        }
+
+        aProbes.emplace_back();
+        aProbes.back().m_sPath = sPath;
+    }
+
+    if(!aProbes.empty())
+        ProbeDevices(aProbes);
+
+    for(DeviceProbe &probe: aProbes)
+    {
+        if(!probe.m_sError.empty())
+            error = probe.m_sError;
+
+        if(probe.m_bNotOurDevice)
+        {
+            m_setRejectedDevicePaths.insert(probe.m_sPath);
+            m_RetryDevicePaths.erase(probe.m_sPath);
             continue;
+        }
 
-        // This will return NULL if this isn't our device.
-        shared_ptr<AutoCloseHandle> hDevice = OpenUSBDevice(sPath.c_str(), error);
-        if(hDevice == nullptr)
+        // If m_hDevice is NULL, we couldn't tell whether this is our device.  Try again
+        // later, starting after half a second and doubling up to a minute.
+        if(probe.m_hDevice == nullptr)
+        {
+            RetryState &retry = m_RetryDevicePaths[probe.m_sPath];
+            double fDelay = min(60.0, 0.5 * (1 << min(retry.m_iFailures, 7)));
+            retry.m_iFailures++;
+            retry.m_fRetryAt = fNow + fDelay;
             continue;
+        }
 
-        Log(ssprintf("Device added: %ls", sPath.c_str()));
-        m_Devices[sPath] = hDevice;
+        Log(ssprintf("Device added: %ls", probe.m_sPath.c_str()));
+        m_Devices[probe.m_sPath] = probe.m_hDevice;
+        m_RetryDevicePaths.erase(probe.m_sPath);
     }
 
     m_setLastDevicePaths = aDevicePaths;
@@ -156,6 +303,17 @@ vector<shared_ptr<AutoCloseHandle>> SMX::SMXDeviceSearch::GetDevices(wstring &er
     return aDevices;
 }
 
+double SMX::SMXDeviceSearch::GetTimeUntilRetry() const
+{
+    if(m_RetryDevicePaths.empty())
+        return -1;
+
+    double fRetryAt = m_RetryDevicePaths.begin()->second.m_fRetryAt;
+    for(auto it: m_RetryDevicePaths)
+        fRetryAt = min(fRetryAt, it.second.m_fRetryAt);
+    return max(0.0, fRetryAt - GetMonotonicTime());
+}
+
 void SMX::SMXDeviceSearch::DeviceWasClosed(shared_ptr<AutoCloseHandle> pDevice)
 {
     map<wstring, shared_ptr<AutoCloseHandle>> aDevices;
@@ -24,8 +24,26 @@ public:
     // path.
     void DeviceWasClosed(shared_ptr<AutoCloseHandle> pDevice);
 
+    // Return how many seconds until a device we couldn't check should be retried, or -1 if
+    // there's nothing to retry.  GetDevices should be called again by then.
+    double GetTimeUntilRetry() const;
+
 private:
     set<wstring> m_setLastDevicePaths;
+
+    // Paths that we've determined aren't our devices, because their IDs or product string
+    // don't match.  We don't open these again until they're removed.
+    set<wstring> m_setRejectedDevicePaths;
+
+    // Paths we couldn't check, because opening the device or reading its attributes or product
+    // string failed.  These are retried, waiting longer after each failure, since some unrelated
+    // devices can never be opened.  They're forgotten when the device is removed.
+    struct RetryState
+    {
+        int m_iFailures = 0;
+        double m_fRetryAt = 0;
+    };
+    map<wstring, RetryState> m_RetryDevicePaths;
     map<wstring, shared_ptr<AutoCloseHandle>> m_Devices;
 };
 }
@@ -1,21 +1,44 @@
 #include "SMXDeviceSearchThreaded.h"
 #include "SMXDeviceSearch.h"
 #include "SMXDeviceConnection.h"
+#include "SMXStats.h"
 
-#include <windows.h>
+#include <algorithm>
 #include <memory>
 using namespace std;
 using namespace SMX;
 
-SMX::SMXDeviceSearchThreaded::SMXDeviceSearchThreaded()
+#ifdef _WIN32
+#include <Dbt.h>
+#include <hidsdi.h>
+#else
+#include <poll.h>
+#include <libudev.h>
+#endif
+
+namespace {
+    // How often to rescan when we're receiving device notifications.  This is just a
+    // fallback in case a notification is missed.
+    const int g_iNotificationPollIntervalMS = 5000;
+
+    // How often to rescan if we couldn't register for notifications.
+    const int g_iPollIntervalMS = 250;
+
+#ifdef _WIN32
+    // CM_Register_Notification is only available on Windows 8 and up, so we look it up
+    // at runtime to keep working on Windows 7.
+    typedef CONFIGRET (WINAPI *CM_Register_Notification_t)(PCM_NOTIFY_FILTER, PVOID, PCM_NOTIFY_CALLBACK, PHCMNOTIFICATION);
+    typedef CONFIGRET (WINAPI *CM_Unregister_Notification_t)(HCMNOTIFICATION);
+#endif
+}
+
+SMX::SMXDeviceSearchThreaded::SMXDeviceSearchThreaded(function<void()> pDevicesChanged)
 {
-    m_hEvent = make_shared<AutoCloseHandle>(CreateEvent(NULL, false, false, NULL));
+    m_pDevicesChanged = pDevicesChanged;
     m_pDeviceList = make_shared<SMXDeviceSearch>();
 
     // Start the thread.
-    DWORD id;
-    m_hThread = CreateThread(NULL, 0, ThreadMainStart, this, 0, &id);
-    SMX::SetThreadName(id, "SMXDeviceSearch");
+    m_Thread = thread(&SMXDeviceSearchThreaded::ThreadMain, this);
 }
 
 SMX::SMXDeviceSearchThreaded::~SMXDeviceSearchThreaded()
@@ -26,22 +49,19 @@ SMX::SMXDeviceSearchThreaded::~SMXDeviceSearchThreaded()
 
 void SMX::SMXDeviceSearchThreaded::Shutdown()
 {
-    if(m_hThread == INVALID_HANDLE_VALUE)
+    if(!m_Thread.joinable())
         return;
 
     // Tell the thread to shut down, and wait for it before returning.
     m_bShutdown = true;
-    SetEvent(m_hEvent->value());
-
-    WaitForSingleObject(m_hThread, INFINITE);
-    m_hThread = INVALID_HANDLE_VALUE;
+    m_Event.Set();
+    m_Thread.join();
 }
 
-DWORD WINAPI SMX::SMXDeviceSearchThreaded::ThreadMainStart(void *self_)
+void SMX::SMXDeviceSearchThreaded::ApplyThreadOptions()
 {
-    SMXDeviceSearchThreaded *self = (SMXDeviceSearchThreaded *) self_;
-    self->ThreadMain();
-    return 0;
+    // This also rescans for devices, which is harmless.
+    m_Event.Set();
 }
 
 void SMX::SMXDeviceSearchThreaded::UpdateDeviceList()
@@ -58,7 +78,9 @@ void SMX::SMXDeviceSearchThreaded::UpdateDeviceList()
 
     // Get the current device list.
     wstring sError;
+    double fStartTime = GetMonotonicTime();
     vector<shared_ptr<AutoCloseHandle>> apDevices = m_pDeviceList->GetDevices(sError);
+    g_Stats.m_DeviceSearchTime.AddSample(GetMonotonicTime() - fStartTime);
     if(!sError.empty())
     {
         Log(ssprintf("Error listing USB devices: %ls", sError.c_str()));
@@ -67,31 +89,269 @@ void SMX::SMXDeviceSearchThreaded::UpdateDeviceList()
 
     // Update the device list returned by GetDevices.
     m_Lock.Lock();
+    bool bChanged = apDevices != m_apDevices;
     m_apDevices = apDevices;
+    if(bChanged)
+        m_fDevicesChangedAt = GetMonotonicTime();
     m_Lock.Unlock();
+
+    // Tell the owner about the change now, instead of waiting for it to check.
+    if(bChanged && m_pDevicesChanged)
+        m_pDevicesChanged();
 }
 
 void SMX::SMXDeviceSearchThreaded::ThreadMain()
 {
+    SetThreadName("SMXDeviceSearch");
+    bool bHaveNotifications = RegisterForDeviceNotifications();
+    int iPollIntervalMS = bHaveNotifications? g_iNotificationPollIntervalMS:g_iPollIntervalMS;
+
     while(!m_bShutdown)
     {
+        m_ThreadOptions.Apply();
         UpdateDeviceList();
-        WaitForSingleObjectEx(m_hEvent->value(), 250, true);
+
+        // Wake up early if a device we couldn't check is due to be retried.
+        int iTimeoutMS = iPollIntervalMS;
+        double fRetryIn = m_pDeviceList->GetTimeUntilRetry();
+        if(fRetryIn >= 0)
+            iTimeoutMS = min(iTimeoutMS, int(fRetryIn * 1000) + 1);
+        WaitForChanges(iTimeoutMS);
+    }
+
+    UnregisterForDeviceNotifications();
+    m_ThreadOptions.Revert();
+}
+
+#ifdef _WIN32
+// Wait until a device notification is received, we're woken up, or the timeout expires.
+void SMX::SMXDeviceSearchThreaded::WaitForChanges(int iTimeoutMS)
+{
+    if(m_hNotificationWindow == NULL)
+    {
+        WaitForSingleObjectEx(m_Event.value(), iTimeoutMS, true);
+        return;
+    }
+
+    // We're using a notification window, so we need to wait for messages too.
+    HANDLE hEvent = m_Event.value();
+    MsgWaitForMultipleObjectsEx(1, &hEvent, iTimeoutMS, QS_ALLINPUT, MWMO_ALERTABLE | MWMO_INPUTAVAILABLE);
+
+    MSG msg;
+    while(PeekMessageW(&msg, NULL, 0, 0, PM_REMOVE))
+    {
+        TranslateMessage(&msg);
+        DispatchMessageW(&msg);
+    }
+}
+
+bool SMX::SMXDeviceSearchThreaded::RegisterForDeviceNotifications()
+{
+    GUID HidGuid;
+    HidD_GetHidGuid(&HidGuid);
+
+    HMODULE hCfgMgr = LoadLibraryExW(L"cfgmgr32.dll", NULL, LOAD_LIBRARY_SEARCH_SYSTEM32);
+    CM_Register_Notification_t pRegisterNotification = hCfgMgr?
+        (CM_Register_Notification_t) GetProcAddress(hCfgMgr, "CM_Register_Notification"): nullptr;
+    if(pRegisterNotification == nullptr)
+    {
+        // This is Windows 7.  Use a window to receive WM_DEVICECHANGE instead.
+        if(hCfgMgr)
+            FreeLibrary(hCfgMgr);
+        return RegisterForDeviceNotificationsWithWindow();
+    }
+
+    CM_NOTIFY_FILTER filter;
+    memset(&filter, 0, sizeof(filter));
+    filter.cbSize = sizeof(filter);
+    filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+    filter.u.DeviceInterface.ClassGuid = HidGuid;
+
+    // We keep cfgmgr32.dll loaded while the notification is registered.  It's unloaded
+    // in UnregisterForDeviceNotifications.
+    CONFIGRET ret = pRegisterNotification(&filter, this, DeviceNotificationCallback, &m_hNotification);
+    if(ret != CR_SUCCESS)
+    {
+        Log(ssprintf("CM_Register_Notification failed (%i), polling for devices", ret));
+        m_hNotification = NULL;
+        FreeLibrary(hCfgMgr);
+        return false;
+    }
+
+    return true;
+}
+
+void SMX::SMXDeviceSearchThreaded::UnregisterForDeviceNotifications()
+{
+    if(m_hNotification != NULL)
+    {
+        // This is only set if we found CM_Register_Notification, so cfgmgr32.dll is
+        // still loaded from RegisterForDeviceNotifications, and we release that reference
+        // below.
+        HMODULE hCfgMgr = GetModuleHandleW(L"cfgmgr32.dll");
+        CM_Unregister_Notification_t pUnregisterNotification =
+            (CM_Unregister_Notification_t) GetProcAddress(hCfgMgr, "CM_Unregister_Notification");
+
+        // This waits for any callbacks in progress to finish.
+        if(pUnregisterNotification)
+            pUnregisterNotification(m_hNotification);
+        m_hNotification = NULL;
+        FreeLibrary(hCfgMgr);
+    }
+
+    if(m_hDeviceNotify != NULL)
+    {
+        UnregisterDeviceNotification(m_hDeviceNotify);
+        m_hDeviceNotify = NULL;
+    }
+
+    if(m_hNotificationWindow != NULL)
+    {
+        DestroyWindow(m_hNotificationWindow);
+        m_hNotificationWindow = NULL;
     }
 }
 
+bool SMX::SMXDeviceSearchThreaded::RegisterForDeviceNotificationsWithWindow()
+{
+    static const wchar_t *szClassName = L"SMXDeviceSearch";
+
+    // Registering the class more than once is harmless, and fails if it already exists.
+    WNDCLASSEXW wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.cbSize = sizeof(wc);
+    wc.lpfnWndProc = DeviceNotificationWindowProc;
+    wc.hInstance = GetModuleHandleW(NULL);
+    wc.lpszClassName = szClassName;
+    RegisterClassExW(&wc);
+
+    m_hNotificationWindow = CreateWindowExW(0, szClassName, L"", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, wc.hInstance, NULL);
+    if(m_hNotificationWindow == NULL)
+    {
+        Log(ssprintf("Couldn't create device notification window, polling for devices: %ls", GetErrorString(GetLastError()).c_str()));
+        return false;
+    }
+    SetWindowLongPtrW(m_hNotificationWindow, GWLP_USERDATA, (LONG_PTR) this);
+
+    DEV_BROADCAST_DEVICEINTERFACE_W filter;
+    memset(&filter, 0, sizeof(filter));
+    filter.dbcc_size = sizeof(filter);
+    filter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+    HidD_GetHidGuid(&filter.dbcc_classguid);
+
+    m_hDeviceNotify = RegisterDeviceNotificationW(m_hNotificationWindow, &filter, DEVICE_NOTIFY_WINDOW_HANDLE);
+    if(m_hDeviceNotify == NULL)
+    {
+        Log(ssprintf("RegisterDeviceNotification failed, polling for devices: %ls", GetErrorString(GetLastError()).c_str()));
+        DestroyWindow(m_hNotificationWindow);
+        m_hNotificationWindow = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+// This is called from a system thread when a HID device is added or removed.
+DWORD CALLBACK SMX::SMXDeviceSearchThreaded::DeviceNotificationCallback(HCMNOTIFICATION hNotify, void *pContext,
+        CM_NOTIFY_ACTION action, PCM_NOTIFY_EVENT_DATA pEventData, DWORD iEventDataSize)
+{
+    SMXDeviceSearchThreaded *self = (SMXDeviceSearchThreaded *) pContext;
+
+    // Wake up the thread to rescan.  If we get a lot of notifications at once, they'll
+    // be collapsed into a single scan.
+    self->m_Event.Set();
+    return ERROR_SUCCESS;
+}
+
+LRESULT CALLBACK SMX::SMXDeviceSearchThreaded::DeviceNotificationWindowProc(HWND hWnd, UINT iMsg, WPARAM wParam, LPARAM lParam)
+{
+    if(iMsg == WM_DEVICECHANGE && (wParam == DBT_DEVICEARRIVAL || wParam == DBT_DEVICEREMOVECOMPLETE))
+    {
+        // This is called from our own thread while it's dispatching messages, and we'll scan
+        // as soon as it returns.  Set the event anyway so we never miss it.
+        SMXDeviceSearchThreaded *self = (SMXDeviceSearchThreaded *) GetWindowLongPtrW(hWnd, GWLP_USERDATA);
+        if(self)
+            self->m_Event.Set();
+        return TRUE;
+    }
+
+    return DefWindowProcW(hWnd, iMsg, wParam, lParam);
+}
+#else
+bool SMX::SMXDeviceSearchThreaded::RegisterForDeviceNotifications()
+{
+    m_pUdev = udev_new();
+    if(m_pUdev == nullptr)
+    {
+        Log("udev_new failed, polling for devices");
+        return false;
+    }
+
+    // Only listen for events after udev has handled them, so the device node's permissions
+    // are set by the time we rescan.
+    m_pMonitor = udev_monitor_new_from_netlink(m_pUdev, "udev");
+    if(m_pMonitor == nullptr ||
+        udev_monitor_filter_add_match_subsystem_devtype(m_pMonitor, "hidraw", nullptr) < 0 ||
+        udev_monitor_enable_receiving(m_pMonitor) < 0)
+    {
+        Log("Couldn't create a udev monitor, polling for devices");
+        UnregisterForDeviceNotifications();
+        return false;
+    }
+
+    return true;
+}
+
+void SMX::SMXDeviceSearchThreaded::UnregisterForDeviceNotifications()
+{
+    if(m_pMonitor != nullptr)
+        udev_monitor_unref(m_pMonitor);
+    m_pMonitor = nullptr;
+
+    if(m_pUdev != nullptr)
+        udev_unref(m_pUdev);
+    m_pUdev = nullptr;
+}
+
+// Wait until a device notification is received, we're woken up, or the timeout expires.
+void SMX::SMXDeviceSearchThreaded::WaitForChanges(int iTimeoutMS)
+{
+    pollfd fds[2];
+    fds[0] = { m_Event.value(), POLLIN, 0 };
+    fds[1] = { m_pMonitor? udev_monitor_get_fd(m_pMonitor):-1, POLLIN, 0 };
+    poll(fds, 2, iTimeoutMS);
+    m_Event.Reset();
+
+    // We rescan after any change, so we don't need the events themselves.  The monitor is
+    // nonblocking, so this stops when there are none left.
+    if(m_pMonitor != nullptr)
+    {
+        while(udev_device *pDevice = udev_monitor_receive_device(m_pMonitor))
+            udev_device_unref(pDevice);
+    }
+}
+#endif
+
 void SMX::SMXDeviceSearchThreaded::DeviceWasClosed(shared_ptr<AutoCloseHandle> pDevice)
 {
     // Add pDevice to the list of closed devices.  We'll call m_pDeviceList->DeviceWasClosed
     // on these from the scanning thread.
+    m_Lock.Lock();
     m_apClosedDevices.push_back(pDevice);
+    m_Lock.Unlock();
+
+    // Rescan right away, so if the device is still there we'll reopen it without waiting
+    // for the next poll.
+    m_Event.Set();
 }
 
-vector<shared_ptr<AutoCloseHandle>> SMX::SMXDeviceSearchThreaded::GetDevices()
+vector<shared_ptr<AutoCloseHandle>> SMX::SMXDeviceSearchThreaded::GetDevices(double *pfChangedAt)
 {
     // Lock to make a copy of the device list.
     m_Lock.Lock();
     vector<shared_ptr<AutoCloseHandle>> apResult = m_apDevices;
+    if(pfChangedAt)
+        *pfChangedAt = m_fDevicesChangedAt;
     m_Lock.Unlock();
     return apResult;
 }
@@ -2,11 +2,20 @@
 #define SMXDeviceSearchThreaded_h
 
 #include "Helpers.h"
-#include <windows.h>
+#include "SMXThreadOptions.h"
+#include <functional>
 #include <memory>
+#include <thread>
 #include <vector>
 using namespace std;
 
+#ifdef _WIN32
+#include <cfgmgr32.h>
+#else
+struct udev;
+struct udev_monitor;
+#endif
+
 namespace SMX {
 
 class SMXDeviceSearch;
@@ -14,32 +23,67 @@ class SMXDeviceSearch;
 // This is a wrapper around SMXDeviceSearch which performs USB scanning in a thread.
 // It's free on Win10, but takes a while on Windows 7 (about 8ms), so running it on
 // a separate thread prevents random timing errors when reading HID updates.
+//
+// We register for HID device interface notifications, and only scan when a device arrives
+// or is removed.  We still poll occasionally in case a notification is missed, and fall back
+// on polling frequently if notifications aren't available.  On Linux, notifications come from
+// a udev monitor for hidraw devices.
 class SMXDeviceSearchThreaded
 {
 public:
-    SMXDeviceSearchThreaded();
+    // pDevicesChanged is called from the search thread when the device list changes, so
+    // the owner can pick up new devices right away instead of polling for them.
+    SMXDeviceSearchThreaded(function<void()> pDevicesChanged);
     ~SMXDeviceSearchThreaded();
 
-    // The same interface as SMXDeviceSearch:
-    vector<shared_ptr<SMX::AutoCloseHandle>> GetDevices();
+    // The same interface as SMXDeviceSearch.  If pfChangedAt is set, it's set to the
+    // GetMonotonicTime time the list last changed.
+    vector<shared_ptr<SMX::AutoCloseHandle>> GetDevices(double *pfChangedAt=nullptr);
     void DeviceWasClosed(shared_ptr<SMX::AutoCloseHandle> pDevice);
 
     // Synchronously shut down the thread.
     void Shutdown();
 
+    // Wake the thread, so it applies options changed with SMX_SetThreadOptions.
+    void ApplyThreadOptions();
+
 private:
     void UpdateDeviceList();
 
-    static DWORD WINAPI ThreadMainStart(void *self_);
     void ThreadMain();
 
+    // Device change notifications.  These are registered from the thread.
+    bool RegisterForDeviceNotifications();
+    void UnregisterForDeviceNotifications();
+    void WaitForChanges(int iTimeoutMS);
+
+#ifdef _WIN32
+    bool RegisterForDeviceNotificationsWithWindow();
+    static DWORD CALLBACK DeviceNotificationCallback(HCMNOTIFICATION hNotify, void *pContext,
+        CM_NOTIFY_ACTION action, PCM_NOTIFY_EVENT_DATA pEventData, DWORD iEventDataSize);
+    static LRESULT CALLBACK DeviceNotificationWindowProc(HWND hWnd, UINT iMsg, WPARAM wParam, LPARAM lParam);
+
+    // If CM_Register_Notification is available (Windows 8 and up), this is our registration.
+    HCMNOTIFICATION m_hNotification = NULL;
+
+    // Otherwise, we receive WM_DEVICECHANGE with a message-only window.
+    HWND m_hNotificationWindow = NULL;
+    HDEVNOTIFY m_hDeviceNotify = NULL;
+#else
+    udev *m_pUdev = nullptr;
+    udev_monitor *m_pMonitor = nullptr;
+#endif
+
     SMX::Mutex m_Lock;
     shared_ptr<SMXDeviceSearch> m_pDeviceList;
-    shared_ptr<SMX::AutoCloseHandle> m_hEvent;
+    SMX::Event m_Event;
     vector<shared_ptr<SMX::AutoCloseHandle>> m_apDevices;
+    double m_fDevicesChangedAt = 0;
+    function<void()> m_pDevicesChanged;
     vector<shared_ptr<SMX::AutoCloseHandle>> m_apClosedDevices;
     bool m_bShutdown = false;
-    HANDLE m_hThread = INVALID_HANDLE_VALUE;
+    SMXThreadOptionsApplier m_ThreadOptions{SMXThread_DeviceSearch, THREAD_PRIORITY_NORMAL};
+    thread m_Thread;
 };
 }
 
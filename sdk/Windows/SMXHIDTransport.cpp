@@ -0,0 +1,209 @@
+#include "SMXHIDTransport.h"
+#include "Helpers.h"
+
+#include <hidsdi.h>
+using namespace std;
+using namespace SMX;
+
+shared_ptr<SMXHIDTransport> SMX::SMXHIDTransport::Create(shared_ptr<AutoCloseHandle> hDevice, wstring &sError)
+{
+    shared_ptr<SMXHIDTransport> pTransport = make_shared<SMXHIDTransport>(hDevice);
+
+    if(!HidD_SetNumInputBuffers(hDevice->value(), 512))
+        LogFormat("Error: HidD_SetNumInputBuffers: %ls", GetErrorString(GetLastError()));
+
+    // Start all of our async reads.
+    for(int i = 0; i < NUM_OVERLAPPED_READS && sError.empty(); ++i)
+        pTransport->BeginAsyncRead(i, sError);
+
+    return pTransport;
+}
+
+SMX::SMXHIDTransport::SMXHIDTransport(shared_ptr<AutoCloseHandle> hDevice):
+    m_hDevice(hDevice)
+{
+    memset(m_Reads, 0, sizeof(m_Reads));
+    m_Writes.reserve(8);
+}
+
+SMX::SMXHIDTransport::~SMXHIDTransport()
+{
+    Close();
+}
+
+void SMX::SMXHIDTransport::Close()
+{
+    if(m_hDevice == nullptr)
+        return;
+
+    CancelIo(m_hDevice->value());
+    WaitForCancelledIO();
+    m_hDevice.reset();
+}
+
+// After CancelIo, wait for our reads and writes to actually finish, since the driver may
+// still write to their OVERLAPPED and buffers until then.  Cancellation is normally
+// immediate, so this doesn't wait for long.
+void SMX::SMXHIDTransport::WaitForCancelledIO()
+{
+    double fTimeout = GetMonotonicTime() + 0.5;
+    while(GetMonotonicTime() < fTimeout)
+    {
+        bool bPending = false;
+        for(OverlappedRead &read: m_Reads)
+            bPending |= !HasOverlappedIoCompleted(&read.m_Overlapped);
+
+        for(unique_ptr<OverlappedWrite> &pWrite: m_Writes)
+            bPending |= pWrite->m_bInFlight && !HasOverlappedIoCompleted(&pWrite->m_Overlapped);
+
+        if(!bPending)
+            return;
+        Sleep(1);
+    }
+
+    Log("Timed out waiting for I/O to be cancelled");
+}
+
+bool SMX::SMXHIDTransport::PeekReport(const uint8_t *&pData, int &iSize, wstring &sError)
+{
+    if(m_hDevice == nullptr)
+        return false;
+
+    if(!m_sReadError.empty())
+    {
+        sError = m_sReadError;
+        return false;
+    }
+
+    OverlappedRead &read = m_Reads[m_iNextRead];
+
+    DWORD bytes;
+    int result = GetOverlappedResult(m_hDevice->value(), &read.m_Overlapped, &bytes, FALSE);
+    if(result == 0)
+    {
+        int windows_error = GetLastError();
+        if(windows_error != ERROR_IO_PENDING && windows_error != ERROR_IO_INCOMPLETE)
+            sError = wstring(L"Error reading device: ") + GetErrorString(windows_error).c_str();
+        return false;
+    }
+
+    pData = (const uint8_t *) read.m_Buffer;
+    iSize = bytes;
+    return true;
+}
+
+void SMX::SMXHIDTransport::PopReport()
+{
+    // Start the next read in this slot, which puts it at the back of the queue.
+    BeginAsyncRead(m_iNextRead, m_sReadError);
+    m_iNextRead = (m_iNextRead + 1) % NUM_OVERLAPPED_READS;
+}
+
+void SMX::SMXHIDTransport::BeginAsyncRead(int iRead, wstring &sError)
+{
+    OverlappedRead &read = m_Reads[iRead];
+
+    // Our read buffer is 64 bytes.  The HID input packet is much smaller than that,
+    // but Windows pads packets to the maximum size of any HID report, and the HID
+    // serial packet is 64 bytes, so we'll get 64 bytes even for 3-byte input packets.
+    // If this didn't happen, we'd have to be smarter about pulling data out of the
+    // read buffer.
+    DWORD bytes;
+    memset(&read.m_Overlapped, 0, sizeof(read.m_Overlapped));
+    memset(read.m_Buffer, 0, sizeof(read.m_Buffer));
+    if(!ReadFile(m_hDevice->value(), read.m_Buffer, sizeof(read.m_Buffer), &bytes, &read.m_Overlapped))
+    {
+        int windows_error = GetLastError();
+        if(windows_error != ERROR_IO_PENDING && windows_error != ERROR_IO_INCOMPLETE)
+            sError = wstring(L"Error reading device: ") + GetErrorString(windows_error).c_str();
+        return;
+    }
+
+    // The async read finished synchronously.  This just means that there was already data
+    // waiting.  The OVERLAPPED is still filled in, so we don't handle it here.  PeekReport will
+    // see that it's complete when it reaches it, which keeps reports in order when other reads
+    // are still in flight.
+}
+
+void SMX::SMXHIDTransport::BeginWrite(const uint8_t *pData, wstring &sError)
+{
+    // Find a write buffer that isn't in use.
+    OverlappedWrite *pWrite = nullptr;
+    for(unique_ptr<OverlappedWrite> &pSlot: m_Writes)
+    {
+        if(!pSlot->m_bInFlight)
+        {
+            pWrite = pSlot.get();
+            break;
+        }
+    }
+
+    if(pWrite == nullptr)
+    {
+        m_Writes.push_back(unique_ptr<OverlappedWrite>(new OverlappedWrite));
+        pWrite = m_Writes.back().get();
+    }
+
+    // In theory the API allows this to return success if the write completed successfully without needing to
+    // be async, like reads can.  However, this can't really happen (the write always needs to go to the device
+    // first, unlike reads which might already be buffered), and there's no way to test it if we implement that,
+    // so this assumes all writes are async.
+    DWORD unused;
+    memcpy(pWrite->m_Data, pData, REPORT_SIZE);
+    memset(&pWrite->m_Overlapped, 0, sizeof(pWrite->m_Overlapped));
+    pWrite->m_bInFlight = true;
+    if(!WriteFile(m_hDevice->value(), pWrite->m_Data, REPORT_SIZE, &unused, &pWrite->m_Overlapped))
+    {
+        int windows_error = GetLastError();
+        if(windows_error != ERROR_IO_PENDING && windows_error != ERROR_IO_INCOMPLETE)
+        {
+            pWrite->m_bInFlight = false;
+            sError = wstring(L"Error writing to device: ") + GetErrorString(windows_error).c_str();
+        }
+    }
+}
+
+bool SMX::SMXHIDTransport::WritesFinished(wstring &sError)
+{
+    bool bFinished = true;
+    for(unique_ptr<OverlappedWrite> &pWrite: m_Writes)
+    {
+        if(!pWrite->m_bInFlight)
+            continue;
+
+        DWORD bytes;
+        int iResult = GetOverlappedResult(m_hDevice->value(), &pWrite->m_Overlapped, &bytes, FALSE);
+        if(iResult == 0)
+        {
+            int windows_error = GetLastError();
+            if(windows_error == ERROR_IO_PENDING || windows_error == ERROR_IO_INCOMPLETE)
+            {
+                bFinished = false;
+                continue;
+            }
+
+            sError = wstring(L"Error writing to device: ") + GetErrorString(windows_error).c_str();
+        }
+
+        pWrite->m_bInFlight = false;
+    }
+
+    return bFinished;
+}
+
+bool SMX::SMXHIDTransport::IsCompletionForTransport(const void *pCompletion) const
+{
+    for(const OverlappedRead &read: m_Reads)
+    {
+        if(pCompletion == &read.m_Overlapped)
+            return true;
+    }
+
+    for(const unique_ptr<OverlappedWrite> &pWrite: m_Writes)
+    {
+        if(pCompletion == &pWrite->m_Overlapped)
+            return true;
+    }
+
+    return false;
+}
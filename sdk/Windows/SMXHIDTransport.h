@@ -0,0 +1,66 @@
+#ifndef SMXHIDTransport_h
+#define SMXHIDTransport_h
+
+#include <windows.h>
+#include <memory>
+#include <vector>
+using namespace std;
+
+#include "Helpers.h"
+#include "SMXTransport.h"
+
+namespace SMX
+{
+// A transport for a HID device opened with overlapped I/O.  The owner associates the handle
+// with the I/O thread's completion port, so finished reads and writes wake it up.
+class SMXHIDTransport: public SMXTransport
+{
+public:
+    // Start reading from hDevice.  If starting the reads fails, sError is set, and the
+    // transport is still returned so it can be closed.
+    static shared_ptr<SMXHIDTransport> Create(shared_ptr<AutoCloseHandle> hDevice, wstring &sError);
+    SMXHIDTransport(shared_ptr<AutoCloseHandle> hDevice);
+    ~SMXHIDTransport();
+
+    void Close() override;
+    bool PeekReport(const uint8_t *&pData, int &iSize, wstring &sError) override;
+    void PopReport() override;
+    void BeginWrite(const uint8_t *pData, wstring &sError) override;
+    bool WritesFinished(wstring &sError) override;
+    bool IsCompletionForTransport(const void *pCompletion) const override;
+
+private:
+    void BeginAsyncRead(int iRead, wstring &sError);
+    void WaitForCancelledIO();
+
+    shared_ptr<AutoCloseHandle> m_hDevice;
+
+    // We always have NUM_OVERLAPPED_READS reads in progress, each with its own buffer, so
+    // reports don't wait in the driver between one read completing and the next starting.
+    // Reads complete in the order they're issued, and m_iNextRead is the oldest one.
+    static const int NUM_OVERLAPPED_READS = 4;
+    struct OverlappedRead
+    {
+        OVERLAPPED m_Overlapped;
+        char m_Buffer[REPORT_SIZE];
+    };
+    OverlappedRead m_Reads[NUM_OVERLAPPED_READS];
+    int m_iNextRead = 0;
+
+    // If restarting a read in PopReport failed, the error is returned by the next PeekReport.
+    wstring m_sReadError;
+
+    // Each write has its own buffer, since the driver uses it until the write completes.
+    // These are reused once they're finished, so this only grows to the most packets that
+    // have been in flight at once.
+    struct OverlappedWrite
+    {
+        OVERLAPPED m_Overlapped;
+        uint8_t m_Data[REPORT_SIZE];
+        bool m_bInFlight = false;
+    };
+    vector<unique_ptr<OverlappedWrite>> m_Writes;
+};
+}
+
+#endif
@@ -1,76 +1,184 @@
 #include "SMXHelperThread.h"
+#include "SMXStats.h"
 
-#include <windows.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 using namespace SMX;
 
-SMX::SMXHelperThread::SMXHelperThread(const string &sThreadName)
+SMX::SMXHelperThread::SMXHelperThread(const string &sThreadName, function<void(int PadNumber, SMXUpdateCallbackReason reason)> pCallback, bool bStartThread):
+    m_pCallback(pCallback)
 {
-    m_hEvent = make_shared<AutoCloseHandle>(CreateEvent(NULL, false, false, NULL));
+    for(atomic<bool> &bUpdateQueued: m_bUpdateQueued)
+        bUpdateQueued.store(false, memory_order_relaxed);
+
+#ifdef _WIN32
+    // WaitOnAddress is only available on Windows 8 and up, so we look it up at runtime and
+    // use an event on Windows 7.
+    m_hSynchModule = LoadLibraryExW(L"api-ms-win-core-synch-l1-2-0.dll", NULL, LOAD_LIBRARY_SEARCH_SYSTEM32);
+    if(m_hSynchModule)
+    {
+        m_pWaitOnAddress = (decltype(m_pWaitOnAddress)) GetProcAddress(m_hSynchModule, "WaitOnAddress");
+        m_pWakeByAddressSingle = (decltype(m_pWakeByAddressSingle)) GetProcAddress(m_hSynchModule, "WakeByAddressSingle");
+        if(m_pWaitOnAddress == nullptr || m_pWakeByAddressSingle == nullptr)
+        {
+            m_pWaitOnAddress = nullptr;
+            m_pWakeByAddressSingle = nullptr;
+        }
+    }
+#endif
+
+    if(!bStartThread)
+        return;
 
     // Start the thread.
-    m_hThread = CreateThread(NULL, 0, ThreadMainStart, this, 0, &m_iThreadId);
-    SMX::SetThreadName(m_iThreadId, sThreadName);
+    m_Thread = thread(&SMXHelperThread::ThreadMain, this, sThreadName);
 }
 
 SMX::SMXHelperThread::~SMXHelperThread()
 {
+    Shutdown();
+#ifdef _WIN32
+    if(m_hSynchModule)
+        FreeLibrary(m_hSynchModule);
+#endif
 }
 
-void SMX::SMXHelperThread::SetHighPriority(bool bHighPriority)
+void SMX::SMXHelperThread::ApplyThreadOptions()
 {
-    SetThreadPriority( m_hThread, THREAD_PRIORITY_HIGHEST );
+    Wake();
 }
 
-DWORD WINAPI SMX::SMXHelperThread::ThreadMainStart(void *self_)
+void SMX::SMXHelperThread::ThreadMain(const string &sThreadName)
 {
-    SMXHelperThread *self = (SMXHelperThread *) self_;
-    self->ThreadMain();
-    return 0;
+    SetThreadName(sThreadName);
+    while(true)
+    {
+        m_ThreadOptions.Apply();
+
+        // Check for shutdown before running callbacks, so anything queued before Shutdown
+        // was called is still run.
+        bool bShutdown = m_bShutdown.load();
+
+        RunQueuedCallbacks();
+
+        if(bShutdown)
+            break;
+
+        WaitForCallbacks();
+    }
+
+    m_ThreadOptions.Revert();
 }
 
-void SMX::SMXHelperThread::ThreadMain()
+int SMX::SMXHelperThread::RunQueuedCallbacks()
 {
-    m_Lock.Lock();
-    while(true)
+    int iCount = 0;
+    Callback callback;
+    while(m_Callbacks.Pop(callback))
     {
-        vector<function<void()>> funcs;
-        swap(m_FunctionsToCall, funcs);
+        // Clear the queued flag before calling the callback, so any change after the
+        // callback reads the pad's state queues another update.
+        if(callback.m_Reason == SMXUpdateCallback_Updated)
+            m_bUpdateQueued[callback.m_iPad].store(false);
 
-        // If we're shutting down and have no more functions to call, stop.
-        if(funcs.empty() && m_bShutdown)
-            break;
+        if(callback.m_iInputTimestamp != 0)
+            g_Stats.m_InputLatency.AddSampleTicks(GetTimestamp() - callback.m_iInputTimestamp);
 
-        // Unlock while we call the queued functions.
-        m_Lock.Unlock();
-        for(auto &func: funcs)
-            func();
+        m_pCallback(callback.m_iPad, callback.m_Reason);
+        iCount++;
+    }
+    return iCount;
+}
+
+// Sleep until a callback is queued, thread options change or we're shutting down.
+void SMX::SMXHelperThread::WaitForCallbacks()
+{
+    // Tell producers we're going to sleep, then check again in case something was queued
+    // before they could see it.
+    m_iSleeping.store(1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if(!m_Callbacks.Empty() || m_bShutdown.load() || m_ThreadOptions.HasChanged())
+    {
+        m_iSleeping.store(0);
+        return;
+    }
 
-        WaitForSingleObjectEx(m_hEvent->value(), 250, true);
-        m_Lock.Lock();
+#ifdef _WIN32
+    if(m_pWaitOnAddress)
+    {
+        uint32_t iSleeping = 1;
+        while(m_iSleeping.load() == 1)
+            m_pWaitOnAddress(&m_iSleeping, &iSleeping, sizeof(iSleeping), INFINITE);
+    }
+    else
+    {
+        // The event may have been left set by a wakeup that raced with the check above.
+        // That just wakes us once for nothing.
+        m_Event.Wait();
     }
-    m_Lock.Unlock();
+#else
+    // This returns right away if m_iSleeping is no longer 1.
+    while(m_iSleeping.load() == 1)
+        syscall(SYS_futex, &m_iSleeping, FUTEX_WAIT_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+}
+
+// Wake up the thread if it's sleeping.
+void SMX::SMXHelperThread::Wake()
+{
+    if(m_iSleeping.exchange(0) != 1)
+        return;
+
+#ifdef _WIN32
+    if(m_pWakeByAddressSingle)
+        m_pWakeByAddressSingle(&m_iSleeping);
+    else
+        m_Event.Set();
+#else
+    syscall(SYS_futex, &m_iSleeping, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
 }
 
 void SMX::SMXHelperThread::Shutdown()
 {
-    if(m_hThread == INVALID_HANDLE_VALUE)
+    if(!m_Thread.joinable())
         return;
 
     // Tell the thread to shut down, and wait for it before returning.
     m_bShutdown = true;
-    SetEvent(m_hEvent->value());
-
-    WaitForSingleObject(m_hThread, INFINITE);
-    m_hThread = INVALID_HANDLE_VALUE;
+    Wake();
+    m_Thread.join();
 }
 
-void SMX::SMXHelperThread::RunInThread(function<void()> func)
+void SMX::SMXHelperThread::QueueCallback(int iPad, SMXUpdateCallbackReason reason, int64_t iInputTimestamp)
 {
-    m_Lock.AssertNotLockedByCurrentThread();
+    if(iPad < 0 || iPad >= SMX_MAX_CABINETS*2)
+        return;
+
+    // If an update is already waiting for this pad, the user will see this change when
+    // it's called.
+    bool bUpdate = reason == SMXUpdateCallback_Updated;
+    if(bUpdate && m_bUpdateQueued[iPad].exchange(true))
+        return;
+
+    Callback callback;
+    callback.m_iPad = iPad;
+    callback.m_Reason = reason;
+    callback.m_iInputTimestamp = iInputTimestamp;
+    if(!m_Callbacks.Push(callback))
+    {
+        if(bUpdate)
+            m_bUpdateQueued[iPad].store(false);
+
+        // Only log once each time the queue fills.
+        if(!m_bCallbacksOverflowed.exchange(true))
+            Log("User callback queue full (callbacks discarded)");
+        return;
+    }
+    m_bCallbacksOverflowed.store(false);
 
-    // Add func to the list, and poke the event to wake up the thread if needed.
-    m_Lock.Lock();
-    m_FunctionsToCall.push_back(func);
-    SetEvent(m_hEvent->value());
-    m_Lock.Unlock();
+    Wake();
 }
@@ -2,44 +2,88 @@
 #define SMXHelperThread_h
 
 #include "Helpers.h"
+#include "SMXThreadOptions.h"
+#include "../SMX.h"
 
 #include <functional>
-#include <vector>
 #include <memory>
+#include <thread>
 using namespace std;
 
 namespace SMX
 {
+// This calls the user's update callback asynchronously from its own thread.  Callbacks are
+// queued without locking or allocating, so queueing them from the I/O thread is cheap.
+//
+// If bStartThread is false, no thread is started, and the owner runs queued callbacks itself
+// by calling RunQueuedCallbacks.
 class SMXHelperThread
 {
 public:
-    SMXHelperThread(const string &sThreadName);
+    SMXHelperThread(const string &sThreadName, function<void(int PadNumber, SMXUpdateCallbackReason reason)> pCallback, bool bStartThread=true);
     ~SMXHelperThread();
 
-    // Raise the priority of the helper thread.
-    void SetHighPriority(bool bHighPriority);
+    // Wake the thread, so it applies options changed with SMX_SetThreadOptions.
+    void ApplyThreadOptions();
 
-    // Shut down the thread.  Any calls queued by RunInThread will complete before
+    // Shut down the thread.  Any callbacks queued by QueueCallback will complete before
     // this returns.
     void Shutdown();
 
-    // Call func asynchronously from the helper thread.
-    void RunInThread(function<void()> func);
+    // Call the callback asynchronously from the helper thread.  This can be called from
+    // any thread.
+    //
+    // SMXUpdateCallback_Updated only tells the user to check the pad's state, so if one is
+    // already waiting for a pad, another isn't queued.
+    //
+    // If iInputTimestamp is set, it's the GetTimestamp time of the input report that
+    // caused the callback, and the time until the callback is made is recorded in g_Stats.
+    void QueueCallback(int iPad, SMXUpdateCallbackReason reason, int64_t iInputTimestamp=0);
 
-    // Return the Win32 thread ID, or INVALID_HANDLE_VALUE if the thread has been
-    // shut down.
-    DWORD GetThreadId() const { return m_iThreadId; }
+    // If the thread wasn't started, run any queued callbacks and return the number run.  Only
+    // one thread can call this.
+    int RunQueuedCallbacks();
+
+    // Return the thread's ID, or thread::id() if it isn't running.
+    thread::id GetThreadId() const { return m_Thread.get_id(); }
 
 private:
-    static DWORD WINAPI ThreadMainStart(void *self_);
-    void ThreadMain();
-
-    DWORD m_iThreadId = 0;
-    SMX::Mutex m_Lock;
-    shared_ptr<SMX::AutoCloseHandle> m_hEvent;
-    bool m_bShutdown = false;
-    HANDLE m_hThread = INVALID_HANDLE_VALUE;
-    vector<function<void()>> m_FunctionsToCall;
+    void ThreadMain(const string &sThreadName);
+    void Wake();
+    void WaitForCallbacks();
+
+    function<void(int PadNumber, SMXUpdateCallbackReason reason)> m_pCallback;
+
+    struct Callback
+    {
+        int m_iPad;
+        SMXUpdateCallbackReason m_Reason;
+        int64_t m_iInputTimestamp;
+    };
+    MPSCQueue<Callback, 256> m_Callbacks;
+    atomic<bool> m_bCallbacksOverflowed{false};
+
+    // This is set for a pad while an SMXUpdateCallback_Updated callback is waiting.
+    atomic<bool> m_bUpdateQueued[SMX_MAX_CABINETS*2];
+
+    // This is set to 1 by the thread before it sleeps, and set back to 0 by whoever wakes
+    // it, so we only make a system call to wake the thread when it's actually asleep.  The
+    // thread sleeps on this with WaitOnAddress if it's available, and on m_Event otherwise.
+    // On Linux, it sleeps on it with a futex.
+    atomic<uint32_t> m_iSleeping{0};
+#ifdef _WIN32
+    HMODULE m_hSynchModule = NULL;
+    BOOL (WINAPI *m_pWaitOnAddress)(volatile void *, void *, SIZE_T, DWORD) = nullptr;
+    void (WINAPI *m_pWakeByAddressSingle)(void *) = nullptr;
+    SMX::Event m_Event;
+#endif
+
+    // This is the user callback thread, which runs at high priority by default, since we
+    // don't want input events to be preempted by other things and reduce timing accuracy.
+    SMXThreadOptionsApplier m_ThreadOptions{SMXThread_Callback, THREAD_PRIORITY_HIGHEST};
+
+    atomic<bool> m_bShutdown{false};
+    thread m_Thread;
 };
 }
 
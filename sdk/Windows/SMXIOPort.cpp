@@ -0,0 +1,125 @@
+#include "SMXIOPort.h"
+
+#include <algorithm>
+using namespace std;
+using namespace SMX;
+
+// This is only defined in newer Windows SDKs.
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+namespace {
+    // Completion keys for m_hIOCP.
+    const ULONG_PTR IOCP_KEY_WAKE = 0;
+    const ULONG_PTR IOCP_KEY_DEVICE = 1;
+}
+
+SMX::SMXIOPort::SMXIOPort()
+{
+    m_hIOCP = make_shared<AutoCloseHandle>(CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1));
+
+    // Create the timer.  High-resolution timers require Windows 10 1803, so if this fails
+    // the caller falls back on millisecond wait timeouts.
+    HANDLE hTimer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if(hTimer != NULL)
+    {
+        m_hTimer = make_shared<AutoCloseHandle>(hTimer);
+        m_bHaveTimer = true;
+    }
+    else
+        Log("High resolution timers not available");
+}
+
+SMX::SMXIOPort::~SMXIOPort()
+{
+}
+
+void SMX::SMXIOPort::Wake()
+{
+    PostQueuedCompletionStatus(m_hIOCP->value(), 0, IOCP_KEY_WAKE, NULL);
+}
+
+void SMX::SMXIOPort::PostCompletion(const void *pCompletion)
+{
+    PostQueuedCompletionStatus(m_hIOCP->value(), 0, IOCP_KEY_DEVICE, (OVERLAPPED *) pCompletion);
+}
+
+// Associate a device handle with our completion port, so its reads and writes wake the
+// I/O thread.
+bool SMX::SMXIOPort::AddDevice(shared_ptr<AutoCloseHandle> pHandle)
+{
+    if(CreateIoCompletionPort(pHandle->value(), m_hIOCP->value(), IOCP_KEY_DEVICE, 0) == NULL)
+    {
+        // This fails if the handle is already associated.  That happens if a device is
+        // closed after an error and reopened before the device search discards the handle,
+        // and in that case it's already associated with our port.
+        int iError = GetLastError();
+        if(iError != ERROR_INVALID_PARAMETER)
+        {
+            LogFormat("CreateIoCompletionPort failed: %ls", GetErrorString(iError));
+            return false;
+        }
+    }
+
+    // Nothing waits on the handle itself, so don't signal it when I/O completes.
+    SetFileCompletionNotificationModes(pHandle->value(), FILE_SKIP_SET_EVENT_ON_HANDLE);
+    return true;
+}
+
+void SMX::SMXIOPort::RemoveDevice(shared_ptr<AutoCloseHandle> pHandle)
+{
+}
+
+void SMX::SMXIOPort::SetTimer(double fTime)
+{
+    if(!m_bHaveTimer || fTime == m_fTimerDueAt)
+        return;
+
+    // The timer is in negative 100ns units for relative times.
+    double fIn = max(0.0, fTime - GetMonotonicTime());
+    LARGE_INTEGER iDueTime;
+    iDueTime.QuadPart = -LONGLONG(fIn * 10000000);
+
+    // The APC is queued to the I/O thread, which waits alertably on the completion port, so
+    // the timer interrupts the wait when it fires.
+    if(!SetWaitableTimer(m_hTimer->value(), &iDueTime, 0, TimerAPC, this, false))
+    {
+        LogFormat("SetWaitableTimer failed: %ls", GetErrorString(GetLastError()));
+        m_hTimer.reset();
+        m_bHaveTimer = false;
+        return;
+    }
+
+    m_fTimerDueAt = fTime;
+}
+
+void CALLBACK SMX::SMXIOPort::TimerAPC(void *pArg, DWORD iTimerLowValue, DWORD iTimerHighValue)
+{
+    // Running the APC wakes the I/O thread.  The timer isn't set anymore, so it'll be set
+    // again if what it was for isn't quite due yet.  This runs on the I/O thread while it's
+    // waiting, which is the only thread that uses the timer.
+    SMXIOPort *pSelf = (SMXIOPort *) pArg;
+    pSelf->m_fTimerDueAt = -1;
+}
+
+bool SMX::SMXIOPort::Wait(int iTimeoutMS, const void *apCompletions[MAX_COMPLETIONS], int &iCompletions)
+{
+    iCompletions = 0;
+
+    OVERLAPPED_ENTRY aEntries[MAX_COMPLETIONS];
+    ULONG iEntries = 0;
+    if(!GetQueuedCompletionStatusEx(m_hIOCP->value(), aEntries, MAX_COMPLETIONS, &iEntries, iTimeoutMS, true))
+        return false;
+
+    bool bOnlyDeviceIO = true;
+    for(ULONG iEntry = 0; iEntry < iEntries; ++iEntry)
+    {
+        const OVERLAPPED_ENTRY &entry = aEntries[iEntry];
+        if(entry.lpCompletionKey == IOCP_KEY_WAKE)
+            bOnlyDeviceIO = false;
+        else
+            apCompletions[iCompletions++] = entry.lpOverlapped;
+    }
+    return bOnlyDeviceIO;
+}
@@ -0,0 +1,80 @@
+#ifndef SMXIOPort_h
+#define SMXIOPort_h
+
+#include <memory>
+using namespace std;
+
+#include "Helpers.h"
+
+namespace SMX
+{
+// The I/O thread sleeps on this until a device's I/O finishes, another thread wakes it, or
+// the lights timer fires.  On Windows, this is an I/O completion port, and the timer is a
+// high-resolution waitable timer.  On Linux, it's an epoll fd, with an eventfd for wakeups
+// and a timerfd for the timer.
+//
+// Only the I/O thread calls Wait and uses the timer.  Wake and PostCompletion can be called
+// from any thread.
+class SMXIOPort
+{
+public:
+    SMXIOPort();
+    ~SMXIOPort();
+
+    // The most completions Wait returns at once.
+    static const int MAX_COMPLETIONS = 16;
+
+    // Wake the I/O thread, so it updates every device.
+    void Wake();
+
+    // Wake the I/O thread with a completion, as if a device's I/O had finished.  This is for
+    // transports that do I/O on their own threads.
+    void PostCompletion(const void *pCompletion);
+
+    // Wake the thread when I/O on a device handle finishes.  Adding a handle again is harmless.
+    bool AddDevice(shared_ptr<AutoCloseHandle> pHandle);
+
+    // Stop waking the thread for a device handle when the device is closed, since the handle
+    // stays open until the device search lets go of it.  Windows can't remove a handle from
+    // a completion port, but closing the device cancels its I/O, so nothing more arrives.
+    void RemoveDevice(shared_ptr<AutoCloseHandle> pHandle);
+
+    // Return true if we have a high-resolution timer.  If we don't, the caller needs to use
+    // Wait's timeout, which only has millisecond resolution.
+    bool HasTimer() const { return m_bHaveTimer; }
+
+    // Wake Wait at the GetMonotonicTime time fTime.  If the timer is already set for that time,
+    // it's left alone.  If setting it fails, HasTimer returns false from then on.
+    void SetTimer(double fTime);
+
+    // Wait for up to iTimeoutMS.  apCompletions is filled in with the completions for device
+    // I/O that finished, which SMXDevice::IsCompletionForDevice matches to a device.  Return
+    // false if we timed out, were woken with Wake or the timer fired, since every device
+    // should be updated then.
+    bool Wait(int iTimeoutMS, const void *apCompletions[MAX_COMPLETIONS], int &iCompletions);
+
+private:
+    bool m_bHaveTimer = false;
+
+    // The time the timer is set for, or -1 if it isn't set.
+    double m_fTimerDueAt = -1;
+
+#ifdef _WIN32
+    static void CALLBACK TimerAPC(void *pArg, DWORD iTimerLowValue, DWORD iTimerHighValue);
+
+    shared_ptr<AutoCloseHandle> m_hIOCP;
+    shared_ptr<AutoCloseHandle> m_hTimer;
+#else
+    shared_ptr<AutoCloseHandle> m_hEpoll;
+    shared_ptr<AutoCloseHandle> m_hTimer;
+
+    // Wake and PostCompletion set this event, which is in the epoll set.  Posted completions
+    // are queued, and m_bWoken is set by Wake, or if the queue is full.
+    Event m_WakeEvent;
+    MPSCQueue<const void *, 64> m_PostedCompletions;
+    atomic<bool> m_bWoken{false};
+#endif
+};
+}
+
+#endif
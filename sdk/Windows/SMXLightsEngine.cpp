@@ -0,0 +1,236 @@
+#include "SMXLightsEngine.h"
+#include "Helpers.h"
+
+#include <string.h>
+#include <math.h>
+using namespace std;
+using namespace SMX;
+
+SMX::SMXLightsEngine::SMXLightsEngine()
+{
+    for(int iPad = 0; iPad < NUM_PADS; ++iPad)
+    {
+        for(Panel &panel: m_Panels[iPad])
+        {
+            for(int &iAnimation: panel.m_iAnimation)
+                iAnimation = -1;
+        }
+        m_iInputState[iPad] = 0;
+    }
+
+    m_fStartTime = GetMonotonicTime();
+}
+
+int SMX::SMXLightsEngine::CreateAnimation(const SMXLightsKeyframe *pKeyframes, int iKeyframes, bool bLoop)
+{
+    if(pKeyframes == nullptr || iKeyframes <= 0)
+    {
+        Log("CreateLightsAnimation: An animation needs at least one keyframe");
+        return -1;
+    }
+
+    for(int i = 1; i < iKeyframes; ++i)
+    {
+        if(pKeyframes[i].m_iTimeMilliseconds < pKeyframes[i-1].m_iTimeMilliseconds)
+        {
+            Log("CreateLightsAnimation: Keyframes must be in order");
+            return -1;
+        }
+    }
+
+    // Reuse a deleted animation's slot if there is one.
+    int iAnimation = 0;
+    while(iAnimation < m_Animations.size() && m_Animations[iAnimation].m_bUsed)
+        iAnimation++;
+    if(iAnimation == m_Animations.size())
+        m_Animations.emplace_back();
+
+    Animation &animation = m_Animations[iAnimation];
+    animation.m_bUsed = true;
+    animation.m_bLoop = bLoop;
+    animation.m_Keyframes.assign(pKeyframes, pKeyframes + iKeyframes);
+    animation.m_fDuration = pKeyframes[iKeyframes-1].m_iTimeMilliseconds / 1000.0;
+    return iAnimation;
+}
+
+void SMX::SMXLightsEngine::DeleteAnimation(int iAnimation)
+{
+    if(!IsValidAnimation(iAnimation))
+        return;
+
+    // Stop using the animation everywhere, so a new animation using the same ID isn't shown
+    // in its place.
+    for(int iPad = 0; iPad < NUM_PADS; ++iPad)
+    {
+        for(Panel &panel: m_Panels[iPad])
+        {
+            for(int &iPanelAnimation: panel.m_iAnimation)
+            {
+                if(iPanelAnimation == iAnimation)
+                    iPanelAnimation = -1;
+            }
+            if(panel.m_iPlaying == iAnimation)
+                panel.m_iPlaying = -1;
+        }
+    }
+
+    Animation &animation = m_Animations[iAnimation];
+    animation.m_bUsed = false;
+    animation.m_Keyframes.clear();
+}
+
+bool SMX::SMXLightsEngine::IsValidAnimation(int iAnimation) const
+{
+    return iAnimation >= 0 && iAnimation < m_Animations.size() && m_Animations[iAnimation].m_bUsed;
+}
+
+void SMX::SMXLightsEngine::SetPanelAnimation(int iPad, int iPanel, SMXLightsTrigger trigger, int iAnimation)
+{
+    if(iPad < 0 || iPad >= NUM_PADS || iPanel < 0 || iPanel >= NUM_PANELS || trigger < 0 || trigger >= NUM_SMX_LIGHTS_TRIGGERS)
+    {
+        LogFormat("SetPanelAnimation: Invalid pad %i, panel %i or trigger %i", iPad, iPanel, (int) trigger);
+        return;
+    }
+
+    if(iAnimation != -1 && !IsValidAnimation(iAnimation))
+    {
+        LogFormat("SetPanelAnimation: Invalid animation %i", iAnimation);
+        return;
+    }
+
+    m_Panels[iPad][iPanel].m_iAnimation[trigger] = iAnimation;
+}
+
+void SMX::SMXLightsEngine::PlayAnimation(int iPad, int iPanel, int iAnimation, double fNow)
+{
+    if(iPad < 0 || iPad >= NUM_PADS || iPanel < 0 || iPanel >= NUM_PANELS || !IsValidAnimation(iAnimation))
+    {
+        LogFormat("PlayPanelAnimation: Invalid pad %i, panel %i or animation %i", iPad, iPanel, iAnimation);
+        return;
+    }
+
+    Panel &panel = m_Panels[iPad][iPanel];
+    panel.m_iPlaying = iAnimation;
+    panel.m_fPlayingSince = fNow;
+    panel.m_bHeld = false;
+}
+
+void SMX::SMXLightsEngine::SetInputState(int iPad, uint16_t iInputState, double fNow)
+{
+    uint16_t iChanged = iInputState ^ m_iInputState[iPad];
+    m_iInputState[iPad] = iInputState;
+    if(iChanged == 0)
+        return;
+
+    for(int iPanel = 0; iPanel < NUM_PANELS; ++iPanel)
+    {
+        if(!(iChanged & (1 << iPanel)))
+            continue;
+
+        Panel &panel = m_Panels[iPad][iPanel];
+        if(iInputState & (1 << iPanel))
+        {
+            // The panel was pressed.  Restart its press animation, if it has one.
+            int iAnimation = panel.m_iAnimation[SMXLightsTrigger_Press];
+            if(!IsValidAnimation(iAnimation))
+                continue;
+
+            panel.m_iPlaying = iAnimation;
+            panel.m_fPlayingSince = fNow;
+            panel.m_bHeld = true;
+        }
+        else
+        {
+            // The panel was released.  A looping press animation stops now, and other
+            // animations finish playing.
+            if(panel.m_bHeld && IsValidAnimation(panel.m_iPlaying) && m_Animations[panel.m_iPlaying].m_bLoop)
+                panel.m_iPlaying = -1;
+            panel.m_bHeld = false;
+        }
+    }
+}
+
+bool SMX::SMXLightsEngine::IsCabinetAnimated(int iCabinet) const
+{
+    for(int iPad = iCabinet*2; iPad < iCabinet*2 + 2; ++iPad)
+    {
+        for(const Panel &panel: m_Panels[iPad])
+        {
+            if(panel.m_iPlaying != -1)
+                return true;
+            for(int iAnimation: panel.m_iAnimation)
+            {
+                if(iAnimation != -1)
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+void SMX::SMXLightsEngine::Render(int iCabinet, double fNow, uint8_t *pOut)
+{
+    for(int iPlayer = 0; iPlayer < 2; ++iPlayer)
+    {
+        int iPad = iCabinet*2 + iPlayer;
+        for(int iPanel = 0; iPanel < NUM_PANELS; ++iPanel)
+        {
+            Panel &panel = m_Panels[iPad][iPanel];
+            uint8_t *pPanelOut = pOut + (iPlayer*NUM_PANELS + iPanel) * PANEL_LIGHTS_SIZE;
+
+            // Show the animation that was triggered, until it finishes.  Looping animations
+            // started by a press repeat until the panel is released.  Other animations
+            // play once.
+            if(panel.m_iPlaying != -1)
+            {
+                const Animation &animation = m_Animations[panel.m_iPlaying];
+                double fTime = fNow - panel.m_fPlayingSince;
+                bool bRepeat = animation.m_bLoop && panel.m_bHeld;
+                if(bRepeat || fTime < animation.m_fDuration)
+                {
+                    RenderAnimation(animation, fTime, pPanelOut);
+                    continue;
+                }
+
+                panel.m_iPlaying = -1;
+            }
+
+            // Otherwise, show the idle animation.  A non-looping idle animation plays once
+            // and then holds its last frame.
+            int iIdle = panel.m_iAnimation[SMXLightsTrigger_Idle];
+            if(iIdle != -1)
+                RenderAnimation(m_Animations[iIdle], fNow - m_fStartTime, pPanelOut);
+            else
+                memset(pPanelOut, 0, PANEL_LIGHTS_SIZE);
+        }
+    }
+}
+
+// Render an animation at fTime seconds after it started.  Colors are interpolated linearly
+// between keyframes.
+void SMX::SMXLightsEngine::RenderAnimation(const Animation &animation, double fTime, uint8_t *pOut) const
+{
+    if(animation.m_bLoop && animation.m_fDuration > 0)
+        fTime = fmod(fTime, animation.m_fDuration);
+
+    double fTimeMilliseconds = fTime * 1000;
+    const vector<SMXLightsKeyframe> &keyframes = animation.m_Keyframes;
+
+    // Find the last keyframe at or before fTime.  Animations only have a few keyframes, so
+    // just search for it.
+    int iFrame = 0;
+    while(iFrame + 1 < keyframes.size() && keyframes[iFrame+1].m_iTimeMilliseconds <= fTimeMilliseconds)
+        iFrame++;
+
+    const SMXLightsKeyframe &from = keyframes[iFrame];
+    if(iFrame + 1 == keyframes.size() || fTimeMilliseconds <= from.m_iTimeMilliseconds)
+    {
+        memcpy(pOut, from.m_Colors, PANEL_LIGHTS_SIZE);
+        return;
+    }
+
+    const SMXLightsKeyframe &to = keyframes[iFrame+1];
+    int iFraction = int((fTimeMilliseconds - from.m_iTimeMilliseconds) * 256 / (to.m_iTimeMilliseconds - from.m_iTimeMilliseconds));
+    for(int i = 0; i < PANEL_LIGHTS_SIZE; ++i)
+        pOut[i] = uint8_t(from.m_Colors[i] + (((to.m_Colors[i] - from.m_Colors[i]) * iFraction) >> 8));
+}
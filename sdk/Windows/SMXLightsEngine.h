@@ -0,0 +1,85 @@
+#ifndef SMXLightsEngine_h
+#define SMXLightsEngine_h
+
+#include <stdint.h>
+#include <vector>
+using namespace std;
+
+#include "../SMX.h"
+
+namespace SMX
+{
+// This plays lights animations uploaded with SMX_CreateLightsAnimation, so applications can
+// have lights that react to steps without sending a lights update every frame.  Each panel
+// has an animation for each SMXLightsTrigger, and the engine renders whole lights frames for
+// SMXManager to send.
+//
+// This is owned by SMXManager, and is only used while holding its lock.
+class SMXLightsEngine
+{
+public:
+    static const int NUM_PADS = SMX_MAX_CABINETS*2;
+    static const int NUM_PANELS = 9;
+    static const int PANEL_LIGHTS_SIZE = 16*3;
+    static const int CABINET_LIGHTS_SIZE = 2*NUM_PANELS*PANEL_LIGHTS_SIZE;
+
+    SMXLightsEngine();
+
+    // Add an animation and return its ID, or -1 if the animation is invalid.
+    int CreateAnimation(const SMXLightsKeyframe *pKeyframes, int iKeyframes, bool bLoop);
+
+    // Delete an animation.  Panels using it stop showing it.
+    void DeleteAnimation(int iAnimation);
+
+    // Set the animation a panel shows for a trigger.  If iAnimation is -1, the trigger is cleared.
+    void SetPanelAnimation(int iPad, int iPanel, SMXLightsTrigger trigger, int iAnimation);
+
+    // Start playing an animation on a panel now, as if it had been pressed.
+    void PlayAnimation(int iPad, int iPanel, int iAnimation, double fNow);
+
+    // Update the input state of a pad, starting press animations on panels that were pressed.
+    void SetInputState(int iPad, uint16_t iInputState, double fNow);
+
+    // Return true if any panel in the cabinet has an animation to show.
+    bool IsCabinetAnimated(int iCabinet) const;
+
+    // Render the lights for a cabinet at fNow, in SMX_SetLights format.  pOut must hold
+    // CABINET_LIGHTS_SIZE bytes.
+    void Render(int iCabinet, double fNow, uint8_t *pOut);
+
+private:
+    struct Animation
+    {
+        bool m_bUsed = false;
+        bool m_bLoop = false;
+        vector<SMXLightsKeyframe> m_Keyframes;
+
+        // The time of the last keyframe, in seconds.
+        double m_fDuration = 0;
+    };
+    vector<Animation> m_Animations;
+
+    struct Panel
+    {
+        int m_iAnimation[NUM_SMX_LIGHTS_TRIGGERS];
+
+        // The animation started by a press or PlayAnimation, or -1 if it's showing its idle
+        // animation.  m_bHeld is true if it was started by a press, and the panel is still
+        // pressed.
+        int m_iPlaying = -1;
+        double m_fPlayingSince = 0;
+        bool m_bHeld = false;
+    };
+    Panel m_Panels[NUM_PADS][NUM_PANELS];
+    uint16_t m_iInputState[NUM_PADS];
+
+    // Looping idle animations are timed from when the engine was created, so panels showing
+    // the same animation are in sync.
+    double m_fStartTime;
+
+    bool IsValidAnimation(int iAnimation) const;
+    void RenderAnimation(const Animation &animation, double fTime, uint8_t *pOut) const;
+};
+}
+
+#endif
@@ -0,0 +1,465 @@
+#include "SMXLog.h"
+#include "Helpers.h"
+#include "SMXThreadOptions.h"
+
+#include <string.h>
+#include <wchar.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+using namespace std;
+using namespace SMX;
+
+namespace {
+    // The log callback.  If this is empty, logs are written to stdout.
+    function<void(const string &log)> g_LogCallback;
+
+    // This is held while formatting logs, and protects g_LogCallback and everything below
+    // that's used for delivering them.  It isn't held while calling the callback, so the
+    // callback can log without deadlocking.
+    Mutex g_LogLock;
+
+    // Formatted logs waiting to be sent to the callback once g_LogLock is released.
+    struct PendingLog
+    {
+        double m_fTime;
+        string m_sLog;
+    };
+    vector<PendingLog> g_PendingLogs;
+
+    // Logs waiting for the log thread.
+    MPSCQueue<LogEntry, 256> g_LogQueue;
+    atomic<uint32_t> g_iLogsDiscarded{0};
+
+    // The log thread.  g_pLogEvent wakes it, and g_bLogWakePending is set when the event has
+    // been set but the thread hasn't woken yet, so we only set it once for a burst of logs.
+    thread g_LogThread;
+    unique_ptr<Event> g_pLogEvent;
+    atomic<bool> g_bLogThreadRunning{false};
+    atomic<bool> g_bLogWakePending{false};
+    atomic<bool> g_bLogThreadShutdown{false};
+
+    // Each message can be logged this many times a second before it's suppressed.  Messages
+    // are grouped by format string, or by their text if they were already formatted.
+    const int MAX_LOGS_PER_SECOND = 10;
+    struct LogRateLimit
+    {
+        uintptr_t m_iKey = 0;
+        double m_fWindowStart = 0;
+        int m_iCount = 0;
+        int m_iSuppressed = 0;
+        string m_sMessage;
+    };
+
+    LogRateLimit g_RateLimits[64];
+    string g_sFormatted;
+
+    // Queue a log to be sent by SendLogs.
+    void DeliverLog(double fTime, const string &sLog)
+    {
+        g_LogLock.AssertLockedByCurrentThread();
+        g_PendingLogs.push_back({fTime, sLog});
+    }
+
+    // Take the logs queued by DeliverLog, and the callback to send them to.  aLogs is swapped
+    // with the queue, so reusing it avoids allocating.
+    void TakePendingLogs(vector<PendingLog> &aLogs, function<void(const string &log)> &pCallback)
+    {
+        g_LogLock.AssertLockedByCurrentThread();
+        aLogs.clear();
+        swap(aLogs, g_PendingLogs);
+        pCallback = g_LogCallback;
+    }
+
+    // Send logs from TakePendingLogs.  This must be called without g_LogLock held.
+    void SendLogs(const vector<PendingLog> &aLogs, const function<void(const string &log)> &pCallback)
+    {
+        g_LogLock.AssertNotLockedByCurrentThread();
+        for(const PendingLog &log: aLogs)
+        {
+            if(pCallback)
+                pCallback(log.m_sLog);
+            else
+                printf("%6.3f: %s\n", log.m_fTime, log.m_sLog.c_str());
+        }
+    }
+
+    // Format one argument.  sSpec is the conversion without its length modifier, like "%08",
+    // and cConversion is the conversion character.  The length is chosen by what was saved.
+    void FormatArg(string &sOut, const LogEntry &entry, const LogEntry::Arg &arg, string &sSpec, char cConversion)
+    {
+        char szBuf[256];
+        szBuf[0] = 0;
+        switch(cConversion)
+        {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        {
+            if(arg.m_Type != LogEntry::Arg_Int && arg.m_Type != LogEntry::Arg_Unsigned)
+                break;
+
+            // Unsigned conversions of signed values should only see the bits of the original type.
+            uint64_t iValue = (uint64_t) arg.m_iValue;
+            bool bUnsignedConversion = cConversion != 'd' && cConversion != 'i' && cConversion != 'c';
+            if(bUnsignedConversion && arg.m_iSize < 8)
+                iValue &= (1ULL << (arg.m_iSize * 8)) - 1;
+
+            if(cConversion == 'c')
+            {
+                sSpec += "c";
+                snprintf(szBuf, sizeof(szBuf), sSpec.c_str(), (int) iValue);
+            }
+            else
+            {
+                sSpec += "ll";
+                sSpec += cConversion;
+                snprintf(szBuf, sizeof(szBuf), sSpec.c_str(), (long long) iValue);
+            }
+            sOut += szBuf;
+            return;
+        }
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        {
+            double fValue;
+            if(arg.m_Type == LogEntry::Arg_Double)
+                fValue = arg.m_fValue;
+            else if(arg.m_Type == LogEntry::Arg_Int)
+                fValue = (double) arg.m_iValue;
+            else if(arg.m_Type == LogEntry::Arg_Unsigned)
+                fValue = (double) (uint64_t) arg.m_iValue;
+            else
+                break;
+
+            sSpec += cConversion;
+            snprintf(szBuf, sizeof(szBuf), sSpec.c_str(), fValue);
+            sOut += szBuf;
+            return;
+        }
+        case 's': case 'S':
+        {
+            if(arg.m_Type == LogEntry::Arg_String)
+            {
+                sSpec += "s";
+                snprintf(szBuf, sizeof(szBuf), sSpec.c_str(), arg.m_iTextOffset == -1? "":entry.m_Text + arg.m_iTextOffset);
+            }
+            else if(arg.m_Type == LogEntry::Arg_WString)
+            {
+                sSpec += "ls";
+                snprintf(szBuf, sizeof(szBuf), sSpec.c_str(), arg.m_iTextOffset == -1? L"":(const wchar_t *) (entry.m_Text + arg.m_iTextOffset));
+            }
+            else
+                break;
+
+            sOut += szBuf;
+            return;
+        }
+        }
+
+        // The argument doesn't match the format.
+        sOut += "<?>";
+    }
+
+    void FormatLogEntry(string &sOut, const LogEntry &entry)
+    {
+        sOut.clear();
+        if(entry.m_szFormat == nullptr)
+        {
+            sOut.assign(entry.m_Text, entry.m_iTextSize);
+            return;
+        }
+
+        string sSpec;
+        int iArg = 0;
+        const char *p = entry.m_szFormat;
+        while(*p)
+        {
+            if(*p != '%')
+            {
+                sOut += *p++;
+                continue;
+            }
+
+            if(p[1] == '%')
+            {
+                sOut += '%';
+                p += 2;
+                continue;
+            }
+
+            // Read the flags, width and precision, and skip over the length.
+            const char *pStart = p++;
+            while(*p && strchr("-+ #0123456789.", *p))
+                ++p;
+            sSpec.assign(pStart, p);
+            while(*p && strchr("hlLzjtI6432", *p))
+                ++p;
+
+            char cConversion = *p;
+            if(cConversion == 0)
+                break;
+            ++p;
+
+            if(iArg >= entry.m_iArgs)
+            {
+                sOut += "<?>";
+                continue;
+            }
+
+            FormatArg(sOut, entry, entry.m_Args[iArg++], sSpec, cConversion);
+        }
+    }
+
+    uintptr_t GetRateLimitKey(const LogEntry &entry)
+    {
+        if(entry.m_szFormat != nullptr)
+            return (uintptr_t) entry.m_szFormat;
+
+        // FNV-1a of the message.
+        uint32_t iHash = 2166136261;
+        for(int i = 0; i < entry.m_iTextSize; ++i)
+            iHash = (iHash ^ (uint8_t) entry.m_Text[i]) * 16777619;
+        return iHash;
+    }
+
+    void ReportSuppressed(LogRateLimit &limit, double fTime)
+    {
+        if(limit.m_iSuppressed == 0)
+            return;
+
+        DeliverLog(fTime, ssprintf("(suppressed %i more messages like: %s)", limit.m_iSuppressed, limit.m_sMessage.c_str()));
+        limit.m_iSuppressed = 0;
+    }
+
+    // Return true if this message should be logged, or false if it's been logged too often.
+    bool CheckRateLimit(uintptr_t iKey, double fTime, const string &sMessage)
+    {
+        LogRateLimit &limit = g_RateLimits[(iKey >> 3) % (sizeof(g_RateLimits) / sizeof(*g_RateLimits))];
+        if(limit.m_iKey != iKey || fTime - limit.m_fWindowStart >= 1)
+        {
+            ReportSuppressed(limit, fTime);
+            limit.m_iKey = iKey;
+            limit.m_fWindowStart = fTime;
+            limit.m_iCount = 0;
+            limit.m_sMessage = sMessage;
+        }
+
+        if(limit.m_iCount >= MAX_LOGS_PER_SECOND)
+        {
+            limit.m_iSuppressed++;
+            return false;
+        }
+
+        limit.m_iCount++;
+        return true;
+    }
+
+    // Report suppressed messages once their window ends, even if they don't happen again.
+    // Return true if any are still waiting.
+    bool ReportExpiredSuppressions(double fNow)
+    {
+        bool bWaiting = false;
+        for(LogRateLimit &limit: g_RateLimits)
+        {
+            if(limit.m_iSuppressed == 0)
+                continue;
+            if(fNow - limit.m_fWindowStart >= 1)
+                ReportSuppressed(limit, fNow);
+            else
+                bWaiting = true;
+        }
+        return bWaiting;
+    }
+
+    void HandleLogEntry(const LogEntry &entry)
+    {
+        FormatLogEntry(g_sFormatted, entry);
+        if(CheckRateLimit(GetRateLimitKey(entry), entry.m_fTime, g_sFormatted))
+            DeliverLog(entry.m_fTime, g_sFormatted);
+    }
+
+    // Deliver everything in g_LogQueue.
+    void FlushLogQueue()
+    {
+        LogEntry entry;
+        while(g_LogQueue.Pop(entry))
+            HandleLogEntry(entry);
+
+        uint32_t iDiscarded = g_iLogsDiscarded.exchange(0);
+        if(iDiscarded > 0)
+            DeliverLog(GetMonotonicTime(), ssprintf("Log queue full (%i messages discarded)", iDiscarded));
+    }
+
+    void LogThreadMain()
+    {
+        SetThreadName("SMXLog");
+        int iError;
+        SetCurrentThreadPriority(THREAD_PRIORITY_BELOW_NORMAL, iError);
+
+        bool bSuppressionsWaiting = false;
+        vector<PendingLog> aLogs;
+        function<void(const string &log)> pCallback;
+        while(1)
+        {
+            // If messages are being suppressed, wake up to report them when their window ends.
+            g_pLogEvent->Wait(bSuppressionsWaiting? 1000:-1);
+            g_bLogWakePending.store(false);
+
+            {
+                LockMutex L(g_LogLock);
+                FlushLogQueue();
+                bSuppressionsWaiting = ReportExpiredSuppressions(GetMonotonicTime());
+                TakePendingLogs(aLogs, pCallback);
+            }
+            SendLogs(aLogs, pCallback);
+
+            if(g_bLogThreadShutdown.load())
+                break;
+        }
+    }
+}
+
+void SMX::LogEntry::SetText(const char *s, size_t iSize)
+{
+    m_iTextSize = (int) min(iSize, size_t(TEXT_SIZE));
+    memcpy(m_Text, s, m_iTextSize);
+}
+
+SMX::LogEntry::Arg *SMX::LogEntry::NewArg(ArgType type)
+{
+    if(m_iArgs == MAX_ARGS)
+        return nullptr;
+
+    Arg *pArg = &m_Args[m_iArgs++];
+    pArg->m_Type = type;
+    pArg->m_iSize = 0;
+    pArg->m_iValue = 0;
+    return pArg;
+}
+
+void SMX::LogEntry::AddArg(const char *s)
+{
+    Arg *pArg = NewArg(Arg_String);
+    if(pArg == nullptr)
+        return;
+
+    // Copy as much of the string as fits, leaving room for the terminator.
+    int iAvailable = TEXT_SIZE - m_iTextSize - 1;
+    if(s == nullptr || iAvailable < 0)
+    {
+        pArg->m_iTextOffset = -1;
+        return;
+    }
+
+    int iLength = (int) min(strlen(s), size_t(iAvailable));
+    pArg->m_iTextOffset = m_iTextSize;
+    memcpy(m_Text + m_iTextSize, s, iLength);
+    m_Text[m_iTextSize + iLength] = 0;
+    m_iTextSize += iLength + 1;
+}
+
+void SMX::LogEntry::AddArg(const wchar_t *s)
+{
+    Arg *pArg = NewArg(Arg_WString);
+    if(pArg == nullptr)
+        return;
+
+    // Wide strings are stored aligned.
+    int iOffset = (m_iTextSize + sizeof(wchar_t) - 1) & ~(sizeof(wchar_t) - 1);
+    int iAvailable = (TEXT_SIZE - iOffset) / (int) sizeof(wchar_t) - 1;
+    if(s == nullptr || iAvailable < 0)
+    {
+        pArg->m_iTextOffset = -1;
+        return;
+    }
+
+    int iLength = (int) min(wcslen(s), size_t(iAvailable));
+    wchar_t *pText = (wchar_t *) (m_Text + iOffset);
+    memcpy(pText, s, iLength * sizeof(wchar_t));
+    pText[iLength] = 0;
+    pArg->m_iTextOffset = iOffset;
+    m_iTextSize = iOffset + (iLength + 1) * sizeof(wchar_t);
+}
+
+void SMX::QueueLog(LogEntry &entry)
+{
+    entry.m_fTime = GetMonotonicTime();
+
+    // If the log thread isn't running, handle the log now.
+    if(!g_bLogThreadRunning.load())
+    {
+        vector<PendingLog> aLogs;
+        function<void(const string &log)> pCallback;
+        {
+            LockMutex L(g_LogLock);
+            HandleLogEntry(entry);
+            TakePendingLogs(aLogs, pCallback);
+        }
+        SendLogs(aLogs, pCallback);
+        return;
+    }
+
+    if(!g_LogQueue.Push(entry))
+    {
+        g_iLogsDiscarded++;
+        return;
+    }
+
+    if(!g_bLogWakePending.exchange(true))
+        g_pLogEvent->Set();
+}
+
+void SMX::Log(string s)
+{
+    LogEntry entry;
+    entry.SetText(s.data(), s.size());
+    QueueLog(entry);
+}
+
+void SMX::Log(const char *s)
+{
+    LogEntry entry;
+    entry.SetText(s, strlen(s));
+    QueueLog(entry);
+}
+
+void SMX::SetLogCallback(function<void(const string &log)> callback)
+{
+    LockMutex L(g_LogLock);
+    g_LogCallback = callback;
+}
+
+void SMX::StartLogThread()
+{
+    if(g_LogThread.joinable())
+        return;
+
+    g_pLogEvent.reset(new Event);
+    g_bLogThreadShutdown = false;
+    g_LogThread = thread(LogThreadMain);
+    g_bLogThreadRunning = true;
+}
+
+void SMX::StopLogThread()
+{
+    if(!g_LogThread.joinable())
+        return;
+
+    // Stop queueing logs, then let the thread flush what's already queued and exit.  This is
+    // called after the SDK's threads have stopped, so nothing else should be logging.
+    g_bLogThreadRunning = false;
+    g_bLogThreadShutdown = true;
+    g_pLogEvent->Set();
+    g_LogThread.join();
+    g_pLogEvent.reset();
+
+    // Deliver anything that was queued while the thread was exiting, and anything that's
+    // still being suppressed.
+    vector<PendingLog> aLogs;
+    function<void(const string &log)> pCallback;
+    {
+        LockMutex L(g_LogLock);
+        FlushLogQueue();
+        ReportExpiredSuppressions(GetMonotonicTime() + 1);
+        TakePendingLogs(aLogs, pCallback);
+    }
+    SendLogs(aLogs, pCallback);
+}
@@ -0,0 +1,109 @@
+#ifndef SMXLog_h
+#define SMXLog_h
+
+#include <stdint.h>
+#include <string>
+#include <functional>
+#include <type_traits>
+using namespace std;
+
+namespace SMX
+{
+// Logs are queued and passed to the log callback from a low-priority thread, so logging never
+// waits for the callback or for stdout.  This matters because we often log from the I/O thread
+// with the lock held, and a device with a bad connection can log a lot.  Messages that repeat
+// too quickly are rate limited, and a count of the suppressed messages is logged instead.
+//
+// Until the log thread is started, and after it's stopped, logs are sent to the callback
+// immediately.
+void Log(string s);
+void Log(const char *s);
+
+// Log a printf-style message, without formatting it or allocating memory.  The arguments are
+// saved, and the message is formatted on the log thread.  Arguments can be integers, floats,
+// and narrow or wide strings, which are copied and may be truncated.  %s and %ls both accept
+// either kind of string.  szFormat must be a string literal, since it's read later, and each
+// format string is rate limited separately.
+template<typename... Args>
+void LogFormat(const char *szFormat, const Args &...args);
+
+// Set a function to receive logs written by SMX::Log.  By default, logs are written
+// to stdout.
+void SetLogCallback(function<void(const string &log)> callback);
+
+// Start and stop the log thread.  StopLogThread flushes any logs that are still queued.
+void StartLogThread();
+void StopLogThread();
+
+// A message queued by Log or LogFormat.
+struct LogEntry
+{
+    static const int MAX_ARGS = 8;
+    static const int TEXT_SIZE = 256;
+
+    enum ArgType { Arg_Int, Arg_Unsigned, Arg_Double, Arg_String, Arg_WString };
+    struct Arg
+    {
+        ArgType m_Type;
+        int m_iSize;
+        union {
+            int64_t m_iValue;
+            double m_fValue;
+            int m_iTextOffset;
+        };
+    };
+
+    // The format string, or null if m_Text is an already formatted message.
+    const char *m_szFormat = nullptr;
+    double m_fTime = 0;
+    int m_iArgs = 0;
+    Arg m_Args[MAX_ARGS];
+
+    // The formatted message, or the text of string arguments.
+    int m_iTextSize = 0;
+    char m_Text[TEXT_SIZE];
+
+    template<typename T>
+    typename enable_if<is_integral<T>::value || is_enum<T>::value>::type AddArg(T value)
+    {
+        Arg *pArg = NewArg(is_signed<T>::value? Arg_Int:Arg_Unsigned);
+        if(pArg == nullptr)
+            return;
+        pArg->m_iSize = sizeof(T);
+        pArg->m_iValue = (int64_t) value;
+    }
+
+    template<typename T>
+    typename enable_if<is_floating_point<T>::value>::type AddArg(T value)
+    {
+        Arg *pArg = NewArg(Arg_Double);
+        if(pArg == nullptr)
+            return;
+        pArg->m_fValue = value;
+    }
+
+    void AddArg(const char *s);
+    void AddArg(const wchar_t *s);
+    void AddArg(const string &s) { AddArg(s.c_str()); }
+    void AddArg(const wstring &s) { AddArg(s.c_str()); }
+
+    void SetText(const char *s, size_t iSize);
+
+private:
+    Arg *NewArg(ArgType type);
+};
+
+void QueueLog(LogEntry &entry);
+
+template<typename... Args>
+void LogFormat(const char *szFormat, const Args &...args)
+{
+    LogEntry entry;
+    entry.m_szFormat = szFormat;
+    int unused[] = { 0, (entry.AddArg(args), 0)... };
+    (void) unused;
+    QueueLog(entry);
+}
+}
+
+#endif
@@ -2,54 +2,146 @@
 #include "SMXDevice.h"
 #include "SMXDeviceConnection.h"
 #include "SMXDeviceSearchThreaded.h"
+#include "SMXCapture.h"
+#include "SMXDeviceCache.h"
+#include "SMXStats.h"
+#include "SMXIOPort.h"
 #include "Helpers.h"
 
-#include <windows.h>
 #include <memory>
+#include <stdexcept>
+#include <stddef.h>
+#include <emmintrin.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#endif
 using namespace std;
 using namespace SMX;
 
 namespace {
     Mutex g_Lock;
+
+    // The block returned by SMX_GetSharedState.  This lives as long as the DLL does, so its
+    // address doesn't change if SMX_Start is called again.  It's only written while holding
+    // g_Lock.
+    SMXSharedState g_SharedState = { SMX_SHARED_STATE_VERSION, sizeof(SMXSharedState), 0, SMXManager::NUM_PAD_SLOTS };
+
+    // smx-config's SMX.cs reads this directly, so make sure the layout doesn't change by accident.
+    // These are the same in 32-bit and 64-bit builds.
+    static_assert(sizeof(SMXPadState) == 56, "SMXPadState layout changed");
+    static_assert(sizeof(SMXSharedPadState) == 216, "SMXSharedPadState layout changed");
+    static_assert(offsetof(SMXSharedState, m_Pads) == 16, "SMXSharedState layout changed");
+
+    // Return the callback mode to use for options.  SMXCallbackMode_Event needs an event, so
+    // fall back on SMXCallbackMode_Thread if there isn't one.  This is used in the initializer
+    // list, so the callback thread is started if we fall back.
+    SMXCallbackMode GetCallbackMode(const SMXStartOptions &options)
+    {
+        if(options.m_CallbackMode == SMXCallbackMode_Event && options.m_hEvent == NULL)
+            return SMXCallbackMode_Thread;
+        return options.m_CallbackMode;
+    }
 }
 
-SMX::SMXManager::SMXManager(function<void(int PadNumber, SMXUpdateCallbackReason reason)> pCallback):
-    m_UserCallbackThread("SMXUserCallbackThread")
+SMX::SMXManager::SMXManager(function<void(int PadNumber, SMXUpdateCallbackReason reason)> pCallback, const SMXStartOptions &options):
+    m_UserCallbackThread("SMXUserCallbackThread", pCallback, GetCallbackMode(options) == SMXCallbackMode_Thread)
 {
-    // Raise the priority of the user callback thread, since we don't want input
-    // events to be preempted by other things and reduce timing accuracy.
-    m_UserCallbackThread.SetHighPriority(true);
-    m_hEvent = make_shared<AutoCloseHandle>(CreateEvent(NULL, false, false, NULL));
-    m_pSMXDeviceSearchThreaded = make_shared<SMXDeviceSearchThreaded>();
+    m_CallbackMode = GetCallbackMode(options);
+    m_hUserEvent = options.m_hEvent;
+    int iBudgetMicroseconds = options.m_iInlineCallbackBudgetMicroseconds > 0? options.m_iInlineCallbackBudgetMicroseconds:250;
+    m_fInlineCallbackBudget = iBudgetMicroseconds / 1000000.0;
+    if(m_CallbackMode != options.m_CallbackMode)
+        Log("SMXCallbackMode_Event was requested without an event");
+
+    // Record how long the lock is held for SMX_GetStats.  Nothing else is using it yet.
+    g_Lock.SetHoldTimeHistogram(&g_Stats.m_LockHoldTime);
+
+    // This also creates the lights timer.  If high-resolution timers aren't available, we'll
+    // fall back on millisecond wait timeouts.
+    m_pIOPort = make_shared<SMXIOPort>();
+
+    for(int iPad = 0; iPad < NUM_PAD_SLOTS; ++iPad)
+    {
+        for(string &sLights: m_sLightsSent[iPad])
+            sLights.reserve(LIGHTS_COMMAND_SIZE);
+        m_fLightsSentAt[iPad] = -1;
+        m_bSkippingLightsUpdate[iPad] = false;
+    }
+
+    memset(&m_LightsTimingStats, 0, sizeof(m_LightsTimingStats));
+    m_LightsTimingStats.m_bHighResolutionTimer = m_pIOPort->HasTimer();
+
+    // When replaying, the replay's devices are connected instead of searching for real ones.
+    if(options.m_sReplayFile != nullptr)
+    {
+        wstring sError;
+        m_pReplay = SMXReplay::Create(options.m_sReplayFile, !options.m_bReplayAsFastAsPossible, sError);
+        if(m_pReplay == nullptr)
+            LogFormat("%ls", sError);
+    }
+    else
+        m_pSMXDeviceSearchThreaded = make_shared<SMXDeviceSearchThreaded>([this] { WakeIOThread(); });
+
+    if(options.m_sCaptureFile != nullptr)
+    {
+        wstring sError;
+        m_pCaptureWriter = SMXCaptureWriter::Create(options.m_sCaptureFile, sError);
+        if(m_pCaptureWriter == nullptr)
+            LogFormat("%ls", sError);
+    }
+
+    // Replayed devices aren't cached, so a replay can't change what real devices start with.
+    if(options.m_bUseDeviceCache && m_pReplay == nullptr)
+    {
+        wstring sPath = options.m_sDeviceCacheFile != nullptr? options.m_sDeviceCacheFile:SMXDeviceCache::GetDefaultPath();
+        if(sPath.empty())
+            Log("Couldn't find a path for the device cache");
+        else
+            m_pDeviceCache = SMXDeviceCache::Create(sPath);
+    }
 
     // Create the SMXDevices.  We don't create these as we connect, we just reuse the same
-    // ones.
-    for(int i = 0; i < 2; ++i)
+    // ones.  Every cabinet shares the same I/O thread and completion port, which only
+    // updates the devices that have I/O to handle, so idle cabinets cost very little.
+    for(int i = 0; i < NUM_PAD_SLOTS; ++i)
     {
-        shared_ptr<SMXDevice> pDevice = SMXDevice::Create(m_hEvent, g_Lock);
+        shared_ptr<SMXDevice> pDevice = SMXDevice::Create(m_pIOPort, g_Lock);
         m_pDevices.push_back(pDevice);
+        m_apDeviceSlots[i].store(pDevice.get());
     }
+    m_pReorderedDevices.resize(NUM_PAD_SLOTS);
+    m_pInvalidDevice = SMXDevice::Create(m_pIOPort, g_Lock);
+
+    // Nothing is connected yet.
+    SMXState state;
+    memset(&state, 0, sizeof(state));
+    m_State.Store(state);
 
     // The callback we send to SMXDeviceConnection will be called from our thread.  Wrap
-    // it so it's called from UserCallbackThread instead.
-    auto pCallbackInThread = [this, pCallback](int PadNumber, SMXUpdateCallbackReason reason) {
-        m_UserCallbackThread.RunInThread([pCallback, PadNumber, reason]() {
-            pCallback(PadNumber, reason);
-        });
+    // it so it's called from UserCallbackThread instead.  In inline mode the callback is still
+    // queued, so it's called by DeliverUpdates once we're unlocked.  In event mode, just
+    // remember that there's something to signal.
+    auto pCallbackInThread = [this](int PadNumber, SMXUpdateCallbackReason reason, int64_t iInputTimestamp) {
+        if(m_CallbackMode == SMXCallbackMode_Event)
+            m_bUserEventPending = true;
+        else
+            m_UserCallbackThread.QueueCallback(PadNumber, reason, iInputTimestamp);
     };
 
     // Set the update callbacks.  Do this before starting the thread, to avoid race conditions.
-    for(int pad = 0; pad < 2; ++pad)
+    for(int pad = 0; pad < NUM_PAD_SLOTS; ++pad)
+    {
         m_pDevices[pad]->SetUpdateCallback(pCallbackInThread);
 
-    // Start the thread.
-    DWORD id;
-    m_hThread = CreateThread(NULL, 0, ThreadMainStart, this, 0, &id);
-    SMX::SetThreadName(id, "SMXManager");
+        LockMutex L(g_Lock);
+        m_pDevices[pad]->SetPadNumberLocked(pad, &m_InputEvents[pad], &m_TestFrames[pad]);
+        if(m_pDeviceCache)
+            m_pDevices[pad]->SetDeviceCacheLocked(m_pDeviceCache);
+    }
 
-    // Raise the priority of the I/O thread, since we don't want input
-    // events to be preempted by other things and reduce timing accuracy.
-    SetThreadPriority( m_hThread, THREAD_PRIORITY_HIGHEST );
+    // Start the thread.
+    m_Thread = thread(&SMXManager::ThreadMain, this);
 }
 
 SMX::SMXManager::~SMXManager()
@@ -58,9 +150,109 @@ SMX::SMXManager::~SMXManager()
     Shutdown();
 }
 
-shared_ptr<SMXDevice> SMX::SMXManager::GetDevice(int pad)
+SMXDevice *SMX::SMXManager::GetDevice(int pad)
+{
+    if(pad < 0 || pad >= NUM_PAD_SLOTS)
+    {
+        LogFormat("Invalid pad %i", pad);
+        return m_pInvalidDevice.get();
+    }
+
+    return m_apDeviceSlots[pad].load();
+}
+
+int SMX::SMXManager::ReadInputEvents(int pad, SMXInputEvent *pEvents, int iMaxEvents)
+{
+    if(pad < 0 || pad >= NUM_PAD_SLOTS)
+    {
+        LogFormat("Invalid pad %i", pad);
+        return 0;
+    }
+
+    int iCount = 0;
+    while(iCount < iMaxEvents && m_InputEvents[pad].Pop(pEvents[iCount]))
+        iCount++;
+    return iCount;
+}
+
+int SMX::SMXManager::ReadTestFrames(int pad, SMXTestFrame *pFrames, int iMaxFrames)
+{
+    if(pad < 0 || pad >= NUM_PAD_SLOTS)
+    {
+        LogFormat("Invalid pad %i", pad);
+        return 0;
+    }
+
+    int iCount = 0;
+    while(iCount < iMaxFrames && m_TestFrames[pad].Pop(pFrames[iCount]))
+        iCount++;
+    return iCount;
+}
+
+void SMX::SMXManager::GetState(SMXState &state) const
+{
+    m_State.Load(state);
+}
+
+const SMXSharedState *SMX::SMXManager::GetSharedState()
 {
-    return m_pDevices[pad];
+    return &g_SharedState;
+}
+
+void SMX::SMXManager::PublishStateLocked()
+{
+    g_Lock.AssertLockedByCurrentThread();
+
+    SMXState state;
+    for(int iPad = 0; iPad < NUM_PAD_SLOTS; ++iPad)
+        m_pDevices[iPad]->GetPadStateLocked(state.m_Pads[iPad]);
+    m_State.Store(state);
+
+    // Clear the whole array, so padding compares equal in PublishSharedStateLocked.
+    SMXSharedPadState pads[NUM_PAD_SLOTS];
+    memset(pads, 0, sizeof(pads));
+    for(int iPad = 0; iPad < NUM_PAD_SLOTS; ++iPad)
+    {
+        memcpy(&pads[iPad].m_State, &state.m_Pads[iPad], sizeof(SMXPadState));
+        if(state.m_Pads[iPad].m_bConnected)
+            pads[iPad].m_bHaveTestData = m_pDevices[iPad]->GetTestDataLocked(pads[iPad].m_TestData);
+    }
+    PublishSharedStateLocked(pads);
+}
+
+// Write pads to g_SharedState.  This works like SeqLock::Store, but the sequence number is
+// part of the public struct.  We're called every time the I/O thread wakes up, so only write
+// if something changed.  That way readers rarely have to retry, and can use the sequence number
+// to see if anything changed.
+void SMX::SMXManager::PublishSharedStateLocked(const SMXSharedPadState *pPads)
+{
+    g_Lock.AssertLockedByCurrentThread();
+
+    if(!memcmp(g_SharedState.m_Pads, pPads, sizeof(g_SharedState.m_Pads)))
+        return;
+
+    uint32_t iSequence = g_SharedState.m_iSequence;
+    g_SharedState.m_iSequence = iSequence + 1;
+    atomic_thread_fence(memory_order_release);
+
+    memcpy(g_SharedState.m_Pads, pPads, sizeof(g_SharedState.m_Pads));
+
+    atomic_thread_fence(memory_order_release);
+    g_SharedState.m_iSequence = iSequence + 2;
+}
+
+void SMX::SMXManager::AssignCabinet(const string &sSerial, int iCabinet)
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    if(iCabinet < 0 || iCabinet >= SMX_MAX_CABINETS)
+        m_CabinetAssignments.erase(sSerial);
+    else
+        m_CabinetAssignments[sSerial] = iCabinet;
+
+    // Wake up the I/O thread to move the device.
+    WakeIOThread();
 }
 
 void SMX::SMXManager::Shutdown()
@@ -69,125 +261,450 @@ void SMX::SMXManager::Shutdown()
 
     // Make sure we're not being called from within m_UserCallbackThread, since that'll
     // deadlock when we shut down m_UserCallbackThread.
-    if(m_UserCallbackThread.GetThreadId() == GetCurrentThreadId())
+    if(m_UserCallbackThread.GetThreadId() == this_thread::get_id())
+        throw runtime_error("SMX::SMXManager::Shutdown must not be called from an SMX callback");
+
+    // Inline callbacks are called from the I/O thread, which can't wait for itself to exit.
+    if(m_Thread.get_id() == this_thread::get_id())
         throw runtime_error("SMX::SMXManager::Shutdown must not be called from an SMX callback");
 
     // Shut down the thread we make user callbacks from.
     m_UserCallbackThread.Shutdown();
 
     // Shut down the device search thread.
-    m_pSMXDeviceSearchThreaded->Shutdown();
+    if(m_pSMXDeviceSearchThreaded)
+        m_pSMXDeviceSearchThreaded->Shutdown();
 
-    if(m_hThread == INVALID_HANDLE_VALUE)
+    if(!m_Thread.joinable())
         return;
 
     // Tell the thread to shut down, and wait for it before returning.
     m_bShutdown = true;
-    SetEvent(m_hEvent->value());
+    WakeIOThread();
 
-    WaitForSingleObject(m_hThread, INFINITE);
-    m_hThread = INVALID_HANDLE_VALUE;
-}
+    m_Thread.join();
 
-DWORD WINAPI SMX::SMXManager::ThreadMainStart(void *self_)
-{
-    SMXManager *self = (SMXManager *) self_;
-    self->ThreadMain();
-    return 0;
+    // The shared state outlives us, so show that nothing is connected anymore.
+    SMXSharedPadState pads[NUM_PAD_SLOTS];
+    memset(pads, 0, sizeof(pads));
+
+    LockMutex L(g_Lock);
+    PublishSharedStateLocked(pads);
 }
 
 // When we connect to a device, we don't know whether it's P1 or P2, since we get that
-// info from the device after we connect to it.  If we have a P2 device in SMX_PadNumber_1
-// or a P1 device in SMX_PadNumber_2, swap the two.  
+// info from the device after we connect to it.  Once we know, move each device into the
+// slot for its player in its cabinet.
+//
+// Devices with a cabinet assigned by serial number go in that cabinet.  Other devices stay
+// in the cabinet they're in if their player's slot is free, so a P2 device in SMX_PadNumber_1
+// and a P1 device in SMX_PadNumber_2 are swapped.  Devices that still don't have a place go in
+// the first cabinet with a free slot for their player, so pads that connect as P1, P1, P2, P2
+// end up as two complete cabinets.  Only if every cabinet already has that player are the pads
+// misconfigured, and then we'll just leave them in their cabinet.
 void SMX::SMXManager::CorrectDeviceOrder()
 {
     // We're still holding the lock from when we updated the devices, so the application
     // won't see the devices out of order before we do this.
     g_Lock.AssertLockedByCurrentThread();
 
-    SMXInfo info[2];
-    m_pDevices[0]->GetInfoLocked(info[0]);
-    m_pDevices[1]->GetInfoLocked(info[1]);
+    int iNewSlot[NUM_PAD_SLOTS];
+    bool bSlotTaken[NUM_PAD_SLOTS];
+    int iPlayer[NUM_PAD_SLOTS];
+    int iAssignedCabinet[NUM_PAD_SLOTS];
+    for(int i = 0; i < NUM_PAD_SLOTS; ++i)
+    {
+        iNewSlot[i] = -1;
+        bSlotTaken[i] = false;
 
-    // If we have two P1s or two P2s, the pads are misconfigured and we'll just leave the order alone.
-    bool Player2[2] = {
-        m_pDevices[0]->IsPlayer2Locked(),
-        m_pDevices[1]->IsPlayer2Locked(),
+        // iPlayer is -1 if we don't know the device's player yet.
+        SMXInfo info;
+        m_pDevices[i]->GetInfoLocked(info);
+        iPlayer[i] = info.m_bConnected? (m_pDevices[i]->IsPlayer2Locked()? 1:0):-1;
+
+        iAssignedCabinet[i] = -1;
+        if(info.m_bConnected && !m_CabinetAssignments.empty())
+        {
+            auto it = m_CabinetAssignments.find(info.m_Serial);
+            if(it != m_CabinetAssignments.end())
+                iAssignedCabinet[i] = it->second;
+        }
+    }
+
+    auto claimSlot = [&](int iDevice, int iSlot) {
+        if(iNewSlot[iDevice] != -1 || bSlotTaken[iSlot])
+            return;
+        iNewSlot[iDevice] = iSlot;
+        bSlotTaken[iSlot] = true;
     };
-    if(info[0].m_bConnected && info[1].m_bConnected && Player2[0] == Player2[1])
+
+    // Devices with an assigned cabinet:
+    for(int i = 0; i < NUM_PAD_SLOTS; ++i)
+    {
+        if(iPlayer[i] != -1 && iAssignedCabinet[i] != -1)
+            claimSlot(i, iAssignedCabinet[i]*2 + iPlayer[i]);
+    }
+
+    // Devices that can use their player's slot in their current cabinet:
+    for(int i = 0; i < NUM_PAD_SLOTS; ++i)
+    {
+        if(iPlayer[i] != -1)
+            claimSlot(i, (i/2)*2 + iPlayer[i]);
+    }
+
+    // Any other connected devices go in the first cabinet with their player's slot free:
+    for(int i = 0; i < NUM_PAD_SLOTS; ++i)
+    {
+        for(int iCabinet = 0; iPlayer[i] != -1 && iCabinet < SMX_MAX_CABINETS; ++iCabinet)
+            claimSlot(i, iCabinet*2 + iPlayer[i]);
+    }
+
+    // If every cabinet already has this player, the pads are misconfigured.  Leave them in
+    // their cabinet if its other slot is free:
+    for(int i = 0; i < NUM_PAD_SLOTS; ++i)
+    {
+        if(iPlayer[i] != -1)
+            claimSlot(i, (i/2)*2 + !iPlayer[i]);
+    }
+
+    // Everything else, including devices that are still connecting and empty slots, stays
+    // where it is if it can, and otherwise fills in the remaining slots.  Do devices that have
+    // a handle first, so they're less likely to move.
+    for(int iPass = 0; iPass < 2; ++iPass)
+    {
+        for(int i = 0; i < NUM_PAD_SLOTS; ++i)
+        {
+            bool bHasHandle = m_pDevices[i]->GetDeviceHandle() != nullptr;
+            if(bHasHandle != (iPass == 0))
+                continue;
+
+            claimSlot(i, i);
+            for(int iSlot = 0; iSlot < NUM_PAD_SLOTS; ++iSlot)
+                claimSlot(i, iSlot);
+        }
+    }
+
+    bool bChanged = false;
+    for(int i = 0; i < NUM_PAD_SLOTS; ++i)
+        bChanged |= iNewSlot[i] != i;
+    if(!bChanged)
         return;
 
-    bool bP1NeedsSwap = info[0].m_bConnected && Player2[0];
-    bool bP2NeedsSwap = info[1].m_bConnected && !Player2[1];
-    if(bP1NeedsSwap || bP2NeedsSwap)
-        swap(m_pDevices[0], m_pDevices[1]);
+    for(int i = 0; i < NUM_PAD_SLOTS; ++i)
+    {
+        m_pReorderedDevices[iNewSlot[i]] = m_pDevices[i];
+        if(iNewSlot[i] == i)
+            continue;
+
+        // We don't know what lights the device that's now in this slot is showing.
+        m_pDevices[i]->SetPadNumberLocked(iNewSlot[i], &m_InputEvents[iNewSlot[i]], &m_TestFrames[iNewSlot[i]]);
+        ForgetLightsSent(iNewSlot[i]);
+    }
+    swap(m_pDevices, m_pReorderedDevices);
+
+    // Update the slots GetDevice reads.  Each slot is updated on its own, so a reader may briefly
+    // see a device in both its old and new slot, but always sees a valid device.  Everything
+    // GetDevice's callers use is safe to read from two threads at once.  Input events and test
+    // frames are the exception, and those are queued by slot, not by device.
+    for(int i = 0; i < NUM_PAD_SLOTS; ++i)
+        m_apDeviceSlots[i].store(m_pDevices[i].get());
+}
+
+void SMX::SMXManager::WakeIOThread()
+{
+    m_pIOPort->Wake();
+}
+
+void SMX::SMXManager::ApplyThreadOptions()
+{
+    WakeIOThread();
+    m_UserCallbackThread.ApplyThreadOptions();
+    if(m_pSMXDeviceSearchThreaded)
+        m_pSMXDeviceSearchThreaded->ApplyThreadOptions();
 }
 
 void SMX::SMXManager::ThreadMain()
 {
+    SetThreadName("SMXManager");
+    m_IOThreadOptions.Apply();
     g_Lock.Lock();
 
+    // If this is true, update every device on the next pass, otherwise only update the ones
+    // that have completed I/O.  We update everything the first time through, and whenever
+    // we're woken up for any other reason, since devices may have commands to send.
+    bool bUpdateAllDevices = true;
+    vector<bool> abDeviceHasIO(m_pDevices.size(), false);
+
     while(!m_bShutdown)
     {
+        // If the lights engine is running, queue new frames for cabinets that are ready for one.
+        UpdateLightsEngine();
+
         // If there are any lights commands to be sent, send them now.  Do this before callig Update(),
         // since this actually just queues commands, which are actually handled in Update.
         SendLightUpdates();
 
-        // See if there are any new devices.
-        AttemptConnections();
+        // See if there are any new devices.  If we opened one, it needs to be updated to start
+        // talking to it.
+        if(AttemptConnections())
+            bUpdateAllDevices = true;
 
-        // Update all connected devices.
-        for(shared_ptr<SMXDevice> pDevice: m_pDevices)
+        // Update connected devices.
+        for(int i = 0; i < m_pDevices.size(); ++i)
         {
+            shared_ptr<SMXDevice> pDevice = m_pDevices[i];
+            if(!bUpdateAllDevices && !abDeviceHasIO[i])
+                continue;
+
             wstring sError;
             pDevice->Update(sError);
 
             if(!sError.empty())
             {
-                Log(ssprintf("Device error: %ls", sError.c_str()));
+                LogFormat("Device error: %ls", sError);
 
                 // Tell m_pDeviceList that the device was closed, so it'll discard the device
                 // and notice if a new device shows up on the same path.
-                m_pSMXDeviceSearchThreaded->DeviceWasClosed(pDevice->GetDeviceHandle());
+                if(m_pSMXDeviceSearchThreaded)
+                    m_pSMXDeviceSearchThreaded->DeviceWasClosed(pDevice->GetDeviceHandle());
+                if(pDevice->GetDeviceHandle())
+                    m_pIOPort->RemoveDevice(pDevice->GetDeviceHandle());
                 pDevice->CloseDevice();
+
+                // The pad will be showing auto-lights when it reconnects.
+                ForgetLightsSent(i);
             }
+
+            // Let the lights engine start press animations.
+            m_LightsEngine.SetInputState(i, pDevice->GetInputState(), GetMonotonicTime());
         }
 
         // Devices may have finished initializing, so see if we need to update the ordering.
         CorrectDeviceOrder();
 
-        // Make a list of handles for WaitForMultipleObjectsEx.
-        vector<HANDLE> aHandles = { m_hEvent->value() };
-        for(shared_ptr<SMXDevice> pDevice: m_pDevices)
-        {
-            shared_ptr<AutoCloseHandle> pHandle = pDevice->GetDeviceHandle();
-            if(pHandle)
-                aHandles.push_back(pHandle->value());
-        }
+        PublishStateLocked();
 
         // See how long we should block waiting for I/O.  If we have any scheduled lights commands,
-        // wait until the next command should be sent, otherwise wait for a second.
+        // wait until the next command should be sent, otherwise wait for a second.  If we have
+        // a high-resolution timer, it'll wake us up for lights instead.
+        ScheduleLightsTimer();
         int iDelayMS = 1000;
-        if(!m_aPendingCommands.empty())
+        double fNextLightsCommandTime = GetNextLightsCommandTime();
+        if(fNextLightsCommandTime >= 0 && !m_pIOPort->HasTimer())
         {
-            double fSendIn = m_aPendingCommands[0].fTimeToSend - GetMonotonicTime();
+            double fSendIn = fNextLightsCommandTime - GetMonotonicTime();
 
             // Add 1ms to the delay time.  We're using a high resolution timer, but
-            // WaitForMultipleObjectsEx only has 1ms resolution, so this keeps us from
+            // SMXIOPort::Wait only has 1ms resolution, so this keeps us from
             // repeatedly waking up slightly too early.
             iDelayMS = int(fSendIn * 1000) + 1;
             iDelayMS = max(0, iDelayMS);
         }
 
+        // When replaying, nothing signals the completion port when reports are due, so wake
+        // up for the next one.
+        double fNextReplayTime = m_pReplay? m_pReplay->GetNextReportTime():-1;
+        if(fNextReplayTime >= 0)
+        {
+            double fReplayIn = fNextReplayTime - GetMonotonicTime();
+            int iReplayDelayMS = fReplayIn <= 0? 0:int(fReplayIn * 1000) + 1;
+            iDelayMS = min(iDelayMS, iReplayDelayMS);
+        }
+
+        // Wake up to send configuration writes that are being held back.
+        for(shared_ptr<SMXDevice> pDevice: m_pDevices)
+        {
+            double fNextConfigTime = pDevice->GetNextConfigSendTimeLocked();
+            if(fNextConfigTime < 0)
+                continue;
+
+            double fConfigIn = fNextConfigTime - GetMonotonicTime();
+            int iConfigDelayMS = fConfigIn <= 0? 0:int(fConfigIn * 1000) + 1;
+            iDelayMS = min(iDelayMS, iConfigDelayMS);
+        }
+
+        // Wake up to save changes to the device cache.
+        double fNextCacheSaveTime = m_pDeviceCache? m_pDeviceCache->GetNextSaveTime():-1;
+        if(fNextCacheSaveTime >= 0)
+        {
+            double fSaveIn = fNextCacheSaveTime - GetMonotonicTime();
+            int iSaveDelayMS = fSaveIn <= 0? 0:int(fSaveIn * 1000) + 1;
+            iDelayMS = min(iDelayMS, iSaveDelayMS);
+        }
+
         // Wait until there's something to do for a connected device, or delay briefly if we're
         // not connected to anything.  Unlock while we block.  Devices are only ever opened or
         // closed from within this thread, so the handles won't go away while we're waiting on
         // them.
         g_Lock.Unlock();
-        WaitForMultipleObjectsEx(aHandles.size(), aHandles.data(), false, iDelayMS, true);
+        DeliverUpdates();
+
+        // The cache is only used by this thread, so save it while we're unlocked, and a slow
+        // disk doesn't hold up other threads.
+        if(m_pDeviceCache)
+            m_pDeviceCache->SaveIfNeeded();
+
+        // Pick up changes from SMX_SetThreadOptions.  WakeIOThread wakes us after they change.
+        m_IOThreadOptions.Apply();
+
+        const void *apCompletions[SMXIOPort::MAX_COMPLETIONS];
+        int iCompletions = 0;
+        bool bOnlyDeviceIO = m_pIOPort->Wait(iDelayMS, apCompletions, iCompletions);
         g_Lock.Lock();
+
+        // If we timed out, were woken up or the lights timer fired, update everything.
+        bUpdateAllDevices = !bOnlyDeviceIO;
+        fill(abDeviceHasIO.begin(), abDeviceHasIO.end(), false);
+        for(int iCompletion = 0; iCompletion < iCompletions; ++iCompletion)
+        {
+            // Find the device that this I/O belongs to.  If it's not found, it's for a request
+            // that's already been handled or cancelled, and there's nothing to do.
+            for(int i = 0; i < m_pDevices.size(); ++i)
+            {
+                if(m_pDevices[i]->IsCompletionForDevice(apCompletions[iCompletion]))
+                    abDeviceHasIO[i] = true;
+            }
+        }
     }
     g_Lock.Unlock();
+    DeliverUpdates();
+
+    // Save any changes to the cache that haven't been saved yet.
+    if(m_pDeviceCache)
+        m_pDeviceCache->SaveIfNeeded(true);
+
+    m_IOThreadOptions.Revert();
+}
+
+// In inline and event modes, deliver updates queued while we were locked.  This is called
+// by the I/O thread after unlocking, so the user can call back into the SDK.
+void SMX::SMXManager::DeliverUpdates()
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+
+    if(m_CallbackMode == SMXCallbackMode_Event)
+    {
+        if(m_bUserEventPending.exchange(false))
+            SignalUserEvent();
+        return;
+    }
+
+    if(m_CallbackMode != SMXCallbackMode_Inline)
+        return;
+
+    double fStartTime = GetMonotonicTime();
+    int iCallbacks = m_UserCallbackThread.RunQueuedCallbacks();
+    if(iCallbacks == 0)
+        return;
+
+    // We only time the batch, so compare the average against the budget.
+    double fNow = GetMonotonicTime();
+    double fAverage = (fNow - fStartTime) / iCallbacks;
+    if(fAverage <= m_fInlineCallbackBudget)
+        return;
+
+    // Don't flood the log if every callback is slow.
+    m_iCallbacksOverBudget += iCallbacks;
+    if(m_fLastCallbackBudgetWarning != -1 && fNow - m_fLastCallbackBudgetWarning < 1)
+        return;
+    m_fLastCallbackBudgetWarning = fNow;
+
+    LogFormat("Inline callbacks took %.0fus each, over the %.0fus budget (%i callbacks over budget)",
+        fAverage * 1000000, m_fInlineCallbackBudget * 1000000, m_iCallbacksOverBudget);
+}
+
+// Signal the event passed in SMXStartOptions::m_hEvent.  This is a HANDLE on Windows, and an
+// eventfd on Linux.
+void SMX::SMXManager::SignalUserEvent()
+{
+#ifdef _WIN32
+    SetEvent((HANDLE) m_hUserEvent);
+#else
+    uint64_t iValue = 1;
+    if(write(int(intptr_t(m_hUserEvent)), &iValue, sizeof(iValue)) == -1 && errno != EAGAIN)
+        LogFormat("Error signalling the update event: %ls", GetErrorString(errno));
+#endif
+}
+
+// Scale a lights color.  Values over about 170 don't make the LEDs any brighter, so this
+// gives better contrast and draws less power.  This is c * 0.6666 in 16-bit fixed point:
+// (c * 43686) >> 16 gives exactly the same result as uint8_t(c * 0.6666f) for every byte.
+static const uint16_t LIGHTS_SCALE = 43686;
+
+// Copy the top or bottom half of 9 panels of lights into a lights command, scaling the
+// colors.  pPanels is 9 panels of 4x4 RGB lights in order.  If iHalf is 0 we copy the top
+// two rows of each panel, otherwise the bottom two.  This writes 9*24 bytes to pOut.
+static void PackLightsHalf(const uint8_t *pPanels, int iHalf, uint8_t *pOut)
+{
+    const __m128i scale = _mm_set1_epi16(LIGHTS_SCALE);
+    const __m128i zero = _mm_setzero_si128();
+    for(int iPanel = 0; iPanel < 9; ++iPanel)
+    {
+        // Each half of a panel is 24 contiguous bytes.  Scale the first 16, then the last 8.
+        const uint8_t *pIn = pPanels + iPanel*4*4*3 + iHalf*4*2*3;
+
+        __m128i first = _mm_loadu_si128((const __m128i *) pIn);
+        __m128i firstLow = _mm_mulhi_epu16(_mm_unpacklo_epi8(first, zero), scale);
+        __m128i firstHigh = _mm_mulhi_epu16(_mm_unpackhi_epi8(first, zero), scale);
+        _mm_storeu_si128((__m128i *) pOut, _mm_packus_epi16(firstLow, firstHigh));
+
+        __m128i last = _mm_loadl_epi64((const __m128i *) (pIn + 16));
+        __m128i lastLow = _mm_mulhi_epu16(_mm_unpacklo_epi8(last, zero), scale);
+        _mm_storel_epi64((__m128i *) (pOut + 16), _mm_packus_epi16(lastLow, zero));
+
+        pOut += 4*2*3;
+    }
+}
+
+// Build the lookup table for indexed lights from a palette of iColors RGB colors, scaling
+// the colors the same way as PackLightsHalf.  Each entry is a color in its low three bytes,
+// so it can be stored with a single 4-byte write.  Entries past the palette are black.
+static void BuildLightsPalette(const uint8_t *pColors, int iColors, uint32_t aPalette[256])
+{
+    memset(aPalette, 0, 256 * sizeof(uint32_t));
+    for(int i = 0; i < iColors; ++i)
+    {
+        const uint8_t *pColor = pColors + i*3;
+        uint32_t iR = (pColor[0] * LIGHTS_SCALE) >> 16;
+        uint32_t iG = (pColor[1] * LIGHTS_SCALE) >> 16;
+        uint32_t iB = (pColor[2] * LIGHTS_SCALE) >> 16;
+        aPalette[i] = iR | (iG << 8) | (iB << 16);
+    }
+}
+
+// Expand the top or bottom half of 9 panels of indexed lights into a lights command.
+// pIndices is 16 lights for each of 9 panels, with 4 or 8 bits per light.  With 4 bits,
+// each byte holds two lights, with the first in the low nibble.  Each light is written as
+// 4 bytes and the next light overwrites the extra byte, so this writes one byte past the
+// 9*24 bytes of lights.
+static void ExpandIndexedLightsHalf(const uint32_t aPalette[256], const uint8_t *pIndices, int iBitsPerLight, int iHalf, uint8_t *pOut)
+{
+    for(int iPanel = 0; iPanel < 9; ++iPanel)
+    {
+        if(iBitsPerLight == 8)
+        {
+            const uint8_t *pIn = pIndices + iPanel*16 + iHalf*8;
+            for(int i = 0; i < 8; ++i)
+                memcpy(pOut + i*3, &aPalette[pIn[i]], 4);
+        }
+        else
+        {
+            const uint8_t *pIn = pIndices + iPanel*8 + iHalf*4;
+            for(int i = 0; i < 4; ++i)
+            {
+                memcpy(pOut + i*6, &aPalette[pIn[i] & 0xF], 4);
+                memcpy(pOut + i*6 + 3, &aPalette[pIn[i] >> 4], 4);
+            }
+        }
+
+        pOut += 4*2*3;
+    }
+}
+
+SMX::SMXManager::PendingCommand::PendingCommand()
+{
+    for(string &sCommand: sPadCommand)
+        sCommand.reserve(LIGHTS_COMMAND_SIZE);
 }
 
 // Lights are updated with two commands.  The top two rows of LEDs in each panel are
@@ -239,27 +756,154 @@ void SMX::SMXManager::ThreadMain()
 // that we don't send the second lights commands, since that may re-disable auto lights.
 // - If we have two pads, the lights update is for both pads and we'll send both commands
 // for both pads at the same time, so both pads update lights simultaneously.
-void SMX::SMXManager::SetLights(const string &sLightData)
+void SMX::SMXManager::SetLights(int iCabinet, const char *pLightData, int iSize)
 {
     g_Lock.AssertNotLockedByCurrentThread();
     LockMutex L(g_Lock);
 
+    if(iCabinet < 0 || iCabinet >= SMX_MAX_CABINETS)
+    {
+        LogFormat("SetLights: Invalid cabinet %i", iCabinet);
+        return;
+    }
+
     // Sanity check the lights data.  It should have 18*16*3 bytes of data: RGB for each of 4x4
     // LEDs on 18 panels.
-    if(sLightData.size() != 2*3*3*16*3)
+    if(iSize != 2*3*3*16*3)
     {
-        Log(ssprintf("SetLights: Lights data should be %i bytes, received %i", 2*3*3*16*3, sLightData.size()));
+        LogFormat("SetLights: Lights data should be %i bytes, received %i", 2*3*3*16*3, iSize);
         return;
     }
 
-    // Split the lights data into P1 and P2.
-    string sPanelLights[2];
-    sPanelLights[0] = sLightData.substr(0, 9*16*3);
-    sPanelLights[1] = sLightData.substr(9*16*3);
+    if(IgnoreLightsForLightsEngine())
+        return;
+
+    // Wake up the I/O thread if it's blocking on the completion port.
+    if(QueueLightsLocked(iCabinet, (const uint8_t *) pLightData))
+        WakeIOThread();
+}
+
+void SMX::SMXManager::SetLightsBuffer(int iCabinet, const char *pLightsBuffer)
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
 
-    // Separate top and bottom lights commands.
+    if(iCabinet < 0 || iCabinet >= SMX_MAX_CABINETS)
+    {
+        LogFormat("SetLightsBuffer: Invalid cabinet %i", iCabinet);
+        return;
+    }
+
+    m_CabinetLights[iCabinet].m_pLightsBuffer = (const uint8_t *) pLightsBuffer;
+}
+
+void SMX::SMXManager::CommitLights(int iCabinet)
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    if(iCabinet < 0 || iCabinet >= SMX_MAX_CABINETS)
+    {
+        LogFormat("CommitLights: Invalid cabinet %i", iCabinet);
+        return;
+    }
+
+    const uint8_t *pLightsBuffer = m_CabinetLights[iCabinet].m_pLightsBuffer;
+    if(pLightsBuffer == nullptr)
+    {
+        LogFormat("CommitLights: No lights buffer is set for cabinet %i", iCabinet);
+        return;
+    }
+
+    if(IgnoreLightsForLightsEngine())
+        return;
+
+    // The lights are packed into commands straight from the caller's buffer.
+    if(QueueLightsLocked(iCabinet, pLightsBuffer))
+        WakeIOThread();
+}
+
+void SMX::SMXManager::SetLightsIndexed(int iCabinet, const uint8_t *pPalette, int iPaletteSize, const uint8_t *pIndices, int iBitsPerLight)
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    if(iCabinet < 0 || iCabinet >= SMX_MAX_CABINETS)
+    {
+        LogFormat("SetLightsIndexed: Invalid cabinet %i", iCabinet);
+        return;
+    }
+
+    if(iBitsPerLight != 4 && iBitsPerLight != 8)
+    {
+        LogFormat("SetLightsIndexed: Lights must have 4 or 8 bits, not %i", iBitsPerLight);
+        return;
+    }
+
+    if(iPaletteSize < 0 || iPaletteSize > (1 << iBitsPerLight))
+    {
+        LogFormat("SetLightsIndexed: Invalid palette size %i for %i-bit lights", iPaletteSize, iBitsPerLight);
+        return;
+    }
+
+    if(IgnoreLightsForLightsEngine())
+        return;
+
+    // Fold the color scaling into the palette, so it's done once per color instead of once
+    // per light.
+    uint32_t aPalette[256];
+    BuildLightsPalette(pPalette, iPaletteSize, aPalette);
+
+    bool bScheduled;
+    PendingCommand *pCommands = ScheduleLightsLocked(iCabinet, bScheduled);
+    for(int iCommand = 0; iCommand < 2; ++iCommand)
+    {
+        for(int iPad = 0; iPad < 2; ++iPad)
+        {
+            // The strings have already reserved this much, so this doesn't allocate.
+            string &sCommand = pCommands[iCommand].sPadCommand[iPad];
+            sCommand.resize(LIGHTS_COMMAND_SIZE);
+
+            // ExpandIndexedLightsHalf writes one byte past the lights, over the newline,
+            // so write the newline after it.
+            uint8_t *pCommand = (uint8_t *) &sCommand[0];
+            const uint8_t *pPadIndices = pIndices + iPad*9*16*iBitsPerLight/8;
+            pCommand[0] = iCommand == 0? '2':'3';
+            ExpandIndexedLightsHalf(aPalette, pPadIndices, iBitsPerLight, iCommand, pCommand + 1);
+            pCommand[LIGHTS_COMMAND_SIZE-1] = '\n';
+        }
+    }
+
+    if(bScheduled)
+        WakeIOThread();
+}
+
+// The lights engine owns the lights while it's enabled, so lights from the application are
+// ignored.  Return true if this is the case, logging it the first time.
+bool SMX::SMXManager::IgnoreLightsForLightsEngine()
+{
+    g_Lock.AssertLockedByCurrentThread();
+    if(!m_bLightsEngineEnabled)
+        return false;
+
+    if(!m_bLoggedLightsEngineEnabled)
+        Log("SetLights: Ignoring lights updates while the lights engine is enabled");
+    m_bLoggedLightsEngineEnabled = true;
+    return true;
+}
+
+// Queue a lights update for a cabinet, replacing a queued update that hasn't been started.
+// Return true if new commands were scheduled, so the I/O thread needs to wake up to send them.
+bool SMX::SMXManager::QueueLightsLocked(int iCabinet, const uint8_t *pLightData)
+{
+    g_Lock.AssertLockedByCurrentThread();
+
+    bool bScheduled;
+    PendingCommand *pCommands = ScheduleLightsLocked(iCabinet, bScheduled);
+
+    // Separate top and bottom lights commands, writing directly into the two commands.
     //
-    // sPanelLights[iPad] is
+    // The lights data for each pad is
     //
     // 0123 0123 0123
     // 4567 4567 4567
@@ -276,46 +920,35 @@ void SMX::SMXManager::SetLights(const string &sLightData)
     // 89AB 89AB 89AB
     // CDEF CDEF CDEF
     //
-    // Set sLightsCommand[iPad][0] to include 0123 4567, and [1] to 89AB CDEF.
-    string sLightCommands[2][2]; // sLightCommands[command][pad]
-
-    auto addByte = [&sLightCommands](int iPanel, int iByte, uint8_t iColor) {
-        // If iPanel is 0-8, this is for pad 0.  For 9-17, it's for pad 1.
-        // If the color byte within the panel is in the top half, it's the first
-        // command, otherwise it's the second command.
-        int iPad = iPanel < 9? 0:1;
-        int iCommandIndex = iByte < 4*2*3? 0:1;
-        sLightCommands[iCommandIndex][iPad].append(1, iColor);
-    };
-
-    // Read the linearly arranged color data we've been given and split it into top and
-    // bottom commands for each pad.
-    int iNextInputByte = 0;
-    for(int iPanel = 0; iPanel < 18; ++iPanel)
+    // The first command includes 0123 4567 for each panel, and the second has 89AB CDEF.
+    for(int iCommand = 0; iCommand < 2; ++iCommand)
     {
-        for(int iByte = 0; iByte < 4*4*3; ++iByte)
+        PendingCommand &command = pCommands[iCommand];
+        for(int iPad = 0; iPad < 2; ++iPad)
         {
-            uint8_t iColor = sLightData[iNextInputByte++];
-            addByte(iPanel, iByte, iColor);
+            // The strings have already reserved this much, so this doesn't allocate.
+            string &sCommand = command.sPadCommand[iPad];
+            sCommand.resize(LIGHTS_COMMAND_SIZE);
+
+            uint8_t *pCommand = (uint8_t *) &sCommand[0];
+            const uint8_t *pPadLights = pLightData + iPad*9*4*4*3;
+            pCommand[0] = iCommand == 0? '2':'3';
+            PackLightsHalf(pPadLights, iCommand, pCommand + 1);
+            pCommand[LIGHTS_COMMAND_SIZE-1] = '\n';
         }
     }
 
-    for(int iPad = 0; iPad < 2; ++iPad)
-    {
-        for(int iCommand = 0; iCommand < 2; ++iCommand)
-        {
-            string &sCommand = sLightCommands[iCommand][iPad];
-
-            // Apply color scaling.  Values over about 170 don't make the LEDs any brighter, so this
-            // gives better contrast and draws less power.
-            for(char &c: sCommand)
-                c = char(uint8_t(c) * 0.6666f);
+    return bScheduled;
+}
 
-            // Add the command byte.
-            sCommand.insert(sCommand.begin(), 1, iCommand == 0? '2':'3');
-            sCommand.push_back('\n');
-        }
-    }
+// Make room for a lights update for a cabinet, and return the two commands to write it into.
+// bScheduled is set to true if new commands were scheduled, so the I/O thread needs to wake
+// up to send them, or false if a queued update that hadn't been started is being replaced.
+SMX::SMXManager::PendingCommand *SMX::SMXManager::ScheduleLightsLocked(int iCabinet, bool &bScheduled)
+{
+    g_Lock.AssertLockedByCurrentThread();
+    CabinetLights &lights = m_CabinetLights[iCabinet];
+    bScheduled = false;
 
     // Each update adds two entries to m_aPendingCommands, one for the top half and one
     // for the lower half.
@@ -331,36 +964,31 @@ void SMX::SMXManager::SetLights(const string &sLightData)
     // This way, we'll always finish a lights update once we start it, so if we receive lights updates
     // very quickly we won't just keep sending the first half and never finish one.  Otherwise, we'll
     // update with the newest data we have available.
-    if(m_aPendingCommands.size() <= 1)
+    if(lights.m_iPendingCommands <= 1)
     {
         static const double fDelayBetweenLightsCommands = 1/60.0;
 
         double fNow = GetMonotonicTime();
-        double fSendCommandAt = max(fNow, m_fDelayLightCommandsUntil);
-        float fFirstCommandTime = fSendCommandAt;
-        float fSecondCommandTime = fFirstCommandTime + fDelayBetweenLightsCommands;
+        double fSendCommandAt = max(fNow, lights.m_fDelayLightCommandsUntil);
+        double fFirstCommandTime = fSendCommandAt;
+        double fSecondCommandTime = fFirstCommandTime + fDelayBetweenLightsCommands;
 
         // Update m_fDelayLightCommandsUntil, so we know when the next 
-        m_fDelayLightCommandsUntil = fSecondCommandTime + fDelayBetweenLightsCommands;
+        lights.m_fDelayLightCommandsUntil = fSecondCommandTime + fDelayBetweenLightsCommands;
 
         // Add two commands to the list, scheduled at fFirstCommandTime and fSecondCommandTime.
-        m_aPendingCommands.push_back(PendingCommand(fFirstCommandTime));
-        m_aPendingCommands.push_back(PendingCommand(fSecondCommandTime));
+        lights.m_aPendingCommands[lights.m_iPendingCommands++].fTimeToSend = fFirstCommandTime;
+        lights.m_aPendingCommands[lights.m_iPendingCommands++].fTimeToSend = fSecondCommandTime;
         // Log(ssprintf("Scheduled commands at %f and %f", fFirstCommandTime, fSecondCommandTime));
-
-        // Wake up the I/O thread if it's blocking on WaitForMultipleObjectsEx.
-        SetEvent(m_hEvent->value());
+        bScheduled = true;
+    }
+    else
+    {
+        // The update we're about to overwrite was never sent.
+        g_Stats.m_iLightsUpdatesDropped++;
     }
 
-    // Set the pad commands.
-    PendingCommand *pPendingCommands[2];
-    pPendingCommands[0] = &m_aPendingCommands[m_aPendingCommands.size()-2];
-    pPendingCommands[1] = &m_aPendingCommands[m_aPendingCommands.size()-1];
-
-    pPendingCommands[0]->sPadCommand[0] = sLightCommands[0][0];
-    pPendingCommands[0]->sPadCommand[1] = sLightCommands[0][1];
-    pPendingCommands[1]->sPadCommand[0] = sLightCommands[1][0];
-    pPendingCommands[1]->sPadCommand[1] = sLightCommands[1][1];
+    return &lights.m_aPendingCommands[lights.m_iPendingCommands - 2];
 }
 
 void SMX::SMXManager::ReenableAutoLights()
@@ -371,40 +999,297 @@ void SMX::SMXManager::ReenableAutoLights()
     // Clear any pending lights commands, so we don't re-disable auto-lighting by sending a
     // lights command after we enable it.  If we've sent the first half of a lights update
     // and this causes us to not send the second half, the controller will just discard it.
-    m_aPendingCommands.clear();
-    for(int iPad = 0; iPad < 2; ++iPad)
-        m_pDevices[iPad]->SendCommandLocked(string("S 1\n", 4));
+    for(CabinetLights &lights: m_CabinetLights)
+        lights.m_iPendingCommands = 0;
+
+    // Stop the lights engine, or it would disable auto-lighting again with its next frame.
+    m_bLightsEngineEnabled = false;
+
+    for(int iPad = 0; iPad < NUM_PAD_SLOTS; ++iPad)
+    {
+        // Send this in the lights class, so it's sent after any lights commands that are
+        // still waiting.
+        m_pDevices[iPad]->SendCommandLocked(string("S 1\n", 4), nullptr, CommandClass_Lights);
+        ForgetLightsSent(iPad);
+    }
+}
+
+void SMX::SMXManager::SetLightsDeltaMode(bool bEnable)
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    m_bLightsDeltaMode = bEnable;
+    for(int iPad = 0; iPad < NUM_PAD_SLOTS; ++iPad)
+        ForgetLightsSent(iPad);
+}
+
+void SMX::SMXManager::SetLightsEngineEnabled(bool bEnable)
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    if(m_bLightsEngineEnabled == bEnable)
+        return;
+
+    // Discard lights updates from SetLights that haven't been started, so the engine's frames
+    // aren't queued behind them.
+    m_bLightsEngineEnabled = bEnable;
+    m_bLoggedLightsEngineEnabled = false;
+    for(CabinetLights &lights: m_CabinetLights)
+    {
+        if(lights.m_iPendingCommands >= 2)
+            lights.m_iPendingCommands -= 2;
+    }
+
+    WakeIOThread();
+}
+
+int SMX::SMXManager::CreateLightsAnimation(const SMXLightsKeyframe *pKeyframes, int iKeyframes, bool bLoop)
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    return m_LightsEngine.CreateAnimation(pKeyframes, iKeyframes, bLoop);
+}
+
+void SMX::SMXManager::DeleteLightsAnimation(int iAnimation)
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    m_LightsEngine.DeleteAnimation(iAnimation);
+}
+
+void SMX::SMXManager::SetPanelAnimation(int iPad, int iPanel, SMXLightsTrigger trigger, int iAnimation)
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    m_LightsEngine.SetPanelAnimation(iPad, iPanel, trigger, iAnimation);
+
+    // A cabinet may have become animated, so wake up the I/O thread to start rendering it.
+    WakeIOThread();
+}
+
+void SMX::SMXManager::PlayPanelAnimation(int iPad, int iPanel, int iAnimation)
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    m_LightsEngine.PlayAnimation(iPad, iPanel, iAnimation, GetMonotonicTime());
+    WakeIOThread();
+}
+
+// Return true if the lights engine should render a frame for a cabinet when it's ready for
+// one.  We don't render for cabinets with nothing to show, or with no pads connected.
+bool SMX::SMXManager::ShouldRenderLightsEngine(int iCabinet) const
+{
+    if(!m_bLightsEngineEnabled || !m_LightsEngine.IsCabinetAnimated(iCabinet))
+        return false;
+    return m_pDevices[iCabinet*2]->IsConnected() || m_pDevices[iCabinet*2+1]->IsConnected();
 }
 
-// Check to see if we should send any commands in m_aPendingCommands.
+// Render and queue a lights update for each animated cabinet that has finished sending its
+// last one.  Frames are rendered as late as possible, so they show the most recent input.
+void SMX::SMXManager::UpdateLightsEngine()
+{
+    g_Lock.AssertLockedByCurrentThread();
+
+    double fNow = GetMonotonicTime();
+    for(int iCabinet = 0; iCabinet < SMX_MAX_CABINETS; ++iCabinet)
+    {
+        const CabinetLights &lights = m_CabinetLights[iCabinet];
+        if(lights.m_iPendingCommands != 0 || fNow < lights.m_fDelayLightCommandsUntil)
+            continue;
+        if(!ShouldRenderLightsEngine(iCabinet))
+            continue;
+
+        m_LightsEngine.Render(iCabinet, fNow, m_LightsEngineFrame);
+        QueueLightsLocked(iCabinet, m_LightsEngineFrame);
+    }
+}
+
+// In delta lights mode, return true if the lights update starting with sFirstHalf is the
+// same as what the pad is already showing and doesn't need to be sent.
+bool SMX::SMXManager::ShouldSkipLightsUpdate(int iPad, const string &sFirstHalf, const string &sSecondHalf)
+{
+    g_Lock.AssertLockedByCurrentThread();
+    if(!m_bLightsDeltaMode)
+        return false;
+
+    // Always send to pads that aren't connected.  This won't do anything, but it makes sure
+    // we don't think the pad has lights that it never received.
+    if(!m_pDevices[iPad]->IsConnected())
+        return false;
+
+    // Send an update at least twice per auto-lights timeout, even if nothing has changed,
+    // so the pad doesn't return to auto-lighting.
+    double fTimeout = 1;
+    SMXConfig config;
+    if(m_pDevices[iPad]->GetConfig(config) && config.autoLightsTimeout != 0)
+        fTimeout = config.autoLightsTimeout * 0.128;
+    if(GetMonotonicTime() - m_fLightsSentAt[iPad] >= fTimeout / 2)
+        return false;
+
+    return sFirstHalf == m_sLightsSent[iPad][0] && sSecondHalf == m_sLightsSent[iPad][1];
+}
+
+// Forget what lights we last sent to a pad, so the next lights update is always sent.
+void SMX::SMXManager::ForgetLightsSent(int iPad)
+{
+    g_Lock.AssertLockedByCurrentThread();
+    m_sLightsSent[iPad][0].clear();
+    m_sLightsSent[iPad][1].clear();
+    m_fLightsSentAt[iPad] = -1;
+}
+
+// Check to see if we should send any lights commands.
 void SMX::SMXManager::SendLightUpdates()
 {
     g_Lock.AssertLockedByCurrentThread();
-    if(m_aPendingCommands.empty())
+    for(int iCabinet = 0; iCabinet < SMX_MAX_CABINETS; ++iCabinet)
+        SendLightUpdatesForCabinet(iCabinet);
+}
+
+void SMX::SMXManager::SendLightUpdatesForCabinet(int iCabinet)
+{
+    CabinetLights &lights = m_CabinetLights[iCabinet];
+    if(lights.m_iPendingCommands == 0)
         return;
 
-    const PendingCommand &command = m_aPendingCommands[0];
+    const PendingCommand &command = lights.m_aPendingCommands[0];
 
     // See if it's time to send the next command.  We only need to look at the first
     // command, since these are always sorted.
     if(command.fTimeToSend > GetMonotonicTime())
         return;
 
+    // Record how late we are sending this command.
+    double fLateness = max(0.0, GetMonotonicTime() - command.fTimeToSend);
+    uint32_t iLatenessMicroseconds = uint32_t(min(fLateness * 1000000, 4e9));
+    int iBucket = 0;
+    while(iBucket < 7 && iLatenessMicroseconds >= (250u << iBucket))
+        iBucket++;
+    m_LightsTimingStats.m_iLatenessHistogram[iBucket]++;
+    m_LightsTimingStats.m_iCommandsSent++;
+    m_LightsTimingStats.m_iMaxLatenessMicroseconds = max(m_LightsTimingStats.m_iMaxLatenessMicroseconds, iLatenessMicroseconds);
+    m_fTotalLightsLateness += fLateness;
+
     // Send the lights command for each pad.  If either pad isn't connected, this won't do
     // anything.
-    for(int iPad = 0; iPad < 2; ++iPad)
-        m_pDevices[iPad]->SendCommandLocked(command.sPadCommand[iPad]);
+    for(int iPlayer = 0; iPlayer < 2; ++iPlayer)
+    {
+        // If this is the first half of an update, decide whether to send the update to this
+        // pad.  The second half is always the next command.  We only skip whole updates,
+        // since the pad only shows an update once it has both halves.
+        int iPad = iCabinet*2 + iPlayer;
+        const string &sCommand = command.sPadCommand[iPlayer];
+        int iHalf = sCommand[0] == '2'? 0:1;
+        if(iHalf == 0)
+            m_bSkippingLightsUpdate[iPad] = ShouldSkipLightsUpdate(iPad, sCommand, lights.m_aPendingCommands[1].sPadCommand[iPlayer]);
+        if(m_bSkippingLightsUpdate[iPad])
+            continue;
+
+        m_pDevices[iPad]->SendCommandLocked(sCommand, nullptr, CommandClass_Lights);
+
+        if(m_bLightsDeltaMode)
+        {
+            m_sLightsSent[iPad][iHalf] = sCommand;
+            if(iHalf == 0)
+                m_fLightsSentAt[iPad] = GetMonotonicTime();
+        }
+    }
+
+    // Remove the command we've sent.  Swap it to the end of the list rather than discarding
+    // it, so its strings are reused by the next update.
+    for(int i = 1; i < lights.m_iPendingCommands; ++i)
+        swap(lights.m_aPendingCommands[i-1], lights.m_aPendingCommands[i]);
+    lights.m_iPendingCommands--;
+}
+
+// Return the time the next lights command for any cabinet should be sent, or -1 if there
+// are no lights commands waiting and the lights engine has nothing to render.
+double SMX::SMXManager::GetNextLightsCommandTime() const
+{
+    double fNextTime = -1;
+    for(int iCabinet = 0; iCabinet < SMX_MAX_CABINETS; ++iCabinet)
+    {
+        // If nothing is queued and the lights engine is running for this cabinet, we need to
+        // wake up when it can render the next frame.
+        const CabinetLights &lights = m_CabinetLights[iCabinet];
+        double fTimeToSend;
+        if(lights.m_iPendingCommands != 0)
+            fTimeToSend = lights.m_aPendingCommands[0].fTimeToSend;
+        else if(ShouldRenderLightsEngine(iCabinet))
+            fTimeToSend = lights.m_fDelayLightCommandsUntil;
+        else
+            continue;
+
+        if(fNextTime < 0 || fTimeToSend < fNextTime)
+            fNextTime = fTimeToSend;
+    }
+    return fNextTime;
+}
+
+// Set the lights timer for the next scheduled lights command.
+void SMX::SMXManager::ScheduleLightsTimer()
+{
+    g_Lock.AssertLockedByCurrentThread();
+    if(!m_pIOPort->HasTimer())
+        return;
+
+    double fTimeToSend = GetNextLightsCommandTime();
+    if(fTimeToSend < 0)
+    {
+        // There's nothing to send.  If the timer is set it's for a command that was cancelled,
+        // and it's harmless to let it fire.
+        return;
+    }
+
+    // This does nothing if the timer is already set for this command.  When it fires, we'll
+    // send the command, or set it again if the command isn't quite due yet.
+    m_pIOPort->SetTimer(fTimeToSend);
+    m_LightsTimingStats.m_bHighResolutionTimer = m_pIOPort->HasTimer();
+}
+
+// Fill in the per-pad command queue depths and lights timing in stats.  The rest of SMXStats
+// is in g_Stats.
+void SMX::SMXManager::GetStats(SMXStats &stats, bool bReset)
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    for(int iPad = 0; iPad < NUM_PAD_SLOTS; ++iPad)
+        m_pDevices[iPad]->GetCommandQueueDepthLocked(stats.m_iCommandQueueDepth[iPad], stats.m_iMaxCommandQueueDepth[iPad], bReset);
 
-    // Remove the command we've sent.
-    m_aPendingCommands.erase(m_aPendingCommands.begin(), m_aPendingCommands.begin()+1);
+    SMXLightsTimingStats &lightsStats = stats.m_LightsTiming;
+    lightsStats = m_LightsTimingStats;
+    if(lightsStats.m_iCommandsSent > 0)
+        lightsStats.m_iAverageLatenessMicroseconds = uint32_t(m_fTotalLightsLateness * 1000000 / lightsStats.m_iCommandsSent);
+
+    if(bReset)
+    {
+        bool bHighResolutionTimer = m_LightsTimingStats.m_bHighResolutionTimer;
+        memset(&m_LightsTimingStats, 0, sizeof(m_LightsTimingStats));
+        m_LightsTimingStats.m_bHighResolutionTimer = bHighResolutionTimer;
+        m_fTotalLightsLateness = 0;
+    }
 }
 
-// See if there are any new devices to connect to.
-void SMX::SMXManager::AttemptConnections()
+// See if there are any new devices to connect to.  Return true if we opened a device.
+bool SMX::SMXManager::AttemptConnections()
 {
     g_Lock.AssertLockedByCurrentThread();
 
-    vector<shared_ptr<AutoCloseHandle>> apDevices = m_pSMXDeviceSearchThreaded->GetDevices();
+    if(m_pReplay)
+        return AttemptReplayConnections();
+    if(m_pSMXDeviceSearchThreaded == nullptr)
+        return false;
+
+    double fDevicesChangedAt;
+    vector<shared_ptr<AutoCloseHandle>> apDevices = m_pSMXDeviceSearchThreaded->GetDevices(&fDevicesChangedAt);
+    bool bOpenedDevice = false;
 
     // Check each device that we've found.  This will include ones we already have open.
     for(shared_ptr<AutoCloseHandle> pHandle: apDevices)
@@ -434,18 +1319,69 @@ void SMX::SMXManager::AttemptConnections()
 
         if(pDeviceToOpen == nullptr)
         {
-            // All device slots are used.  Are there more than two devices plugged in?
-            Log("Error: No available slots for device.  Are more than two devices connected?");
+            // All device slots are used.  Are there more devices plugged in than we support?
+            LogFormat("Error: No available slots for device.  Are more than %i devices connected?", (int) NUM_PAD_SLOTS);
             break;
         }
 
-        // Open the device in this slot.
+        // Open the device in this slot.  Add it to our I/O port first, so we're woken up by the
+        // reads it starts.
         Log("Opening SMX device");
+        if(!m_pIOPort->AddDevice(pHandle))
+            continue;
+
         wstring sError;
         pDeviceToOpen->OpenDeviceHandle(pHandle, sError);
         if(!sError.empty())
-            Log(ssprintf("Error opening device: %ls", sError.c_str()));
+            LogFormat("Error opening device: %ls", sError);
+        else
+        {
+            g_Stats.m_DeviceOpenDelay.AddSample(GetMonotonicTime() - fDevicesChangedAt);
+            if(m_pCaptureWriter)
+                pDeviceToOpen->SetCaptureWriter(m_pCaptureWriter);
+        }
+        bOpenedDevice = true;
     }
+
+    return bOpenedDevice;
+}
+
+// Connect replayed devices that have reached the point in the capture where they connected.
+bool SMX::SMXManager::AttemptReplayConnections()
+{
+    g_Lock.AssertLockedByCurrentThread();
+
+    bool bOpenedDevice = false;
+    for(int iReplayDevice = 0; iReplayDevice < m_pReplay->GetNumDevices(); ++iReplayDevice)
+    {
+        if(!m_pReplay->IsDeviceWaitingToConnect(iReplayDevice))
+            continue;
+
+        shared_ptr<SMXDevice> pDeviceToOpen;
+        for(shared_ptr<SMXDevice> pDevice: m_pDevices)
+        {
+            if(pDevice->GetDeviceHandle() == NULL)
+            {
+                pDeviceToOpen = pDevice;
+                break;
+            }
+        }
+
+        // If every slot is in use, wait for one to be freed.
+        if(pDeviceToOpen == nullptr)
+            break;
+
+        LogFormat("Opening replayed SMX device %i", iReplayDevice);
+        wstring sError;
+        pDeviceToOpen->OpenReplay(m_pReplay, iReplayDevice, sError);
+        if(!sError.empty())
+            LogFormat("Error opening device: %ls", sError);
+        else if(m_pCaptureWriter)
+            pDeviceToOpen->SetCaptureWriter(m_pCaptureWriter);
+        bOpenedDevice = true;
+    }
+
+    return bOpenedDevice;
 }
 
 
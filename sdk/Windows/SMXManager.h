@@ -1,19 +1,26 @@
 #ifndef SMXManager_h
 #define SMXManager_h
 
-#include <windows.h>
 #include <memory>
 #include <vector>
+#include <map>
 #include <functional>
+#include <thread>
 using namespace std;
 
 #include "Helpers.h"
 #include "../SMX.h"
+#include "SMXDevice.h"
 #include "SMXHelperThread.h"
+#include "SMXLightsEngine.h"
+#include "SMXThreadOptions.h"
 
 namespace SMX {
-class SMXDevice;
 class SMXDeviceSearchThreaded;
+class SMXReplay;
+class SMXCaptureWriter;
+class SMXDeviceCache;
+class SMXIOPort;
 
 struct SMXControllerState
 {
@@ -30,46 +37,182 @@ struct SMXControllerState
 // Connected controllers can be accessed with GetDevice(), 
 // This also abstracts controller numbers.  GetDevice(SMX_PadNumber_1) will return the
 // first device that connected, 
+//
+// Devices are kept in NUM_PAD_SLOTS slots, two for each cabinet.  The pad number of a device
+// is its slot, cabinet*2 + player.
 class SMXManager
 {
 public:
     // pCallback is a function to be called when something changes on any device.  This allows
-    // efficiently detecting when a panel is pressed or other changes happen.
-    SMXManager(function<void(int PadNumber, SMXUpdateCallbackReason reason)> pCallback);
+    // efficiently detecting when a panel is pressed or other changes happen.  options.m_CallbackMode
+    // selects which thread it's called from, or whether an event is set instead.
+    SMXManager(function<void(int PadNumber, SMXUpdateCallbackReason reason)> pCallback, const SMXStartOptions &options);
     ~SMXManager();
 
+    static const int NUM_PAD_SLOTS = SMX_MAX_CABINETS*2;
+
     void Shutdown();
-    shared_ptr<SMXDevice> GetDevice(int pad);
-    void SetLights(const string &sLightData);
+
+    // Return the device in a pad slot.  This doesn't lock, so it can be called from any thread.
+    // If pad is out of range, an error is logged and a device that's never connected is returned.
+    SMXDevice *GetDevice(int pad);
+
+    // Read queued input events and streamed test frames for a pad slot.  These don't lock, and
+    // only one thread may read each slot.
+    int ReadInputEvents(int pad, SMXInputEvent *pEvents, int iMaxEvents);
+    int ReadTestFrames(int pad, SMXTestFrame *pFrames, int iMaxFrames);
+
+    void AssignCabinet(const string &sSerial, int iCabinet);
+    void GetState(SMXState &state) const;
+    static const SMXSharedState *GetSharedState();
+    void SetLights(int iCabinet, const char *pLightData, int iSize);
+    void SetLightsIndexed(int iCabinet, const uint8_t *pPalette, int iPaletteSize, const uint8_t *pIndices, int iBitsPerLight);
+    void SetLightsBuffer(int iCabinet, const char *pLightsBuffer);
+    void CommitLights(int iCabinet);
     void ReenableAutoLights();
+    void SetLightsDeltaMode(bool bEnable);
+    void SetLightsEngineEnabled(bool bEnable);
+    int CreateLightsAnimation(const SMXLightsKeyframe *pKeyframes, int iKeyframes, bool bLoop);
+    void DeleteLightsAnimation(int iAnimation);
+    void SetPanelAnimation(int iPad, int iPanel, SMXLightsTrigger trigger, int iAnimation);
+    void PlayPanelAnimation(int iPad, int iPanel, int iAnimation);
+    void GetStats(SMXStats &stats, bool bReset);
+
+    // Wake our threads, so they apply options changed with SMX_SetThreadOptions.
+    void ApplyThreadOptions();
 
 private:
-    static DWORD WINAPI ThreadMainStart(void *self_);
     void ThreadMain();
-    void AttemptConnections();
+    void WakeIOThread();
+    void DeliverUpdates();
+    void SignalUserEvent();
+    bool AttemptConnections();
+    bool AttemptReplayConnections();
     void CorrectDeviceOrder();
+    void PublishStateLocked();
+    void PublishSharedStateLocked(const SMXSharedPadState *pPads);
+    bool IgnoreLightsForLightsEngine();
+    bool QueueLightsLocked(int iCabinet, const uint8_t *pLightData);
+    bool ShouldRenderLightsEngine(int iCabinet) const;
+    void UpdateLightsEngine();
     void SendLightUpdates();
+    void SendLightUpdatesForCabinet(int iCabinet);
+    double GetNextLightsCommandTime() const;
+    void ScheduleLightsTimer();
+    bool ShouldSkipLightsUpdate(int iPad, const string &sFirstHalf, const string &sSecondHalf);
+    void ForgetLightsSent(int iPad);
+
+    thread m_Thread;
 
-    HANDLE m_hThread = INVALID_HANDLE_VALUE;
-    shared_ptr<SMX::AutoCloseHandle> m_hEvent;
+    // The I/O thread runs at high priority by default, since we don't want input events to
+    // be preempted by other things and reduce timing accuracy.
+    SMXThreadOptionsApplier m_IOThreadOptions{SMXThread_IO, THREAD_PRIORITY_HIGHEST};
+
+    // The I/O thread waits on this.  Device handles are added to it, so each wakeup tells us
+    // exactly which device's I/O finished.  Other threads call Wake to wake the thread when
+    // there's something for it to do.
+    shared_ptr<SMXIOPort> m_pIOPort;
     shared_ptr<SMXDeviceSearchThreaded> m_pSMXDeviceSearchThreaded;
+
+    // If replaying, the replay devices are connected from, and m_pSMXDeviceSearchThreaded is null.
+    shared_ptr<SMXReplay> m_pReplay;
+
+    // If capturing, the file traffic for every connection is written to.
+    shared_ptr<SMXCaptureWriter> m_pCaptureWriter;
+
+    // If enabled, the cache of device configurations.  This is only used by the I/O thread.
+    shared_ptr<SMXDeviceCache> m_pDeviceCache;
     bool m_bShutdown = false;
     vector<shared_ptr<SMXDevice>> m_pDevices;
 
+    // The state of all devices, returned by GetState.  This is published by the I/O thread
+    // each time it finishes updating devices, and read without locking.  The same state is
+    // also published to the block returned by GetSharedState.
+    SeqLock<SMXState> m_State;
+
+    // Cabinets chosen for pads by serial number with AssignCabinet.
+    map<string, int> m_CabinetAssignments;
+
+    // Scratch space for CorrectDeviceOrder, so reordering devices doesn't allocate.
+    vector<shared_ptr<SMXDevice>> m_pReorderedDevices;
+
+    // The device in each slot, for GetDevice.  m_pDevices is only used while holding g_Lock,
+    // so this is updated along with it.  Devices are never destroyed while we exist, so these
+    // stay valid after a device moves to another slot.
+    atomic<SMXDevice *> m_apDeviceSlots[NUM_PAD_SLOTS];
+
+    // Input events and streamed test frames for each slot.  These belong to the slot and not
+    // the device, so the reader for a slot never pops a queue that another slot's reader is
+    // popping, even while devices are being reordered.
+    InputEventQueue m_InputEvents[NUM_PAD_SLOTS];
+    TestFrameQueue m_TestFrames[NUM_PAD_SLOTS];
+
+    // The device GetDevice returns for invalid pad numbers, which never connects.
+    shared_ptr<SMXDevice> m_pInvalidDevice;
+
     // We make user callbacks asynchronously in this thread, to avoid any locking or timing
-    // issues that could occur by calling them in our I/O thread.
+    // issues that could occur by calling them in our I/O thread.  With SMXCallbackMode_Inline,
+    // the thread isn't started, and the I/O thread runs the queued callbacks itself each time
+    // it unlocks.
     SMXHelperThread m_UserCallbackThread;
 
+    // How updates are delivered to the user.  With SMXCallbackMode_Event, m_bUserEventPending
+    // is set when something changes, and m_hUserEvent is set when the I/O thread next unlocks.
+    SMXCallbackMode m_CallbackMode;
+    double m_fInlineCallbackBudget;
+    double m_fLastCallbackBudgetWarning = -1;
+    int m_iCallbacksOverBudget = 0;
+    void *m_hUserEvent = NULL;
+    atomic<bool> m_bUserEventPending{false};
+
+    // Each lights command is the command byte, the top or bottom two rows of 4x4 RGB lights
+    // for each of 9 panels, and a newline.
+    static const int LIGHTS_COMMAND_SIZE = 1 + 9*4*2*3 + 1;
+
     // A list of queued lights commands to send to the controllers.  This is always sorted
-    // by iTimeToSend.
+    // by fTimeToSend.  A lights update is two commands, and we only ever have a partially
+    // sent update and one more queued, so there are at most 3 commands.  The command strings
+    // are allocated once and reused, so queueing lights doesn't allocate.
     struct PendingCommand
     {
-        PendingCommand(float fTime): fTimeToSend(fTime) { }
+        PendingCommand();
         double fTimeToSend = 0;
         string sPadCommand[2];
     };
-    vector<PendingCommand> m_aPendingCommands;
-    double m_fDelayLightCommandsUntil = 0;
+
+    // Each cabinet's lights are scheduled separately.
+    struct CabinetLights
+    {
+        PendingCommand m_aPendingCommands[3];
+        int m_iPendingCommands = 0;
+        double m_fDelayLightCommandsUntil = 0;
+
+        // The caller's buffer set with SetLightsBuffer, which CommitLights sends from.
+        const uint8_t *m_pLightsBuffer = nullptr;
+    };
+    CabinetLights m_CabinetLights[SMX_MAX_CABINETS];
+    PendingCommand *ScheduleLightsLocked(int iCabinet, bool &bScheduled);
+
+    // If true, lights updates that don't change a pad's lights aren't sent to it, except
+    // often enough to keep it from timing out and returning to auto-lighting.  m_sLightsSent
+    // is the last update we sent to each pad, and is cleared when we don't know what the pad
+    // is showing.  m_bSkippingLightsUpdate is set when we decide to skip the first half of
+    // an update, so we skip the second half too.
+    bool m_bLightsDeltaMode = false;
+    string m_sLightsSent[NUM_PAD_SLOTS][2]; // [pad][half]
+    double m_fLightsSentAt[NUM_PAD_SLOTS];
+    bool m_bSkippingLightsUpdate[NUM_PAD_SLOTS];
+
+    // If enabled, the lights engine renders a lights update for each animated cabinet as
+    // soon as the previous one has been sent, and SetLights is ignored.  m_LightsEngineFrame
+    // is the buffer it renders into.
+    bool m_bLightsEngineEnabled = false;
+    bool m_bLoggedLightsEngineEnabled = false;
+    SMXLightsEngine m_LightsEngine;
+    uint8_t m_LightsEngineFrame[SMXLightsEngine::CABINET_LIGHTS_SIZE];
+
+    SMXLightsTimingStats m_LightsTimingStats;
+    double m_fTotalLightsLateness = 0;
 };
 }
 
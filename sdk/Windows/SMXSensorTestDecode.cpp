@@ -0,0 +1,85 @@
+#include "SMXSensorTestDecode.h"
+
+#include <string.h>
+#include <emmintrin.h>
+using namespace SMX;
+
+void SMX::DecodeSensorTestData(const uint16_t *pWords, int iWords, uint8_t *pOut, int iOutSize)
+{
+    // Copy the words into a zero-padded buffer, so we can always read whole blocks of 16.
+    uint16_t words[MAX_SENSOR_TEST_DECODE_SIZE*8];
+    int iBlocks = (iOutSize + 1) / 2;
+    int iWordsNeeded = iBlocks * 16;
+    int iWordsToCopy = iWords < iWordsNeeded? iWords:iWordsNeeded;
+    memcpy(words, pWords, iWordsToCopy * sizeof(uint16_t));
+    memset(words + iWordsToCopy, 0, (iWordsNeeded - iWordsToCopy) * sizeof(uint16_t));
+
+    const __m128i iLowByteMask = _mm_set1_epi16(0x00FF);
+    for(int iBlock = 0; iBlock < iBlocks; ++iBlock)
+    {
+        // Each block of 16 words is two bytes of output for each panel.  Split the words into
+        // their low bytes, which hold panels 0-7, and high bytes, which hold panel 8, packed
+        // into one byte per word.  The values are 0-255, so packing doesn't saturate.
+        const __m128i *pBlock = (const __m128i *) (words + iBlock*16);
+        __m128i iWords0 = _mm_loadu_si128(pBlock + 0);
+        __m128i iWords1 = _mm_loadu_si128(pBlock + 1);
+        __m128i iLow = _mm_packus_epi16(_mm_and_si128(iWords0, iLowByteMask), _mm_and_si128(iWords1, iLowByteMask));
+        __m128i iHigh = _mm_packus_epi16(_mm_srli_epi16(iWords0, 8), _mm_srli_epi16(iWords1, 8));
+
+        // For panel N, shift bit N of each byte up to bit 7, and movemask collects it from all
+        // 16 words.  Shifting 64-bit lanes by less than 8 moves each byte's own bit into bit 7,
+        // so bits crossing into the next byte don't matter.  These shifts need immediates, so
+        // the panels are unrolled.
+        uint16_t iBits[9];
+        iBits[0] = (uint16_t) _mm_movemask_epi8(_mm_slli_epi64(iLow, 7));
+        iBits[1] = (uint16_t) _mm_movemask_epi8(_mm_slli_epi64(iLow, 6));
+        iBits[2] = (uint16_t) _mm_movemask_epi8(_mm_slli_epi64(iLow, 5));
+        iBits[3] = (uint16_t) _mm_movemask_epi8(_mm_slli_epi64(iLow, 4));
+        iBits[4] = (uint16_t) _mm_movemask_epi8(_mm_slli_epi64(iLow, 3));
+        iBits[5] = (uint16_t) _mm_movemask_epi8(_mm_slli_epi64(iLow, 2));
+        iBits[6] = (uint16_t) _mm_movemask_epi8(_mm_slli_epi64(iLow, 1));
+        iBits[7] = (uint16_t) _mm_movemask_epi8(iLow);
+        iBits[8] = (uint16_t) _mm_movemask_epi8(_mm_slli_epi64(iHigh, 7));
+
+        // The last block only has one byte if iOutSize is odd.
+        int iByte = iBlock*2;
+        bool bSecondByte = iByte + 1 < iOutSize;
+        for(int iPanel = 0; iPanel < 9; ++iPanel)
+        {
+            uint8_t *pPanelOut = pOut + iPanel*iOutSize + iByte;
+            pPanelOut[0] = (uint8_t) iBits[iPanel];
+            if(bSecondByte)
+                pPanelOut[1] = (uint8_t) (iBits[iPanel] >> 8);
+        }
+    }
+}
+
+void SMX::DecodeSensorTestDataScalar(const uint16_t *pWords, int iWords, uint8_t *pOut, int iOutSize)
+{
+    for(int iPanel = 0; iPanel < 9; ++iPanel)
+    {
+        int iBit = 0;
+        uint8_t *p = pOut + iPanel*iOutSize;
+
+        // Read each byte.
+        for(int i = 0; i < iOutSize; ++i)
+        {
+            // Read each bit in this byte.
+            uint8_t result = 0;
+            for(int j = 0; j < 8; ++j)
+            {
+                bool bit = false;
+
+                if(iBit < iWords)
+                {
+                    bit = pWords[iBit] & (1 << iPanel);
+                    iBit++;
+                }
+
+                result |= bit << j;
+            }
+
+            *p++ = result;
+        }
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef SMXSensorTestDecode_h
+#define SMXSensorTestDecode_h
+
+#include <stdint.h>
+
+namespace SMX
+{
+// Sensor test responses ("y") are transposed: each 16-bit word holds one bit from each of the
+// nine panels, with panel N in bit N.  Each panel's data is read from consecutive words, least
+// significant bit first, so word i holds bit i%8 of byte i/8 of every panel's data.
+//
+// Decode the first iOutSize bytes of each panel's data into pOut, which holds 9*iOutSize bytes,
+// with panel N's data at pOut + N*iOutSize.  Words past iWords are read as zero.  iOutSize can
+// be at most MAX_SENSOR_TEST_DECODE_SIZE.
+//
+// This transposes 16 words at a time with SSE2, so all nine panels are decoded in one pass
+// without testing bits individually.
+const int MAX_SENSOR_TEST_DECODE_SIZE = 32;
+void DecodeSensorTestData(const uint16_t *pWords, int iWords, uint8_t *pOut, int iOutSize);
+
+// The same, decoding one bit at a time.  This is the original decoder, and is kept as a
+// reference for testing and benchmarking.
+void DecodeSensorTestDataScalar(const uint16_t *pWords, int iWords, uint8_t *pOut, int iOutSize);
+}
+
+#endif
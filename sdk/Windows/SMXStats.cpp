@@ -0,0 +1,117 @@
+#include "SMXStats.h"
+#include "Helpers.h"
+
+#include <algorithm>
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+
+#if defined(SMX_TRACELOGGING)
+#include <TraceLoggingProvider.h>
+
+// {37EDC0B4-DBAB-4E60-BEDA-822C51C760C6}
+TRACELOGGING_DEFINE_PROVIDER(g_hTraceProvider, "StepManiaX.SDK",
+    (0x37edc0b4, 0xdbab, 0x4e60, 0xbe, 0xda, 0x82, 0x2c, 0x51, 0xc7, 0x60, 0xc6));
+#endif
+
+using namespace SMX;
+
+SMX::Stats SMX::g_Stats;
+
+namespace
+{
+    // Return the index of the highest set bit in iValue, or -1 if it's zero.
+    int GetHighestBit(uint32_t iValue)
+    {
+#ifdef _WIN32
+        unsigned long iHighestBit;
+        return _BitScanReverse(&iHighestBit, iValue)? int(iHighestBit):-1;
+#else
+        return iValue? 31 - __builtin_clz(iValue):-1;
+#endif
+    }
+
+    uint32_t ReadAndReset(atomic<uint32_t> &value, bool bReset)
+    {
+        return bReset? value.exchange(0):value.load();
+    }
+}
+
+SMX::StatsHistogram::StatsHistogram(const char *sName)
+{
+    m_sName = sName;
+    for(atomic<uint32_t> &iBucket: m_iBuckets)
+        iBucket.store(0, memory_order_relaxed);
+}
+
+void SMX::StatsHistogram::AddSample(double fSeconds)
+{
+    AddSampleMicroseconds(int64_t(fSeconds * 1000000));
+}
+
+void SMX::StatsHistogram::AddSampleTicks(int64_t iTicks)
+{
+    AddSampleMicroseconds(int64_t(iTicks * 1000000.0 / GetTimestampFrequency()));
+}
+
+void SMX::StatsHistogram::AddSampleMicroseconds(int64_t iMicroseconds)
+{
+    uint32_t iSample = (uint32_t) min(max(iMicroseconds, int64_t(0)), int64_t(0xFFFFFFFF));
+
+    // Bucket 0 is under 1us, and bucket N is under 2^N us.
+    int iBucket = min(GetHighestBit(iSample) + 1, SMX_HISTOGRAM_BUCKETS - 1);
+
+    m_iCount.fetch_add(1, memory_order_relaxed);
+    m_iTotalMicroseconds.fetch_add(iSample, memory_order_relaxed);
+    m_iBuckets[iBucket].fetch_add(1, memory_order_relaxed);
+
+    uint32_t iMax = m_iMaxMicroseconds.load(memory_order_relaxed);
+    while(iSample > iMax && !m_iMaxMicroseconds.compare_exchange_weak(iMax, iSample, memory_order_relaxed))
+        ;
+
+#if defined(SMX_TRACELOGGING)
+    TraceLoggingWrite(g_hTraceProvider, "Sample",
+        TraceLoggingString(m_sName, "Name"),
+        TraceLoggingUInt32(iSample, "Microseconds"));
+#endif
+}
+
+void SMX::StatsHistogram::Get(SMXHistogram &histogram, bool bReset)
+{
+    histogram.m_iCount = ReadAndReset(m_iCount, bReset);
+    uint64_t iTotal = bReset? m_iTotalMicroseconds.exchange(0):m_iTotalMicroseconds.load();
+    histogram.m_iAverageMicroseconds = histogram.m_iCount? uint32_t(iTotal / histogram.m_iCount):0;
+    histogram.m_iMaxMicroseconds = ReadAndReset(m_iMaxMicroseconds, bReset);
+    for(int i = 0; i < SMX_HISTOGRAM_BUCKETS; ++i)
+        histogram.m_iBuckets[i] = ReadAndReset(m_iBuckets[i], bReset);
+}
+
+void SMX::GetStats(SMXStats &stats, bool bReset)
+{
+    g_Stats.m_InputLatency.Get(stats.m_InputLatency, bReset);
+    g_Stats.m_LockHoldTime.Get(stats.m_LockHoldTime, bReset);
+    g_Stats.m_CommandRoundTrip.Get(stats.m_CommandRoundTrip, bReset);
+    g_Stats.m_DeviceSearchTime.Get(stats.m_DeviceSearchTime, bReset);
+    g_Stats.m_DeviceProbeTime.Get(stats.m_DeviceProbeTime, bReset);
+    g_Stats.m_DeviceOpenDelay.Get(stats.m_DeviceOpenDelay, bReset);
+    g_Stats.m_DeviceInfoTime.Get(stats.m_DeviceInfoTime, bReset);
+    g_Stats.m_DeviceConfigTime.Get(stats.m_DeviceConfigTime, bReset);
+    g_Stats.m_StartupConnectTime.Get(stats.m_StartupConnectTime, bReset);
+    stats.m_iLightsUpdatesDropped = ReadAndReset(g_Stats.m_iLightsUpdatesDropped, bReset);
+    stats.m_iLightsCommandsCoalesced = ReadAndReset(g_Stats.m_iLightsCommandsCoalesced, bReset);
+    stats.m_iTestFramesDropped = ReadAndReset(g_Stats.m_iTestFramesDropped, bReset);
+}
+
+void SMX::StartTracing()
+{
+#if defined(SMX_TRACELOGGING)
+    TraceLoggingRegister(g_hTraceProvider);
+#endif
+}
+
+void SMX::StopTracing()
+{
+#if defined(SMX_TRACELOGGING)
+    TraceLoggingUnregister(g_hTraceProvider);
+#endif
+}
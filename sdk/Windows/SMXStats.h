@@ -0,0 +1,64 @@
+#ifndef SMXStats_h
+#define SMXStats_h
+
+#include <stdint.h>
+#include <atomic>
+using namespace std;
+
+#include "../SMX.h"
+
+namespace SMX
+{
+// A histogram of durations for SMXStats.  Samples can be added from any thread without locking.
+class StatsHistogram
+{
+public:
+    // sName identifies the histogram in trace events, and must be a static string.
+    StatsHistogram(const char *sName);
+
+    // Add a sample, in seconds or GetTimestamp ticks.
+    void AddSample(double fSeconds);
+    void AddSampleTicks(int64_t iTicks);
+
+    void Get(SMXHistogram &histogram, bool bReset);
+
+private:
+    void AddSampleMicroseconds(int64_t iMicroseconds);
+
+    const char *m_sName;
+    atomic<uint32_t> m_iCount{0};
+    atomic<uint64_t> m_iTotalMicroseconds{0};
+    atomic<uint32_t> m_iMaxMicroseconds{0};
+    atomic<uint32_t> m_iBuckets[SMX_HISTOGRAM_BUCKETS];
+};
+
+// Statistics collected for SMX_GetStats.  Per-pad command queue depths aren't kept here, since
+// they're read from each device's connection.
+struct Stats
+{
+    StatsHistogram m_InputLatency{"InputLatency"};
+    StatsHistogram m_LockHoldTime{"LockHoldTime"};
+    StatsHistogram m_CommandRoundTrip{"CommandRoundTrip"};
+    StatsHistogram m_DeviceSearchTime{"DeviceSearchTime"};
+    StatsHistogram m_DeviceProbeTime{"DeviceProbeTime"};
+    StatsHistogram m_DeviceOpenDelay{"DeviceOpenDelay"};
+    StatsHistogram m_DeviceInfoTime{"DeviceInfoTime"};
+    StatsHistogram m_DeviceConfigTime{"DeviceConfigTime"};
+    StatsHistogram m_StartupConnectTime{"StartupConnectTime"};
+    atomic<uint32_t> m_iLightsUpdatesDropped{0};
+    atomic<uint32_t> m_iLightsCommandsCoalesced{0};
+    atomic<uint32_t> m_iTestFramesDropped{0};
+};
+extern Stats g_Stats;
+
+// Copy g_Stats into stats, except for the command queue depths.
+void GetStats(SMXStats &stats, bool bReset);
+
+// If the SDK is built with SMX_TRACELOGGING, each sample is also written as a TraceLogging
+// event, so it can be recorded with ETW tools like WPR.  These register and unregister the
+// provider, and do nothing otherwise.
+void StartTracing();
+void StopTracing();
+}
+
+#endif
@@ -0,0 +1,207 @@
+#include "SMXThreadOptions.h"
+#include "Helpers.h"
+
+#include <algorithm>
+#include <atomic>
+using namespace std;
+using namespace SMX;
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+namespace {
+    Mutex g_Lock;
+
+    // The options set for each thread, and a generation that's incremented whenever they
+    // change, so threads can check for changes without locking.
+    SMXThreadOptions g_Options[NUM_SMX_THREADS];
+    wstring g_sMMCSSTask[NUM_SMX_THREADS];
+    atomic<uint32_t> g_iGeneration[NUM_SMX_THREADS] = { {1}, {1}, {1} };
+
+    const char *g_szThreadNames[NUM_SMX_THREADS] = { "I/O", "callback", "device search" };
+
+#ifdef _WIN32
+    // avrt.dll isn't always present, eg. on Server Core, so we load it when it's first needed.
+    bool g_bLoadedAvrt = false;
+    HANDLE (WINAPI *g_pAvSetMmThreadCharacteristicsW)(const wchar_t *, DWORD *) = nullptr;
+    BOOL (WINAPI *g_pAvRevertMmThreadCharacteristics)(HANDLE) = nullptr;
+
+    void LoadAvrt()
+    {
+        g_Lock.AssertLockedByCurrentThread();
+        if(g_bLoadedAvrt)
+            return;
+        g_bLoadedAvrt = true;
+
+        HMODULE hAvrt = LoadLibraryExW(L"avrt.dll", NULL, LOAD_LIBRARY_SEARCH_SYSTEM32);
+        if(hAvrt == NULL)
+            return;
+
+        g_pAvSetMmThreadCharacteristicsW = (decltype(g_pAvSetMmThreadCharacteristicsW)) GetProcAddress(hAvrt, "AvSetMmThreadCharacteristicsW");
+        g_pAvRevertMmThreadCharacteristics = (decltype(g_pAvRevertMmThreadCharacteristics)) GetProcAddress(hAvrt, "AvRevertMmThreadCharacteristics");
+        if(g_pAvSetMmThreadCharacteristicsW == nullptr || g_pAvRevertMmThreadCharacteristics == nullptr)
+        {
+            g_pAvSetMmThreadCharacteristicsW = nullptr;
+            g_pAvRevertMmThreadCharacteristics = nullptr;
+        }
+    }
+#endif
+}
+
+#ifdef _WIN32
+bool SMX::SetCurrentThreadPriority(int iPriority, int &iError)
+{
+    if(SetThreadPriority(GetCurrentThread(), iPriority))
+        return true;
+
+    iError = GetLastError();
+    return false;
+}
+#else
+bool SMX::SetCurrentThreadPriority(int iPriority, int &iError)
+{
+    // Higher priorities are lower nice values.  Raising a thread above normal priority needs
+    // CAP_SYS_NICE, or an RLIMIT_NICE that allows it.
+    int iNice = min(max(-iPriority * 5, -20), 19);
+    if(setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), iNice) == 0)
+        return true;
+
+    iError = errno;
+    return false;
+}
+#endif
+
+void SMX::SetThreadOptions(SMXThread thread, const SMXThreadOptions &options)
+{
+    if(thread < 0 || thread >= NUM_SMX_THREADS)
+    {
+        LogFormat("SetThreadOptions: Invalid thread %i", (int) thread);
+        return;
+    }
+
+    LockMutex L(g_Lock);
+    g_Options[thread] = options;
+    g_sMMCSSTask[thread] = options.m_sMMCSSTask? options.m_sMMCSSTask:L"";
+    g_Options[thread].m_sMMCSSTask = nullptr;
+    g_iGeneration[thread]++;
+}
+
+SMX::SMXThreadOptionsApplier::SMXThreadOptionsApplier(SMXThread thread, int iDefaultPriority):
+    m_Thread(thread),
+    m_iDefaultPriority(iDefaultPriority)
+{
+}
+
+bool SMX::SMXThreadOptionsApplier::HasChanged() const
+{
+    return g_iGeneration[m_Thread].load() != m_iGeneration;
+}
+
+void SMX::SMXThreadOptionsApplier::Apply()
+{
+    if(!HasChanged())
+        return;
+
+    SMXThreadOptions options;
+    wstring sMMCSSTask;
+    {
+        LockMutex L(g_Lock);
+        m_iGeneration = g_iGeneration[m_Thread].load();
+        options = g_Options[m_Thread];
+        sMMCSSTask = g_sMMCSSTask[m_Thread];
+#ifdef _WIN32
+        if(!sMMCSSTask.empty())
+            LoadAvrt();
+#endif
+    }
+
+    const char *szThread = g_szThreadNames[m_Thread];
+    int iPriority = options.m_iPriority == SMX_THREAD_PRIORITY_DEFAULT? m_iDefaultPriority:options.m_iPriority;
+    int iError;
+    if(!SetCurrentThreadPriority(iPriority, iError))
+        LogFormat("Error setting %s thread priority to %i: %ls", szThread, iPriority, GetErrorString(iError));
+
+#ifdef _WIN32
+    // If the affinity mask is cleared, go back to the process's affinity.
+    DWORD_PTR iAffinityMask = (DWORD_PTR) options.m_iAffinityMask;
+    if(iAffinityMask == 0 && m_bAffinitySet)
+    {
+        DWORD_PTR iSystemAffinityMask;
+        GetProcessAffinityMask(GetCurrentProcess(), &iAffinityMask, &iSystemAffinityMask);
+    }
+
+    if(iAffinityMask != 0)
+    {
+        if(SetThreadAffinityMask(GetCurrentThread(), iAffinityMask) == 0)
+            LogFormat("Error setting %s thread affinity to %llx: %ls", szThread, (uint64_t) iAffinityMask, GetErrorString(GetLastError()));
+        m_bAffinitySet = options.m_iAffinityMask != 0;
+    }
+
+    if(sMMCSSTask != m_sMMCSSTask)
+    {
+        if(sMMCSSTask.empty())
+            Revert();
+        else
+        {
+            // Register the new task before reverting the old one, so if this fails the thread
+            // keeps its previous registration.
+            DWORD iTaskIndex = 0;
+            HANDLE hMMCSS = NULL;
+            if(g_pAvSetMmThreadCharacteristicsW == nullptr)
+                LogFormat("Can't register the %s thread with MMCSS: avrt.dll isn't available", szThread);
+            else if((hMMCSS = g_pAvSetMmThreadCharacteristicsW(sMMCSSTask.c_str(), &iTaskIndex)) == NULL)
+                LogFormat("Error registering the %s thread as MMCSS task \"%ls\": %ls", szThread, sMMCSSTask, GetErrorString(GetLastError()));
+            else
+            {
+                Revert();
+                m_hMMCSS = hMMCSS;
+                m_sMMCSSTask = sMMCSSTask;
+            }
+        }
+    }
+#else
+    // If the affinity mask is cleared, go back to the affinity the thread had before we set it.
+    if(options.m_iAffinityMask != 0 || m_bAffinitySet)
+    {
+        if(!m_bAffinitySet)
+            pthread_getaffinity_np(pthread_self(), sizeof(m_OriginalAffinity), &m_OriginalAffinity);
+
+        cpu_set_t affinity = m_OriginalAffinity;
+        if(options.m_iAffinityMask != 0)
+        {
+            CPU_ZERO(&affinity);
+            for(int iCPU = 0; iCPU < 64; ++iCPU)
+            {
+                if(options.m_iAffinityMask & (1ULL << iCPU))
+                    CPU_SET(iCPU, &affinity);
+            }
+        }
+
+        int iResult = pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity);
+        if(iResult != 0)
+            LogFormat("Error setting %s thread affinity to %llx: %ls", szThread, options.m_iAffinityMask, GetErrorString(iResult));
+        m_bAffinitySet = options.m_iAffinityMask != 0;
+    }
+
+    if(sMMCSSTask != m_sMMCSSTask)
+    {
+        if(!sMMCSSTask.empty())
+            LogFormat("Can't register the %s thread with MMCSS: MMCSS is only available on Windows", szThread);
+        m_sMMCSSTask = sMMCSSTask;
+    }
+#endif
+}
+
+void SMX::SMXThreadOptionsApplier::Revert()
+{
+#ifdef _WIN32
+    if(m_hMMCSS != NULL)
+        g_pAvRevertMmThreadCharacteristics(m_hMMCSS);
+    m_hMMCSS = NULL;
+#endif
+    m_sMMCSSTask.clear();
+}
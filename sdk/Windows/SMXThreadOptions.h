@@ -0,0 +1,70 @@
+#ifndef SMXThreadOptions_h
+#define SMXThreadOptions_h
+
+#include <string>
+using namespace std;
+
+#ifndef _WIN32
+#include <sched.h>
+#endif
+
+#include "Helpers.h"
+#include "../SMX.h"
+
+// Thread priorities are Win32 THREAD_PRIORITY values on every platform.
+#ifndef _WIN32
+#define THREAD_PRIORITY_BELOW_NORMAL -1
+#define THREAD_PRIORITY_NORMAL 0
+#define THREAD_PRIORITY_HIGHEST 2
+#endif
+
+namespace SMX
+{
+// Set the calling thread's priority to a THREAD_PRIORITY value.  On Linux, this is mapped to
+// a nice value, five steps for each level.  On failure, return false and set iError.
+bool SetCurrentThreadPriority(int iPriority, int &iError);
+
+// Store the options for a thread set with SMX_SetThreadOptions.  These are kept globally, so
+// they can be set before SMX_Start.  The owner of the thread needs to wake it, so it notices.
+void SetThreadOptions(SMXThread thread, const SMXThreadOptions &options);
+
+// Each of the SDK's threads owns one of these, and calls Apply from the thread itself when it
+// starts and whenever it wakes up.  MMCSS registration only applies to the calling thread, so
+// threads apply their own options.  Options are only applied when they've changed, so this is
+// cheap to call often.
+class SMXThreadOptionsApplier
+{
+public:
+    SMXThreadOptionsApplier(SMXThread thread, int iDefaultPriority);
+
+    // Apply the thread's options to the calling thread if they've changed since last time.
+    void Apply();
+
+    // Return true if the options have changed since they were last applied.  This can be used
+    // to check for changes that were made just before the thread went to sleep.
+    bool HasChanged() const;
+
+    // Undo MMCSS registration.  This must be called by the thread before it exits.  This does
+    // nothing on Linux, which has no MMCSS.
+    void Revert();
+
+private:
+    SMXThread m_Thread;
+    int m_iDefaultPriority;
+
+    // The options generation we last applied.  Generations start at 1, so the first call to
+    // Apply always applies the options.
+    uint32_t m_iGeneration = 0;
+    bool m_bAffinitySet = false;
+    wstring m_sMMCSSTask;
+#ifdef _WIN32
+    HANDLE m_hMMCSS = NULL;
+#else
+    // Linux has no process affinity to go back to when the mask is cleared, so we remember
+    // the thread's affinity from before we first set it.
+    cpu_set_t m_OriginalAffinity;
+#endif
+};
+}
+
+#endif
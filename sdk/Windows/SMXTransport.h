@@ -0,0 +1,50 @@
+#ifndef SMXTransport_h
+#define SMXTransport_h
+
+#include <stdint.h>
+#include <string>
+using namespace std;
+
+namespace SMX
+{
+// A transport moves raw HID reports to and from a device.  SMXDeviceConnection handles the
+// protocol on top of it (packet framing, PACKET_FLAG_* and device info), so the protocol
+// doesn't depend on how the platform does I/O.
+//
+// Transports are nonblocking, and are only used by the I/O thread.  They wake the thread when
+// reports arrive or writes finish, through the I/O completion port.
+class SMXTransport
+{
+public:
+    // The size of the largest report.  Packets we write are always this size.
+    static const int REPORT_SIZE = 64;
+
+    virtual ~SMXTransport() { }
+
+    // Stop all I/O.  Once this returns, nothing is using the transport's buffers.  This can
+    // be called more than once.
+    virtual void Close() = 0;
+
+    // Return the oldest report that's been received, without removing it.  pData points into
+    // the transport's buffers, and stays valid until PopReport or Close.  Return false if no
+    // report is waiting.  If the device has failed, sError is set.
+    virtual bool PeekReport(const uint8_t *&pData, int &iSize, wstring &sError) = 0;
+    virtual void PopReport() = 0;
+
+    // Start writing a REPORT_SIZE packet.  The data is copied, and packets are written in order.
+    virtual void BeginWrite(const uint8_t *pData, wstring &sError) = 0;
+
+    // Return true if every packet passed to BeginWrite has been written.
+    virtual bool WritesFinished(wstring &sError) = 0;
+
+    // Return true if pCompletion is for I/O on this transport.  On Windows, this is the
+    // OVERLAPPED from a completion port entry, and with epoll, it's the event's data pointer.
+    virtual bool IsCompletionForTransport(const void *pCompletion) const = 0;
+
+    // Return true if this isn't a real device, like a replay.  Nothing acknowledges commands,
+    // so SMXDeviceConnection finishes them itself as they're written.
+    virtual bool IsSimulated() const { return false; }
+};
+}
+
+#endif
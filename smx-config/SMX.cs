@@ -1,5 +1,6 @@
 using System;
 using System.Runtime.InteropServices;
+using System.Threading;
 using smx_config;
 
 // This is a binding to the native SMX.dll.
@@ -196,6 +197,77 @@ namespace SMX
         }
     };
 
+    // The test data in SMXSharedPadState.  This is SMXSensorTestModeData with fixed buffers,
+    // so it can be read straight from native memory.
+    [StructLayout(LayoutKind.Sequential)]
+    public unsafe struct SMXSharedTestData
+    {
+        public fixed byte bHaveDataFromPanel[9];
+        public fixed Int16 sensorLevel[9*4];
+        public fixed byte bBadSensorInput[9*4];
+        public fixed Int32 iDIPSwitchPerPanel[9];
+    };
+
+    // The state of one pad, read with SMX.ReadSharedState.  This matches SMXSharedPadState in
+    // SMX.h exactly.  Bools are bytes, so the struct is blittable.
+    [StructLayout(LayoutKind.Sequential)]
+    public unsafe struct SMXSharedPadState
+    {
+        public byte connected;
+        public fixed byte serial[33];
+        public UInt16 firmwareVersion;
+        public UInt16 inputState;
+        public Int64 inputTimestamp;
+        public UInt32 configGeneration;
+        public UInt32 configWriteAcked;
+
+        public byte haveTestData;
+        public SMXSharedTestData testData;
+    };
+
+    // The header of SMXSharedState.  The pads follow it.
+    [StructLayout(LayoutKind.Sequential)]
+    struct SMXSharedStateHeader
+    {
+        public UInt32 version;
+        public UInt32 size;
+        public UInt32 sequence;
+        public UInt32 numPads;
+    };
+
+    // A lights buffer that's pinned and registered with SMX_SetLightsBuffer, so lights can be
+    // sent without passing an array each time.  Write lights into Data, in the same format as
+    // SMX.SetLights, and call Commit to send them.  Dispose this before dropping it, so the
+    // native side stops using the buffer, and create a new one if SMX is restarted.
+    public class SMXLightsBuffer: IDisposable
+    {
+        public readonly byte[] Data = new byte[864];
+        private readonly int Cabinet;
+        private GCHandle Handle;
+
+        public SMXLightsBuffer(int cabinet)
+        {
+            Cabinet = cabinet;
+            Handle = GCHandle.Alloc(Data, GCHandleType.Pinned);
+            SMX.SetLightsBuffer(Cabinet, Handle.AddrOfPinnedObject());
+        }
+
+        public void Commit()
+        {
+            if(Handle.IsAllocated)
+                SMX.CommitLights(Cabinet);
+        }
+
+        public void Dispose()
+        {
+            if(!Handle.IsAllocated)
+                return;
+
+            SMX.SetLightsBuffer(Cabinet, IntPtr.Zero);
+            Handle.Free();
+        }
+    };
+
     public static class SMX
     {
         [System.Flags]
@@ -245,6 +317,12 @@ namespace SMX
         [DllImport("SMX.dll", CallingConvention = CallingConvention.Cdecl)]
         private static extern bool SMX_SetLights(byte[] buf);
         [DllImport("SMX.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void SMX_SetLightsBuffer(int cabinet, IntPtr buf);
+        [DllImport("SMX.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void SMX_CommitLights(int cabinet);
+        [DllImport("SMX.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern IntPtr SMX_GetSharedState();
+        [DllImport("SMX.dll", CallingConvention = CallingConvention.Cdecl)]
         private static extern bool SMX_ReenableAutoLights();
         [DllImport("SMX.dll", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Ansi)]
         private static extern IntPtr SMX_Version();
@@ -409,5 +487,80 @@ namespace SMX
             if(!DLLAvailable()) return;
             SMX_ReenableAutoLights();
         }
+
+        // Use SMXLightsBuffer instead of calling these directly.
+        public static void SetLightsBuffer(int cabinet, IntPtr buf)
+        {
+            if(!DLLAvailable()) return;
+            SMX_SetLightsBuffer(cabinet, buf);
+        }
+
+        public static void CommitLights(int cabinet)
+        {
+            if(!DLLAvailable()) return;
+            SMX_CommitLights(cabinet);
+        }
+
+        // The SMXSharedState version we understand, from SMX_SHARED_STATE_VERSION.
+        private const UInt32 SharedStateVersion = 1;
+        private static IntPtr SharedState = IntPtr.Zero;
+
+        // Return the shared state block, or null if the DLL isn't available or its layout
+        // doesn't match ours.  The block never moves, so we only look it up once.
+        private static unsafe SMXSharedStateHeader *GetSharedState()
+        {
+            if(SharedState == IntPtr.Zero)
+            {
+                if(!DLLAvailable()) return null;
+
+                SMXSharedStateHeader *header = (SMXSharedStateHeader *) SMX_GetSharedState();
+                int expectedSize = sizeof(SMXSharedStateHeader) + (int) header->numPads * sizeof(SMXSharedPadState);
+                if(header->version != SharedStateVersion || header->size != expectedSize)
+                {
+                    Console.WriteLine("SMX_GetSharedState: unsupported version " + header->version + ", size " + header->size);
+                    return null;
+                }
+
+                SharedState = (IntPtr) header;
+            }
+
+            return (SMXSharedStateHeader *) SharedState;
+        }
+
+        // Read the state of each pad into pads, which is usually SMX_MAX_CABINETS*2 long.  This
+        // reads the DLL's memory directly, so it doesn't allocate, lock or marshal anything.
+        // sequence changes whenever the state does, so callers can skip work if it's the same
+        // as last time.  Return false if the shared state isn't available.
+        public static unsafe bool ReadSharedState(SMXSharedPadState[] pads, out UInt32 sequence)
+        {
+            sequence = 0;
+            SMXSharedStateHeader *header = GetSharedState();
+            if(header == null)
+                return false;
+
+            SMXSharedPadState *source = (SMXSharedPadState *) (header + 1);
+            int count = Math.Min(pads.Length, (int) header->numPads);
+            while(true)
+            {
+                // The sequence number is odd while the block is being written.
+                UInt32 before = Volatile.Read(ref header->sequence);
+                if((before & 1) != 0)
+                {
+                    Thread.SpinWait(1);
+                    continue;
+                }
+
+                for(int pad = 0; pad < count; ++pad)
+                    pads[pad] = source[pad];
+
+                // If the sequence number changed, the block was written while we were copying it.
+                Thread.MemoryBarrier();
+                if(Volatile.Read(ref header->sequence) == before)
+                {
+                    sequence = before;
+                    return true;
+                }
+            }
+        }
     }
 }